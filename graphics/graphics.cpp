@@ -0,0 +1,156 @@
+/*
+    Tumbleweed
+
+    the graphics module, GLFW and NanoVG, loaded by tw as it starts
+*/
+#include <stdio.h>
+
+#ifdef __APPLE__
+#	define GLFW_INCLUDE_GLCOREARB
+#endif
+#include <GLFW/glfw3.h>
+
+#include "nanovg.h"
+#define NANOVG_GL3_IMPLEMENTATION
+#include "nanovg_gl.h"
+
+#include "graphics.h"
+
+#if defined(_WIN32)
+#define TW_EXPORT extern "C" __declspec(dllexport)
+#else
+#define TW_EXPORT extern "C"
+#endif
+
+static GLFWwindow* window;
+static int winWidth, winHeight;
+static float pxRatio;
+
+static void error_callback(int error, const char* description)
+{
+    fputs(description, stderr);
+}
+
+static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, GL_TRUE);
+}
+
+TW_EXPORT void my_nvgFillColor(NVGcontext* vg, NVGcolor color) {
+    printf("R: %f G: %f B: %f A: %F\n", color.r, color.g, color.b, color.a);
+    nvgFillColor(vg, nvgRGBA(28.0, 30.0, 34.0, 192.0));
+}
+
+TW_EXPORT void drawWindow(NVGcontext* vg, const char* title, float x, float y, float w, float h)
+{
+    nvgBeginFrame(vg, winWidth, winHeight, pxRatio);
+
+	float cornerRadius = 3.0f;
+	NVGpaint shadowPaint;
+	NVGpaint headerPaint;
+
+	nvgSave(vg);
+//	nvgClearState(vg);
+
+	// Window
+	nvgBeginPath(vg);
+	nvgRoundedRect(vg, x,y, w,h, cornerRadius);
+	nvgFillColor(vg, nvgRGBA(28,30,34,192));
+//	nvgFillColor(vg, nvgRGBA(0,0,0,128));
+	nvgFill(vg);
+
+
+	nvgRestore(vg);
+
+    nvgEndFrame(vg);
+
+    glfwSwapBuffers(window);
+    glfwPollEvents();
+
+}
+
+TW_EXPORT int twGraphicsOpen(TGraphics* graphics)
+{
+    NVGcontext* vg = NULL;
+    double mx, my;
+
+    if (!glfwInit())
+        return 0;
+
+    glfwSetErrorCallback(error_callback);
+
+#ifndef _WIN32 // don't require this on win32, and works with more cards
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#endif
+    glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, 1);
+
+    window = glfwCreateWindow(640, 480, "NanoVG", NULL, NULL);
+
+    if (!window)
+    {
+        glfwTerminate();
+        return 0;
+    }
+
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(1);
+    glfwSetKeyCallback(window, key_callback);
+
+    vg = nvgCreateGL3(NVG_ANTIALIAS | NVG_STENCIL_STROKES | NVG_DEBUG);
+    if (vg == NULL) {
+            printf("Could not init nanovg.\n");
+            glfwDestroyWindow(window);
+            glfwTerminate();
+            return 0;
+    }
+
+    graphics->fontNormal = nvgCreateFont(vg, "sans", "Roboto-Regular.ttf");
+    if (graphics->fontNormal == -1) {
+        printf("Could not add font italic.\n");
+        nvgDeleteGL3(vg);
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 0;
+    }
+    graphics->fontBold = nvgCreateFont(vg, "sans-bold", "Roboto-Bold.ttf");
+    if (graphics->fontBold == -1) {
+        printf("Could not add font bold.\n");
+        nvgDeleteGL3(vg);
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 0;
+    }
+
+    glfwGetCursorPos(window, &mx, &my);
+    glfwGetWindowSize(window, &winWidth, &winHeight);
+    glfwGetFramebufferSize(window, &graphics->fbWidth, &graphics->fbHeight);
+    // Calculate pixel ration for hi-dpi devices.
+    pxRatio = (float)graphics->fbWidth / (float)winWidth;
+
+    glViewport(0, 0, graphics->fbWidth, graphics->fbHeight);
+    glClearColor(0.3f, 0.3f, 0.32f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT);
+
+    printf("GL_COLOR_BUFFER_BIT: %d\n", GL_COLOR_BUFFER_BIT);
+    printf("GL_DEPTH_BUFFER_BIT: %d\n", GL_DEPTH_BUFFER_BIT);
+    printf("GL_STENCIL_BUFFER_BIT: %d\n", GL_STENCIL_BUFFER_BIT);
+
+    //drawWindow(vg, "Widgets `n Stuff", 50, 50, 300, 400);
+
+    graphics->vg = vg;
+    graphics->window = window;
+    graphics->winWidth = winWidth;
+    graphics->winHeight = winHeight;
+    graphics->pxRatio = pxRatio;
+    return 1;
+}
+
+TW_EXPORT void twGraphicsClose(TGraphics* graphics)
+{
+    glfwDestroyWindow(window);
+    glfwTerminate();
+}
@@ -0,0 +1,131 @@
+/*
+    Tumbleweed
+
+    allocation profiling, sampled allocations totalled by the Smalltalk
+    stack that made them
+*/
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "env.h"
+#include "objmemory.h"
+#include "names.h"
+#include "allocprofile.h"
+#include "vm.h"
+
+/* the name of a class, or ? if it hasn't got one */
+static const char* className(object aClass)
+{
+    if (aClass == nilobj || isImmediate(aClass) || objectRef(aClass).isBytes() ||
+            objectRef(aClass).size() < nameInClass)
+        return "?";
+    object name = objectRef(aClass).basicAt(nameInClass);
+    if (name == nilobj || isImmediate(name) || !objectRef(name).isBytes())
+        return "?";
+    return objectRef(name).charPtr();
+}
+
+TAllocationProfile::TAllocationProfile() :
+    m_running(false),
+    m_sampleCount(0),
+    m_pendingBytes(0)
+{
+}
+
+void TAllocationProfile::start(size_t interval)
+{
+    m_stacks.clear();
+    m_sampleCount = 0;
+    m_pending = nilobj;
+    m_running = interval > 0;
+    MemoryManager::Instance()->setAllocationSampler(interval, m_running? sample : NULL);
+}
+
+void TAllocationProfile::stop()
+{
+    resolvePending();
+    MemoryManager::Instance()->setAllocationSampler(0, NULL);
+    m_running = false;
+}
+
+size_t TAllocationProfile::sampleCount()
+{
+    resolvePending();
+    return m_sampleCount;
+}
+
+void TAllocationProfile::writeFolded(FILE* fp)
+{
+    resolvePending();
+    for (std::map<std::string, TStackTotal>::iterator i = m_stacks.begin(), iend = m_stacks.end(); i != iend; ++i)
+        fprintf(fp, "%s %lu\n", i->first.c_str(), (unsigned long)i->second.bytes);
+}
+
+/* called by the memory manager, from inside allocObject(). only the
+   frames are recorded now, the class isn't set until the allocation
+   returns */
+void TAllocationProfile::sample(object allocated, size_t bytes)
+{
+    TVMState& vm = VM::state();
+    TAllocationProfile& profile = vm.allocationProfile;
+    profile.resolvePending();
+
+    /* each frame's linkage area holds the previous link pointer, then
+       the context, nil while it is still on the stack, then the return
+       point, the method, and the byte offset */
+    object frames[kMaxFrames];
+    size_t depth = 0;
+    object stack = vm.processStack;
+    if (stack != nilobj && !isImmediate(stack) && !objectRef(stack).isBytes())
+    {
+        long size = objectRef(stack).size();
+        long link = vm.linkPointer;
+        while (link > 0 && link + 4 <= size && depth < kMaxFrames)
+        {
+            object context = objectRef(stack).basicAt(link + 1);
+            object method = (context == nilobj)? objectRef(stack).basicAt(link + 3)
+                : objectRef(context).basicAt(methodInContext);
+            if (method == nilobj || isImmediate(method))
+                break;
+            frames[depth++] = method;
+            object previous = objectRef(stack).basicAt(link);
+            if (!isSmallInteger(previous) || getInteger(previous) >= link)
+                break;
+            link = getInteger(previous);
+        }
+    }
+
+    std::string& folded = profile.m_pendingStack;
+    folded.clear();
+    while (depth > 0)
+    {
+        object method = frames[--depth];
+        folded += className(objectRef(method).basicAt(methodClassInMethod));
+        folded += ">>";
+        object selector = objectRef(method).basicAt(messageInMethod);
+        folded += (selector != nilobj && !isImmediate(selector))? objectRef(selector).charPtr() : "?";
+        folded += ';';
+    }
+    profile.m_pending = allocated;
+    profile.m_pendingBytes = bytes;
+}
+
+/* finish the last sample, now its class should be known. the handle
+   keeps the object from being collected, but an image read in since
+   may have left its slot free, and then the sample is dropped */
+void TAllocationProfile::resolvePending()
+{
+    if (m_pending == nilobj)
+        return;
+    object allocated = m_pending;
+    m_pending = nilobj;
+    if (objectRef(allocated).flags & kFreeSlot)
+        return;
+    m_pendingStack += className(objectRef(allocated).objectClass());
+    TStackTotal& total = m_stacks[m_pendingStack];
+    ++total.samples;
+    total.bytes += m_pendingBytes;
+    ++m_sampleCount;
+}
@@ -0,0 +1,87 @@
+/*
+    Tumbleweed
+
+    allocation profiling, sampled allocations totalled by the Smalltalk
+    stack that made them
+*/
+
+#ifndef __ALLOCPROFILE_H__
+#define __ALLOCPROFILE_H__
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include "objmemory.h"
+
+/*! \brief Sampled allocations, by the methods on the stack when made.
+ *
+ * While running, the memory manager calls in every so many bytes. The
+ * methods of the innermost frames of the running process are taken
+ * from the process stack, following the linkage from linkPointer, and
+ * the class of the object made is added once it has been set, at the
+ * next sample or when the profile is written.
+ *
+ * Each VM has one of these in its state.
+ */
+class TAllocationProfile
+{
+    public:
+        //! Mean bytes allocated between samples, unless told otherwise.
+        static const size_t kDefaultInterval = 256 * 1024;
+        //! Frames of the stack kept for each sample.
+        static const size_t kMaxFrames = 8;
+
+        TAllocationProfile();
+
+        /*! Clear out any samples, and start sampling.
+         *
+         * \param interval The mean number of bytes between samples.
+         */
+        void start(size_t interval = kDefaultInterval);
+
+        //! Stop sampling, keeping the samples so far.
+        void stop();
+
+        bool running() const;
+
+        //! The number of samples taken since started.
+        size_t sampleCount();
+
+        /*! Write the samples in folded stack format, for flame graphs.
+         *
+         * One line per distinct stack, outermost frame first, the frames
+         * Class>>selector separated by semicolons, and last the class
+         * allocated, then a space and the bytes the samples stand for.
+         *
+         * \param fp The file to write to.
+         */
+        void writeFolded(FILE* fp);
+
+    private:
+        struct TStackTotal
+        {
+            size_t samples;
+            size_t bytes;
+        };
+
+        static void sample(object allocated, size_t bytes);
+        void resolvePending();
+
+        std::map<std::string, TStackTotal> m_stacks;
+        bool m_running;
+        size_t m_sampleCount;
+        //! The last object sampled, whose class may not be set yet, held
+        //! by a handle so that its slot can't be reused before then.
+        ObjectHandle m_pending;
+        std::string m_pendingStack;
+        size_t m_pendingBytes;
+};
+
+inline bool TAllocationProfile::running() const
+{
+    return m_running;
+}
+
+#endif
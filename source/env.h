@@ -24,9 +24,6 @@ typedef unsigned char byte;
 
 # define byteToInt(b) (b)
 
-/* this is a bit sloppy - but it works */
-# define longCanBeInt(l) ((l >= LONG_MIN) && (l <= LONG_MAX))
-
 /* ======== various defines that should work on all systems ==== */
 
 # define streq(a,b) (strcmp(a,b) == 0)
@@ -37,6 +34,16 @@ To get around this we define a lot of symbols which become nothing if
 prototypes aren't available */
 
 
+/* each VM runs on its own thread, so its state is thread local. plain
+   data uses the compiler's own storage class, which, unlike thread_local,
+   doesn't check for dynamic initialisation on each access from another
+   file. objects with constructors have to be thread_local */
+#if defined(_MSC_VER)
+#define TW_THREAD __declspec(thread)
+#else
+#define TW_THREAD __thread
+#endif
+
 #if defined(__APPLE__)
 #define SO_EXT  "so"
 #define MAX_PATH  PATH_MAX
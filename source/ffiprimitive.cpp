@@ -22,16 +22,16 @@ extern "C" {
 #include <assert.h>
 #include <ffi.h>
 #include <limits.h>
+#include <map>
 
 #include "env.h"
 #include "objmemory.h"
 #include "names.h"
 #include "interp.h"
+#include "vm.h"
 
 extern ObjectHandle sendMessageToObject(ObjectHandle receiver, const char* message, ObjectHandle* args, int cargs);
 
-extern ObjectHandle processStack;
-extern int linkPointer;
 
 typedef void* FFI_LibraryHandle;
 typedef void* FFI_FunctionHandle;
@@ -41,6 +41,8 @@ typedef struct FFI_DataType_U
   int typemap;
   ffi_type* type;
   void* ptr;
+  // The byte object whose data area C was given, dirty after the call.
+  object body;
   union {
     char* charPtr;
     int   integer;
@@ -142,7 +144,7 @@ static const char* ffiStrs[] =
 };
 
 static int ffiNumStrs = sizeof(ffiStrs)/sizeof(ffiStrs[0]);
-static object *ffiSyms;
+static TW_THREAD object *ffiSyms;
 static void* ffiLSTTypes[] = 
 {
   &ffi_type_uchar,      // FFI_CHAR,
@@ -262,14 +264,14 @@ void valueOut(object value, FFI_DataType* data)
       break;
     case FFI_FLOAT_OUT:
       data->outFloat.pointer = &data->outFloat._float;
-      data->outFloat._float = objectRef(realValue).floatValue();
+      data->outFloat._float = floatValue(realValue);
       data->ptr = &data->outFloat.pointer;
       data->type = &ffi_type_pointer;
       break;
     case FFI_DOUBLE_OUT:
     case FFI_LONGDOUBLE_OUT:
       data->outDouble.pointer = &data->outDouble._double;
-      data->outDouble._double = objectRef(realValue).floatValue();
+      data->outDouble._double = floatValue(realValue);
       data->ptr = &data->outDouble.pointer;
       data->type = &ffi_type_pointer;
       break;
@@ -282,6 +284,7 @@ void valueOut(object value, FFI_DataType* data)
     case FFI_STRING_OUT:
     case FFI_SYMBOL:
     case FFI_SYMBOL_OUT:
+      data->body = realValue;
       data->charPtr = objectRef(realValue).charPtr();
       data->ptr = &data->charPtr;
       data->type = &ffi_type_pointer;
@@ -291,7 +294,7 @@ void valueOut(object value, FFI_DataType* data)
       if(getClass(realValue) == globalSymbol("Integer"))
         data->integer = getInteger(realValue);
       else if(getClass(realValue) == globalSymbol("Float"))
-        data->integer = (int)objectRef(realValue).floatValue();
+        data->integer = (int)floatValue(realValue);
       data->ptr = &data->integer;
       data->type = &ffi_type_uint32;
     case FFI_INT:
@@ -299,25 +302,25 @@ void valueOut(object value, FFI_DataType* data)
       if(getClass(realValue) == globalSymbol("Integer"))
         data->integer = getInteger(realValue);
       else if(getClass(realValue) == globalSymbol("Float"))
-        data->integer = (int)objectRef(realValue).floatValue();
+        data->integer = (int)floatValue(realValue);
       data->ptr = &data->integer;
       data->type = &ffi_type_sint32;
       break;
     case FFI_FLOAT:
       // \todo: How to check type.
-      data->_float = objectRef(realValue).floatValue();
+      data->_float = floatValue(realValue);
       data->ptr = &data->_float;
       data->type = &ffi_type_float;
       break;
     case FFI_DOUBLE:
       // \todo: How to check type.
-      data->_double = objectRef(realValue).floatValue();
+      data->_double = floatValue(realValue);
       data->ptr = &data->_double;
       data->type = &ffi_type_double;
       break;
     case FFI_LONGDOUBLE:
       // \todo: How to check type.
-      data->_float = objectRef(realValue).floatValue();
+      data->_float = floatValue(realValue);
       data->ptr = &data->_float;
       data->type = &ffi_type_longdouble;
       break;
@@ -354,12 +357,12 @@ void valueOut(object value, FFI_DataType* data)
         ObjectHandle args[1];
         args[0] = createSymbol("fields");
         ObjectHandle result = sendMessageToObject(value, "respondsTo:", args, 1);
-        if(result == booleanSyms[booleanTrue])
+        if(result == VM::state().booleanSyms[booleanTrue])
         {
           result = sendMessageToObject(value, "fields", NULL, 0);
           // \todo: type check return.
           // Now process the returned array
-          int ctypes = objectRef(result).size;
+          int ctypes = objectRef(result).size();
           // Create an ffi_type to represent this structure.
           ffi_type* ed_type = new ffi_type;
           // \todo: check leakage.
@@ -540,7 +543,7 @@ object valueIn(int retMap, FFI_DataType* data)
         int csize = edclass->basicAt(sizeInClass);
         ObjectHandle ed = MemoryManager::Instance()->allocObject(csize);
         ed->basicAtPut(1, newArray(data->externalData.numMembers));
-        ed->_class = edclass;
+        ed->setClass(edclass);
         // Now fill in the values using recursive marshalling.
         ObjectHandle args[2];
         for(int i = 0; i < data->externalData.numMembers; ++i)
@@ -559,7 +562,7 @@ object valueIn(int retMap, FFI_DataType* data)
         int csize = edclass->basicAt(sizeInClass);
         ObjectHandle ed = MemoryManager::Instance()->allocObject(csize);
         ed->basicAtPut(1, newArray(data->externalData.numMembers));
-        ed->_class = edclass;
+        ed->setClass(edclass);
         // Now fill in the values using recursive marshalling.
         ObjectHandle args[2];
         char* structStorage = static_cast<char*>(data->externalData.pointer);
@@ -596,11 +599,24 @@ FFI_CallbackData* newCallbackData(int numArgs)
 void deleteCallbackData(FFI_CallbackData *data)
 {
   free(data->argTypeArray);
-  free(data);
+  delete data;
 }
 
+/* what was allocated for each callback, keyed on the code pointer handed
+   back to Smalltalk, so that it can be released again */
+typedef struct FFI_Callback_U
+{
+  ffi_closure* closure;
+  ffi_cif* cif;
+  ffi_type** args;
+  FFI_CallbackData* data;
+} FFI_Callback;
+
+static thread_local std::map<void*, FFI_Callback> callbacks;
+
 void callBack(ffi_cif* cif, void* ret, void* args[], void* ud)
 {
+  TVMState& vm = VM::state();
   void* handle = *(void**)args[0];
   int arg;
 
@@ -632,8 +648,8 @@ void callBack(ffi_cif* cif, void* ret, void* args[], void* ud)
     // \todo: Memory leak
   }
 
-  ObjectHandle saveProcessStack = processStack;
-  int saveLinkPointer = linkPointer;
+  ObjectHandle saveProcessStack = vm.processStack;
+  int saveLinkPointer = vm.linkPointer;
   while(execute(process, 15000));
   // Re-read the stack object, in case it had to grow during execution and 
   // was replaced.
@@ -644,8 +660,8 @@ void callBack(ffi_cif* cif, void* ret, void* args[], void* ud)
   valueOut(ro, &temp); 
   // \todo: Support struct returns
   memcpy(ret, temp.ptr, ffiLSTTypeSizes[data->retType]);
-  processStack = saveProcessStack;
-  linkPointer = saveLinkPointer;
+  vm.processStack = saveProcessStack;
+  vm.linkPointer = saveLinkPointer;
 }
 
 object ffiPrimitive(int number, object* arguments)
@@ -742,8 +758,8 @@ object ffiPrimitive(int number, object* arguments)
         FFI_FunctionHandle func = objectRef(arguments[0]).cPointerValue();
         object rtype = arguments[1];
         int retMap = mapType(rtype);
-        int cargTypes = objectRef(arguments[2]).size;
-        int cargs = objectRef(arguments[3]).size;
+        int cargTypes = objectRef(arguments[2]).size();
+        int cargs = objectRef(arguments[3]).size();
         int cOutArgs = 0;
 
         assert(cargTypes <= cargs);
@@ -783,6 +799,11 @@ object ffiPrimitive(int number, object* arguments)
             returnedObject = newArray(cargTypes + 1);
 
             ffi_call(&cif, reinterpret_cast<void(*)()>(func), retData, values);
+            // C may have written to any data area it was given, without
+            // the write barrier, so those objects go in the next delta.
+            for(int i = 0; i < cargTypes; ++i)
+              if(dataValues[i].body != nilobj && !isImmediate(dataValues[i].body))
+                objectRef(dataValues[i].body).flags |= kDirty;
             FFI_DataType ret;
             ret.typemap = retMap;
             readFromStorage(retData, &ret);
@@ -819,7 +840,7 @@ object ffiPrimitive(int number, object* arguments)
 
         object rtype = arguments[0];
         int retMap = mapType(rtype);
-        int cargTypes = objectRef(arguments[1]).size;
+        int cargTypes = objectRef(arguments[1]).size();
         ffi_closure* closure;
         ffi_cif *cif = static_cast<ffi_cif*>(calloc(1, sizeof(ffi_cif)));
         object block = arguments[2];
@@ -859,13 +880,13 @@ object ffiPrimitive(int number, object* arguments)
             /* Initialize the closure, setting stream to stdout */
             if(ffi_prep_closure_loc(closure, cif, callBack, data, callback) == FFI_OK)
             {
+              FFI_Callback record = { closure, cif, args, data };
+              callbacks[callback] = record;
               returnedObject = newCPointer(callback);
             }
           }
         }
 
-        /* Deallocate both closure, and bound_puts */
-        //ffi_closure_free(closure);
       }
       break;
 
@@ -895,6 +916,25 @@ object ffiPrimitive(int number, object* arguments)
 #endif
       break;
 
+     /* 
+      *  cCallbackFree <callback>, normally sent by the callback's finalizer
+      */
+    case 5: /* cCallbackFree */
+      {
+        std::map<void*, FFI_Callback>::iterator i = callbacks.find(objectRef(arguments[0]).cPointerValue());
+        if(i != callbacks.end())
+        {
+          ffi_closure_free(i->second.closure);
+          free(i->second.cif);
+          free(i->second.args);
+          deleteCallbackData(i->second.data);
+          callbacks.erase(i);
+          returnedObject = VM::state().booleanSyms[booleanTrue];
+        }
+        else
+          returnedObject = VM::state().booleanSyms[booleanFalse];
+      }
+      break;
 
     default:
       sysError("unknown primitive","ffiPrimitive");
@@ -31,8 +31,8 @@ bool savetext = true;
     buffer.  In addition, all methods must also fit into this buffer.
 */
 # define TextBufferSize 16384
-static char* textBuffer = NULL;
-static Lexer ll;
+static TW_THREAD char* textBuffer = NULL;
+static thread_local Lexer ll;
 
 /*
     findClass gets a class object,
@@ -65,7 +65,7 @@ static ObjectHandle findClassWithMeta(const char* name, ObjectHandle metaObj)
     {
         size = getInteger(metaObj->basicAt(sizeInClass));
         newObj = MemoryManager::Instance()->allocObject(size);
-        newObj->_class = metaObj;
+        newObj->setClass(metaObj);
 
         /* now make name */
         nameObj = createSymbol(name);
@@ -91,7 +91,14 @@ static ObjectHandle createRawClass(const char* _class, const char* metaclass, co
 
     metaObj = findClass(metaclass);
     classObj = findClassWithMeta(_class, metaObj);
-    classObj->_class = metaObj;
+    classObj->setClass(metaObj);
+    MemoryManager::Instance()->writeBarrier(classObj, metaObj);
+
+    /* a class made before its metaclass was declared has only the
+       slots of a plain class, give it room for the class variables */
+    size = getInteger(metaObj->basicAt(sizeInClass));
+    if(classObj->size() < size)
+        MemoryManager::Instance()->growObject(classObj, size);
 
     //printf("RAWCLASS %s %s %s\n", class, metaclass, superclass);
 
@@ -103,6 +110,9 @@ static ObjectHandle createRawClass(const char* _class, const char* metaclass, co
         classObj->basicAtPut(superClassInClass, superObj);
         size = getInteger(superObj->basicAt(sizeInClass));
     }
+    /* instances have at least the variables of the superclass */
+    if(size > getInteger(classObj->basicAt(sizeInClass)))
+        classObj->basicAtPut(sizeInClass, newInteger(size));
     return classObj;
 }
 
@@ -189,7 +199,8 @@ static void readClassDeclaration()
 
     metaObj = createRawClass(metaClassName, "Class", metaSuperClassName);
     classObj = createRawClass(className.c_str(), metaClassName, superName.c_str());
-    classObj->_class = metaObj;
+    classObj->setClass(metaObj);
+    MemoryManager::Instance()->writeBarrier(classObj, metaObj);
 
     // Get the current class size, we'll build on this as 
     // we add instance variables.
@@ -284,9 +295,6 @@ static void readMethods(FILE* fd, bool printit)
 
 }
 
-extern ObjectHandle processStack;
-extern int linkPointer;
-
 
 /*
     fileIn reads in a module definition
@@ -310,6 +318,7 @@ void fileIn(FILE* fd, bool printit)
         else 
             sysError("unrecognized line", textBuffer);
         MemoryManager::Instance()->garbageCollect();
+        MemoryManager::Instance()->compactIfPending();
     }
     delete[](textBuffer);
 }
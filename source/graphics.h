@@ -0,0 +1,40 @@
+/*
+    Tumbleweed
+
+    the graphics module, a window and a NanoVG context, loaded by tw as
+    it starts, and left out of tw-headless altogether
+*/
+
+#ifndef __GRAPHICS_H__
+#define __GRAPHICS_H__
+
+/*! \brief What the graphics module opened, to be set as globals.
+ *
+ * The module keeps the GLFW and NanoVG types to itself, the driver only
+ * sees pointers, so neither it nor the VM library links against them.
+ */
+struct TGraphics
+{
+    void* vg;
+    void* window;
+    int winWidth, winHeight;
+    int fbWidth, fbHeight;
+    float pxRatio;
+    int fontNormal, fontBold;
+};
+
+//! The names the driver looks up in the module.
+#define TW_GRAPHICS_OPEN "twGraphicsOpen"
+#define TW_GRAPHICS_CLOSE "twGraphicsClose"
+
+/*! Open a window with a NanoVG context and the fonts loaded.
+ *
+ * \param graphics Filled in with what was opened.
+ * \return 0 if there is no display, or anything else failed.
+ */
+typedef int (*TGraphicsOpen)(TGraphics* graphics);
+
+//! Close what TGraphicsOpen opened.
+typedef void (*TGraphicsClose)(TGraphics* graphics);
+
+#endif
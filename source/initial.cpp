@@ -71,20 +71,20 @@ void makeInitialImage()
   symbolObj = createSymbol("Symbol");
   symbolClass = createAndRegisterNewClass("Symbol");
   integerClass = createAndRegisterNewClass("Integer");
-  symbolObj->_class = symbolClass;
+  symbolObj->setClass(symbolClass);
   classClass = createAndRegisterNewClass("Class");
-  symbolClass->_class = classClass;
-  integerClass->_class = classClass;
+  symbolClass->setClass(classClass);
+  integerClass->setClass(classClass);
   metaClassClass = createAndRegisterNewClass("MetaClass");
-  classClass->_class = metaClassClass;
+  classClass->setClass(metaClassClass);
 
   /* now fix up classes for symbol table */
   /* and make a couple common classes, just to hold their places */
   createAndRegisterNewClass("Link");
   createAndRegisterNewClass("ByteArray");
-  hashTable->_class = createAndRegisterNewClass("Array");
-  objectRef(symbols)._class = createAndRegisterNewClass("Dictionary");
-  objectRef(nilobj)._class = createAndRegisterNewClass("UndefinedObject");
+  hashTable->setClass(createAndRegisterNewClass("Array"));
+  objectRef(symbols).setClass(createAndRegisterNewClass("Dictionary"));
+  objectRef(nilobj).setClass(createAndRegisterNewClass("UndefinedObject"));
   createAndRegisterNewClass("String");
   nameTableInsert(symbols, strHash("symbols"), createSymbol("symbols"), symbols);
 
@@ -17,6 +17,7 @@
 # include "env.h"
 # include "objmemory.h"
 # include "names.h"
+# include "vm.h"
 # include "interp.h"
 # include "parser.h"
 
@@ -24,33 +25,22 @@ bool watching = 0;
 extern object primitive( int, object* );
 
 /*
-   the following variables are local to this module
+   the interpreter registers, and the cache of recently executed methods
+   used for fast lookup, are kept in the state of the running VM, see vm.h
    */
 
-static ObjectHandle method, messageToSend;
-
 static int messTest(object obj)
 {
-  return obj == messageToSend;
+  return obj == VM::state().messageToSend;
 }
 
-/* a cache of recently executed methods is used for fast lookup */
-# define cacheSize 211
-static struct
-{
-  ObjectHandle cacheMessage;  /* the message being requested */
-  ObjectHandle lookupClass;   /* the class of the receiver */
-  ObjectHandle cacheClass;    /* the class of the method */
-  ObjectHandle cacheMethod;   /* the method itself */
-} methodCache[cacheSize];
-
 /* flush an entry from the cache (usually when its been recompiled) */
 void flushCache(object messageToSend, object _class)
 {
   int hash;
 
   hash = ((hashObject(messageToSend)) + (hashObject(_class))) % cacheSize;
-  methodCache[hash].cacheMessage = nilobj;
+  VM::state().methodCache[hash].cacheMessage = nilobj;
 }
 
 /*
@@ -61,6 +51,8 @@ void flushCache(object messageToSend, object _class)
 static bool findMethod(object* methodClassLocation)
 {
   object methodTable, methodClass;
+  ObjectHandle& method = VM::state().method;
+  ObjectHandle& messageToSend = VM::state().messageToSend;
 
   method = nilobj;
   methodClass = *methodClassLocation;
@@ -107,19 +99,25 @@ static bool findMethod(object* methodClassLocation)
 # define contextAt(n) *(cntx+n)
 # define contextAtPut(n,x) (contextAt(n-1)=(x))
 # define processStackAt(n) *(psb+(n-1))
+/* an immediate Character has its value, the one instance variable of
+   a Char, in a slot of its own. the slot is a copy, so it can be read,
+   but AssignInstance drops stores into it: an immediate has no storage
+   to change */
+# define setReceiver(x) do { \
+    if (!isImmediate(x)) rcv = objectRef(x).sysMemPtr(); \
+    else if (isCharacter(x)) { \
+      charValue = newInteger(immediateCharValue(x)); rcv = &charValue; } \
+  } while(0)
 
 
-/* the following are manipulated by primitives */
-ObjectHandle  processStack;
-int     linkPointer;
-
 static object growProcessStack(int top, int toadd)
 {
   int size, i;
   ObjectHandle newStack;
+  ObjectHandle& processStack = VM::state().processStack;
 
   if (toadd < 100) toadd = 100;
-  size = processStack->size + toadd;
+  size = processStack->size() + toadd;
   newStack = newArray(size);
   for (i = 1; i <= top; i++) {
     newStack->basicAtPut(i, processStack->basicAt(i));
@@ -127,11 +125,27 @@ static object growProcessStack(int top, int toadd)
   return newStack;
 }
 
+/*
+   the process stack is written directly by the interpreter, without
+   a write barrier on every push, so it is passed to the barrier as a
+   whole whenever execute() leaves it. the end of the time slice is 
+   also when the incremental collector gets to do some work
+   */
+struct EndOfTimeSlice
+{
+  ~EndOfTimeSlice()
+  {
+    MemoryManager::Instance()->writeBarrier(VM::state().processStack);
+    MemoryManager::Instance()->incrementalStep();
+  }
+};
+
 bool execute(object aProcess, int maxsteps)
 {
   object returnedObject;
   int returnPoint, timeSliceCounter;
   object *pst, *psb, *rcv = NULL, *arg, *temps, *lits, *cntx;
+  object charValue;
   ObjectHandle contextObject;
   object *primargs;
   int byteOffset;
@@ -143,7 +157,23 @@ bool execute(object aProcess, int maxsteps)
   byte *bp;
   ObjectHandle intClass = globalSymbol("Integer");
 
+  /* the registers and symbols of the running VM */
+  TVMState& vm = VM::state();
+  ObjectHandle& processStack = vm.processStack;
+  int& linkPointer = vm.linkPointer;
+  ObjectHandle& method = vm.method;
+  ObjectHandle& messageToSend = vm.messageToSend;
+  TMethodCacheEntry* methodCache = vm.methodCache;
+  const std::vector<ObjectHandle>& booleanSyms = vm.booleanSyms;
+  const std::vector<ObjectHandle>& unSyms = vm.unSyms;
+  const std::vector<ObjectHandle>& binSyms = vm.binSyms;
+
   MemoryManager* memmgr = MemoryManager::Instance();
+  /* nothing points into a data area yet, so this is a safe point to 
+     move them, after which they must stay put until we return */
+  memmgr->compactIfPending();
+  TBodyLock bodyLock;
+  EndOfTimeSlice endOfTimeSlice;
 
   /* unpack the instance variables from the process */
   processStack    = objectRef(aProcess).basicAt(stackInProcess);
@@ -174,10 +204,7 @@ readLinkageBlock:
     temps = objectRef(contextObject->basicAt(temporariesInContext)).sysMemPtr();
   }
 
-#if !defined TW_SMALLINTEGER_AS_OBJECT
-  if((argumentsAt(0) & 1) == 0)
-#endif
-    rcv = objectRef(argumentsAt(0)).sysMemPtr();
+  setReceiver(argumentsAt(0));
 
 readMethodInfo:
   lits           = objectRef(method->basicAt(literalsInMethod)).sysMemPtr();
@@ -271,11 +298,16 @@ readMethodInfo:
         break;
 
       case AssignInstance:
-        receiverAtPut(low, stackTop());
+        if (!isImmediate(argumentsAt(0))) {
+          receiverAtPut(low, stackTop());
+          memmgr->writeBarrier(argumentsAt(0), stackTop());
+        }
         break;
 
       case AssignTemporary:
         temporaryAtPut(low, stackTop());
+        if (contextObject != processStack)
+          memmgr->writeBarrier(contextObject->basicAt(temporariesInContext), stackTop());
         break;
 
       case MarkArguments:
@@ -288,10 +320,7 @@ readMethodInfo:
 
 doSendMessage:
         arg = psb + (returnPoint-1);
-#if !defined TW_SMALLINTEGER_AS_OBJECT
-        if((argumentsAt(0) & 1) == 0)
-#endif
-          rcv = objectRef(argumentsAt(0)).sysMemPtr();
+        setReceiver(argumentsAt(0));
         methodClass = getClass(argumentsAt(0));
 
 doFindMessage:
@@ -364,7 +393,7 @@ doFindMessage:
         /* stack, if not make stack larger */
         i = 7 + methodTempSize(method) + methodStackSize(method);
         j = processStackTop();
-        if ((j + i) > processStack->size)
+        if ((j + i) > processStack->size())
         {
           processStack = growProcessStack(j, i);
           psb = processStack->sysMemPtr();
@@ -393,7 +422,7 @@ doFindMessage:
         temps = pst+1;
         pst += methodTempSize(method);
         /* break if we are too big and probably looping */
-        if (processStack->size > 1800) timeSliceCounter = 0;
+        if (processStack->size() > 1800) timeSliceCounter = 0;
         goto readMethodInfo;
 
       case SendUnary:
@@ -415,10 +444,18 @@ doFindMessage:
         /* and conversions are not necessary */
         /* and overflow does not occur */
         primargs = pst - 1;
-        if ((! watching) && (low <= 12) &&
-            (getClass(primargs[0]) == classObject(kInteger) &&
-              getClass(primargs[1]) == classObject(kInteger))) {
-          returnedObject = primitive(low+60, primargs);
+        if ((! watching) && (low <= 12)) {
+          returnedObject = nilobj;
+          if (getClass(primargs[0]) == classObject(kInteger) &&
+              getClass(primargs[1]) == classObject(kInteger))
+            returnedObject = primitive(low+60, primargs);
+          /* on overflow, or with a large integer argument, the large
+             integer primitives promote or demote as needed */
+          if (returnedObject == nilobj && 
+              vm.classSyms[kLargePositiveInteger] != nilobj &&
+              (isSmallInteger(primargs[0]) || isLargeInteger(primargs[0])) &&
+              (isSmallInteger(primargs[1]) || isLargeInteger(primargs[1])))
+            returnedObject = primitive(low+210, primargs);
           if (returnedObject != nilobj) {
             // pop arguments off stack , push on result
             stackTopFree();
@@ -489,9 +526,12 @@ doFindMessage:
                 return false /* all done */;
             }
             break;
-          case 58: /* allocObject */
-            j = getInteger(*primargs);
-            returnedObject = memmgr->allocObject(j);
+          case 58: /* allocObject, nil if it can't be that big */
+            {
+              long size = getInteger(*primargs);
+              returnedObject = (size >= 0 && (unsigned long) size <= ObjectStruct::maxSize)?
+                memmgr->allocObject(size) : nilobj;
+            }
             break;
           case 87: /* value of symbol */
             returnedObject = globalSymbol(objectRef(*primargs).charPtr());
@@ -586,10 +626,7 @@ doReturn:
           case SendToSuper:
             i = nextByte();
             messageToSend = literalsAt(i);
-#if !defined TW_SMALLINTEGER_AS_OBJECT
-            if((argumentsAt(0) & 1) == 0)
-#endif
-              rcv = objectRef(argumentsAt(0)).sysMemPtr();
+            setReceiver(argumentsAt(0));
             methodClass = method->basicAt(methodClassInMethod);
             /* if there is a superclass, use it
                otherwise for class Object (the only
@@ -628,8 +665,9 @@ ObjectHandle sendMessageToObject(ObjectHandle receiver, const char* message, Obj
 {
   MemoryManager* memmgr = MemoryManager::Instance();
   object methodClass = getClass(receiver);
+  TVMState& vm = VM::state();
 
-  messageToSend = createSymbol(message);
+  vm.messageToSend = createSymbol(message);
   if (! findMethod(&methodClass))
   {
     return ObjectHandle();
@@ -650,7 +688,7 @@ ObjectHandle sendMessageToObject(ObjectHandle receiver, const char* message, Obj
   // Context is nil, meaning use the stack for context information
   stack->basicAtPut(contextInStack + cargs, nilobj);
   // Fill in the context data.
-  stack->basicAtPut(methodInStack + cargs, method);
+  stack->basicAtPut(methodInStack + cargs, vm.method);
   stack->basicAtPut(returnpointInStack + cargs, newInteger(1));
   stack->basicAtPut(bytepointerInStack + cargs, newInteger(1));
 
@@ -660,15 +698,15 @@ ObjectHandle sendMessageToObject(ObjectHandle receiver, const char* message, Obj
   for(int i = 0; i < cargs; ++i)
     stack->basicAtPut(2 + i, args[i]);
 
-  ObjectHandle saveProcessStack = processStack;
-  int saveLinkPointer = linkPointer;
+  ObjectHandle saveProcessStack = vm.processStack;
+  int saveLinkPointer = vm.linkPointer;
   while(execute(process, 15000));
   // Re-read the stack object, in case it had to grow during execution and
   // was replaced.
   stack = process->basicAt(stackInProcess);
   object ro = stack->basicAt(1);
-  processStack = saveProcessStack;
-  linkPointer = saveLinkPointer;
+  vm.processStack = saveProcessStack;
+  vm.linkPointer = saveLinkPointer;
 
   return ro;
 }
@@ -677,6 +715,7 @@ ObjectHandle sendMessageToObject(ObjectHandle receiver, const char* message, Obj
 void runCode(const char * text)
 {
     ObjectHandle stack, method, firstProcess;
+    TVMState& vm = VM::state();
 
     method = newMethod();
     Parser pp = Parser(Lexer(text));
@@ -701,13 +740,13 @@ void runCode(const char * text)
     stack->basicAtPut(bytepointerInStack, newInteger(1));    /* byte offset */
 
     /* now go execute it */
-    ObjectHandle saveProcessStack = processStack;
-    int saveLinkPointer = linkPointer;
+    ObjectHandle saveProcessStack = vm.processStack;
+    int saveLinkPointer = vm.linkPointer;
     while (execute(firstProcess, 15000)) fprintf(stderr,"..");
     // Re-read the stack object, in case it had to grow during execution and
     // was replaced.
     //stack = firstProcess->basicAt(stackInProcess);
     //object ro = stack->basicAt(1);
-    processStack = saveProcessStack;
-    linkPointer = saveLinkPointer;
+    vm.processStack = saveProcessStack;
+    vm.linkPointer = saveLinkPointer;
 }
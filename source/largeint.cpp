@@ -0,0 +1,610 @@
+/*
+    Tumbleweed
+
+    arbitrary precision integers, the arithmetic behind the
+    LargePositiveInteger and LargeNegativeInteger primitives
+*/
+
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "largeint.h"
+
+typedef TLargeInteger::digit digit;
+typedef std::vector<digit> TDigits;
+
+/* below this many digits in the shorter operand the schoolbook method is
+   quicker than splitting the operands */
+static const size_t kKaratsubaThreshold = 32;
+
+static void trim(TDigits& a)
+{
+    while(!a.empty() && a.back() == 0)
+        a.pop_back();
+}
+
+static int compareMagnitude(const TDigits& a, const TDigits& b)
+{
+    if(a.size() != b.size())
+        return a.size() < b.size()? -1 : 1;
+    for(size_t i = a.size(); i-- > 0; )
+        if(a[i] != b[i])
+            return a[i] < b[i]? -1 : 1;
+    return 0;
+}
+
+static TDigits addMagnitude(const TDigits& a, const TDigits& b)
+{
+    const TDigits& longer = a.size() >= b.size()? a : b;
+    const TDigits& shorter = a.size() >= b.size()? b : a;
+    TDigits result(longer.size() + 1);
+    uint64_t carry = 0;
+    for(size_t i = 0; i < longer.size(); ++i)
+    {
+        carry += longer[i];
+        if(i < shorter.size())
+            carry += shorter[i];
+        result[i] = static_cast<digit>(carry);
+        carry >>= 32;
+    }
+    result[longer.size()] = static_cast<digit>(carry);
+    trim(result);
+    return result;
+}
+
+/* a must be no smaller than b */
+static TDigits subtractMagnitude(const TDigits& a, const TDigits& b)
+{
+    TDigits result(a.size());
+    int64_t borrow = 0;
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        int64_t t = static_cast<int64_t>(a[i]) - borrow - (i < b.size()? b[i] : 0);
+        borrow = t < 0;
+        result[i] = static_cast<digit>(t);
+    }
+    trim(result);
+    return result;
+}
+
+/* add x into result starting at digit offset, result is big enough */
+static void addShifted(TDigits& result, const TDigits& x, size_t offset)
+{
+    uint64_t carry = 0;
+    size_t i = 0;
+    for(; i < x.size(); ++i)
+    {
+        carry += static_cast<uint64_t>(result[offset + i]) + x[i];
+        result[offset + i] = static_cast<digit>(carry);
+        carry >>= 32;
+    }
+    for(i += offset; carry != 0; ++i)
+    {
+        carry += result[i];
+        result[i] = static_cast<digit>(carry);
+        carry >>= 32;
+    }
+}
+
+static TDigits multiplySchoolbook(const TDigits& a, const TDigits& b)
+{
+    TDigits result(a.size() + b.size());
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        uint64_t carry = 0;
+        for(size_t j = 0; j < b.size(); ++j)
+        {
+            carry += static_cast<uint64_t>(a[i]) * b[j] + result[i + j];
+            result[i + j] = static_cast<digit>(carry);
+            carry >>= 32;
+        }
+        result[i + b.size()] = static_cast<digit>(carry);
+    }
+    trim(result);
+    return result;
+}
+
+static TDigits lowDigits(const TDigits& a, size_t count)
+{
+    TDigits result(a.begin(), a.begin() + std::min(count, a.size()));
+    trim(result);
+    return result;
+}
+
+static TDigits highDigits(const TDigits& a, size_t from)
+{
+    if(from >= a.size())
+        return TDigits();
+    return TDigits(a.begin() + from, a.end());
+}
+
+/* Karatsuba, splitting both at half the longer, three multiplications of
+   half the size in place of four */
+static TDigits multiplyMagnitude(const TDigits& a, const TDigits& b)
+{
+    if(a.empty() || b.empty())
+        return TDigits();
+    if(std::min(a.size(), b.size()) < kKaratsubaThreshold)
+        return multiplySchoolbook(a, b);
+
+    size_t half = std::max(a.size(), b.size()) / 2;
+    TDigits result(a.size() + b.size() + 1);
+    const TDigits& longer = a.size() >= b.size()? a : b;
+    const TDigits& shorter = a.size() >= b.size()? b : a;
+    if(shorter.size() <= half)
+    {
+        /* too lopsided to split both, so split the longer only */
+        addShifted(result, multiplyMagnitude(lowDigits(longer, half), shorter), 0);
+        addShifted(result, multiplyMagnitude(highDigits(longer, half), shorter), half);
+    }
+    else
+    {
+        TDigits a0 = lowDigits(a, half), a1 = highDigits(a, half);
+        TDigits b0 = lowDigits(b, half), b1 = highDigits(b, half);
+        TDigits z0 = multiplyMagnitude(a0, b0);
+        TDigits z2 = multiplyMagnitude(a1, b1);
+        TDigits z1 = multiplyMagnitude(addMagnitude(a0, a1), addMagnitude(b0, b1));
+        z1 = subtractMagnitude(subtractMagnitude(z1, z0), z2);
+        addShifted(result, z0, 0);
+        addShifted(result, z1, half);
+        addShifted(result, z2, 2 * half);
+    }
+    trim(result);
+    return result;
+}
+
+static TDigits shiftLeftMagnitude(const TDigits& a, size_t bits)
+{
+    if(a.empty())
+        return TDigits();
+    size_t words = bits / 32;
+    unsigned int s = bits % 32;
+    TDigits result(a.size() + words + 1);
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        uint64_t t = static_cast<uint64_t>(a[i]) << s;
+        result[i + words] |= static_cast<digit>(t);
+        result[i + words + 1] = static_cast<digit>(t >> 32);
+    }
+    trim(result);
+    return result;
+}
+
+static TDigits shiftRightMagnitude(const TDigits& a, size_t bits)
+{
+    size_t words = bits / 32;
+    if(words >= a.size())
+        return TDigits();
+    unsigned int s = bits % 32;
+    TDigits result(a.size() - words);
+    for(size_t i = 0; i < result.size(); ++i)
+    {
+        uint64_t t = a[i + words];
+        if(i + words + 1 < a.size())
+            t |= static_cast<uint64_t>(a[i + words + 1]) << 32;
+        result[i] = static_cast<digit>(t >> s);
+    }
+    trim(result);
+    return result;
+}
+
+/* divide in place by a single digit, answering the remainder */
+static digit divideByDigit(TDigits& a, digit d)
+{
+    uint64_t remainder = 0;
+    for(size_t i = a.size(); i-- > 0; )
+    {
+        uint64_t t = (remainder << 32) | a[i];
+        a[i] = static_cast<digit>(t / d);
+        remainder = t % d;
+    }
+    trim(a);
+    return static_cast<digit>(remainder);
+}
+
+/* a = a * m + add, growing a as needed */
+static void multiplyAddDigit(TDigits& a, digit m, digit add)
+{
+    uint64_t carry = add;
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        carry += static_cast<uint64_t>(a[i]) * m;
+        a[i] = static_cast<digit>(carry);
+        carry >>= 32;
+    }
+    if(carry != 0)
+        a.push_back(static_cast<digit>(carry));
+}
+
+static int leadingZeros(digit d)
+{
+    int n = 0;
+    for(digit bit = 0x80000000u; bit != 0 && (d & bit) == 0; bit >>= 1)
+        ++n;
+    return n;
+}
+
+/* Knuth's algorithm D, long division a digit at a time with the divisor
+   normalised so each quotient digit guess is at most two too big */
+static void divideMagnitude(const TDigits& u, const TDigits& v, TDigits& quotient, TDigits& remainder)
+{
+    if(compareMagnitude(u, v) < 0)
+    {
+        quotient.clear();
+        remainder = u;
+        return;
+    }
+    if(v.size() == 1)
+    {
+        quotient = u;
+        digit r = divideByDigit(quotient, v[0]);
+        remainder.assign(r != 0? 1 : 0, r);
+        return;
+    }
+
+    const uint64_t base = 1ULL << 32;
+    size_t n = v.size();
+    size_t m = u.size() - n;
+    int s = leadingZeros(v.back());
+    TDigits vn = shiftLeftMagnitude(v, s);
+    TDigits un = shiftLeftMagnitude(u, s);
+    un.resize(u.size() + 1);
+    quotient.assign(m + 1, 0);
+
+    for(size_t j = m + 1; j-- > 0; )
+    {
+        uint64_t numerator = (static_cast<uint64_t>(un[j + n]) << 32) | un[j + n - 1];
+        uint64_t qhat = numerator / vn[n - 1];
+        uint64_t rhat = numerator % vn[n - 1];
+        while(qhat >= base || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2]))
+        {
+            --qhat;
+            rhat += vn[n - 1];
+            if(rhat >= base)
+                break;
+        }
+
+        /* multiply and subtract */
+        int64_t borrow = 0;
+        int64_t t;
+        for(size_t i = 0; i < n; ++i)
+        {
+            uint64_t p = qhat * vn[i];
+            t = static_cast<int64_t>(un[i + j]) - borrow - static_cast<int64_t>(p & 0xffffffffu);
+            un[i + j] = static_cast<digit>(t);
+            borrow = static_cast<int64_t>(p >> 32) - (t >> 32);
+        }
+        t = static_cast<int64_t>(un[j + n]) - borrow;
+        un[j + n] = static_cast<digit>(t);
+
+        /* the guess was one too big, add the divisor back */
+        if(t < 0)
+        {
+            --qhat;
+            uint64_t carry = 0;
+            for(size_t i = 0; i < n; ++i)
+            {
+                carry += static_cast<uint64_t>(un[i + j]) + vn[i];
+                un[i + j] = static_cast<digit>(carry);
+                carry >>= 32;
+            }
+            un[j + n] += static_cast<digit>(carry);
+        }
+        quotient[j] = static_cast<digit>(qhat);
+    }
+    trim(quotient);
+    un.resize(n);
+    trim(un);
+    remainder = shiftRightMagnitude(un, s);
+}
+
+/* the two's complement of a, sign extended to count digits */
+static TDigits toTwosComplement(const TDigits& a, bool negative, size_t count)
+{
+    TDigits result(a);
+    result.resize(count, 0);
+    if(negative)
+    {
+        uint64_t carry = 1;
+        for(size_t i = 0; i < count; ++i)
+        {
+            carry += static_cast<digit>(~result[i]);
+            result[i] = static_cast<digit>(carry);
+            carry >>= 32;
+        }
+    }
+    return result;
+}
+
+TLargeInteger::TLargeInteger(long value) :
+    m_negative(value < 0)
+{
+    unsigned long magnitude = m_negative? 0UL - static_cast<unsigned long>(value) : value;
+    for(; magnitude != 0; magnitude = (sizeof(magnitude) > 4)? magnitude >> 32 : 0)
+        m_digits.push_back(static_cast<digit>(magnitude));
+}
+
+TLargeInteger::TLargeInteger(const unsigned char* bytes, size_t count, bool negative) :
+    m_negative(negative),
+    m_digits((count + 3) / 4, 0)
+{
+    for(size_t i = 0; i < count; ++i)
+        m_digits[i / 4] |= static_cast<digit>(bytes[i]) << (8 * (i % 4));
+    normalise();
+}
+
+bool TLargeInteger::fromDouble(double d, TLargeInteger& result)
+{
+    if(d != d || d - d != 0.0)
+        return false;
+    int exponent;
+    double mantissa = frexp(fabs(d), &exponent);
+    result = TLargeInteger();
+    if(exponent <= 0)
+        return true;
+    /* the 53 bit mantissa as an integer, then shifted into place, which
+       drops only the fraction */
+    uint64_t bits = static_cast<uint64_t>(ldexp(mantissa, 53));
+    result.m_digits.push_back(static_cast<digit>(bits));
+    result.m_digits.push_back(static_cast<digit>(bits >> 32));
+    result.normalise();
+    result = result.shift(exponent - 53);
+    if(d < 0)
+        result = -result;
+    return true;
+}
+
+bool TLargeInteger::fromString(const std::string& text, int radix, TLargeInteger& result)
+{
+    if(radix < 2 || radix > 36 || text.empty())
+        return false;
+    TDigits magnitude;
+    /* take in as many characters at a time as fit in a digit */
+    digit chunk = 1;
+    digit part = 0;
+    for(size_t i = 0; i < text.size(); ++i)
+    {
+        char c = text[i];
+        int value = isdigit(c)? c - '0' : isalpha(c)? toupper(c) - 'A' + 10 : radix;
+        if(value >= radix)
+            return false;
+        if(static_cast<uint64_t>(chunk) * radix > 0xffffffffu)
+        {
+            multiplyAddDigit(magnitude, chunk, part);
+            chunk = 1;
+            part = 0;
+        }
+        chunk *= radix;
+        part = part * radix + value;
+    }
+    multiplyAddDigit(magnitude, chunk, part);
+    result = TLargeInteger();
+    result.m_digits = magnitude;
+    result.normalise();
+    return true;
+}
+
+bool TLargeInteger::toLong(long& value) const
+{
+    if(m_digits.size() * sizeof(digit) > sizeof(long))
+        return false;
+    unsigned long magnitude = 0;
+    for(size_t i = m_digits.size(); i-- > 0; )
+        magnitude = (sizeof(magnitude) > 4? magnitude << 32 : 0) | m_digits[i];
+    if(!m_negative)
+    {
+        if(magnitude > static_cast<unsigned long>(LONG_MAX))
+            return false;
+        value = static_cast<long>(magnitude);
+    }
+    else
+    {
+        if(magnitude - 1 > static_cast<unsigned long>(LONG_MAX))
+            return false;
+        value = -static_cast<long>(magnitude - 1) - 1;
+    }
+    return true;
+}
+
+double TLargeInteger::toDouble() const
+{
+    double result = 0.0;
+    for(size_t i = m_digits.size(); i-- > 0; )
+        result = result * 4294967296.0 + m_digits[i];
+    return m_negative? -result : result;
+}
+
+size_t TLargeInteger::byteCount() const
+{
+    if(m_digits.empty())
+        return 0;
+    size_t count = m_digits.size() * 4;
+    for(digit top = m_digits.back(); (top & 0xff000000u) == 0; top <<= 8)
+        --count;
+    return count;
+}
+
+void TLargeInteger::getBytes(unsigned char* bytes) const
+{
+    size_t count = byteCount();
+    for(size_t i = 0; i < count; ++i)
+        bytes[i] = static_cast<unsigned char>(m_digits[i / 4] >> (8 * (i % 4)));
+}
+
+std::string TLargeInteger::toString(int radix) const
+{
+    if(radix < 2 || radix > 36)
+        return std::string();
+    if(m_digits.empty())
+        return "0";
+
+    /* peel off as many characters at a time as fit in a digit */
+    digit chunk = radix;
+    int perChunk = 1;
+    while(static_cast<uint64_t>(chunk) * radix <= 0xffffffffu)
+    {
+        chunk *= radix;
+        ++perChunk;
+    }
+    static const char characters[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    std::string reversed;
+    TDigits magnitude(m_digits);
+    while(!magnitude.empty())
+    {
+        digit part = divideByDigit(magnitude, chunk);
+        for(int i = 0; i < perChunk && (part != 0 || !magnitude.empty()); ++i)
+        {
+            reversed += characters[part % radix];
+            part /= radix;
+        }
+    }
+    if(m_negative)
+        reversed += '-';
+    return std::string(reversed.rbegin(), reversed.rend());
+}
+
+TLargeInteger TLargeInteger::operator-() const
+{
+    TLargeInteger result(*this);
+    result.m_negative = !m_negative;
+    result.normalise();
+    return result;
+}
+
+TLargeInteger operator+(const TLargeInteger& a, const TLargeInteger& b)
+{
+    TLargeInteger result;
+    if(a.m_negative == b.m_negative)
+    {
+        result.m_digits = addMagnitude(a.m_digits, b.m_digits);
+        result.m_negative = a.m_negative;
+    }
+    else if(compareMagnitude(a.m_digits, b.m_digits) >= 0)
+    {
+        result.m_digits = subtractMagnitude(a.m_digits, b.m_digits);
+        result.m_negative = a.m_negative;
+    }
+    else
+    {
+        result.m_digits = subtractMagnitude(b.m_digits, a.m_digits);
+        result.m_negative = b.m_negative;
+    }
+    result.normalise();
+    return result;
+}
+
+TLargeInteger operator-(const TLargeInteger& a, const TLargeInteger& b)
+{
+    return a + -b;
+}
+
+TLargeInteger operator*(const TLargeInteger& a, const TLargeInteger& b)
+{
+    TLargeInteger result;
+    result.m_digits = multiplyMagnitude(a.m_digits, b.m_digits);
+    result.m_negative = a.m_negative != b.m_negative;
+    result.normalise();
+    return result;
+}
+
+int TLargeInteger::compare(const TLargeInteger& a, const TLargeInteger& b)
+{
+    if(a.m_negative != b.m_negative)
+        return a.m_negative? -1 : 1;
+    int c = compareMagnitude(a.m_digits, b.m_digits);
+    return a.m_negative? -c : c;
+}
+
+bool TLargeInteger::divide(const TLargeInteger& a, const TLargeInteger& b, TLargeInteger& quotient, TLargeInteger& remainder)
+{
+    if(b.isZero())
+        return false;
+    TDigits q, r;
+    divideMagnitude(a.m_digits, b.m_digits, q, r);
+    quotient.m_digits.swap(q);
+    quotient.m_negative = a.m_negative != b.m_negative;
+    quotient.normalise();
+    remainder.m_digits.swap(r);
+    remainder.m_negative = a.m_negative;
+    remainder.normalise();
+    return true;
+}
+
+TLargeInteger TLargeInteger::gcd(const TLargeInteger& a, const TLargeInteger& b)
+{
+    TDigits x(a.m_digits), y(b.m_digits), q, r;
+    while(!y.empty())
+    {
+        divideMagnitude(x, y, q, r);
+        x.swap(y);
+        y.swap(r);
+    }
+    TLargeInteger result;
+    result.m_digits.swap(x);
+    return result;
+}
+
+TLargeInteger TLargeInteger::shift(long count) const
+{
+    TLargeInteger result;
+    result.m_negative = m_negative;
+    if(count >= 0)
+        result.m_digits = shiftLeftMagnitude(m_digits, count);
+    else if(!m_negative)
+        result.m_digits = shiftRightMagnitude(m_digits, -count);
+    else
+    {
+        /* -a >> n is -((a - 1 >> n) + 1) */
+        TDigits one(1, 1);
+        result.m_digits = addMagnitude(shiftRightMagnitude(subtractMagnitude(m_digits, one), -count), one);
+    }
+    result.normalise();
+    return result;
+}
+
+TLargeInteger TLargeInteger::bitwise(const TLargeInteger& a, const TLargeInteger& b, TBitOperation operation)
+{
+    size_t count = std::max(a.m_digits.size(), b.m_digits.size()) + 1;
+    TDigits x = toTwosComplement(a.m_digits, a.m_negative, count);
+    TDigits y = toTwosComplement(b.m_digits, b.m_negative, count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        switch(operation)
+        {
+            case kBitAnd: x[i] &= y[i]; break;
+            case kBitOr:  x[i] |= y[i]; break;
+            case kBitXor: x[i] ^= y[i]; break;
+        }
+    }
+    TLargeInteger result;
+    result.m_negative = (x.back() & 0x80000000u) != 0;
+    /* two's complement is its own inverse */
+    result.m_digits = toTwosComplement(x, result.m_negative, count);
+    result.normalise();
+    return result;
+}
+
+TLargeInteger TLargeInteger::bitAnd(const TLargeInteger& a, const TLargeInteger& b)
+{
+    return bitwise(a, b, kBitAnd);
+}
+
+TLargeInteger TLargeInteger::bitOr(const TLargeInteger& a, const TLargeInteger& b)
+{
+    return bitwise(a, b, kBitOr);
+}
+
+TLargeInteger TLargeInteger::bitXor(const TLargeInteger& a, const TLargeInteger& b)
+{
+    return bitwise(a, b, kBitXor);
+}
+
+void TLargeInteger::normalise()
+{
+    trim(m_digits);
+    if(m_digits.empty())
+        m_negative = false;
+}
@@ -0,0 +1,135 @@
+/*
+    Tumbleweed
+
+    arbitrary precision integers, the arithmetic behind the
+    LargePositiveInteger and LargeNegativeInteger primitives
+*/
+
+#ifndef __LARGEINT_H__
+#define __LARGEINT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*! A signed integer of any size.
+ *
+ * The magnitude is held as 32 bit digits, least significant first, with
+ * no leading zero digits, so zero has none. In the image the same
+ * magnitude is held as the bytes of a byte object, least significant
+ * first, and the sign is the object's class.
+ */
+class TLargeInteger
+{
+    public:
+        typedef uint32_t digit;
+
+        //! Zero.
+        TLargeInteger();
+
+        //! The value of a SmallInteger, or any long.
+        TLargeInteger(long value);
+
+        /*! From the bytes of a large integer object.
+         *
+         * \param bytes The magnitude, least significant byte first.
+         * \param count The number of bytes.
+         * \param negative True for a LargeNegativeInteger.
+         */
+        TLargeInteger(const unsigned char* bytes, size_t count, bool negative);
+
+        /*! The integer part of a double, rounded towards zero.
+         *
+         * \return False if the double is infinite or not a number.
+         */
+        static bool fromDouble(double d, TLargeInteger& result);
+
+        /*! From the digits of a literal, in a radix from 2 to 36.
+         *
+         * \return False, leaving result alone, if the text is empty or
+         * has anything but digits of the radix, no sign is allowed.
+         */
+        static bool fromString(const std::string& text, int radix, TLargeInteger& result);
+
+        bool negative() const;
+        bool isZero() const;
+
+        /*! The value as a long, if it fits in one.
+         *
+         * \return False if it doesn't, with value unchanged.
+         */
+        bool toLong(long& value) const;
+
+        //! The nearest double, or an infinity if too big.
+        double toDouble() const;
+
+        //! The number of bytes in the magnitude.
+        size_t byteCount() const;
+
+        //! Copy the magnitude out, least significant byte first.
+        void getBytes(unsigned char* bytes) const;
+
+        /*! The digits in a radix from 2 to 36, with a leading - if negative.
+         *
+         * \return An empty string for a radix out of range.
+         */
+        std::string toString(int radix) const;
+
+        TLargeInteger operator-() const;
+        friend TLargeInteger operator+(const TLargeInteger& a, const TLargeInteger& b);
+        friend TLargeInteger operator-(const TLargeInteger& a, const TLargeInteger& b);
+        friend TLargeInteger operator*(const TLargeInteger& a, const TLargeInteger& b);
+
+        //! Less than zero, zero or more than zero as a is less, equal or more than b.
+        static int compare(const TLargeInteger& a, const TLargeInteger& b);
+
+        /*! Division truncated towards zero, as quo: and rem: do.
+         *
+         * The remainder takes the sign of the dividend.
+         *
+         * \return False, leaving the results alone, if the divisor is zero.
+         */
+        static bool divide(const TLargeInteger& a, const TLargeInteger& b, TLargeInteger& quotient, TLargeInteger& remainder);
+
+        //! The greatest common divisor, never negative.
+        static TLargeInteger gcd(const TLargeInteger& a, const TLargeInteger& b);
+
+        /*! Shift left for positive counts, right for negative.
+         *
+         * As on two's complement, a right shift rounds towards negative
+         * infinity.
+         */
+        TLargeInteger shift(long count) const;
+
+        //! Bitwise operations as on two's complement of unlimited width.
+        static TLargeInteger bitAnd(const TLargeInteger& a, const TLargeInteger& b);
+        static TLargeInteger bitOr(const TLargeInteger& a, const TLargeInteger& b);
+        static TLargeInteger bitXor(const TLargeInteger& a, const TLargeInteger& b);
+
+    private:
+        enum TBitOperation { kBitAnd, kBitOr, kBitXor };
+        static TLargeInteger bitwise(const TLargeInteger& a, const TLargeInteger& b, TBitOperation operation);
+        void normalise();
+
+        bool m_negative;
+        std::vector<digit> m_digits;
+};
+
+inline TLargeInteger::TLargeInteger() :
+    m_negative(false)
+{
+}
+
+inline bool TLargeInteger::negative() const
+{
+    return m_negative;
+}
+
+inline bool TLargeInteger::isZero() const
+{
+    return m_digits.empty();
+}
+
+#endif
@@ -172,21 +172,24 @@ tokentype Lexer::nextToken()
     else if (isdigit(m_cc)) 
     {     /* number */
         long longresult = m_cc - '0';
+        bool fits = true;
         while (nextChar() && isdigit(m_cc)) 
         {
             strToken.push_back(m_cc);
-            longresult = (longresult * 10) + (m_cc - '0');
+            /* past a SmallInteger the parser makes a large integer from
+               the digits in the token string */
+            if (fits && longresult > (kSmallIntegerMax - (m_cc - '0')) / 10)
+                fits = false;
+            if (fits)
+                longresult = (longresult * 10) + (m_cc - '0');
         }
-        if (longCanBeInt(longresult)) 
+        if (fits) 
         {
             m_tokenInteger = longresult;
             m_currentToken = intconst;
         }
         else 
-        {
-            m_currentToken = floatconst;
-            m_tokenFloat = (double) longresult;
-        }
+            m_currentToken = largeconst;
         if (m_cc == '.') 
         {    /* possible float */
             if (nextChar() && isdigit(m_cc)) 
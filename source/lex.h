@@ -19,6 +19,7 @@ typedef enum tokensyms
     namecolon, 
     intconst, 
     floatconst, 
+    largeconst, 
     charconst, 
     symconst,
     arraybegin, 
@@ -56,7 +57,7 @@ class Lexer
         char peek();
         tokentype currentToken() const;
         const std::string& strToken() const;
-        int intToken() const;
+        long intToken() const;
         double floatToken() const;
         const char* source() const;
 
@@ -70,7 +71,7 @@ class Lexer
         bool binarySecond(char c);
 
         tokentype   m_currentToken;
-        int m_tokenInteger;
+        long m_tokenInteger;
         double m_tokenFloat;
         std::string m_tokenString;
         const char* m_source;
@@ -92,7 +93,7 @@ inline const std::string& Lexer::strToken() const
     return m_tokenString;
 }
 
-inline int Lexer::intToken() const
+inline long Lexer::intToken() const
 {
     return m_tokenInteger;
 }
@@ -27,21 +27,25 @@
 
 # include <stdio.h>
 # include <string.h>
+# include <map>
+# include <vector>
 # include "env.h"
 # include "objmemory.h"
 # include "names.h"
+# include "largeint.h"
+# include "vm.h"
 
-void nameTableInsert(object dict, int hash, object key, object value)
+void nameTableInsert(object dict, long hash, object key, object value)
 {   
     ObjectHandle table, link, nwLink, nextLink, tablentry;
 
     /* first get the hash table */
     table = objectRef(dict).basicAt(tableInDictionary);
 
-    if (table->size < 3)
+    if (table->size() < 3)
         sysError("attempt to insert into","too small name table");
     else {
-        hash = 3 * ( hash % (table->size / 3));
+        hash = 3 * ( hash % (table->size() / 3));
         tablentry = table->basicAt(hash+1);
         if ((tablentry == nilobj) || (tablentry == key)) {
             table->basicAtPut(hash+1, key);
@@ -75,16 +79,16 @@ void nameTableInsert(object dict, int hash, object key, object value)
     }
 }
 
-object hashEachElement(object dict, register int hash, int (*fun)(object))
+object hashEachElement(object dict, register long hash, int (*fun)(object))
 {   
     object table, key, value, link;
     register object *hp;
-    int tablesize;
+    long tablesize;
 
     table = objectRef(dict).basicAt(tableInDictionary);
 
     /* now see if table is valid */
-    if ((tablesize = objectRef(table).size) < 3)
+    if ((tablesize = objectRef(table).size()) < 3)
         sysError("system error","lookup on null table");
     else 
     {
@@ -106,23 +110,20 @@ object hashEachElement(object dict, register int hash, int (*fun)(object))
     return nilobj;
 }
 
-int strHash(const char* str)    /* compute hash value of string ---- strHash */
+long strHash(const char* str)    /* compute hash value of string ---- strHash */
 {   
-    register int hash;
+    register long hash;
     register const char *p;
 
     hash = 0;
     for (p = str; *p; p++)
         hash += *p;
     if (hash < 0) hash = - hash;
-    /* make sure it can be a smalltalk integer */
-    if (hash > 16384)
-        hash >>= 2;
     return hash;
 }
 
-static object objBuffer;
-static const char   *charBuffer;
+static TW_THREAD object objBuffer;
+static TW_THREAD const char   *charBuffer;
 
 static int strTest(object key) /* test for string equality ---- strTest */
 {
@@ -147,11 +148,6 @@ object nameTableLookup(object dict, const char* str)
     return hashEachElement(dict, strHash(str), strTest);
 }
 
-std::vector<ObjectHandle> booleanSyms;
-std::vector<ObjectHandle> unSyms;
-std::vector<ObjectHandle> binSyms;
-ObjectHandle classSyms[k__lastClass+1];
-
 const char *unStrs[] = {"isNil", "notNil", "value", "new", "class", "size",
 "basicSize", "print", "printString", 0};
 
@@ -177,26 +173,255 @@ struct ClassRef classStrs[] = {
     { "String", kString },
     { "Symbol", kSymbol },
     { "Process", kProcess },
+    { "LargePositiveInteger", kLargePositiveInteger },
+    { "LargeNegativeInteger", kLargeNegativeInteger },
 
     { 0, k__lastClass },
 };
 
+/* the value under aSelector in a method table, searched from end to
+   end, since after renumbering the tables are misplaced themselves */
+static object scanMethods(object methods, object aSelector)
+{
+    object table = objectRef(methods).basicAt(tableInDictionary);
+    long size = objectRef(table).size();
+    for (long i = 1; i + 2 <= size; i += 3)
+    {
+        if (objectRef(table).basicAt(i) == aSelector)
+            return objectRef(table).basicAt(i+1);
+        for (object link = objectRef(table).basicAt(i+2); link != nilobj;
+                link = objectRef(link).basicAt(nextInLink))
+            if (objectRef(link).basicAt(keyInLink) == aSelector)
+                return objectRef(link).basicAt(valueInLink);
+    }
+    return nilobj;
+}
+
+static bool inherits(object aClass, object superClass)
+{
+    for (; aClass != nilobj; aClass = objectRef(aClass).basicAt(superClassInClass))
+        if (aClass == superClass)
+            return true;
+    return false;
+}
+
+/* which keys hash by their number, those whose #hash is Object's, and
+   Integers aside, which the primitive hashes by value */
+class TIdentityKeys
+{
+    public:
+        TIdentityKeys() :
+            m_hashSelector(globalKey("hash")),
+            m_integerClass(globalSymbol("Integer")),
+            m_identityHash(nilobj)
+        {
+            object objectClass = globalSymbol("Object");
+            if (objectClass != nilobj && objectRef(objectClass).basicAt(methodsInClass) != nilobj)
+                m_identityHash = scanMethods(objectRef(objectClass).basicAt(methodsInClass), m_hashSelector);
+        }
+
+        bool operator()(object key)
+        {
+            if (key == nilobj || isImmediate(key))
+                return false;
+            object aClass = objectRef(key).objectClass();
+            std::map<object, bool>::iterator known = m_classes.find(aClass);
+            if (known != m_classes.end())
+                return known->second;
+            return m_classes[aClass] = byIdentity(aClass);
+        }
+
+    private:
+        bool byIdentity(object aClass)
+        {
+            if (aClass == m_integerClass)
+                return false;
+            for (; aClass != nilobj; aClass = objectRef(aClass).basicAt(superClassInClass))
+            {
+                object methods = objectRef(aClass).basicAt(methodsInClass);
+                object method = (methods == nilobj)? nilobj : scanMethods(methods, m_hashSelector);
+                if (method != nilobj)
+                    return method == m_identityHash;
+            }
+            return true;
+        }
+
+        object m_hashSelector;
+        object m_integerClass;
+        object m_identityHash;
+        std::map<object, bool> m_classes;
+};
+
+struct TRehashEntry
+{
+    object key;
+    object value;
+    long bucket;
+};
+
+/* put the entries of a Dictionary whose keys hash by identity back in
+   the buckets their new numbers hash to */
+static void rehashDictionary(object dict, TIdentityKeys& identityKeys)
+{
+    object table = objectRef(dict).basicAt(tableInDictionary);
+    long buckets = objectRef(table).size() / 3;
+    std::vector<TRehashEntry> entries;
+    bool moved = false;
+    for (long b = 0; b < buckets; ++b)
+    {
+        object key = objectRef(table).basicAt(3*b+1);
+        object value = objectRef(table).basicAt(3*b+2);
+        object link = objectRef(table).basicAt(3*b+3);
+        for (;;)
+        {
+            if (key != nilobj)
+            {
+                TRehashEntry entry = { key, value, identityKeys(key)? hashObject(key) % buckets : b };
+                moved = moved || entry.bucket != b;
+                entries.push_back(entry);
+            }
+            if (link == nilobj)
+                break;
+            key = objectRef(link).basicAt(keyInLink);
+            value = objectRef(link).basicAt(valueInLink);
+            link = objectRef(link).basicAt(nextInLink);
+        }
+    }
+    if (!moved)
+        return;
+
+    /* the Links are made afresh, so hold on to the entries meanwhile */
+    ObjectHandle held = newArray(2 * entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        held->basicAtPut(2*i+1, entries[i].key);
+        held->basicAtPut(2*i+2, entries[i].value);
+    }
+    for (long i = 1; i <= 3 * buckets; ++i)
+        objectRef(table).basicAtPut(i, nilobj);
+    for (size_t i = 0; i < entries.size(); ++i)
+        nameTableInsert(dict, entries[i].bucket, held->basicAt(2*i+1), held->basicAt(2*i+2));
+}
+
+/* the same for a WeakKeyDictionary, whose table holds chains of
+   Ephemerons, these are relinked as they are */
+static void rehashWeakKeyDictionary(object dict, TIdentityKeys& identityKeys)
+{
+    object table = objectRef(dict).basicAt(tableInDictionary);
+    long size = objectRef(table).size();
+    std::vector<object> links;
+    std::vector<long> buckets;
+    for (long b = 0; b < size; ++b)
+    {
+        for (object link = objectRef(table).basicAt(b+1); link != nilobj;
+                link = objectRef(link).basicAt(nextInLink))
+        {
+            object key = objectRef(link).basicAt(keyInLink);
+            if (key == nilobj)
+                continue;
+            links.push_back(link);
+            buckets.push_back(identityKeys(key)? hashObject(key) % size : b);
+        }
+        objectRef(table).basicAtPut(b+1, nilobj);
+    }
+    for (size_t i = 0; i < links.size(); ++i)
+    {
+        objectRef(links[i]).basicAtPut(nextInLink, objectRef(table).basicAt(buckets[i]+1));
+        objectRef(table).basicAtPut(buckets[i]+1, links[i]);
+    }
+}
+
+/* objects hash by their number unless their class says otherwise, so once
+   an image renumbered as it was saved is read, every dictionary holding
+   such keys, the method tables among them, has to be rehashed before
+   anything is looked up. the symbols table hashes names, and is left be */
+void rehashDictionaries()
+{
+    MemoryManager* mm = MemoryManager::Instance();
+    object dictionaryClass = globalSymbol("Dictionary");
+    object weakClass = globalSymbol("WeakKeyDictionary");
+    TIdentityKeys identityKeys;
+    std::map<object, int> kinds;
+    /* dictionaries made while rehashing are already in order */
+    size_t count = mm->storageSize();
+    for (size_t i = 1; i < count; ++i)
+    {
+        object dict = objectID(i);
+        if (dict == symbols || (objectRef(dict).flags & kFreeSlot))
+            continue;
+        object aClass = objectRef(dict).objectClass();
+        std::map<object, int>::iterator kind = kinds.find(aClass);
+        if (kind == kinds.end())
+            kind = kinds.insert(std::make_pair(aClass,
+                    inherits(aClass, weakClass)? 2 : inherits(aClass, dictionaryClass)? 1 : 0)).first;
+        if (kind->second == 0)
+            continue;
+        object table = objectRef(dict).basicAt(tableInDictionary);
+        if (table == nilobj || isImmediate(table) || objectRef(table).isBytes())
+            continue;
+        if (kind->second == 2)
+            rehashWeakKeyDictionary(dict, identityKeys);
+        else
+            rehashDictionary(dict, identityKeys);
+    }
+}
+
+/* an Array of every object whose class has a method for aSelector, or
+   inherits one. the heap is collected first, so that all of those found
+   are live, and survive the Array being made */
+object allResponders(object aSelector)
+{
+    MemoryManager* mm = MemoryManager::Instance();
+    mm->garbageCollect();
+    std::map<object, bool> responds;
+    std::vector<object> found;
+    size_t count = mm->storageSize();
+    for (size_t i = 1; i < count; ++i)
+    {
+        object x = objectID(i);
+        if (objectRef(x).flags & kFreeSlot)
+            continue;
+        object aClass = objectRef(x).objectClass();
+        std::map<object, bool>::iterator known = responds.find(aClass);
+        if (known == responds.end())
+        {
+            bool method = false;
+            for (object c = aClass; c != nilobj && !method; c = objectRef(c).basicAt(superClassInClass))
+            {
+                object methods = objectRef(c).basicAt(methodsInClass);
+                method = methods != nilobj && scanMethods(methods, aSelector) != nilobj;
+            }
+            known = responds.insert(std::make_pair(aClass, method)).first;
+        }
+        if (known->second)
+            found.push_back(x);
+    }
+    ObjectHandle list = newArray(found.size());
+    for (size_t i = 0; i < found.size(); ++i)
+        list->basicAtPut(i + 1, found[i]);
+    return list;
+}
+
 /* initialize common symbols used by the parser and interpreter */
 void initCommonSymbols()
 {   
     int i;
+    TVMState& vm = VM::state();
+
+    if (MemoryManager::Instance()->imageRenumbered())
+        rehashDictionaries();
 
-    booleanSyms.push_back(globalSymbol("true"));
-    booleanSyms.push_back(globalSymbol("false"));
+    vm.booleanSyms.push_back(globalSymbol("true"));
+    vm.booleanSyms.push_back(globalSymbol("false"));
     for (i = 0; unStrs[i]; ++i)
-        unSyms.push_back(createSymbol(unStrs[i]));
+        vm.unSyms.push_back(createSymbol(unStrs[i]));
     for (i = 0; binStrs[i]; ++i)
-        binSyms.push_back(createSymbol(binStrs[i]));
+        vm.binSyms.push_back(createSymbol(binStrs[i]));
     //classSyms.resize(k__lastClass);
     for (i = 0; classStrs[i].index != k__lastClass; ++i)
     {
         ObjectHandle h = globalSymbol(classStrs[i].name);
-        classSyms[classStrs[i].index] = globalSymbol(classStrs[i].name);
+        vm.classSyms[classStrs[i].index] = globalSymbol(classStrs[i].name);
     }
 }
 
@@ -218,10 +443,12 @@ object createSymbol(const char* name)
 
 object createAndRegisterNewClass(const char* name)
 {
-    object newObj = newClass(name);
+    ObjectHandle newObj = newClass(name);
     /* now put in global symbols table */
-    object nameObj = newSymbol(name);
+    ObjectHandle nameObj = createSymbol(name);
+    newObj->basicAtPut(nameInClass, nameObj);
     nameTableInsert(symbols, strHash(name), nameObj, newObj);
+    return newObj;
 }
 
 
@@ -230,7 +457,7 @@ object newArray(int size)
     object newObj;
 
     newObj = MemoryManager::Instance()->allocObject(size);
-    objectRef(newObj)._class = classObject(kArray);
+    objectRef(newObj).setClass(classObject(kArray));
     return newObj;
 }
 
@@ -239,7 +466,7 @@ object newBlock()
     object newObj;
 
     newObj = MemoryManager::Instance()->allocObject(blockSize);
-    objectRef(newObj)._class = classObject(kBlock);
+    objectRef(newObj).setClass(classObject(kBlock));
     return newObj;
 }
 
@@ -248,26 +475,22 @@ object newByteArray(int size)
     object newobj;
 
     newobj = MemoryManager::Instance()->allocByte(size);
-    objectRef(newobj)._class = classObject(kByteArray);
+    objectRef(newobj).setClass(classObject(kByteArray));
     return newobj;
 }
 
 object newChar(int value)
 {   
-    object newobj;
-
-    newobj = MemoryManager::Instance()->allocObject(1);
-    objectRef(newobj).basicAtPut(1, newInteger(value));
-    objectRef(newobj)._class = classObject(kChar);
-    return(newobj);
+    return immediateChar(value);
 }
 
 object newClass(const char* name)
 {   
-    object newObj, nameObj, methTable;
+    ObjectHandle newObj;
+    object nameObj = nilobj, methTable;
 
     newObj = MemoryManager::Instance()->allocObject(classSize);
-    objectRef(newObj)._class = classObject(kClass);
+    objectRef(newObj).setClass(classObject(kClass));
 
     /* now make name */
     //nameObj = newSymbol(name);
@@ -283,7 +506,7 @@ object newContext(int link, object method, object args, object temp)
     object newObj;
 
     newObj = MemoryManager::Instance()->allocObject(contextSize);
-    objectRef(newObj)._class = classObject(kContext);
+    objectRef(newObj).setClass(classObject(kContext));
     objectRef(newObj).basicAtPut(linkPtrInContext, newInteger(link));
     objectRef(newObj).basicAtPut(methodInContext, method);
     objectRef(newObj).basicAtPut(argumentsInContext, args);
@@ -293,10 +516,10 @@ object newContext(int link, object method, object args, object temp)
 
 object newDictionary(int size)
 {   
-    object newObj;
+    ObjectHandle newObj;
 
     newObj = MemoryManager::Instance()->allocObject(dictionarySize);
-    objectRef(newObj)._class = classObject(kDictionary);
+    objectRef(newObj).setClass(classObject(kDictionary));
     objectRef(newObj).basicAtPut(tableInDictionary, newArray(size));
     return newObj;
 }
@@ -305,12 +528,22 @@ object newFloat(double d)
 {   
     object newObj;
 
+    if (fitsImmediateFloat(d))
+        return immediateFloat(d);
     newObj = MemoryManager::Instance()->allocByte((int) sizeof (double));
     memcpy(objectRef(newObj).charPtr(), (char *) &d, (int) sizeof (double));
-    objectRef(newObj)._class = classObject(kFloat);
+    objectRef(newObj).setClass(classObject(kFloat));
     return newObj;
 }
 
+/* the value of a Float, immediate or not */
+double floatValue(object f)
+{
+    if (isSmallFloat(f))
+        return immediateFloatValue(f);
+    return objectRef(f).floatValue();
+}
+
 object newInteger(long i)
 {   
 #if defined TW_SMALLINTEGER_AS_OBJECT
@@ -318,13 +551,32 @@ object newInteger(long i)
 
     newObj = MemoryManager::Instance()->allocByte((int) sizeof (int));
     memcpy(objectRef(newObj).charPtr(), (char *) &i, (int) sizeof (int));
-    objectRef(newObj)._class = classObject(kInteger);
+    objectRef(newObj).setClass(classObject(kInteger));
     return newObj;
 #else
-    return (i << 1) + 1;
+    return static_cast<object>((static_cast<unsigned long>(i) << 1) | 1);
 #endif
 }
 
+/* a SmallInteger when the value fits, otherwise a large integer, or nil
+   if the image has no large integer classes */
+object newLargeInteger(const TLargeInteger& value)
+{
+    long small;
+    if (value.toLong(small) && fitsSmallInteger(small))
+        return newInteger(small);
+
+    object largeClass = VM::state().classSyms[value.negative()? kLargeNegativeInteger : kLargePositiveInteger];
+    if (largeClass == nilobj)
+        return nilobj;
+    if (value.byteCount() > ObjectStruct::maxSize)
+        return nilobj;
+    object newObj = MemoryManager::Instance()->allocByte(value.byteCount());
+    value.getBytes(reinterpret_cast<unsigned char*>(objectRef(newObj).charPtr()));
+    objectRef(newObj).setClass(largeClass);
+    return newObj;
+}
+
 object newCPointer(void* l)
 {   
     object newObj;
@@ -332,7 +584,7 @@ object newCPointer(void* l)
     int s = sizeof(void*);
     newObj = MemoryManager::Instance()->allocByte((int) sizeof (void*));
     memcpy(objectRef(newObj).charPtr(), (char *) &l, (int) sizeof (void*));
-    objectRef(newObj)._class = classObject(kCPointer);
+    objectRef(newObj).setClass(classObject(kCPointer));
     return newObj;
 }
 
@@ -341,7 +593,7 @@ object newLink(object key, object value)
     object newObj;
 
     newObj = MemoryManager::Instance()->allocObject(linkSize);
-    objectRef(newObj)._class = classObject(kLink);
+    objectRef(newObj).setClass(classObject(kLink));
     objectRef(newObj).basicAtPut(keyInLink, key);
     objectRef(newObj).basicAtPut(valueInLink, value);
     return newObj;
@@ -351,7 +603,7 @@ object newMethod()
 {   object newObj;
 
     newObj = MemoryManager::Instance()->allocObject(methodSize);
-    objectRef(newObj)._class = classObject(kMethod);
+    objectRef(newObj).setClass(classObject(kMethod));
     return newObj;
 }
 
@@ -360,7 +612,7 @@ object newStString(const char* value)
   object newObj;
 
     newObj = MemoryManager::Instance()->allocStr(value);
-    objectRef(newObj)._class = classObject(kString);
+    objectRef(newObj).setClass(classObject(kString));
     return(newObj);
 }
 
@@ -369,7 +621,7 @@ object newSymbol(const char* str)
     object newObj;
 
     newObj = MemoryManager::Instance()->allocStr(str);
-    objectRef(newObj)._class = classObject(kSymbol);
+    objectRef(newObj).setClass(classObject(kSymbol));
     //nameTableInsert(symbols, strHash(str), newObj, nilobj);
     return newObj;
 }
@@ -80,6 +80,8 @@ enum ClassSymbols_t {
     kString,
     kSymbol,
     kProcess,
+    kLargePositiveInteger,
+    kLargeNegativeInteger,
 
     k__lastClass,
 };
@@ -91,34 +93,25 @@ struct ClassRef {
 
 extern struct ClassRef classStrs[];
 
+class TLargeInteger;
 
-extern ObjectHandle classSyms[];
-extern std::vector<ObjectHandle> unSyms, binSyms;
 
 # define booleanTrue 0
 # define booleanFalse 1
-extern std::vector<ObjectHandle> booleanSyms;
 
-extern void nameTableInsert( object, int, object, object);
+extern void nameTableInsert( object, long, object, object);
 /*extern object hashEachElement( OBJ X INT X INT FUNC );*/
-extern int strHash ( const char* );
+extern long strHash ( const char* );
 extern object globalKey ( const char* );
 extern object nameTableLookup ( object, const char* );
 # define globalSymbol(s) nameTableLookup(symbols, s)
-object hashEachElement(object dict, register int hash, int(*fun)(object));
+object hashEachElement(object dict, register long hash, int(*fun)(object));
 
 extern object createSymbol(const char* name);
+extern void rehashDictionaries();
+extern object allResponders(object aSelector);
 extern object createAndRegisterNewClass(const char* name);
 
-inline object classObject(ClassSymbols_t cname) {
-    object cached = classSyms[cname];
-    if(cached != nilobj) {
-        return cached;
-    } else {
-        return globalSymbol(classStrs[cname].name);
-    }
-}
-
 object newArray(int size);
 object newBlock();
 object newByteArray(int size);
@@ -127,7 +120,9 @@ object newClass(const char* name);
 object newContext(int link, object method, object args, object temp);
 object newDictionary(int size);
 object newFloat(double d);
+double floatValue(object f);
 object newInteger(long i);
+object newLargeInteger(const TLargeInteger& value);
 object newCPointer(void* l);
 object newLink(object key, object value);
 object newMethod();
@@ -23,22 +23,58 @@
 
 #include <sstream>
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if !defined(WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+
 #include "env.h"
 #include "objmemory.h"
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#define ATOMIC_FETCH_OR(x, v) __atomic_fetch_or(&(x), (v), __ATOMIC_RELAXED)
+#else
+#include <intrin.h>
+#define PREFETCH(p)
+#define ATOMIC_FETCH_OR(x, v) _InterlockedOr64((long long*)&(x), (v))
+#endif
 #include "interp.h"
 #include "names.h"
 
 
 bool debugging = false;
 
-extern object firstProcess;
-object symbols;     /* table of all symbols created */
+TW_THREAD object symbols;     /* table of all symbols created */
 
-ObjectHandle* ObjectHandle::head = NULL;
-ObjectHandle* ObjectHandle::tail = NULL;
+/* plain data, so set before any global handle is constructed */
+TW_THREAD long* ObjectHandle::m_roots = NULL;
+TW_THREAD long* ObjectHandle::m_rootTop = NULL;
+TW_THREAD long* ObjectHandle::m_rootLimit = NULL;
+TW_THREAD bool ObjectHandle::m_rootsOrphaned = false;
+const long ObjectHandle::vacantSlot;
 
 /*
     in theory the objectTable should only be accessible to the memory
@@ -52,140 +88,435 @@ ObjectHandle* ObjectHandle::tail = NULL;
     calloc during the initialization of the memory manager.
 */
 
-MemoryManager* MemoryManager::m_pInstance = NULL;
+TW_THREAD MemoryManager* MemoryManager::m_pInstance = NULL;
+const double MemoryManager::m_defaultCompactionThreshold = 0.5;
 
 
-void MemoryManager::Initialise(size_t initialSize, size_t growCount)
+void MemoryManager::Initialise(size_t initialSize, size_t growCount, const THeapGrowth& growth)
 {
     if(NULL != m_pInstance)
         delete(m_pInstance);
 
-    m_pInstance = new MemoryManager(initialSize, growCount);
+    m_pInstance = new MemoryManager(initialSize, growCount, growth);
+}
+
+void MemoryManager::Release()
+{
+    delete m_pInstance;
+    m_pInstance = NULL;
 }
 
 
-MemoryManager::MemoryManager(size_t initialSize, size_t growCount) : noGC(false), growAmount(growCount)
+TObjectTable::~TObjectTable()
 {
-    objectTable.resize(initialSize);
+    for(size_t i = 0; i < m_segments.size(); ++i)
+        delete[] m_segments[i];
+}
 
-    /* set all the reference counts to zero */
-    for(TObjectTableIterator i = objectTable.begin(), iend = objectTable.end(); i != iend; ++i)
-    {
-        i->referenceCount = 0; 
-        i->size = 0; 
-    }
+void TObjectTable::resize(size_t size, const ObjectStruct& value)
+{
+    while(m_segments.size() * segmentSize < size)
+        m_segments.push_back(new ObjectStruct[segmentSize]);
+    for(; m_size < size; ++m_size)
+        (*this)[m_size] = value;
+}
 
-    /* make up the initial free lists */
-    setFreeLists();
 
-    /* object at location 0 is the nil object, so give it nonzero ref */
-    objectTable[0].referenceCount = 1; objectTable[0].size = 0;
+bool TMarkBitmap::markShared(size_t index)
+{
+    unsigned long long bit = 1ULL << (index & 63);
+    return !(ATOMIC_FETCH_OR(m_words[index >> 6], bit) & bit);
 }
 
-MemoryManager::~MemoryManager()
+
+TObjectArena::TObjectArena() : 
+    m_freeCount(0),
+    m_mappedCount(0),
+    m_mappedWords(0),
+    m_top(NULL),
+    m_limit(NULL)
 {
 }
 
+/* chunks are mapped directly where possible, so that freeing one is
+   certain to give the memory back to the OS */
+static object* allocChunk(size_t words)
+{
+#if defined(WIN32)
+    return mBlockAlloc(words);
+#else
+    void* chunk = mmap(NULL, words * sizeof(object), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (chunk == MAP_FAILED)? NULL : static_cast<object*>(chunk);
+#endif
+}
 
-object MemoryManager::allocObject(size_t memorySize)
+static void freeChunk(object* chunk, size_t words)
 {
-    int i;
-    size_t position;
-    bool done;
-    TObjectFreeListIterator tpos;
+#if defined(WIN32)
+    free(chunk);
+#else
+    munmap(chunk, words * sizeof(object));
+#endif
+}
 
-    /* first try the free lists, this is fastest */
-    if((tpos = objectFreeList.find(memorySize)) != objectFreeList.end() &&
-            tpos->second != nilobj)
+TObjectArena::~TObjectArena()
+{
+    for(size_t i = 0; i < m_chunks.size(); ++i)
+        freeChunk(m_chunks[i], chunkSize);
+    for(size_t i = 0; i < m_images.size(); ++i)
     {
-        position = tpos->second;
-        objectFreeList.erase(tpos);
-        objectFreeListInv.erase(position);
+        if(m_images[i].mapped)
+            freeChunk(m_images[i].base, m_images[i].words);
+        else
+            free(m_images[i].base);
     }
+}
+
+void TObjectArena::adoptImage(object* base, size_t words, bool mapped,
+        unsigned long long device, unsigned long long inode)
+{
+    TImageBlock block = { base, words, mapped, device, inode };
+    m_images.push_back(block);
+}
 
-    /* if not there, next try making a size zero object and
-        making it bigger */
-    else if ((tpos = objectFreeList.find(0)) != objectFreeList.end() &&
-            tpos->second != nilobj) 
+/* truncating a file takes away even the pages of a private mapping
+   that have been written to, so the blocks are copied out and mapped
+   anonymously in their place, at the same address */
+bool TObjectArena::copyImage(unsigned long long device, unsigned long long inode)
+{
+#if !defined(WIN32)
+    for(size_t i = 0; i < m_images.size(); ++i)
     {
-        position = tpos->second;
-        objectFreeList.erase(tpos);
-        objectFreeListInv.erase(position);
-        objectTable[position].size = memorySize;
-        objectTable[position].memory = mBlockAlloc(memorySize);
+        TImageBlock& block = m_images[i];
+        if(!block.mapped || block.device != device || block.inode != inode)
+            continue;
+        size_t bytes = block.words * sizeof(object);
+        void* copy = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(copy == MAP_FAILED)
+            return false;
+        memcpy(copy, block.base, bytes);
+        if(mmap(block.base, bytes, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            munmap(copy, bytes);
+            return false;
+        }
+        memcpy(block.base, copy, bytes);
+        munmap(copy, bytes);
+        block.device = block.inode = 0;
     }
+#endif
+    return true;
+}
 
-    else 
-    {      /* not found, must work a bit harder */
-        done = false;
+object* TObjectArena::newChunk(size_t words)
+{
+    /* the tail of the current chunk is still usable, so file it */
+    size_t left = m_limit - m_top;
+    if(left > 0)
+        release(m_top, left);
+
+    m_top = allocChunk(chunkSize);
+    if(NULL == m_top)
+        sysError("out of memory","allocating object arena");
+    m_chunks.push_back(m_top);
+    m_limit = m_top + chunkSize;
+
+    object* memory = m_top;
+    m_top += words;
+    return memory;
+}
+
+/* one word more than asked for, for the size of a very large object */
+object* TObjectArena::allocateLarge(size_t words)
+{
+    object* memory;
+    if(words < mappedSize)
+        memory = mBlockAlloc(words + 1);
+    else
+    {
+        memory = allocChunk(words + 1);
+        ++m_mappedCount;
+        m_mappedWords += words;
+    }
+    if(NULL == memory)
+        sysError("out of memory","allocating large object");
+    return memory + 1;
+}
+
+void TObjectArena::release(object* memory, size_t words)
+{
+    /* small ones can be reused as well as any, large ones are left */
+    if(words >= largeSize && inImage(memory))
+        return;
+    if(words >= mappedSize)
+    {
+        freeChunk(memory - 1, words + 1);
+        --m_mappedCount;
+        m_mappedWords -= words;
+    }
+    else if(words >= largeSize)
+        free(memory - 1);
+    else if(words > 0)
+    {
+        memset(memory, 0, words * sizeof(object));
+        m_free[words].push_back(memory);
+        ++m_freeCount;
+    }
+}
+
+static bool bodyAddressLess(const TArenaBody& a, const TArenaBody& b)
+{
+    return *a.owner < *b.owner;
+}
+
+size_t TObjectArena::compact(TArenaBodies& bodies)
+{
+    size_t moved = 0;
+
+    for(size_t i = 0; i < largeSize; ++i)
+        m_free[i].clear();
+    m_freeCount = 0;
+    if(m_chunks.empty())
+        return 0;
+
+    /* taking the chunks and the data areas in address order, nothing
+       is ever moved up past a data area that hasn't been moved yet */
+    std::sort(m_chunks.begin(), m_chunks.end());
+    std::sort(bodies.begin(), bodies.end(), bodyAddressLess);
 
-        /* first try making a bigger object smaller */
-        TObjectFreeListIterator tbigger = objectFreeList.upper_bound(memorySize);
-        if(tbigger != objectFreeList.end() &&
-                tbigger->second != nilobj)
+    size_t chunk = 0;
+    m_top = m_chunks[0];
+    m_limit = m_top + chunkSize;
+    for(TArenaBodies::iterator i = bodies.begin(), iend = bodies.end(); i != iend; ++i)
+    {
+        if(static_cast<size_t>(m_limit - m_top) < i->words)
         {
-            position = tbigger->second;
-            objectFreeList.erase(tbigger);
-            objectFreeListInv.erase(position);
-            /* just trim it a bit */
-            objectTable[position].size = memorySize;
-            done = true;
+            size_t left = m_limit - m_top;
+            if(left > 0)
+                release(m_top, left);
+            m_top = m_chunks[++chunk];
+            m_limit = m_top + chunkSize;
         }
-
-        /* next try making a smaller object bigger */
-        if (! done)
+        if(*i->owner != m_top)
         {
-            TObjectFreeListIterator tsmaller = objectFreeList.lower_bound(memorySize);
-            if(tsmaller != objectFreeList.begin() &&
-                    (--tsmaller != objectFreeList.begin()) &&
-                     tsmaller->second != nilobj)
-            {
-                position = tsmaller->second;
-                objectFreeList.erase(tsmaller);
-                objectFreeListInv.erase(position);
-                objectTable[position].size = memorySize;
+            memmove(m_top, *i->owner, i->words * sizeof(object));
+            *i->owner = m_top;
+            moved += i->words;
+        }
+        m_top += i->words;
+    }
+    memset(m_top, 0, (m_limit - m_top) * sizeof(object));
 
-                free(objectTable[position].memory);
+    while(m_chunks.size() > chunk + 1)
+    {
+        freeChunk(m_chunks.back(), chunkSize);
+        m_chunks.pop_back();
+    }
+    return moved;
+}
 
-                objectTable[position].memory = mBlockAlloc(memorySize);
-                done = true;
-            }
-        }
 
-        /* if we STILL don't have it then there is nothing */
-        /* more we can do */
-        if (! done)
+MemoryManager::MemoryManager(size_t initialSize, size_t growCount, const THeapGrowth& growth) : 
+    nurserySize(m_defaultNurserySize),
+    markDepth(0),
+    maxMarkDepth(0),
+    lastMarkTime(0),
+    totalMarkTime(0),
+    fragmentation(0),
+    compactionThreshold(m_defaultCompactionThreshold),
+    compactionPending(false),
+    bodyLocks(0),
+    lastCompactionMoved(0),
+    chunksReleased(0),
+    gcPhase(kIdle),
+    sweepCursor(0),
+    sweepLiveWords(0),
+    incrementalBudget(m_defaultIncrementalBudget),
+    promotedSinceCycle(0),
+    liveObjects(0),
+    statsLog(NULL),
+    allocationSampler(NULL),
+    sampleInterval(0),
+    sampleCountdown(LONG_MAX),
+    sampleWindow(LONG_MAX),
+    sampleSeed(88172645463325252UL),
+    snapshotProcess(0),
+    renumberedImage(false),
+    pauseNext(0),
+    gcWorkers(1),
+    noGC(false), 
+    growAmount(growCount),
+    heapGrowth(growth),
+    liveRatio(0),
+    reclaimRatio(1.0),
+    grewWithoutCollecting(false),
+    sweepFreed(0)
+{
+    memset(&savedImage, 0, sizeof(savedImage));
+    ObjectStruct empty;
+    memset(&empty, 0, sizeof(empty));
+    objectTable.resize(initialSize, empty);
+    markBits.resize(initialSize);
+
+    /* make up the initial free lists, nothing is marked yet so all
+       but nil is free */
+    setFreeLists();
+
+    /* object at location 0 is the nil object */
+    objectTable[0].setPointerSize(0);
+    objectTable[0].flags = kOld;
+}
+
+MemoryManager::~MemoryManager()
+{
+    setStatsLog(NULL);
+}
+
+
+void MemoryManager::pushFreeSlot(object index)
+{
+    ObjectStruct& slot = objectTable[index];
+    size_t sizeClass = slot.size();
+
+    slot.flags |= kFreeSlot;
+    slot.setClass(freeListHeads[sizeClass]);
+    freeListHeads[sizeClass] = index;
+    freeListMask |= (1ULL << sizeClass);
+    ++freeListCounts[sizeClass];
+    ++freeSlots;
+}
+
+object MemoryManager::popFreeSlot(size_t sizeClass)
+{
+    object index = freeListHeads[sizeClass];
+    ObjectStruct& slot = objectTable[index];
+
+    freeListHeads[sizeClass] = slot.objectClass();
+    if(freeListHeads[sizeClass] == 0)
+        freeListMask &= ~(1ULL << sizeClass);
+    --freeListCounts[sizeClass];
+    --freeSlots;
+
+    slot.flags = 0;
+    slot.setClass(nilobj);
+    return index;
+}
+
+void MemoryManager::clearFreeLists()
+{
+    for(size_t i = 0; i < m_sizeClassCount; ++i)
+    {
+        freeListHeads[i] = 0;
+        freeListCounts[i] = 0;
+    }
+    freeListMask = 0;
+    freeSlots = 0;
+}
+
+
+object MemoryManager::allocObject(size_t memorySize)
+{
+    object position;
+
+    /* keep the nursery bounded, so minor collections stay short */
+    if(youngObjects.size() >= nurserySize && !noGC)
+        minorCollect();
+
+    /* first try the free list of the exact size, the data area is
+       already there and cleared, so this is fastest */
+    if(memorySize < m_sizeClassCount && freeListHeads[memorySize] != 0)
+    {
+        position = popFreeSlot(memorySize);
+    }
+    else 
+    {
+        if(memorySize > ObjectStruct::maxSize)
+            sysError("object too large","allocObject");
+
+        /* if there is nothing free at all, try to reclaim some young
+           objects. if that isn't enough, the old generation needs 
+           collecting too, in the background if possible, stopping to 
+           do it all at once only if a background collection is 
+           already underway and nothing at all could be found. failing
+           that make the store bigger. if the last collection found 
+           next to nothing, grow straight away, but collect again the 
+           next time */
+        if(0 == freeListMask)
         {
-            if(debugging)
-                fprintf(stderr, "Failed to find an available object, trying GC\n");
-            if(garbageCollect() > 0)
+            size_t freed = 0;
+            if(reclaimRatio >= heapGrowth.minReclaimRatio || grewWithoutCollecting)
             {
-                return allocObject(memorySize);
+                if(debugging)
+                    fprintf(stderr, "Failed to find an available object, trying GC\n");
+                grewWithoutCollecting = false;
+                freed = minorCollect();
+                if(freed < nurserySize / 4)
+                {
+                    if(gcPhase == kIdle)
+                        startIncrementalCycle();
+                    else if(freed == 0)
+                        freed += garbageCollect();
+                }
             }
             else
+                grewWithoutCollecting = true;
+            if(freed == 0)
             {
                 if(debugging)
                     fprintf(stderr, "No suitable objects available after GC, growing store.\n");
-                growObjectStore(growAmount);
-                return allocObject(memorySize);
+                growObjectStore(nextGrowth());
             }
+            return allocObject(memorySize);
         }
+
+        /* prefer a size zero slot, otherwise take a slot from the 
+           nearest size class and replace its data area */
+        if(freeListHeads[0] != 0)
+            position = popFreeSlot(0);
+        else
+        {
+            unsigned long long bigger = (memorySize < m_sizeClassCount)?
+                freeListMask & (~0ULL << memorySize) : 0;
+            size_t sizeClass = (bigger != 0)? 
+                __builtin_ctzll(bigger) : 63 - __builtin_clzll(freeListMask);
+            position = popFreeSlot(sizeClass);
+            arena.release(objectTable[position].memory, sizeClass);
+        }
+        objectTable[position].memory = arena.allocate(memorySize);
     }
 
-    /* set class and type */
-    objectTable[position].referenceCount = 0;
-    objectTable[position]._class = nilobj;
-    objectTable[position].size = memorySize;
-    return(position << 1);
+    youngObjects.push_back(position);
+    ++stats.objectsAllocated;
+    stats.wordsAllocated += memorySize;
+
+    /* objects made during an incremental collection are allocated 
+       marked, unless the sweep has already gone past them */
+    if(gcPhase == kMarking || (gcPhase == kSweeping && (size_t)position <= sweepCursor))
+        objectTable[position].flags |= kMarked;
+
+    /* set class and type, young objects start unmarked */
+    markBits.unmark(position);
+    objectTable[position].setClass(nilobj);
+    objectTable[position].setPointerSize(memorySize);
+
+    /* the countdown never runs out while sampling is off */
+    sampleCountdown -= sizeof(ObjectStruct) + memorySize * sizeof(object);
+    if(sampleCountdown <= 0)
+        sampleAllocation(objectID(position));
+    return(objectID(position));
 }
 
 object MemoryManager::allocByte(size_t size)
 {
     object newObj;
 
-    newObj = allocObject((size + 1) / 2);
-    /* negative size fields indicate bit objects */
-    objectRef(newObj).size = -size;
+    if(size > ObjectStruct::maxSize)
+        sysError("object too large","allocByte");
+    newObj = allocObject((size + sizeof(object) - 1) / sizeof(object));
+    objectRef(newObj).setByteSize(size);
     return newObj;
 }
 
@@ -208,145 +539,1505 @@ object MemoryManager::allocStr(register const char* str)
     return(newSym);
 }
 
+bool MemoryManager::growObject(object obj, size_t size)
+{
+    if (isImmediate(obj) || objectFromID(obj).isBytes())
+        return false;
+    ObjectStruct& p = objectFromID(obj);
+    size_t old = p.size();
+    if (size <= old)
+        return true;
+
+    object* memory = arena.allocate(size);
+    if (old > 0)
+        memcpy(memory, p.memory, old * sizeof(object));
+    arena.release(p.memory, old);
+    p.memory = memory;
+    p.setPointerSize(size);
+    p.flags |= kDirty;
+    stats.wordsAllocated += size;
+    return true;
+}
+
+bool MemoryManager::makeWeak(object obj)
+{
+    if (isImmediate(obj))
+        return false;
+    ObjectStruct& p = objectFromID(obj);
+    if (p.isBytes() || (p.flags & kEphemeron))
+        return false;
+    p.flags |= kWeak | kDirty;
+    return true;
+}
+
+bool MemoryManager::makeEphemeron(object obj)
+{
+    if (isImmediate(obj))
+        return false;
+    ObjectStruct& p = objectFromID(obj);
+    if (p.slotCount() < 2 || (p.flags & kWeak))
+        return false;
+    p.flags |= kEphemeron | kDirty;
+    return true;
+}
+
+bool MemoryManager::addFinalizer(object target, object executor)
+{
+    if (!target || isImmediate(target))
+        return false;
+    TFinalizer f = { target, executor };
+    finalizers.push_back(f);
+    return true;
+}
+
+object MemoryManager::nextFinalizer()
+{
+    if (finalizationQueue.empty())
+        return nilobj;
+    object executor = finalizationQueue.front();
+    finalizationQueue.pop_front();
+    return executor;
+}
+
+/* call f with each executor, they are roots whether or not their 
+   targets have died yet */
+template<typename F>
+void MemoryManager::forEachFinalizerRoot(F f)
+{
+    for (TFinalizerList::iterator i = finalizers.begin(), iend = finalizers.end(); i != iend; ++i)
+        f(i->executor);
+    for (TFinalizationQueue::iterator i = finalizationQueue.begin(), iend = finalizationQueue.end(); i != iend; ++i)
+        f(*i);
+}
+
+/* move the executors of targets isLive rejects onto the queue */
+template<typename L>
+void MemoryManager::queueFinalizers(L isLive)
+{
+    for (size_t i = 0; i < finalizers.size(); )
+    {
+        if (isLive(finalizers[i].target))
+            ++i;
+        else
+        {
+            finalizationQueue.push_back(finalizers[i].executor);
+            finalizers[i] = finalizers.back();
+            finalizers.pop_back();
+        }
+    }
+}
+
 bool MemoryManager::destroyObject(object z)
 {
     register struct ObjectStruct *p;
-    register int i;
-    int size;
-    bool deleted = false;
+    size_t size;
 
     p = &objectTable[z];
-    if (p->referenceCount < 0) 
+    if(p->flags & kFreeSlot)
+        return false;
+
+    size = p->words();
+
+    /* small objects keep their cleared data area for reuse at the
+       same size, large ones give it back */
+    if (size >= m_sizeClassCount)
+    {
+        arena.release(p->memory, size);
+        p->memory = NULL;
+        size = 0;
+    }
+    else if (size > 0) 
+        memset(p->memory, 0, size * sizeof(object));
+    p->setPointerSize(size);
+
+    pushFreeSlot(z);
+    return true;
+}
+
+void MemoryManager::setFreeLists() 
+{
+    clearFreeLists();
+    for(size_t i = 0; i < objectTable.size(); ++i)
+        objectTable[i].flags &= ~kFreeSlot;
+
+    /* add unmarked objects, highest first so that the lowest indices
+       are at the head of the lists */
+    for(int z=objectTable.size()-1; z>0; z--)
+    {
+        // If really unused, destroyObject will take care
+        // of cleaning up and adding to the free list.
+        if (!markBits.test(z))
+            destroyObject(z);
+    }
+}
+
+/* mark an object, and queue it to have its contents marked if this 
+   is the first time it has been visited */
+inline void MemoryManager::markObject(object x)
+{
+    if (x && !isImmediate(x) && markBits.mark(objectIndex(x))) 
+    {
+        ObjectStruct& p = objectFromID(x);
+        if (p.slotCount() > 0)
+            PREFETCH(p.memory);
+        markStack.push_back(&p);
+    }
+}
+
+/* as markObject, but old objects are neither marked nor traced */
+inline void MemoryManager::markYoungObject(object x)
+{
+    if (x && !isImmediate(x)) 
+    {
+        ObjectStruct& p = objectFromID(x);
+        if (!(p.flags & kOld) && markBits.mark(objectIndex(x))) 
+        {
+            if (p.slotCount() > 0)
+                PREFETCH(p.memory);
+            markStack.push_back(&p);
+        }
+    }
+}
+
+void MemoryManager::drainMarkStack(bool youngOnly)
+{
+    while (!markStack.empty())
+    {
+        if (markStack.size() > markDepth)
+            markDepth = markStack.size();
+
+        ObjectStruct& p = *markStack.back();
+        markStack.pop_back();
+        if (p.flags & (kWeak | kEphemeron))
+        {
+            scanWeak(p, youngOnly);
+            continue;
+        }
+        if (youngOnly)
+            markYoungObject(p.objectClass());
+        else
+            markObject(p.objectClass());
+        long n = p.slotCount();
+        if (n > 0) 
+        {
+            object* m = p.memory;
+            if (youngOnly)
+            {
+                for (long i = n; i; --i) 
+                    markYoungObject(*m++);
+            }
+            else
+            {
+                for (long i = n; i; --i) 
+                    markObject(*m++);
+            }
+        }
+    }
+}
+
+void MemoryManager::visit(register object x)
+{
+    markObject(x);
+    drainMarkStack(false);
+}
+
+/* true if x has been marked, or is not collected by this collection */
+bool MemoryManager::survives(object x, bool youngOnly)
+{
+    if (!x || isImmediate(x))
+        return true;
+    if (youngOnly && (objectFromID(x).flags & kOld))
+        return true;
+    return markBits.test(objectIndex(x));
+}
+
+/* the slots of a weak object are left for processWeak, as is the value
+   of an ephemeron whose key hasn't been marked yet */
+void MemoryManager::scanWeak(ObjectStruct& p, bool youngOnly)
+{
+    if (youngOnly)
+        markYoungObject(p.objectClass());
+    else
+        markObject(p.objectClass());
+    if (p.flags & kWeak)
+    {
+        weakObjects.push_back(&p);
+        return;
+    }
+
+    object* m = p.memory;
+    long n = p.slotCount();
+    long first = 2;
+    if (survives(m[0], youngOnly))
+        first = 1;
+    else
+        ephemerons.push_back(&p);
+    for (long i = first; i < n; ++i)
+    {
+        if (youngOnly)
+            markYoungObject(m[i]);
+        else
+            markObject(m[i]);
+    }
+}
+
+/* called once everything strongly reachable is marked. ephemerons whose
+   keys have been reached since they were scanned have their values 
+   traced, which may reach more keys, until no more are. The rest have 
+   lost their keys, and weak slots holding dead objects are cleared. 
+   the executors of dead finalizable objects, already marked as roots,
+   are queued */
+void MemoryManager::processWeak(bool youngOnly)
+{
+    bool traced = true;
+    while (traced)
+    {
+        traced = false;
+        for (size_t i = 0; i < ephemerons.size(); )
+        {
+            ObjectStruct& e = *ephemerons[i];
+            if (survives(e.memory[0], youngOnly))
+            {
+                if (youngOnly)
+                    markYoungObject(e.memory[1]);
+                else
+                    markObject(e.memory[1]);
+                ephemerons[i] = ephemerons.back();
+                ephemerons.pop_back();
+                traced = true;
+            }
+            else
+                ++i;
+        }
+        drainMarkStack(youngOnly);
+    }
+    queueFinalizers([&](object x) { return survives(x, youngOnly); });
+
+    for (TMarkStack::iterator i = ephemerons.begin(), iend = ephemerons.end(); i != iend; ++i)
+    {
+        (*i)->memory[0] = nilobj;
+        (*i)->memory[1] = nilobj;
+        (*i)->flags |= kDirty;
+    }
+    ephemerons.clear();
+
+    for (TMarkStack::iterator i = weakObjects.begin(), iend = weakObjects.end(); i != iend; ++i)
+    {
+        object* m = (*i)->memory;
+        for (long n = (*i)->slotCount(); n; --n, ++m)
+            if (!survives(*m, youngOnly))
+            {
+                *m = nilobj;
+                (*i)->flags |= kDirty;
+            }
+    }
+    weakObjects.clear();
+}
+
+
+/* call f with each object held by an ObjectHandle */
+template<typename F>
+static void forEachHandle(F f)
+{
+    const object* roots = ObjectHandle::rootSlots();
+    for(size_t i = 0, top = ObjectHandle::rootTop(); i < top; ++i)
+        if(roots[i] != ObjectHandle::vacantSlot)
+            f(roots[i]);
+}
+
+int MemoryManager::garbageCollect()
+{
+    register int j;
+    int c=1,f=0;
+
+    if(noGC)
+        return 0;
+
+    if (debugging) 
+        fprintf(stderr,"\ngarbage collecting ... \n");
+
+    clock_t start = clock();
+    abandonIncrementalCycle();
+
+    if (gcWorkers > 1)
+    {
+        parallelMark();
+    }
+    else
+    {
+        markBits.clear();
+        markBits.mark(0);
+        beginMark();
+        /* visit symbols and firstProcess to mark everything they reach */
+
+        visit(symbols);
+
+        /* Visit any explicitly held references from the use of ObjectHandle */
+        forEachHandle([this](object x) { visit(x); });
+        forEachFinalizerRoot([this](object x) { visit(x); });
+        processWeak(false);
+        endMark();
+    }
+
+    /* add new garbage to the free lists 
+    * promote the survivors
+    * count the objects
+    */
+
+    size_t liveWords = 0;
+    if (gcWorkers > 1)
+        f = parallelSweep(c, liveWords);
+    else for (j=objectTable.size()-1; j>0; j--) 
+    {
+        if (!markBits.test(j)) 
+        {
+            if(destroyObject(j))
+                f++;
+        } 
+        else
+        {
+            objectTable[j].flags = (objectTable[j].flags & ~(kRemembered | kMarked)) | kOld;
+            c++;
+            size_t words = objectTable[j].words();
+            if (words < TObjectArena::largeSize && !arena.inImage(objectTable[j].memory))
+                liveWords += words;
+        }
+    }
+    youngObjects.clear();
+    rememberedSet.clear();
+    liveObjects = c;
+    promotedSinceCycle = 0;
+    noteCollection(f, c + f);
+    measureFragmentation(liveWords);
+    recordPause(start);
+    ++stats.fullCollections;
+    endCollection("full", f);
+
+    if (debugging)
+    {
+        fprintf(stderr," %d references.\n",ObjectHandle::numTotalHandles());
+        fprintf(stderr," %d objects - %d freed.\n",c,f);
+    }
+
+    return f;
+}
+
+
+/* run f(0) .. f(workers - 1), each on its own thread, the first on the
+   calling thread */
+template<typename F>
+static void runWorkers(size_t workers, F f)
+{
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < workers; ++i)
+        threads.push_back(std::thread(f, i));
+    f(0);
+    for(size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+}
+
+/* the part of the object table [1, size) that worker k of n takes */
+static size_t rangeStart(size_t size, size_t k, size_t n)
+{
+    return 1 + (size - 1) * k / n;
+}
+
+/* a marking thread's work, a Chase-Lev deque. the owner pushes and 
+   pops at the bottom without locking, other threads steal from the top,
+   racing each other and the owner for the last item with a CAS. a ring
+   that fills is replaced by one twice its size, the old one kept until 
+   the deque goes, since a thief may still be reading from it */
+class TMarkDeque
+{
+    public:
+        TMarkDeque() : top(0), bottom(0)
+        {
+            rings.emplace_back(new TRing(1024));
+            ring.store(rings.back().get(), std::memory_order_relaxed);
+        }
+
+        size_t size() const
+        {
+            long b = bottom.load(std::memory_order_relaxed);
+            long t = top.load(std::memory_order_relaxed);
+            return (b > t)? b - t : 0;
+        }
+
+        void push(ObjectStruct* x)
+        {
+            long b = bottom.load(std::memory_order_relaxed);
+            long t = top.load(std::memory_order_acquire);
+            TRing* r = ring.load(std::memory_order_relaxed);
+            if (b - t > static_cast<long>(r->mask))
+                r = grow(r, t, b);
+            r->put(b, x);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        //! The newest item, NULL if there is none.
+        ObjectStruct* pop()
+        {
+            long b = bottom.load(std::memory_order_relaxed) - 1;
+            TRing* r = ring.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long t = top.load(std::memory_order_relaxed);
+            if (t > b)
+            {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return NULL;
+            }
+            ObjectStruct* x = r->get(b);
+            if (t == b)
+            {
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    x = NULL;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return x;
+        }
+
+        //! The oldest item, NULL if there is none or another thread took it first.
+        ObjectStruct* steal()
+        {
+            long t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long b = bottom.load(std::memory_order_acquire);
+            if (t >= b)
+                return NULL;
+            ObjectStruct* x = ring.load(std::memory_order_acquire)->get(t);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return NULL;
+            return x;
+        }
+
+    private:
+        struct TRing
+        {
+            size_t mask;
+            std::unique_ptr<std::atomic<ObjectStruct*>[]> items;
+
+            explicit TRing(size_t capacity) : mask(capacity - 1), items(new std::atomic<ObjectStruct*>[capacity]) {}
+            ObjectStruct* get(long i) const { return items[i & mask].load(std::memory_order_relaxed); }
+            void put(long i, ObjectStruct* x) { items[i & mask].store(x, std::memory_order_relaxed); }
+        };
+
+        TRing* grow(TRing* r, long t, long b)
+        {
+            TRing* bigger = new TRing((r->mask + 1) * 2);
+            for (long i = t; i < b; ++i)
+                bigger->put(i, r->get(i));
+            rings.emplace_back(bigger);
+            ring.store(bigger, std::memory_order_release);
+            return bigger;
+        }
+
+        std::atomic<long> top;
+        std::atomic<long> bottom;
+        std::atomic<TRing*> ring;
+        std::vector<std::unique_ptr<TRing> > rings;
+};
+
+/* mark an object, several threads may reach it at once, only the one 
+   that sets its bit scans it */
+static inline void markShared(MemoryManager* mm, TMarkBitmap& bits, object x, TMarkDeque& work)
+{
+    if (x && !isImmediate(x) && bits.markShared(objectIndex(x))) 
     {
-        fprintf(stderr,"object %d\n", static_cast<int>(z));
-        sysError("negative reference count","");
+        ObjectStruct& p = mm->objectFromID(x);
+        if (p.slotCount() > 0)
+            PREFETCH(p.memory);
+        work.push(&p);
     }
-    size = p->size;
-    if (size < 0) size = ((- size) + 1) /2;
+}
 
-    if(objectFreeListInv.find(z) == objectFreeListInv.end())
+/* take an item from any other worker's deque */
+static ObjectStruct* stealWork(std::vector<TMarkDeque>& deques, size_t self)
+{
+    for(size_t i = 1; i < deques.size(); ++i)
     {
-        objectFreeList.insert(std::pair<size_t, object>(size, z));
-        objectFreeListInv.insert(std::pair<object, size_t>(z, size));
-        deleted = true;
+        TMarkDeque& d = deques[(self + i) % deques.size()];
+        if (d.size() == 0)
+            continue;
+        if (ObjectStruct* x = d.steal())
+            return x;
     }
+    return NULL;
+}
+
+void MemoryManager::parallelMark()
+{
+    size_t workers = gcWorkers;
+
+    markBits.clear();
+    markBits.mark(0);
+
+    beginMark();
+
+    /* share the roots out between the workers, before they start */
+    std::vector<TMarkDeque> deques(workers);
+    size_t next = 0;
+    markShared(this, markBits, symbols, deques[next++ % workers]);
+    forEachHandle([&](object x) { markShared(this, markBits, x, deques[next++ % workers]); });
+    forEachFinalizerRoot([&](object x) { markShared(this, markBits, x, deques[next++ % workers]); });
+
+    std::vector<size_t> depths(workers, 0);
+    std::vector<TMarkStack> weak(workers), ephemeral(workers);
+    std::atomic<size_t> idle(0);
+
+    runWorkers(workers, [&](size_t k) {
+        TMarkDeque& work = deques[k];
+        ObjectStruct* x = NULL;
+        for(;;)
+        {
+            while (x != NULL || (x = work.pop()) != NULL)
+            {
+                if (work.size() > depths[k])
+                    depths[k] = work.size();
+
+                ObjectStruct& p = *x;
+                x = NULL;
+                markShared(this, markBits, p.objectClass(), work);
+                long n = p.slotCount();
+                long first = 0;
+                /* weak slots, and ephemeron keys and values, are left
+                   for processWeak once the workers are done */
+                if (p.flags & kWeak)
+                {
+                    weak[k].push_back(&p);
+                    n = 0;
+                }
+                else if (p.flags & kEphemeron)
+                {
+                    ephemeral[k].push_back(&p);
+                    first = 2;
+                }
+                if (n > first)
+                {
+                    object* m = p.memory + first;
+                    for (long i = n - first; i; --i) 
+                        markShared(this, markBits, *m++, work);
+                }
+            }
+            if ((x = stealWork(deques, k)) != NULL)
+                continue;
+
+            /* out of work, done once every worker is */
+            ++idle;
+            for(;;)
+            {
+                if (idle.load() == workers)
+                    return;
+                bool found = false;
+                for(size_t i = 0; i < workers && !found; ++i)
+                    found = deques[i].size() > 0;
+                if (found)
+                {
+                    --idle;
+                    if ((x = stealWork(deques, k)) != NULL)
+                        break;
+                    ++idle;
+                }
+                else
+                    std::this_thread::yield();
+            }
+        }
+    });
 
-    if (size > 0) 
+    markDepth = *std::max_element(depths.begin(), depths.end());
+    for(size_t k = 0; k < workers; ++k)
     {
-        for (i = size; i > 0; )
-            p->memory[--i] = nilobj;
+        weakObjects.insert(weakObjects.end(), weak[k].begin(), weak[k].end());
+        ephemerons.insert(ephemerons.end(), ephemeral[k].begin(), ephemeral[k].end());
     }
-    p->size = size;
+    processWeak(false);
+    endMark();
+}
+
+/* the free slots found by one sweep worker, a chain for each size, 
+   linked as in the main free lists */
+struct TFreeFragment
+{
+    object heads[64];
+    object tails[64];
+    size_t counts[64];
+    std::vector<std::pair<object*, size_t> > large;
+    int freed;
+    int live;
+    size_t liveWords;
+};
+
+int MemoryManager::parallelSweep(int& live, size_t& liveWords)
+{
+    size_t workers = gcWorkers;
+    size_t tableSize = objectTable.size();
+    std::vector<TFreeFragment> fragments(workers);
+
+    runWorkers(workers, [&](size_t k) {
+        TFreeFragment& frag = fragments[k];
+        memset(frag.heads, 0, sizeof(frag.heads));
+        memset(frag.tails, 0, sizeof(frag.tails));
+        memset(frag.counts, 0, sizeof(frag.counts));
+        frag.freed = frag.live = 0;
+        frag.liveWords = 0;
+
+        for(size_t j = rangeStart(tableSize, k + 1, workers); j-- > rangeStart(tableSize, k, workers); )
+        {
+            ObjectStruct& p = objectTable[j];
+            size_t words = p.words();
+            if (!markBits.test(j))
+            {
+                if (p.flags & kFreeSlot)
+                    continue;
+
+                /* as destroyObject, but onto this worker's fragment, and
+                   leaving large data areas to be released afterwards */
+                if (words >= m_sizeClassCount)
+                {
+                    frag.large.push_back(std::make_pair(p.memory, words));
+                    p.memory = NULL;
+                    words = 0;
+                }
+                else if (words > 0)
+                    memset(p.memory, 0, words * sizeof(object));
+                p.setPointerSize(words);
+                p.flags |= kFreeSlot;
+                p.setClass(frag.heads[words]);
+                if (frag.heads[words] == 0)
+                    frag.tails[words] = j;
+                frag.heads[words] = j;
+                frag.counts[words]++;
+                frag.freed++;
+            }
+            else
+            {
+                p.flags = (p.flags & ~(kRemembered | kMarked)) | kOld;
+                frag.live++;
+                if (words < TObjectArena::largeSize && !arena.inImage(p.memory))
+                    frag.liveWords += words;
+            }
+        }
+    });
+
+    /* chain the fragments together, lowest range first, in front of 
+       what was already free */
+    int freed = 0;
+    for(size_t s = 0; s < m_sizeClassCount; ++s)
+    {
+        object head = freeListHeads[s];
+        for(size_t k = workers; k-- > 0; )
+        {
+            TFreeFragment& frag = fragments[k];
+            if (frag.heads[s] == 0)
+                continue;
+            objectTable[frag.tails[s]].setClass(head);
+            head = frag.heads[s];
+            freeListCounts[s] += frag.counts[s];
+            freeSlots += frag.counts[s];
+        }
+        freeListHeads[s] = head;
+        if (head != 0)
+            freeListMask |= (1ULL << s);
+    }
+    for(size_t k = 0; k < workers; ++k)
+    {
+        TFreeFragment& frag = fragments[k];
+        for(size_t i = 0; i < frag.large.size(); ++i)
+            arena.release(frag.large[i].first, frag.large[i].second);
+        freed += frag.freed;
+        live += frag.live;
+        liveWords += frag.liveWords;
+    }
+    return freed;
+}
+
+void MemoryManager::setGCWorkers(size_t workers)
+{
+    gcWorkers = (workers > 0)? workers : 1;
+}
+
+
+void MemoryManager::remember(ObjectStruct* p)
+{
+    p->flags |= kRemembered;
+    rememberedSet.push_back(p);
+}
+
+void MemoryManager::forgetRemembered()
+{
+    for(TRememberedSet::iterator i = rememberedSet.begin(), iend = rememberedSet.end(); i != iend; ++i)
+        (*i)->flags &= ~kRemembered;
+    rememberedSet.clear();
+}
+
+/* old objects are not traced, anything young they refer to is 
+   reached via the remembered set */
+void MemoryManager::visitYoung(object x)
+{
+    markYoungObject(x);
+    drainMarkStack(true);
+}
+
+void MemoryManager::visitYoungChildren(ObjectStruct& p)
+{
+    /* a remembered object may since have been freed */
+    if (p.flags & kFreeSlot)
+        return;
+    if (p.flags & (kWeak | kEphemeron))
+        scanWeak(p, true);
+    else
+    {
+        markYoungObject(p.objectClass());
+        long n = p.slotCount();
+        if (n > 0) 
+        {
+            object* m = p.memory;
+            for (long i = n; i; --i) 
+                markYoungObject(*m++);
+        }
+    }
+    drainMarkStack(true);
+}
+
+int MemoryManager::minorCollect()
+{
+    int f = 0;
+    size_t promoted = 0;
+
+    if(noGC)
+        return 0;
+
+    if (debugging) 
+        fprintf(stderr,"\nminor collection of %d young objects ... \n", 
+                static_cast<int>(youngObjects.size()));
+
+    clock_t start = clock();
+
+    beginMark();
+    visitYoung(symbols);
+
+    /* The ObjectHandle roots, an old object held by a handle may be 
+       written to without a barrier, for instance the process stack,
+       so its contents are roots too */
+    forEachHandle([this](object x) {
+        if (x && !isImmediate(x))
+        {
+            if (objectFromID(x).flags & kOld)
+                visitYoungChildren(objectFromID(x));
+            else
+                visitYoung(x);
+        }
+    });
+
+    for(TRememberedSet::iterator i = rememberedSet.begin(), iend = rememberedSet.end(); i != iend; ++i)
+        visitYoungChildren(**i);
+    forEachFinalizerRoot([this](object x) { visitYoung(x); });
+    processWeak(true);
+    endMark();
+
+    /* sweep just the nursery, anything still alive is promoted, so
+       there is nothing left for the remembered set to track */
+    for(TObjectList::iterator i = youngObjects.begin(), iend = youngObjects.end(); i != iend; ++i)
+    {
+        ObjectStruct& p = objectTable[*i];
+        if (p.flags & (kFreeSlot | kOld))
+            continue;
+        if (!markBits.test(*i))
+        {
+            if(destroyObject(*i))
+                f++;
+        }
+        else
+        {
+            p.flags |= kOld;
+            promoted++;
+        }
+    }
+    noteCollection(f, f + promoted);
+    youngObjects.clear();
+    forgetRemembered();
+    promotedSinceCycle += promoted;
+    recordPause(start);
+    ++stats.minorCollections;
+    endCollection("minor", f);
+
+    if (debugging)
+        fprintf(stderr," %d freed.\n",f);
+
+    return f;
+}
+
+
+size_t MemoryManager::objectCount()
+{   
+    return storageSize() - freeSlotsCount();
+}
+
+size_t MemoryManager::storageSize() const
+{
+    return objectTable.size();
+}
+
+size_t MemoryManager::freeSlotsCount()
+{   
+    return freeSlots;
+}
+
+size_t MemoryManager::freeSlotsCount(size_t size) const
+{
+    return (size < m_sizeClassCount)? freeListCounts[size] : 0;
+}
+
+void MemoryManager::compact()
+{
+    if (debugging)
+        fprintf(stderr,"\ncompacting object memory ... \n");
+
+    clock_t start = clock();
+
+    /* free slots give up their data areas, the rest are slid together */
+    TArenaBodies bodies;
+    clearFreeLists();
+    for (int z = objectTable.size() - 1; z > 0; z--)
+    {
+        ObjectStruct& p = objectTable[z];
+        if (p.flags & kFreeSlot)
+        {
+            if (p.words() >= TObjectArena::largeSize)
+                arena.release(p.memory, p.words());
+            p.memory = NULL;
+            p.setPointerSize(0);
+            pushFreeSlot(z);
+        }
+        else
+        {
+            /* those still in an image stay there */
+            size_t words = p.words();
+            if (words > 0 && words < TObjectArena::largeSize && !arena.inImage(p.memory))
+            {
+                TArenaBody body = { &p.memory, words };
+                bodies.push_back(body);
+            }
+        }
+    }
+
+    size_t chunks = arena.chunkCount();
+    lastCompactionMoved = arena.compact(bodies);
+    chunksReleased += chunks - arena.chunkCount();
+    ++stats.compactions;
+    compactionPending = false;
+    recordPause(start);
+    logStats("compaction", 0);
+
+    if (debugging)
+        fprintf(stderr," %d words moved.\n", static_cast<int>(lastCompactionMoved));
+}
+
+void MemoryManager::compactIfPending()
+{
+    if (compactionPending && bodyLocks == 0 && !noGC)
+        compact();
+}
+
+void MemoryManager::setCompactionThreshold(double threshold)
+{
+    compactionThreshold = threshold;
+}
+
+/* measure how much of the arena is lost to dead and free data areas,
+   the next safe point will compact it if it is too much */
+void MemoryManager::measureFragmentation(size_t liveWords)
+{
+    fragmentation = (arena.capacity() > 0)? 
+        1.0 - (double)liveWords / arena.capacity() : 0.0;
+    compactionPending = arena.chunkCount() > 1 && fragmentation > compactionThreshold;
+}
+
+
+/* true if x has been reached by the incremental collector */
+bool MemoryManager::isShaded(object x)
+{
+    return !x || isImmediate(x) || (objectFromID(x).flags & kMarked);
+}
+
+void MemoryManager::shadeObject(object x)
+{
+    if (x && !isImmediate(x)) 
+    {
+        ObjectStruct& p = objectFromID(x);
+        if (!(p.flags & kMarked))
+            shade(p);
+    }
+}
+
+/* objects held by handles, the process stack in particular, may have 
+   been written without a barrier, so they are scanned again even if 
+   already marked */
+void MemoryManager::shadeRoots()
+{
+    shadeObject(symbols);
+    forEachHandle([this](object x) {
+        if (x && !isImmediate(x))
+            shade(objectFromID(x));
+    });
+    forEachFinalizerRoot([this](object x) { shadeObject(x); });
+}
+
+void MemoryManager::startIncrementalCycle()
+{
+    if (gcPhase != kIdle || noGC)
+        return;
+
+    if (debugging)
+        fprintf(stderr,"\nstarting incremental collection ... \n");
+
+    gcPhase = kMarking;
+    promotedSinceCycle = 0;
+    shadeRoots();
+}
+
+void MemoryManager::abandonIncrementalCycle()
+{
+    greyStack.clear();
+    rescanSet.clear();
+    cycleWeakObjects.clear();
+    cycleEphemerons.clear();
+    gcPhase = kIdle;
+}
+
+size_t MemoryManager::incrementalMark(size_t budget)
+{
+    size_t work = 0;
+
+    while (!greyStack.empty() && work < budget)
+    {
+        ObjectStruct& p = *greyStack.back();
+        greyStack.pop_back();
+        ++work;
+        /* shaded, then freed by a minor collection */
+        if (p.flags & kFreeSlot)
+            continue;
+        shadeObject(p.objectClass());
+        long n = p.slotCount();
+        object* m = p.memory;
+        if (p.flags & kWeak)
+        {
+            cycleWeakObjects.push_back(&p);
+            n = 0;
+        }
+        else if (p.flags & kEphemeron)
+        {
+            if (!isShaded(m[0]))
+            {
+                cycleEphemerons.push_back(&p);
+                m += 2;
+                n -= 2;
+            }
+        }
+        if (n > 0)
+        {
+            for (long i = n; i; --i) 
+                shadeObject(*m++);
+            work += n;
+        }
+    }
+    return work;
+}
+
+/* as processWeak, once the incremental collector has marked all else.
+   an object listed may since have been freed by a minor collection, 
+   and its slot reused, anything stored in it since was shaded by the 
+   write barrier, so it is only skipped if no longer weak */
+void MemoryManager::finishIncrementalWeak()
+{
+    bool traced = true;
+    while (traced)
+    {
+        traced = false;
+        for (size_t i = 0; i < cycleEphemerons.size(); )
+        {
+            ObjectStruct& e = *cycleEphemerons[i];
+            bool gone = !(e.flags & kEphemeron) || (e.flags & kFreeSlot);
+            if (gone || isShaded(e.memory[0]))
+            {
+                if (!gone)
+                    shadeObject(e.memory[1]);
+                cycleEphemerons[i] = cycleEphemerons.back();
+                cycleEphemerons.pop_back();
+                traced = true;
+            }
+            else
+                ++i;
+        }
+        incrementalMark(~(size_t)0);
+    }
+    queueFinalizers([this](object x) { return isShaded(x); });
+
+    for (TMarkStack::iterator i = cycleEphemerons.begin(), iend = cycleEphemerons.end(); i != iend; ++i)
+    {
+        (*i)->memory[0] = nilobj;
+        (*i)->memory[1] = nilobj;
+        (*i)->flags |= kDirty;
+    }
+    cycleEphemerons.clear();
+
+    for (TMarkStack::iterator i = cycleWeakObjects.begin(), iend = cycleWeakObjects.end(); i != iend; ++i)
+    {
+        if (!((*i)->flags & kWeak) || ((*i)->flags & kFreeSlot))
+            continue;
+        object* m = (*i)->memory;
+        for (long n = (*i)->slotCount(); n; --n, ++m)
+            if (!isShaded(*m))
+            {
+                *m = nilobj;
+                (*i)->flags |= kDirty;
+            }
+    }
+    cycleWeakObjects.clear();
+}
+
+size_t MemoryManager::incrementalSweep(size_t budget)
+{
+    size_t freed = 0;
+
+    for (size_t n = 0; n < budget && sweepCursor > 0; ++n, --sweepCursor)
+    {
+        ObjectStruct& p = objectTable[sweepCursor];
+        if (p.flags & kFreeSlot)
+            continue;
+        if (p.flags & kMarked)
+        {
+            p.flags &= ~kMarked;
+            ++liveObjects;
+            size_t words = p.words();
+            if (words < TObjectArena::largeSize && !arena.inImage(p.memory))
+                sweepLiveWords += words;
+        }
+        else if (destroyObject(sweepCursor))
+            ++freed;
+    }
+    sweepFreed += freed;
+    return freed;
+}
+
+bool MemoryManager::incrementalStep()
+{
+    if (noGC)
+        return gcPhase != kIdle;
+
+    if (gcPhase == kIdle)
+    {
+        if (promotedSinceCycle < std::max(nurserySize, liveObjects / 2))
+            return false;
+        startIncrementalCycle();
+    }
+
+    clock_t start = clock();
+    if (gcPhase == kMarking)
+    {
+        incrementalMark(incrementalBudget);
+        if (greyStack.empty())
+        {
+            /* nothing left to mark, scan the roots and anything written
+               without a barrier once more and finish marking in this 
+               step, then start sweeping */
+            shadeRoots();
+            for (TMarkStack::iterator i = rescanSet.begin(), iend = rescanSet.end(); i != iend; ++i)
+                shade(**i);
+            rescanSet.clear();
+            incrementalMark(~(size_t)0);
+            finishIncrementalWeak();
+            gcPhase = kSweeping;
+            sweepCursor = objectTable.size() - 1;
+            sweepLiveWords = 0;
+            sweepFreed = 0;
+            liveObjects = 0;
+        }
+    }
+    else
+    {
+        incrementalSweep(incrementalBudget);
+        if (sweepCursor == 0)
+        {
+            gcPhase = kIdle;
+            noteCollection(sweepFreed, sweepFreed + liveObjects);
+            measureFragmentation(sweepLiveWords);
+            if (debugging)
+                fprintf(stderr,"\nincremental collection done, %d objects.\n", 
+                        static_cast<int>(liveObjects));
+        }
+    }
+    recordPause(start);
+    if (gcPhase == kIdle)
+    {
+        ++stats.incrementalCycles;
+        endCollection("incremental", sweepFreed);
+    }
+
+    return gcPhase != kIdle;
+}
+
+void MemoryManager::setIncrementalBudget(size_t budget)
+{
+    incrementalBudget = (budget > 0)? budget : 1;
+}
+
+void MemoryManager::recordPause(clock_t start)
+{
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (pauseTimes.size() < m_pauseSampleCount)
+        pauseTimes.push_back(secs);
+    else
+        pauseTimes[pauseNext] = secs;
+    pauseNext = (pauseNext + 1) % m_pauseSampleCount;
+
+    size_t bucket = 0;
+    for (double limit = 1e-6; secs >= limit && bucket < TGCStats::kPauseBuckets - 1; limit *= 2)
+        ++bucket;
+    ++stats.pauseHistogram[bucket];
+    ++stats.pauses;
+    stats.totalPauseSeconds += secs;
+    stats.lastPauseSeconds = secs;
+    stats.maxPauseSeconds = std::max(stats.maxPauseSeconds, secs);
+}
 
-    return deleted;
+/* a minor, full or incremental collection has finished, what was
+   allocated since the last is counted afresh */
+void MemoryManager::endCollection(const char* kind, size_t freed)
+{
+    stats.lastFreed = freed;
+    stats.totalFreed += freed;
+    logStats(kind, freed);
+    stats.totalObjectsAllocated += stats.objectsAllocated;
+    stats.objectsAllocated = 0;
+    stats.wordsAllocated = 0;
 }
 
-void MemoryManager::setFreeLists() 
+void MemoryManager::logStats(const char* kind, size_t freed)
 {
-    objectFreeList.clear();
-    objectFreeListInv.clear();
+    if (statsLog == NULL)
+        return;
+
+    long long now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    fprintf(statsLog, "{\"time\":%lld,\"kind\":\"%s\",\"pause_us\":%.0f,\"freed\":%lu,"
+            "\"allocated_objects\":%lu,\"allocated_bytes\":%lu,\"live\":%lu,"
+            "\"table_size\":%lu,\"free_slots\":%lu,\"growths\":%lu,\"grow_us\":%.0f,"
+            "\"free_lists\":[",
+            now, kind, stats.lastPauseSeconds * 1e6, (unsigned long)freed,
+            (unsigned long)stats.objectsAllocated, (unsigned long)(stats.wordsAllocated * sizeof(object)),
+            (unsigned long)(objectTable.size() - freeSlots), (unsigned long)objectTable.size(),
+            (unsigned long)freeSlots, (unsigned long)stats.growths, stats.growSeconds * 1e6);
+    for (size_t i = 0; i < m_sizeClassCount; ++i)
+        fprintf(statsLog, i? ",%lu" : "%lu", (unsigned long)freeListCounts[i]);
+    fprintf(statsLog, "]}\n");
+    fflush(statsLog);
+}
 
-    /* add free objects */
-    for(int z=objectTable.size()-1; z>0; z--)
-    {
-        // If really unused, destroyObject will take care
-        // of cleaning up and adding to the free list.
-        if (objectTable[z].referenceCount == 0)
-            destroyObject(z);
-    }
+const TGCStats& MemoryManager::gcStats() const
+{
+    return stats;
 }
 
-void MemoryManager::visit(register object x)
+bool MemoryManager::setStatsLog(const char* path)
 {
-    int i, s;
-    object *p;
+    if (statsLog != NULL)
+        fclose(statsLog);
+    statsLog = (path != NULL)? fopen(path, "a") : NULL;
+    return path == NULL || statsLog != NULL;
+}
 
-    if (x && (!(x&1))) 
+void MemoryManager::heapCensus(std::vector<TClassCensus>& census, bool retained)
+{
+    census.clear();
+    std::unordered_map<object, unsigned int> entries;
+    std::vector<unsigned int> censusEntry;
+    if (retained)
+        censusEntry.resize(objectTable.size());
+
+    object lastClass = nilobj;
+    unsigned int entry = 0;
+    for (size_t j = 0; j < objectTable.size(); ++j)
     {
-        if (--(objectFromID(x).referenceCount) == -1) 
+        ObjectStruct& p = objectTable[j];
+        if (p.flags & kFreeSlot)
+            continue;
+        /* runs of one class are common, a table of instances say */
+        if (census.empty() || p.objectClass() != lastClass)
         {
-            /* then it's the first time we've visited it, so: */
-            visit(objectFromID(x)._class);
-            s = objectRef(x).size;
-            if (s>0) 
+            lastClass = p.objectClass();
+            std::pair<std::unordered_map<object, unsigned int>::iterator, bool> found = 
+                entries.insert(std::make_pair(lastClass, (unsigned int)census.size()));
+            if (found.second)
             {
-                p = objectFromID(x).memory;
-                for (i=s; i; --i) 
-                    visit(*p++);
+                TClassCensus c = { lastClass, 0, 0, 0 };
+                census.push_back(c);
             }
+            entry = found.first->second;
         }
+        ++census[entry].instances;
+        census[entry].bytes += sizeof(ObjectStruct) + p.words() * sizeof(object);
+        if (retained)
+            censusEntry[j] = entry;
     }
-}
 
+    if (retained)
+        retainedSizes(census, censusEntry);
+}
 
-int MemoryManager::garbageCollect()
+/* the number of references object traces from p, for reference() */
+static long referenceCount(ObjectStruct& p)
 {
-    register int j;
-    int c=1,f=0;
-
-    if(noGC)
-        return 0;
-
-    if (debugging) 
-        fprintf(stderr,"\ngarbage collecting ... \n");
-
-    for(TObjectTableIterator x = objectTable.begin(), xend = objectTable.end(); x != xend; ++x)
-        x->referenceCount = 0;
-    objectTable[0].referenceCount = 1;
-    /* visit symbols and firstProcess to toggle their referenceCount */
+    return (p.flags & kWeak)? 1 : 1 + p.slotCount();
+}
 
-    visit(symbols);
+/* reference i of p, its class and then its slots, as a full collection
+   traces them, nilobj in place of weak references */
+static object reference(ObjectStruct& p, long i)
+{
+    if (i == 0)
+        return p.objectClass();
+    if (i == 1 && (p.flags & kEphemeron))
+        return nilobj;
+    return p.memory[i - 1];
+}
 
-    /* Visit any explicitly held references from the use of ObjectHandle */
-    ObjectHandle* explicitRef = ObjectHandle::getListHead();
-    while(explicitRef)
+/* Lengauer and Tarjan's dominator algorithm, the simple version, over 
+   the objects reachable from the roots. Everything is numbered in depth 
+   first order, with a virtual root, number 0, referring to each of the
+   real roots. The dominator tree is then walked to sum retained sizes 
+   by class, counting an instance only if no instance of the same class
+   dominates it. */
+void MemoryManager::retainedSizes(std::vector<TClassCensus>& census, const std::vector<unsigned int>& censusEntry)
+{
+    typedef unsigned int node;
+    const node none = ~0u;
+    const size_t tableSize = objectTable.size();
+
+    std::vector<object> roots;
+    roots.push_back(symbols);
+    forEachHandle([&](object x) { roots.push_back(x); });
+    forEachFinalizerRoot([&](object x) { roots.push_back(x); });
+
+    /* the references of node v, in depth first numbering, the virtual 
+       root's are the real roots */
+    std::vector<size_t> vertex;
+    auto successorCount = [&](node v) -> long {
+        return (v == 0)? (long)roots.size() : referenceCount(objectTable[vertex[v]]);
+    };
+    auto successor = [&](node v, long i) -> object {
+        return (v == 0)? roots[i] : reference(objectTable[vertex[v]], i);
+    };
+
+    /* number the reachable objects, without recursion */
+    std::vector<node> number(tableSize, none);
+    auto numberOf = [&](object x) -> node {
+        if (x == nilobj || isImmediate(x) || objectIndex(x) >= tableSize)
+            return none;
+        return number[objectIndex(x)];
+    };
+    std::vector<node> parent;
+    vertex.push_back(tableSize);
+    parent.push_back(none);
+    std::vector<std::pair<node, long> > stack;
+    stack.push_back(std::make_pair(node(0), 0L));
+    while (!stack.empty())
     {
-        visit(*explicitRef);
-        explicitRef = explicitRef->next();
+        node v = stack.back().first;
+        long i = stack.back().second++;
+        if (i >= successorCount(v))
+        {
+            stack.pop_back();
+            continue;
+        }
+        object next = successor(v, i);
+        if (next == nilobj || isImmediate(next) || objectIndex(next) >= tableSize ||
+                number[objectIndex(next)] != none || (objectTable[objectIndex(next)].flags & kFreeSlot))
+            continue;
+        node w = vertex.size();
+        number[objectIndex(next)] = w;
+        vertex.push_back(objectIndex(next));
+        parent.push_back(v);
+        stack.push_back(std::make_pair(w, 0L));
     }
+    std::vector<std::pair<node, long> >().swap(stack);
+    const node count = vertex.size();
 
-    /* add new garbage to objectFreeList 
-    * toggle referenceCount 
-    * count the objects
-    */
+    /* predecessors of each node, packed */
+    std::vector<size_t> firstPred(count + 1, 0);
+    for (node v = 0; v < count; ++v)
+        for (long i = 0, n = successorCount(v); i < n; ++i)
+        {
+            node w = numberOf(successor(v, i));
+            if (w != none)
+                ++firstPred[w + 1];
+        }
+    for (node v = 0; v < count; ++v)
+        firstPred[v + 1] += firstPred[v];
+    std::vector<node> preds(firstPred[count]);
+    {
+        std::vector<size_t> fill(firstPred.begin(), firstPred.end() - 1);
+        for (node v = 0; v < count; ++v)
+            for (long i = 0, n = successorCount(v); i < n; ++i)
+            {
+                node w = numberOf(successor(v, i));
+                if (w != none)
+                    preds[fill[w]++] = v;
+            }
+    }
+    std::vector<node>().swap(number);
+
+    std::vector<node> semi(count), label(count), ancestor(count, none), idom(count, none);
+    std::vector<node> bucket(count, none), nextInBucket(count, none);
+    std::vector<node> path;
+    for (node v = 0; v < count; ++v)
+        semi[v] = label[v] = v;
+
+    /* the node of least semidominator on the path to v in the forest
+       built so far, compressing the path as it goes */
+    auto eval = [&](node v) -> node {
+        if (ancestor[v] == none)
+            return v;
+        path.clear();
+        for (node x = v; ancestor[ancestor[x]] != none; x = ancestor[x])
+            path.push_back(x);
+        for (size_t k = path.size(); k--; )
+        {
+            node y = path[k];
+            node a = ancestor[y];
+            if (semi[label[a]] < semi[label[y]])
+                label[y] = label[a];
+            ancestor[y] = ancestor[a];
+        }
+        return label[v];
+    };
 
-    for (j=objectTable.size()-1; j>0; j--) 
+    for (node w = count - 1; w > 0; --w)
     {
-        if (objectTable[j].referenceCount == 0) 
+        for (size_t i = firstPred[w]; i < firstPred[w + 1]; ++i)
         {
-            if(destroyObject(j))
-                f++;
-        } 
-        else
+            node u = eval(preds[i]);
+            if (semi[u] < semi[w])
+                semi[w] = semi[u];
+        }
+        nextInBucket[w] = bucket[semi[w]];
+        bucket[semi[w]] = w;
+        node p = parent[w];
+        ancestor[w] = p;
+        for (node v = bucket[p]; v != none; v = nextInBucket[v])
         {
-            if (0!=(objectTable[j].referenceCount = -objectTable[j].referenceCount))
-                c++;
+            node u = eval(v);
+            idom[v] = (semi[u] < semi[v])? u : p;
         }
+        bucket[p] = none;
     }
+    for (node w = 1; w < count; ++w)
+        if (idom[w] != semi[w])
+            idom[w] = idom[idom[w]];
+
+    /* a node's dominator is numbered before it, so sizes can be summed
+       up the tree in reverse order */
+    std::vector<size_t> size(count, 0);
+    for (node w = 1; w < count; ++w)
+        size[w] = sizeof(ObjectStruct) + objectTable[vertex[w]].words() * sizeof(object);
+    for (node w = count - 1; w > 0; --w)
+        size[idom[w]] += size[w];
+
+    /* children in the dominator tree, packed, reusing the predecessors */
+    std::fill(firstPred.begin(), firstPred.end(), 0);
+    for (node w = 1; w < count; ++w)
+        ++firstPred[idom[w] + 1];
+    for (node v = 0; v < count; ++v)
+        firstPred[v + 1] += firstPred[v];
+    preds.resize(count);
+    std::copy(firstPred.begin(), firstPred.end() - 1, ancestor.begin());
+    for (node w = 1; w < count; ++w)
+        preds[ancestor[idom[w]]++] = w;
+
+    /* walk the tree, with the number of instances of each class on the
+       path down to the current node, a high bit marks leaving a node */
+    const node leaving = 1u << (sizeof(node) * 8 - 1);
+    std::vector<node> enclosing(census.size(), 0);
+    std::vector<node> walk;
+    walk.push_back(0);
+    while (!walk.empty())
+    {
+        node v = walk.back();
+        walk.pop_back();
+        if (v & leaving)
+        {
+            --enclosing[censusEntry[vertex[v & ~leaving]]];
+            continue;
+        }
+        if (v != 0)
+        {
+            unsigned int entry = censusEntry[vertex[v]];
+            if (enclosing[entry]++ == 0)
+                census[entry].retainedBytes += size[v];
+            walk.push_back(v | leaving);
+        }
+        for (size_t i = firstPred[v]; i < firstPred[v + 1]; ++i)
+            walk.push_back(preds[i]);
+    }
+}
 
-    if (debugging)
+void MemoryManager::setAllocationSampler(size_t interval, TAllocationSampler sampler)
+{
+    allocationSampler = (interval > 0)? sampler : NULL;
+    sampleInterval = interval;
+    sampleWindow = sampleCountdown = LONG_MAX;
+    if (allocationSampler != NULL)
     {
-        fprintf(stderr," %d references.\n",ObjectHandle::numTotalHandles());
-        fprintf(stderr," %d objects - %d freed.\n",c,f);
+        sampleCountdown = 0;
+        sampleAllocation(nilobj);
     }
+}
 
-    return f;
+/* report the sample, if there is one, and start the next window. a
+   xorshift spreads the windows over half to one and a half intervals */
+void MemoryManager::sampleAllocation(object allocated)
+{
+    if (allocated != nilobj && allocationSampler != NULL)
+        allocationSampler(allocated, sampleWindow - sampleCountdown);
+    if (allocationSampler == NULL)
+    {
+        sampleWindow = sampleCountdown = LONG_MAX;
+        return;
+    }
+    sampleSeed ^= sampleSeed << 13;
+    sampleSeed ^= sampleSeed >> 7;
+    sampleSeed ^= sampleSeed << 17;
+    sampleWindow = sampleCountdown = 
+        (long)(sampleInterval / 2 + sampleSeed % (sampleInterval + 1));
+    if (sampleWindow == 0)
+        sampleWindow = sampleCountdown = 1;
 }
 
+double MemoryManager::pausePercentile(double percentile) const
+{
+    if (pauseTimes.empty())
+        return 0.0;
 
-size_t MemoryManager::objectCount()
-{   
-    return storageSize() - freeSlotsCount();
+    std::vector<double> sorted(pauseTimes);
+    size_t n = (size_t)((sorted.size() - 1) * std::min(std::max(percentile, 0.0), 100.0) / 100.0 + 0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+    return sorted[n];
 }
 
-size_t MemoryManager::storageSize() const
+
+void MemoryManager::beginMark()
 {
-    return objectTable.size();
+    markDepth = 0;
+    markStart = clock();
 }
 
-size_t MemoryManager::freeSlotsCount()
-{   
-    return objectFreeListInv.size();
+void MemoryManager::endMark()
+{
+    lastMarkTime = (double)(clock() - markStart) / CLOCKS_PER_SEC;
+    totalMarkTime += lastMarkTime;
+    if (markDepth > maxMarkDepth)
+        maxMarkDepth = markDepth;
 }
 
 std::string MemoryManager::statsString()
@@ -355,7 +2046,26 @@ std::string MemoryManager::statsString()
     str << "Memory Statistics:" << std::endl;
     str << "\tActive Objects     " << objectCount() << std::endl;
     str << "\tObjectstore size   " << objectTable.size() << std::endl;
-    str << "\tFree objects       " << objectFreeListInv.size() << std::endl;
+    str << "\tFree objects       " << freeSlots << std::endl;
+    str << "\tStore growths      " << stats.growths << std::endl;
+    str << "\tLive after GC      " << liveRatio * 100.0 << "%" << std::endl;
+    str << "\tLast GC reclaimed  " << reclaimRatio * 100.0 << "%" << std::endl;
+    str << "\tArena chunks       " << arena.chunkCount() << std::endl;
+    str << "\tFree data areas    " << arena.freeCount() << std::endl;
+    str << "\tMapped data areas  " << arena.mappedCount() << " (" 
+        << arena.mappedWords() * sizeof(object) / 1024 << "KB)" << std::endl;
+    str << "\tFragmentation      " << fragmentation * 100.0 << "%" << std::endl;
+    str << "\tCompactions        " << stats.compactions << std::endl;
+    str << "\tLast words moved   " << lastCompactionMoved << std::endl;
+    str << "\tChunks released    " << chunksReleased << std::endl;
+    str << "\tIncremental cycles " << stats.incrementalCycles << std::endl;
+    str << "\tPause p50/p99/max  " << pausePercentile(50) * 1000.0 << "/" 
+        << pausePercentile(99) * 1000.0 << "/" << pausePercentile(100) * 1000.0 << "ms" << std::endl;
+    str << "\tLast mark time     " << lastMarkTime * 1000.0 << "ms" << std::endl;
+    str << "\tTotal mark time    " << totalMarkTime * 1000.0 << "ms" << std::endl;
+    str << "\tLast mark depth    " << markDepth << std::endl;
+    str << "\tMax mark depth     " << maxMarkDepth << std::endl;
+    str << "\tGC workers         " << gcWorkers << std::endl;
 
     return str.str();
 }
@@ -363,20 +2073,102 @@ std::string MemoryManager::statsString()
 
 
 
-static struct 
+/*
+   images start with a header, then the object table, an entry for every
+   index up to objectCount, free ones included. then, aligned so that 
+   they can be mapped straight into memory, the data areas one after 
+   another. the data areas are mapped privately, pages are copied by 
+   the OS the first time they are written, and the rest stay shared with
+   the page cache, so reading an image costs little more than its table.
+   */
+static const char kImageMagic[8] = { 'T', 'W', 'I', 'M', 'A', 'G', 'E', 0 };
+static const uint32_t kImageVersion = 2;
+/* TImageHeader::flags, the objects were renumbered as they were written */
+static const uint32_t kImageRenumbered = 0x01;
+/* the data areas start on a multiple of this, the largest page size in common use */
+static const size_t kImageAlignment = 65536;
+
+struct TImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    //! sizeof(object) where the image was written, it must match.
+    uint32_t wordSize;
+    uint64_t objectCount;
+    int64_t symbols;
+    //! File offset of the data areas, and their length.
+    uint64_t bodiesOffset;
+    uint64_t bodiesWords;
+    //! Added in version 2.
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct TImageEntry
+{
+    int64_t objectClass;
+    //! Bytes or slots, as ObjectStruct::size().
+    uint32_t size;
+    //! kFreeSlot, kBytes, kWeak and kEphemeron.
+    uint32_t flags;
+    //! Offset of the data area, in words from the start of them all.
+    uint64_t body;
+};
+
+/*
+   changes appended by imageWriteDelta() follow the data areas, each a 
+   header, then an entry for every object made, changed or freed since 
+   the image was last saved, then the data areas of those in use, one 
+   after another. a delta cut short, by a crash say, is left out, with
+   any after it.
+   */
+static const char kDeltaMagic[8] = { 'T', 'W', 'D', 'E', 'L', 'T', 'A', 0 };
+
+struct TImageDelta
+{
+    char magic[8];
+    //! Entries in the object table once the delta is applied.
+    uint64_t objectCount;
+    int64_t symbols;
+    uint64_t entryCount;
+    uint64_t bodiesWords;
+};
+
+struct TImageDeltaEntry
+{
+    uint64_t index;
+    //! The body is counted from the start of the delta's data areas.
+    TImageEntry entry;
+};
+
+/*
+   images from before the header, still read, have no table. each 
+   object is written as one of these and then its data.
+   */
+struct TImageObject
 {
     int di;
     object cl;
     short ds;
-} dummyObject;
+    //! kWeak and kEphemeron, in what was padding in older images.
+    unsigned short fl;
+};
 
 /*
    imageRead - read in an object image
+   images with a header are mapped, see imageReadMapped(), and any
+   changes appended to them replayed, older ones are read an object at
+   a time.
    we toss out the free lists built initially,
    reconstruct the linkages, then rebuild the free
    lists around the new objects.
-   The only objects with nonzero reference counts
-   will be those reachable from either symbols
+   The objects read are marked, so only the
+   slots between them go on the free lists.
+   Byte objects are stored padded out to the
+   (bytes+1)/2 words the image format has always
+   used, the padding is skipped here.
+   References in images from before immediate
+   Characters and Floats are converted as read.
    */
 static int fr(FILE* fp, char* p, int s)
 {   
@@ -388,78 +2180,703 @@ static int fr(FILE* fp, char* p, int s)
   return r;
 }
 
+/* words a byte object of the given size takes up in an image */
+static size_t imageWords(const ObjectStruct& o)
+{
+  return o.isBytes()? (o.size() + 1) / 2 : o.size();
+}
+
+/* images written since Characters and Floats became immediates start
+   with this, older ones start with the symbols ID, never a SmallInteger,
+   and shift references up one rather than two */
+static const object kImmediatesImageMark = -1;
+
+static object fromOldImage(object o)
+{
+  return isSmallInteger(o)? o : o << 1;
+}
+
+bool MemoryManager::imageReadMapped(FILE* fp)
+{
+  TImageHeader header;
+  if (!fr(fp, (char *) &header, sizeof(header)) || 
+      memcmp(header.magic, kImageMagic, sizeof(kImageMagic)) != 0)
+  {
+    fseek(fp, 0, SEEK_SET);
+    return false;
+  }
+  /* version 1 headers stop short of the flags */
+  if (header.version == 1)
+  {
+    header.flags = 0;
+    fseek(fp, offsetof(TImageHeader, flags), SEEK_SET);
+  }
+  else if (header.version != kImageVersion)
+    sysError("image version not supported","imageRead");
+  if (header.wordSize != sizeof(object))
+    sysError("image word size not supported","imageRead");
+  renumberedImage = (header.flags & kImageRenumbered) != 0;
+
+  size_t count = header.objectCount;
+  std::vector<TImageEntry> entries(count);
+  if (count > 0 && fread(&entries[0], sizeof(TImageEntry), count, fp) != count)
+    sysError("imageRead count error","");
+
+  object* bodies = NULL;
+  size_t bodyBytes = header.bodiesWords * sizeof(object);
+  if (bodyBytes > 0)
+  {
+#if !defined(WIN32)
+    void* mapped = mmap(NULL, bodyBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, 
+        fileno(fp), header.bodiesOffset);
+    if (mapped != MAP_FAILED)
+    {
+      struct stat info;
+      if (fstat(fileno(fp), &info) != 0)
+        memset(&info, 0, sizeof(info));
+      bodies = static_cast<object*>(mapped);
+      arena.adoptImage(bodies, header.bodiesWords, true, info.st_dev, info.st_ino);
+    }
+#endif
+    /* not mappable, a pipe say, so read them all in one go */
+    if (bodies == NULL)
+    {
+      bodies = static_cast<object*>(malloc(bodyBytes));
+      if (bodies == NULL || fseek(fp, header.bodiesOffset, SEEK_SET) != 0 ||
+          fread(bodies, sizeof(object), header.bodiesWords, fp) != header.bodiesWords)
+        sysError("imageRead count error","");
+      arena.adoptImage(bodies, header.bodiesWords, false);
+    }
+  }
+
+  if (count > objectTable.size())
+    growObjectStore(count - objectTable.size() + growAmount);
+  markBits.clear();
+  symbols = header.symbols;
+  for (size_t i = 0; i < count; ++i)
+  {
+    const TImageEntry& e = entries[i];
+    ObjectStruct& o = objectTable[i];
+    if (e.flags & kFreeSlot)
+      continue;
+    o.setClass(e.objectClass);
+    o.flags = (e.flags & (kWeak | kEphemeron)) | kOld;
+    /* a very large object's size is in the word before its data area */
+    size_t words = ObjectStruct::wordsFor(e.size, (e.flags & kBytes) != 0);
+    if (words > 0 && (e.body + words > header.bodiesWords ||
+          (e.size >= ObjectStruct::kSizeInBody && e.body == 0)))
+      sysError("image data area out of range","imageRead");
+    o.memory = (words > 0)? bodies + e.body : NULL;
+    if (e.flags & kBytes)
+      o.setByteSize(e.size);
+    else
+      o.setPointerSize(e.size);
+    markBits.mark(i);
+  }
+
+  if (fseek(fp, header.bodiesOffset + header.bodiesWords * sizeof(object), SEEK_SET) == 0)
+  {
+    size_t deltaCount = count;
+    while (readDelta(fp, deltaCount))
+      ;
+    count = std::max(count, deltaCount);
+  }
+
+  setFreeLists();
+  for (size_t i = 0; i < objectTable.size(); ++i)
+    objectTable[i].flags &= ~kDirty;
+  youngObjects.clear();
+  rememberedSet.clear();
+  noteSaved(fp, count);
+  return true;
+}
+
+/* apply the next delta, if there is a whole one. the data areas are
+   copied rather than mapped, deltas being small and not page aligned */
+bool MemoryManager::readDelta(FILE* fp, size_t& count)
+{
+  long start = ftell(fp);
+  TImageDelta delta;
+  std::vector<TImageDeltaEntry> entries;
+  std::vector<object> bodies;
+  bool complete = fread(&delta, sizeof(delta), 1, fp) == 1 &&
+    memcmp(delta.magic, kDeltaMagic, sizeof(kDeltaMagic)) == 0 &&
+    delta.entryCount <= delta.objectCount;
+  if (complete)
+  {
+    entries.resize(delta.entryCount);
+    bodies.resize(delta.bodiesWords);
+    complete = (delta.entryCount == 0 || 
+        fread(&entries[0], sizeof(TImageDeltaEntry), delta.entryCount, fp) == delta.entryCount) &&
+      (delta.bodiesWords == 0 ||
+        fread(&bodies[0], sizeof(object), delta.bodiesWords, fp) == delta.bodiesWords);
+  }
+  if (!complete)
+  {
+    fseek(fp, start, SEEK_SET);
+    return false;
+  }
+
+  if (delta.objectCount > objectTable.size())
+    growObjectStore(delta.objectCount - objectTable.size() + growAmount);
+  count = delta.objectCount;
+  symbols = delta.symbols;
+  for (size_t k = 0; k < entries.size(); ++k)
+  {
+    size_t i = entries[k].index;
+    const TImageEntry& e = entries[k].entry;
+    if (i >= delta.objectCount)
+      sysError("image change out of range","imageRead");
+    ObjectStruct& o = objectTable[i];
+    if (markBits.test(i) && o.memory != NULL && !arena.inImage(o.memory))
+      arena.release(o.memory, o.words());
+    o.memory = NULL;
+    markBits.unmark(i);
+    if (e.flags & kFreeSlot)
+    {
+      o.flags = 0;
+      o.setPointerSize(0);
+      continue;
+    }
+    o.setClass(e.objectClass);
+    o.flags = (e.flags & (kWeak | kEphemeron)) | kOld;
+    size_t words = ObjectStruct::wordsFor(e.size, (e.flags & kBytes) != 0);
+    if (words > 0)
+    {
+      if (e.body + words > delta.bodiesWords)
+        sysError("image data area out of range","imageRead");
+      o.memory = arena.allocate(words);
+      memcpy(o.memory, &bodies[e.body], words * sizeof(object));
+    }
+    if (e.flags & kBytes)
+      o.setByteSize(e.size);
+    else
+      o.setPointerSize(e.size);
+    markBits.mark(i);
+  }
+  return true;
+}
+
+/* remember which file the image is in, and how long, so changes are
+   only ever appended to it. false if what was written couldn't be
+   flushed, and then nothing is remembered */
+bool MemoryManager::noteSaved(FILE* fp, size_t count)
+{
+  struct stat info;
+  memset(&savedImage, 0, sizeof(savedImage));
+  if (fflush(fp) != 0)
+    return false;
+  if (fstat(fileno(fp), &info) == 0 && S_ISREG(info.st_mode))
+  {
+    savedImage.device = info.st_dev;
+    savedImage.inode = info.st_ino;
+    savedImage.length = ftell(fp);
+    savedImage.objectCount = count;
+  }
+  return true;
+}
+
 void MemoryManager::imageRead(FILE* fp)
 {   
-  long i, size;
+  long i;
+  TImageObject dummyObject;
+  bool oldImage;
 
+  memset(&savedImage, 0, sizeof(savedImage));
+  renumberedImage = false;
+  if (imageReadMapped(fp))
+    return;
+
+  markBits.clear();
   fr(fp, (char *) &symbols, sizeof(object));
+  oldImage = symbols != kImmediatesImageMark;
+  if (oldImage)
+    symbols = fromOldImage(symbols);
+  else
+    fr(fp, (char *) &symbols, sizeof(object));
   i = 0;
 
   while(fr(fp, (char *) &dummyObject, sizeof(dummyObject))) 
   {
     i = dummyObject.di;
 
-    if ((i < 0) || (i >= objectTable.size()))
+    if ((i < 0) || (static_cast<size_t>(i) >= objectTable.size()))
     {
         // Grow enough, plus a bit.
         growObjectStore(i - objectTable.size() + 500);
     }
-    objectTable[i]._class = dummyObject.cl;
-    if ((objectTable[i]._class < 0) || 
-        ((objectTable[i]._class) >= objectTable.size())) 
+    if (oldImage)
+      dummyObject.cl = fromOldImage(dummyObject.cl);
+    objectTable[i].setClass(dummyObject.cl);
+    if (objectIndex(dummyObject.cl) >= objectTable.size()) 
     {
         // Grow enough, plus a bit.
-        growObjectStore(objectTable[i]._class - objectTable.size() + 500);
+        growObjectStore(objectIndex(dummyObject.cl) - objectTable.size() + 500);
     }
-    objectTable[i].size = size = dummyObject.ds;
-    if (size < 0) size = ((- size) + 1) / 2;
-    if (size != 0) 
+    objectTable[i].flags = dummyObject.fl & (kWeak | kEphemeron);
+    size_t words = ObjectStruct::wordsFor(labs(dummyObject.ds), dummyObject.ds < 0);
+    objectTable[i].memory = arena.allocate(words);
+    if (dummyObject.ds < 0)
+      objectTable[i].setByteSize(- dummyObject.ds);
+    else
+      objectTable[i].setPointerSize(dummyObject.ds);
+    if (words != 0) 
     {
-      objectTable[i].memory = mBlockAlloc((int) size);
       fr(fp, (char *) objectTable[i].memory,
-          sizeof(object) * (int) size);
+          sizeof(object) * (int) words);
+      if (oldImage && !objectTable[i].isBytes())
+        for (size_t j = 0; j < words; ++j)
+          objectTable[i].memory[j] = fromOldImage(objectTable[i].memory[j]);
     }
-    else
-      objectTable[i].memory = (object *) 0;
+    size_t padding = imageWords(objectTable[i]) - words;
+    if (padding != 0)
+      fseek(fp, sizeof(object) * padding, SEEK_CUR);
 
-    objectTable[i].referenceCount = 666;
+    markBits.mark(i);
+    objectTable[i].flags |= kOld;
   }
   setFreeLists();
+  youngObjects.clear();
+  rememberedSet.clear();
 }
 
-/*
-   imageWrite - write out an object image
-   */
+/* the table index of each object in a renumbered image, and the ID it
+   gets there by table index, nil for anything left out. objects only 
+   the running VM can reach are left out, nothing saved refers to them */
+void MemoryManager::imageOrder(std::vector<object>& order, std::vector<object>& newID)
+{
+  order.assign(1, 0);
+  newID.assign(objectTable.size(), nilobj);
+  std::vector<object> stack;
+  stack.push_back(objectTable[0].objectClass());
+  stack.push_back(symbols);
+  while (!stack.empty())
+  {
+    object x = stack.back();
+    stack.pop_back();
+    if (x == nilobj || isImmediate(x))
+      continue;
+    size_t i = objectIndex(x);
+    if (i >= objectTable.size() || newID[i] != nilobj || (objectTable[i].flags & kFreeSlot))
+      continue;
+    newID[i] = objectID(order.size());
+    order.push_back(i);
+    /* the class comes next, then the slots in order */
+    ObjectStruct& p = objectTable[i];
+    for (long j = p.slotCount(); j > 0; --j)
+      stack.push_back(p.memory[j - 1]);
+    stack.push_back(p.objectClass());
+  }
+}
+
+/* the table entry for o, written as free if asked to, its data area at
+   bodiesWords, which is moved past it */
+static void fillImageEntry(const ObjectStruct& o, object objectClass, bool free, TImageEntry& e, uint64_t& bodiesWords)
+{
+  memset(&e, 0, sizeof(e));
+  e.flags = free? kFreeSlot : o.flags & (kFreeSlot | kBytes | kWeak | kEphemeron);
+  if (e.flags & kFreeSlot)
+    return;
+  e.objectClass = objectClass;
+  e.size = o.size();
+  /* a very large object keeps its size in the word before its data
+     area, so it is mapped the same way */
+  if (e.size >= ObjectStruct::kSizeInBody)
+    ++bodiesWords;
+  e.body = bodiesWords;
+  bodiesWords += o.words();
+}
+
+/* an image ready to be written, the header and table filled in */
+struct TImageLayout
+{
+  TImageHeader header;
+  std::vector<TImageEntry> entries;
+  //! The table index of each entry.
+  std::vector<object> order;
+  //! The ID each object gets, by table index, if renumbering.
+  std::vector<object> newID;
+};
+
+/* collect, then lay out the table, clearing the changed marks of what
+   is written if asked to */
+void MemoryManager::imageLayout(TImageLayout& layout, bool renumber, bool clearDirty)
+{
+  garbageCollect();
+
+  std::vector<object>& order = layout.order;
+  std::vector<object>& newID = layout.newID;
+  if (renumber)
+    imageOrder(order, newID);
+  else
+  {
+    size_t used = objectTable.size();
+    while (used > 1 && (objectTable[used - 1].flags & kFreeSlot))
+      --used;
+    order.resize(used);
+    for (size_t i = 0; i < used; ++i)
+      order[i] = i;
+  }
+  size_t count = order.size();
+
+  TImageHeader& header = layout.header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kImageMagic, sizeof(kImageMagic));
+  header.version = kImageVersion;
+  header.wordSize = sizeof(object);
+  header.objectCount = count;
+  header.symbols = renumber? newID[objectIndex(symbols)] : symbols;
+  header.flags = renumber? kImageRenumbered : 0;
+  size_t tableEnd = sizeof(header) + count * sizeof(TImageEntry);
+  header.bodiesOffset = (tableEnd + kImageAlignment - 1) / kImageAlignment * kImageAlignment;
+
+  layout.entries.assign(count, TImageEntry());
+  for (size_t i = 0; i < count; ++i)
+  {
+    ObjectStruct& o = objectTable[order[i]];
+    if (clearDirty)
+      o.flags &= ~kDirty;
+    fillImageEntry(o, renumber && !(o.flags & kFreeSlot)? newID[objectIndex(o.objectClass())] : o.objectClass(), 
+        false, layout.entries[i], header.bodiesWords);
+  }
+}
 
-static void fw(FILE* fp, char* p, int s)
+/* write a laid out image through write(pointer, bytes), which answers
+   false if it failed */
+template<typename W>
+bool MemoryManager::imageWriteLayout(const TImageLayout& layout, W write)
 {
-  if (fwrite(p, s, 1, fp) != 1) {
-    sysError("imageWrite size error","");
+  static const object zeros[16] = { 0 };
+  const TImageHeader& header = layout.header;
+  size_t count = layout.entries.size();
+  bool renumber = (header.flags & kImageRenumbered) != 0;
+
+  if (!write(&header, sizeof(header)) ||
+      (count > 0 && !write(&layout.entries[0], count * sizeof(TImageEntry))))
+    return false;
+  for (size_t padding = header.bodiesOffset - sizeof(header) - count * sizeof(TImageEntry); padding > 0; )
+  {
+    size_t n = std::min(padding, sizeof(zeros));
+    if (!write(zeros, n))
+      return false;
+    padding -= n;
+  }
+  std::vector<object> renumbered;
+  for (size_t i = 0; i < count; ++i)
+  {
+    ObjectStruct& o = objectTable[layout.order[i]];
+    if ((o.flags & kFreeSlot) || o.words() == 0)
+      continue;
+    if ((size_t)o.size() >= ObjectStruct::kSizeInBody && !write(o.memory - 1, sizeof(object)))
+      return false;
+    if (!renumber || o.isBytes())
+    {
+      if (!write(o.memory, sizeof(object) * o.words()))
+        return false;
+      continue;
+    }
+    renumbered.assign(o.memory, o.memory + o.words());
+    for (size_t j = 0; j < renumbered.size(); ++j)
+      if (!isImmediate(renumbered[j]))
+        renumbered[j] = layout.newID[objectIndex(renumbered[j])];
+    if (!write(&renumbered[0], sizeof(object) * renumbered.size()))
+      return false;
   }
+  return true;
 }
 
-void MemoryManager::imageWrite(FILE* fp)
+bool MemoryManager::imageWrite(FILE* fp, bool renumber)
 {   
-  long i, size;
+  TImageLayout layout;
+  imageLayout(layout, renumber, !renumber);
+  bool written = imageWriteLayout(layout, [fp](const void* p, size_t bytes) {
+      return fwrite(p, bytes, 1, fp) == 1;
+  });
+  if (!written || renumber)
+  {
+    memset(&savedImage, 0, sizeof(savedImage));
+    return written && fflush(fp) == 0;
+  }
+  return noteSaved(fp, layout.entries.size());
+}
 
-  garbageCollect();
+/* a temporary file beside path, for an image to be written to and then
+   renamed over it, unique so that saves to the same path don't collide */
+static int createTemporary(const char* path, std::string& temporary)
+{
+#if !defined(WIN32)
+  temporary = std::string(path) + ".XXXXXX";
+  int fd = mkstemp(&temporary[0]);
+  if (fd >= 0)
+    fchmod(fd, 0644);
+  return fd;
+#else
+  temporary = std::string(path) + ".tmp";
+  return _open(temporary.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#endif
+}
+
+bool MemoryManager::releaseImageFile(const char* path)
+{
+  struct stat info;
+  return stat(path, &info) != 0 || arena.copyImage(info.st_dev, info.st_ino);
+}
+
+bool MemoryManager::imageSave(const char* path, bool renumber)
+{
+  std::string temporary;
+  int fd = createTemporary(path, temporary);
+  if (fd < 0)
+    return false;
+  FILE* fp = fdopen(fd, "wb");
+  if (fp == NULL)
+  {
+    close(fd);
+    remove(temporary.c_str());
+    return false;
+  }
+  bool saved = imageWrite(fp, renumber);
+#if !defined(WIN32)
+  saved = saved && fsync(fileno(fp)) == 0;
+#else
+  remove(path);
+#endif
+  saved = (fclose(fp) == 0) && saved;
+  saved = saved && rename(temporary.c_str(), path) == 0;
+  if (!saved)
+  {
+    remove(temporary.c_str());
+    memset(&savedImage, 0, sizeof(savedImage));
+  }
+  return saved;
+}
 
-  fw(fp, (char *) &symbols, sizeof(object));
+/* write(2) until it is all written, or it fails */
+static bool writeAll(int fd, const void* p, size_t bytes)
+{
+  const char* c = static_cast<const char*>(p);
+  while (bytes > 0)
+  {
+#if defined(WIN32)
+    int n = _write(fd, c, (unsigned)std::min(bytes, (size_t)INT_MAX));
+#else
+    ssize_t n = write(fd, c, bytes);
+#endif
+    if (n < 0)
+      return false;
+    c += n;
+    bytes -= n;
+  }
+  return true;
+}
 
-  for (i = 0; i < objectTable.size(); i++) 
+/* the delta is written straight to the file, not through stdio, so
+   that if it fails the file can be cut back with nothing left buffered
+   to be flushed after it */
+bool MemoryManager::imageWriteDelta(FILE* fp)
+{
+  struct stat info;
+  if (savedImage.length == 0 || fstat(fileno(fp), &info) != 0 ||
+      static_cast<unsigned long long>(info.st_dev) != savedImage.device ||
+      static_cast<unsigned long long>(info.st_ino) != savedImage.inode ||
+      info.st_size != savedImage.length)
+    return false;
+
+  /* most of what is new is garbage already */
+  minorCollect();
+
+  size_t count = objectTable.size();
+  while (count > savedImage.objectCount && (objectTable[count - 1].flags & kFreeSlot))
+    --count;
+
+  TImageDelta delta;
+  memset(&delta, 0, sizeof(delta));
+  memcpy(delta.magic, kDeltaMagic, sizeof(kDeltaMagic));
+  delta.objectCount = count;
+  delta.symbols = symbols;
+
+  /* slots past the end of the last save are free unless listed */
+  std::vector<TImageDeltaEntry> entries;
+  for (size_t i = 0; i < count; ++i)
   {
-    if (objectTable[i].referenceCount > 0) 
+    ObjectStruct& o = objectTable[i];
+    if (!(o.flags & kDirty))
+      continue;
+    if ((o.flags & kFreeSlot) && i >= savedImage.objectCount)
+      continue;
+    TImageDeltaEntry d;
+    memset(&d, 0, sizeof(d));
+    d.index = i;
+    d.entry.flags = o.flags & (kFreeSlot | kBytes | kWeak | kEphemeron);
+    if (!(o.flags & kFreeSlot))
     {
-      dummyObject.di = i;
-      dummyObject.cl = objectTable[i]._class;
-      dummyObject.ds = size = objectTable[i].size;
-      fw(fp, (char *) &dummyObject, sizeof(dummyObject));
-      if (size < 0) size = ((- size) + 1) / 2;
-      if (size != 0)
-        fw(fp, (char *) objectTable[i].memory,
-            sizeof(object) * size);
+      d.entry.objectClass = o.objectClass();
+      d.entry.size = o.size();
+      d.entry.body = delta.bodiesWords;
+      delta.bodiesWords += o.words();
     }
+    entries.push_back(d);
+  }
+  delta.entryCount = entries.size();
+
+  int fd = fileno(fp);
+  bool written = fflush(fp) == 0 &&
+#if defined(WIN32)
+    _lseeki64(fd, 0, SEEK_END) == savedImage.length &&
+#else
+    lseek(fd, 0, SEEK_END) == savedImage.length &&
+#endif
+    writeAll(fd, &delta, sizeof(delta)) &&
+    (entries.empty() || writeAll(fd, &entries[0], entries.size() * sizeof(TImageDeltaEntry)));
+  for (size_t k = 0; written && k < entries.size(); ++k)
+  {
+    ObjectStruct& o = objectTable[entries[k].index];
+    if (!(o.flags & kFreeSlot) && o.words() != 0)
+      written = writeAll(fd, o.memory, sizeof(object) * o.words());
+  }
+#if defined(WIN32)
+  written = written && _commit(fd) == 0;
+#else
+  written = written && fsync(fd) == 0;
+#endif
+
+  /* a delta that didn't all reach the disk is cut off, and the objects 
+     stay dirty for the next one */
+  if (!written)
+  {
+#if defined(WIN32)
+    if (_chsize_s(fd, savedImage.length) != 0)
+#else
+    if (ftruncate(fd, savedImage.length) != 0)
+#endif
+      memset(&savedImage, 0, sizeof(savedImage));
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i)
+    objectTable[i].flags &= ~kDirty;
+  savedImage.length += sizeof(delta) + entries.size() * sizeof(TImageDeltaEntry) +
+    delta.bodiesWords * sizeof(object);
+  savedImage.objectCount = count;
+  return true;
+}
+
+/* true if slot i is free, or will be once the incremental sweep under
+   way reaches it. it has found everything unmarked below its cursor 
+   dead, and those may refer to slots it has already freed */
+bool MemoryManager::snapshotFree(size_t i) const
+{
+  const ObjectStruct& o = objectTable[i];
+  return (o.flags & kFreeSlot) || 
+    (gcPhase == kSweeping && i > 0 && i <= sweepCursor && !(o.flags & kMarked));
+}
+
+/* write the heap as it is, garbage and all, to fd. this is for a forked
+   child, so it allocates nothing and writes with system calls alone,
+   walking the table once to size the image and again to write it */
+bool MemoryManager::imageWriteSnapshot(int fd)
+{
+  static const object zeros[16] = { 0 };
+  size_t count = objectTable.size();
+  while (count > 1 && snapshotFree(count - 1))
+    --count;
+
+  TImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kImageMagic, sizeof(kImageMagic));
+  header.version = kImageVersion;
+  header.wordSize = sizeof(object);
+  header.objectCount = count;
+  header.symbols = symbols;
+  size_t tableEnd = sizeof(header) + count * sizeof(TImageEntry);
+  header.bodiesOffset = (tableEnd + kImageAlignment - 1) / kImageAlignment * kImageAlignment;
+  TImageEntry entries[256];
+  for (size_t i = 0; i < count; ++i)
+    fillImageEntry(objectTable[i], objectTable[i].objectClass(), snapshotFree(i), entries[0], header.bodiesWords);
+  if (!writeAll(fd, &header, sizeof(header)))
+    return false;
+
+  uint64_t bodiesWords = 0;
+  for (size_t i = 0; i < count; )
+  {
+    size_t n = 0;
+    for (; n < sizeof(entries) / sizeof(entries[0]) && i < count; ++n, ++i)
+      fillImageEntry(objectTable[i], objectTable[i].objectClass(), snapshotFree(i), entries[n], bodiesWords);
+    if (!writeAll(fd, entries, n * sizeof(TImageEntry)))
+      return false;
+  }
+  for (size_t padding = header.bodiesOffset - tableEnd; padding > 0; )
+  {
+    size_t n = std::min(padding, sizeof(zeros));
+    if (!writeAll(fd, zeros, n))
+      return false;
+    padding -= n;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    ObjectStruct& o = objectTable[i];
+    if (snapshotFree(i) || o.words() == 0)
+      continue;
+    if ((size_t)o.size() >= ObjectStruct::kSizeInBody && !writeAll(fd, o.memory - 1, sizeof(object)))
+      return false;
+    if (!writeAll(fd, o.memory, sizeof(object) * o.words()))
+      return false;
+  }
+  return true;
+}
+
+/* nothing is collected or laid out before forking, the process stops
+   only for the fork. other VM threads may hold the malloc or stdio 
+   locks as the child is made, so it writes the image and renames the
+   file with system calls alone */
+bool MemoryManager::startSnapshot(const char* path)
+{
+#if defined(WIN32)
+  return false;
+#else
+  if (snapshotProcess != 0)
+    return false;
+  std::string temporary;
+  int fd = createTemporary(path, temporary);
+  if (fd < 0)
+    return false;
+  const char* temporaryPath = temporary.c_str();
+  pid_t child = fork();
+  if (child == 0)
+  {
+    bool saved = imageWriteSnapshot(fd);
+    saved = saved && fsync(fd) == 0;
+    saved = (close(fd) == 0) && saved;
+    saved = saved && rename(temporaryPath, path) == 0;
+    if (!saved)
+      unlink(temporaryPath);
+    _exit(saved? 0 : 1);
+  }
+  close(fd);
+  if (child < 0)
+  {
+    remove(temporaryPath);
+    return false;
+  }
+  snapshotProcess = child;
+  return true;
+#endif
+}
+
+TSnapshotStatus MemoryManager::snapshotStatus()
+{
+#if !defined(WIN32)
+  if (snapshotProcess != 0)
+  {
+    int status = 0;
+    pid_t done = waitpid(static_cast<pid_t>(snapshotProcess), &status, WNOHANG);
+    if (done == 0)
+      return kSnapshotRunning;
+    snapshotProcess = 0;
+    return (done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)? kSnapshotSaved : kSnapshotFailed;
   }
+#endif
+  return kNoSnapshot;
 }
 
 void MemoryManager::disableGC(bool disable)
@@ -470,29 +2887,62 @@ void MemoryManager::disableGC(bool disable)
 
 size_t MemoryManager::growObjectStore(size_t amount)
 {
+    clock_t start = clock();
     // Empty object to use when resizing.
-    ObjectStruct empty = {nilobj, 0, 0, NULL};
+    ObjectStruct empty;
+    memset(&empty, 0, sizeof(empty));
 
     size_t currentSize = objectTable.size();
+    if(amount > ObjectStruct::maxObjects - currentSize)
+        sysError("too many objects","growObjectStore");
     objectTable.resize(objectTable.size()+amount, empty);
+    markBits.resize(objectTable.size());
 
     if(debugging)
         fprintf(stderr, "Growing object store to %d\n", static_cast<int>(objectTable.size()));
 
-    // Add all new objects to the free list.
-    for(size_t i = currentSize; i < objectTable.size(); ++i)
-    {
-       objectFreeList.insert(std::pair<size_t, object>(0, i));
-       objectFreeListInv.insert(std::pair<object, size_t>(i, 0));
-    } 
+    // Add all new objects to the free list, lowest index at the head.
+    for(size_t i = objectTable.size(); i > currentSize; --i)
+        pushFreeSlot(i - 1);
+    ++stats.growths;
+    stats.growSeconds += (double)(clock() - start) / CLOCKS_PER_SEC;
     return objectTable.size();
 }
 
+/* the fixed grow count, unless most of the table survived the last 
+   collection, when growing by a little would soon just mean collecting 
+   again for little gain */
+size_t MemoryManager::nextGrowth() const
+{
+    if(liveRatio < heapGrowth.survivalThreshold || heapGrowth.growthFactor <= 1.0)
+        return growAmount;
+    size_t geometric = static_cast<size_t>(objectTable.size() * (heapGrowth.growthFactor - 1.0));
+    return std::max(growAmount, geometric);
+}
+
+/* record how well a collection did, for deciding how to meet the next
+   shortage */
+void MemoryManager::noteCollection(size_t freed, size_t examined)
+{
+    reclaimRatio = examined? static_cast<double>(freed) / examined : 0.0;
+    liveRatio = static_cast<double>(objectTable.size() - freeSlots) / objectTable.size();
+}
+
 void MemoryManager::setGrowAmount(size_t amount)
 {
     growAmount = amount;
 }
 
+void MemoryManager::setHeapGrowth(const THeapGrowth& growth)
+{
+    heapGrowth = growth;
+}
+
+void MemoryManager::setNurserySize(size_t size)
+{
+    nurserySize = size;
+}
+
 
 
 
@@ -501,7 +2951,7 @@ int ObjectStruct::byteAt(int i)
     byte* bp;
     unsigned char t;
 
-    if((i <= 0) || (i > 2 * - size))
+    if((i <= 0) || (i > size()))
         sysError("index out of range", "byteAt");
     else
     {
@@ -515,7 +2965,7 @@ int ObjectStruct::byteAt(int i)
 void ObjectStruct::byteAtPut(int i, int x)
 {
     byte *bp;
-    if ((i <= 0) || (i > 2 * - size)) 
+    if ((i <= 0) || (i > size())) 
     {
         sysError("index out of range", "byteAtPut");
     }
@@ -523,12 +2973,13 @@ void ObjectStruct::byteAtPut(int i, int x)
     {
         bp = bytePtr();
         bp[i-1] = x;
+        flags |= kDirty;
     }
 }
 
 object ObjectStruct::basicAt(int i)
 {
-    if(( i <= 0) || (i > size))
+    if(( i <= 0) || (i > slotCount()))
     {
         fprintf(stderr, "Indexing: %d\n", i);
         sysError("index out of range", "basicAt");
@@ -569,49 +3020,88 @@ void* ObjectStruct::cPointerValue()
     return l;
 }
 
-int ObjectHandle::numTotalHandles()
+/* the root stack is reserved once, as a range of addresses far larger
+   than it will ever need, so that handles can point straight at their
+   slots, and it is committed a step at a time as it grows */
+static const size_t rootStackReserve = (sizeof(void*) == 8)? (size_t)1 << 30 : (size_t)1 << 24;
+static const size_t rootStackStep = 1 << 20;
+
+static long* reserveRoots()
 {
-    if(NULL == ObjectHandle::head)
-        return 0;
-    else
+#if defined(WIN32)
+    return static_cast<long*>(VirtualAlloc(NULL, rootStackReserve * sizeof(long),
+            MEM_RESERVE, PAGE_NOACCESS));
+#else
+    void* roots = mmap(NULL, rootStackReserve * sizeof(long), PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (roots == MAP_FAILED)? NULL : static_cast<long*>(roots);
+#endif
+}
+
+static bool commitRoots(long* slots, size_t count)
+{
+#if defined(WIN32)
+    return NULL != VirtualAlloc(slots, count * sizeof(long), MEM_COMMIT, PAGE_READWRITE);
+#else
+    return 0 == mprotect(slots, count * sizeof(long), PROT_READ | PROT_WRITE);
+#endif
+}
+
+/* unmaps a thread's root stack as the thread exits, or if thread local
+   handles made before the stack are still to be destroyed, once the 
+   last of them has been */
+struct ObjectHandle::RootStackOwner
+{
+    ~RootStackOwner()
     {
-        int total = 1;
-        ObjectHandle* head = ObjectHandle::head;
-        while(head->m_next)
-        {
-            ++total;
-            head = head->m_next;
-        }
-        return total;
+        if(m_rootTop == m_roots)
+            releaseRoots();
+        else
+            m_rootsOrphaned = true;
     }
+};
+
+void ObjectHandle::releaseRoots()
+{
+#if defined(WIN32)
+    VirtualFree(m_roots, 0, MEM_RELEASE);
+#else
+    munmap(m_roots, rootStackReserve * sizeof(long));
+#endif
+    m_roots = m_rootTop = m_rootLimit = NULL;
+    m_rootsOrphaned = false;
 }
 
-bool ObjectHandle::isReferenced(long handle)
+void ObjectHandle::growRoots()
 {
-    if(NULL == ObjectHandle::head)
-        return false;
-    else
+    static thread_local RootStackOwner owner;
+
+    if(NULL == m_roots)
     {
-        ObjectHandle* head = ObjectHandle::head;
-        while(head->m_next)
-        {
-			if(head->m_handle == handle)
-				return true;
-            head = head->m_next;
-        }
-		if(head->m_handle == handle)
-			return true;
-        return false;
+        m_roots = m_rootTop = m_rootLimit = reserveRoots();
+        if(NULL == m_roots)
+            sysError("out of memory","growRoots");
     }
+    if(m_rootLimit == m_roots + rootStackReserve)
+        sysError("too many object handles","growRoots");
+    if(!commitRoots(m_rootLimit, rootStackStep))
+        sysError("out of memory","growRoots");
+    m_rootLimit += rootStackStep;
 }
 
-
-ObjectHandle* ObjectHandle::getListHead()
+int ObjectHandle::numTotalHandles()
 {
-    return ObjectHandle::head;
+    int total = 0;
+    for(const long* slot = m_roots; slot != m_rootTop; ++slot)
+        if(*slot != vacantSlot)
+            ++total;
+    return total;
 }
 
-ObjectHandle* ObjectHandle::getListTail()
+bool ObjectHandle::isReferenced(long handle)
 {
-    return ObjectHandle::tail;
+    for(const long* slot = m_roots; slot != m_rootTop; ++slot)
+        if(*slot == handle)
+            return true;
+    return false;
 }
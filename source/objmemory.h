@@ -6,6 +6,9 @@
 #ifndef MEMORY_H_INCLUDED
 #define MEMORY_H_INCLUDED
 
+#include <assert.h>
+#include <string.h>
+
 #include "env.h"
 
 #if defined TW_UNIT_TESTS
@@ -22,6 +25,20 @@ struct ObjectStruct;
  * The handle automatically records the reference on creation, and 
  * releases it when destroyed, so it just needs to be properly 
  * scoped
+ *
+ * Each handle is a one slot frame on the root stack, a contiguous
+ * array that the collector scans linearly. Creating a handle pushes a
+ * slot, destroying it pops the slot. Handles nearly always die in the
+ * reverse order to their creation. One that is destroyed out of order,
+ * in a container or on the heap, leaves its slot vacant, to be popped
+ * with the handle above it. Moving a handle hands its slot over rather
+ * than pushing another, so a std::vector of handles that reallocates
+ * leaves no vacant slots behind. Each thread has a root stack of its own,
+ * as each runs its own VM, and global handles are thread local, taking
+ * their slots the first time the thread uses them.
+ * The stack's addresses are reserved once, with room for far more
+ * handles than are ever live, and committed as it grows, so it never
+ * moves and a handle can hold a pointer to its slot.
  */
 class ObjectHandle
 {
@@ -42,6 +59,13 @@ class ObjectHandle
          * \param from The ObjectHandle to duplicate.
          */
         ObjectHandle(const ObjectHandle& from);
+        //! Move constructor
+        /*! Takes over the slot of the handle moved from, which may then
+         *  only be assigned to or destroyed.
+         *
+         * \param from The ObjectHandle to take the slot of.
+         */
+        ObjectHandle(ObjectHandle&& from) noexcept;
         ObjectHandle(long object);
         //! Constructor
         /*! Takes an object ID and manager to reference against, 
@@ -73,10 +97,10 @@ class ObjectHandle
          */
         long handle() const
         {
-            return m_handle;
+            return *m_slot;
         }
 
-        int hash() const;
+        long hash() const;
 
         //! Assignement operator
         /*!
@@ -91,49 +115,207 @@ class ObjectHandle
 
         ObjectHandle& operator=(const ObjectHandle& from);
 
-        ObjectHandle* next() const;
-        ObjectHandle* prev() const;
-
     static int numTotalHandles();
     static bool isReferenced(long handle);
-    static ObjectHandle* getListHead();
-    static ObjectHandle* getListTail();
 
-    private:
-        long    m_handle;
-        ObjectHandle* m_next;
-        ObjectHandle* m_prev;
+    /*! The root stack, the slots below rootTop() hold the objects 
+     *  referenced by all live handles, and vacantSlot for those that
+     *  have been destroyed but not yet popped.
+     */
+    static const long* rootSlots();
+    static size_t rootTop();
 
-    static  ObjectHandle* head;
-    static  ObjectHandle* tail;      
+    //! Marks a slot no longer owned by a handle, never a valid object.
+    static const long vacantSlot = -2;
 
-    void removeFromList();
-    void appendToList();
+    private:
+        long*   m_slot;
+
+    static TW_THREAD long*  m_roots;
+    static TW_THREAD long*  m_rootTop;
+    static TW_THREAD long*  m_rootLimit;
+    static TW_THREAD bool   m_rootsOrphaned;
+
+    struct RootStackOwner;
+    static void growRoots();
+    static void releaseRoots();
+    void pushSlot(long object);
+    void popSlot();
 };
 
 
 typedef long object;
 
-inline int hashObject(object o)
+/* An object ID either refers to an entry in the object table, or is
+   itself the value, an immediate, which one is told by the low bits.
+
+       ...xxx1  SmallInteger, the value shifted up one
+       ...xx00  reference, the index into the object table shifted up two
+       ...x010  Character, the code point shifted up three
+       ...x110  Float, a double packed into the top 61 bits
+
+   Immediates have no entry in the table, so nothing to collect, and 
+   they are compared, as well as hashed, by value. */
+enum ImmediateTags
+{
+    kTagMask = 7,
+    kCharacterTag = 2,
+    kFloatTag = 6,
+};
+
+inline bool isImmediate(object o)
+{
+    return (o & 3) != 0;
+}
+
+inline bool isSmallInteger(object o)
+{
+    return (o & 1) != 0;
+}
+
+inline bool isCharacter(object o)
+{
+    return (o & kTagMask) == kCharacterTag;
+}
+
+inline bool isSmallFloat(object o)
+{
+    return (o & kTagMask) == kFloatTag;
+}
+
+//! The object table index of a reference.
+inline size_t objectIndex(object o)
 {
-    return o;
+    return static_cast<unsigned long>(o) >> 2;
+}
+
+//! The reference to an object table index.
+inline object objectID(size_t index)
+{
+    return static_cast<object>(index << 2);
+}
+
+/* A SmallInteger is the rest of the word above its tag bit, so on
+   64 bit builds it runs from -2^62 to 2^62-1. */
+static const long kSmallIntegerMax = LONG_MAX >> 1;
+static const long kSmallIntegerMin = LONG_MIN >> 1;
+
+inline bool fitsSmallInteger(long value)
+{
+    return value >= kSmallIntegerMin && value <= kSmallIntegerMax;
+}
+
+/* a reference hashes as its index shifted up one, which it was itself
+   before immediates, so hashed collections in older images still work */
+inline long hashObject(object o)
+{
+    return static_cast<long>((static_cast<unsigned long>(o) >> 1) & kSmallIntegerMax);
+}
+
+inline object immediateChar(int value)
+{
+    return (static_cast<object>(value) << 3) | kCharacterTag;
+}
+
+inline int immediateCharValue(object o)
+{
+    return static_cast<int>(o >> 3);
+}
+
+/* Only doubles whose exponent is within 2^-127 to 2^128 of one, and
+   zero, have an immediate form, which needs 64 bit IDs. The encoding
+   rotates the sign to the bottom, so the exponent is at the top, and
+   rebases the exponent so its top three bits are clear. */
+static const unsigned long long kFloatExponentBias = 896ULL << 53;
+
+inline bool fitsImmediateFloat(double d)
+{
+    unsigned long long bits;
+    memcpy(&bits, &d, sizeof(bits));
+    unsigned int exponent = (bits >> 52) & 0x7ff;
+    return sizeof(object) >= sizeof(bits) && 
+        ((exponent > 896 && exponent < 1152) || (bits << 1) == 0);
+}
+
+inline object immediateFloat(double d)
+{
+    unsigned long long bits;
+    memcpy(&bits, &d, sizeof(bits));
+    bits = (bits << 1) | (bits >> 63);
+    if (bits > 1)
+        bits -= kFloatExponentBias;
+    return static_cast<object>((bits << 3) | kFloatTag);
+}
+
+inline double immediateFloatValue(object o)
+{
+    unsigned long long bits = static_cast<unsigned long long>(o) >> 3;
+    if (bits > 1)
+        bits += kFloatExponentBias;
+    bits = (bits >> 1) | (bits << 63);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
 }
 
 
 /*! \brief Object structure
  *
  * The default structure that represents all objects int he system.
+ *
+ * The header is kept to two words, the data area pointer, and the class
+ * ID packed with the size and flags. The marks of full and minor
+ * collections are not part of the header, the memory manager keeps 
+ * them in a side bitmap indexed by object ID. Use the accessors rather
+ * than the fields.
  */
 struct ObjectStruct 
 {
-    //! ID of the object that defines the class of this object.
-    object _class;
-    //! A reference counter, used only during mark/sweep GC.
-    long referenceCount;
-    //! The size of the data area, in object ID's
-    long size;
     //! A pointer to the data area of the object.
-    object*memory;
+    object* memory;
+    //! ID of the object that defines the class of this object.
+    /*! While the slot is on a free list this holds the index of the
+     *  next free slot in the same size class instead. Only 32 bits, to
+     *  keep the header to two words, which is what limits the object
+     *  table to maxObjects.
+     */
+    unsigned int m_class;
+    //! Status and format bits, see ObjectFlags.
+    unsigned int flags : 8;
+    //! The number of elements in the data area, bytes if kBytes is set
+    //! otherwise object ID's, or kSizeInBody.
+    unsigned int m_size : 24;
+
+    //! The size of an object too big for m_size, which is kept in the
+    //! word before its data area instead, see TObjectArena.
+    static const size_t kSizeInBody = (1 << 24) - 1;
+    //! The largest size an object can have, as much as an image can hold.
+    static const size_t maxSize = 0xFFFFFFFFUL;
+    //! The most objects the table can hold, so that every ID fits in m_class.
+    static const size_t maxObjects = (0xFFFFFFFFUL >> 2) + 1;
+
+    //! Class getter, the ID of the class object.
+    object objectClass() const;
+    //! Class setter, marks the object changed.
+    /*! The ID must fit in m_class, as any ID or index in a table of no
+     *  more than maxObjects does.
+     */
+    void setClass(object c);
+
+    //! True if the data area holds bytes rather than object ID's.
+    bool isBytes() const;
+    //! The number of bytes or object ID's in the data area.
+    long size() const;
+    //! The number of object ID's in the data area, none for byte objects.
+    long slotCount() const;
+    //! The length of the data area, in object ID's.
+    size_t words() const;
+    //! Set the size, and mark the data area as holding object ID's.
+    void setPointerSize(size_t count);
+    //! Set the size, and mark the data area as holding bytes.
+    void setByteSize(size_t count);
+    //! The length of the data area of an object of the given size.
+    static size_t wordsFor(size_t count, bool bytes);
 
     //! Data pointer getter
     object* sysMemPtr();
@@ -199,13 +381,39 @@ struct ObjectStruct
 
 };
 
+/*! \brief Bits held in ObjectStruct::flags. */
+enum ObjectFlags
+{
+    //! The slot is unused and linked into one of the free lists.
+    kFreeSlot = 0x01,
+    //! The object has survived a collection, and is in the old generation.
+    kOld = 0x02,
+    //! The object is old, and is in the remembered set.
+    kRemembered = 0x04,
+    //! The object has been reached in the current incremental collection.
+    kMarked = 0x08,
+    //! The data area holds bytes, not object ID's.
+    kBytes = 0x10,
+    //! The slots don't keep their contents alive, and are set to nil
+    //! once their contents are collected.
+    kWeak = 0x20,
+    //! The first slot, the key, is held weakly, and the second, the 
+    //! value, only kept alive while the key is. Both are set to nil once
+    //! the key is collected. Any further slots are ordinary.
+    kEphemeron = 0x40,
+    //! Made, changed, or freed since the image was last saved or read,
+    //! see MemoryManager::imageWriteDelta().
+    kDirty = 0x80,
+};
+
 # define nilobj (object) 0
 # define mBlockAlloc(size) (object *) calloc((unsigned) size, sizeof(object))
 
 /*
-    the dictionary symbols is the source of all symbols in the system
+    the dictionary symbols is the source of all symbols in the system,
+    one per thread, as is all interpreter state
 */
-extern object symbols;
+extern TW_THREAD object symbols;
 
 /*
     finally some external declarations with prototypes
@@ -217,47 +425,484 @@ extern bool debugging;
 void givepause();
 
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <vector>
 #include <string>
+#include <time.h>
+
+/*! \brief Storage for the object table.
+ *
+ * The table grows by adding fixed size segments rather than by 
+ * reallocating, so an ObjectStruct never moves once created. References 
+ * to table entries therefore stay valid across an allocation that grows
+ * the table, and the remembered set can hold plain pointers.
+ */
+class TObjectTable
+{
+    public:
+        static const size_t segmentShift = 12;
+        static const size_t segmentSize = 1 << segmentShift;
+
+        TObjectTable() : m_size(0) {}
+        ~TObjectTable();
+
+        ObjectStruct& operator[](size_t index)
+        {
+            return m_segments[index >> segmentShift][index & (segmentSize - 1)];
+        }
+
+        const ObjectStruct& operator[](size_t index) const
+        {
+            return m_segments[index >> segmentShift][index & (segmentSize - 1)];
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        /*! Grow the table, new entries are copies of value.
+         *
+         * \param size The new size, the table never shrinks.
+         * \param value The initial value of the new entries.
+         */
+        void resize(size_t size, const ObjectStruct& value);
+
+    private:
+        TObjectTable(const TObjectTable&);
+        TObjectTable& operator=(const TObjectTable&);
+
+        std::vector<ObjectStruct*> m_segments;
+        size_t m_size;
+};
+
+/*! \brief One mark bit for each entry in the object table.
+ *
+ * Full and minor collections mark here rather than in the object 
+ * header, so clearing every mark is a short memset and marking touches
+ * one bit instead of an object's header.
+ */
+class TMarkBitmap
+{
+    public:
+        //! Make room for size entries, new bits are clear.
+        void resize(size_t size)
+        {
+            m_words.resize((size + 63) / 64, 0);
+        }
+
+        void clear()
+        {
+            std::fill(m_words.begin(), m_words.end(), 0ULL);
+        }
+
+        bool test(size_t index) const
+        {
+            return (m_words[index >> 6] >> (index & 63)) & 1;
+        }
+
+        //! Set a bit, returning true if it was clear before.
+        bool mark(size_t index)
+        {
+            unsigned long long bit = 1ULL << (index & 63);
+            unsigned long long& word = m_words[index >> 6];
+            if(word & bit)
+                return false;
+            word |= bit;
+            return true;
+        }
+
+        //! As mark, but safe while other threads mark the same words.
+        bool markShared(size_t index);
+
+        void unmark(size_t index)
+        {
+            m_words[index >> 6] &= ~(1ULL << (index & 63));
+        }
+
+    private:
+        std::vector<unsigned long long> m_words;
+};
+
+/*! \brief A data area held in the arena, and the pointer that owns it. */
+struct TArenaBody
+{
+    object** owner;
+    size_t words;
+};
+
+typedef std::vector<TArenaBody> TArenaBodies;
+
+/*! \brief Storage for object data areas.
+ *
+ * Small data areas are carved out of large chunks by bump allocation,
+ * so objects allocated together sit together in memory. A released data
+ * area is cleared and kept on a free list for its exact size, ready to
+ * be handed out again. Data areas of largeSize words or more are
+ * allocated individually, and those of mappedSize words or more, big
+ * Arrays and buffers, are mapped from the OS for themselves alone, so
+ * that releasing one gives all its pages straight back. Each large one
+ * has a word before it, to hold the size of an object too big for its
+ * header.
+ *
+ * All data areas handed out are zero filled.
+ *
+ * Released data areas and the unused ends of chunks fragment the arena
+ * over time, compact() slides the data areas still in use down to the
+ * start of the arena, and gives the chunks left empty back to the OS.
+ *
+ * The data areas of an image are used where they were read or mapped,
+ * see adoptImage(). They are never moved by compaction, and large ones
+ * are simply dropped when released.
+ */
+class TObjectArena
+{
+    public:
+        static const size_t chunkSize = 32768;
+        static const size_t largeSize = 64;
+        static const size_t mappedSize = 1024;
+
+        TObjectArena();
+        ~TObjectArena();
+
+        /*! Get a cleared data area.
+         *
+         * \param words The size of the data area, in object ID's.
+         * \return The data area, NULL for a size of zero.
+         */
+        object* allocate(size_t words);
+
+        /*! Give a data area back for reuse.
+         *
+         * \param memory The data area, as returned from allocate.
+         * \param words The size it was allocated with.
+         */
+        void release(object* memory, size_t words);
+
+        /*! Slide data areas together, and free the chunks left empty.
+         *
+         * Every data area not in the list is dropped, including all those
+         * on the free lists. Each owner is updated to point at the new
+         * location of its data area.
+         *
+         * \param bodies The data areas in use, reordered by the call.
+         * \return The number of words moved.
+         */
+        size_t compact(TArenaBodies& bodies);
+
+        //! Number of chunks allocated.
+        size_t chunkCount() const;
+
+        //! Number of words in all chunks.
+        size_t capacity() const;
+
+        //! Number of released small data areas waiting for reuse.
+        size_t freeCount() const;
+
+        //! Number of data areas mapped individually.
+        size_t mappedCount() const;
+
+        //! Number of words in all individually mapped data areas.
+        size_t mappedWords() const;
+
+        /*! Take on the data areas of an image.
+         *
+         * The block is kept until the arena is destroyed.
+         *
+         * \param base The data areas, one after another.
+         * \param words The length of the block.
+         * \param mapped True if the block was mapped from the image 
+         *          file, false if it came from malloc.
+         * \param device The device of the file mapped from.
+         * \param inode The file's inode.
+         */
+        void adoptImage(object* base, size_t words, bool mapped,
+                unsigned long long device = 0, unsigned long long inode = 0);
+
+        /*! Copy the blocks mapped from a file into memory of their own.
+         *
+         * The mappings are private, but a page not yet written to is
+         * still read from the file, and once the file is truncated every
+         * page past its end is gone. The blocks stay where they are, so
+         * nothing pointing into them changes.
+         *
+         * \param device The device of the file.
+         * \param inode The file's inode.
+         * \return false if there wasn't the memory to copy them.
+         */
+        bool copyImage(unsigned long long device, unsigned long long inode);
+
+        //! True if the data area is in a block taken on by adoptImage().
+        bool inImage(const object* memory) const;
+
+    private:
+        struct TImageBlock
+        {
+            object* base;
+            size_t words;
+            bool mapped;
+            //! The file still read from, 0 once copied or if not mapped.
+            unsigned long long device;
+            unsigned long long inode;
+        };
+
+        TObjectArena(const TObjectArena&);
+        TObjectArena& operator=(const TObjectArena&);
+
+        object* newChunk(size_t words);
+        object* allocateLarge(size_t words);
+
+        std::vector<object*> m_chunks;
+        std::vector<object*> m_free[largeSize];
+        size_t m_freeCount;
+        size_t m_mappedCount;
+        size_t m_mappedWords;
+        object* m_top;
+        object* m_limit;
+        std::vector<TImageBlock> m_images;
+};
+
+inline object* TObjectArena::allocate(size_t words)
+{
+    if(words == 0)
+        return NULL;
+    if(words >= largeSize)
+        return allocateLarge(words);
+    if(!m_free[words].empty())
+    {
+        object* memory = m_free[words].back();
+        m_free[words].pop_back();
+        --m_freeCount;
+        return memory;
+    }
+    if(static_cast<size_t>(m_limit - m_top) < words)
+        return newChunk(words);
+    object* memory = m_top;
+    m_top += words;
+    return memory;
+}
+
+inline bool TObjectArena::inImage(const object* memory) const
+{
+    for(size_t i = 0; i < m_images.size(); ++i)
+        if(memory >= m_images[i].base && memory < m_images[i].base + m_images[i].words)
+            return true;
+    return false;
+}
+
+inline size_t TObjectArena::chunkCount() const
+{
+    return m_chunks.size();
+}
+
+inline size_t TObjectArena::capacity() const
+{
+    return m_chunks.size() * chunkSize;
+}
+
+inline size_t TObjectArena::freeCount() const
+{
+    return m_freeCount;
+}
+
+inline size_t TObjectArena::mappedCount() const
+{
+    return m_mappedCount;
+}
+
+inline size_t TObjectArena::mappedWords() const
+{
+    return m_mappedWords;
+}
 
-typedef std::vector<ObjectStruct>     TObjectTable;
-typedef TObjectTable::iterator  TObjectTableIterator;
-typedef std::multimap<size_t, object>    TObjectFreeList;
-typedef std::map<object, size_t>    TObjectFreeListInv;
 typedef std::map<object, long>    TObjectRefs;
-typedef TObjectFreeList::iterator   TObjectFreeListIterator;
-typedef TObjectFreeListInv::iterator   TObjectFreeListInvIterator;
-typedef TObjectFreeList::reverse_iterator   TObjectFreeListRevIterator;
+typedef std::vector<object>     TObjectList;
+typedef std::vector<ObjectStruct*>  TRememberedSet;
+typedef std::vector<ObjectStruct*>  TMarkStack;
+
+//! An object registered for finalization, and what to notify once it dies.
+struct TFinalizer
+{
+    object target;
+    object executor;
+};
+typedef std::vector<TFinalizer>   TFinalizerList;
+//! Executors waiting to be run, taken from the front.
+typedef std::deque<object>        TFinalizationQueue;
+
+//! When and by how much the object table grows once the free lists run dry.
+struct THeapGrowth
+{
+    THeapGrowth() : growthFactor(1.5), survivalThreshold(0.5), minReclaimRatio(0.05) {}
+
+    //! The table is grown to this multiple of its size while survival is high.
+    double growthFactor;
+    //! Fraction of the table live after a collection, above which growth is geometric.
+    double survivalThreshold;
+    //! Fraction of the objects it examined that a collection must free, for
+    //! the next shortage to be worth collecting for, rather than growing at once.
+    double minReclaimRatio;
+};
+
+//! Counters kept by the collector and allocator, see MemoryManager::gcStats().
+struct TGCStats
+{
+    //! Bucket n of the pause histogram counts pauses under 2^n microseconds, the last any longer.
+    static const size_t kPauseBuckets = 24;
+
+    TGCStats() { memset(this, 0, sizeof(*this)); }
+
+    size_t minorCollections;
+    size_t fullCollections;
+    size_t incrementalCycles;
+    size_t compactions;
+    //! Times the object table has grown, and the time spent growing it.
+    size_t growths;
+    double growSeconds;
+    //! Every collection, incremental step and compaction is one pause.
+    size_t pauses;
+    double totalPauseSeconds;
+    double maxPauseSeconds;
+    double lastPauseSeconds;
+    size_t pauseHistogram[kPauseBuckets];
+    //! Allocated since the last minor, full or incremental collection finished.
+    size_t objectsAllocated;
+    size_t wordsAllocated;
+    size_t totalObjectsAllocated;
+    //! Objects freed by the last collection, and by all of them.
+    size_t lastFreed;
+    size_t totalFreed;
+};
+
+/*! Called for each sampled allocation, see MemoryManager::setAllocationSampler().
+ *
+ * \param allocated The new object, its class not yet set.
+ * \param bytes The bytes allocated since the last sample, which this one stands for.
+ */
+typedef void (*TAllocationSampler)(object allocated, size_t bytes);
+
+//! How a snapshot started by MemoryManager::startSnapshot() is going.
+enum TSnapshotStatus
+{
+    kNoSnapshot,
+    kSnapshotRunning,
+    kSnapshotSaved,
+    kSnapshotFailed
+};
+
+struct TImageLayout;
+
+//! The image file last saved or read, see MemoryManager::imageWriteDelta().
+struct TSavedImage
+{
+    //! Which file it is, and its length then, zero if there isn't one.
+    unsigned long long device;
+    unsigned long long inode;
+    long long length;
+    //! Entries in the object table of the image.
+    size_t objectCount;
+};
+
+//! The instances of one class found by MemoryManager::heapCensus().
+struct TClassCensus
+{
+    object classObject;
+    size_t instances;
+    //! Shallow size of the instances, table entries and data areas.
+    size_t bytes;
+    /*! Bytes only reachable through the instances.
+     *
+     * The sum of the retained sizes of the instances, leaving out any
+     * instance retained by another, so nothing is counted twice.
+     */
+    size_t retainedBytes;
+};
 
 /*! \brief The memory manager
  *
  * The class that manages all objects in the system.
  * Objects are allocated into an array, the memory pointer then
- * directs to a malloced area.
+ * directs to a data area from the arena.
+ *
+ * Free slots are kept on singly linked chains threaded through the
+ * object table, one chain per exact size, up to m_sizeClassCount words.
+ * A free slot keeps its cleared data area, so reusing a slot of the
+ * right size is a simple pop. Larger objects release their data area
+ * when they die, and are kept as size zero slots.
+ *
+ * Collection is generational. New objects are young, and are recorded
+ * in the nursery list. A minor collection marks from the roots and the
+ * remembered set, only tracing through young objects, then sweeps just
+ * the nursery. Survivors are promoted to the old generation, so after
+ * any collection there are no young objects left. Old objects that have
+ * a young object stored into them are added to the remembered set by
+ * the write barrier.
+ *
+ * The old generation is collected incrementally. Once enough objects
+ * have been promoted, a cycle is started, and a bounded amount of 
+ * marking is done at the end of each interpreter time slice, followed
+ * by a bounded amount of sweeping. Marking is tri-colour, using the 
+ * kMarked flag and a grey stack, and the write barrier shades anything
+ * stored while marking is in progress, so that no marked object ever 
+ * refers to an unmarked one. Objects allocated during a cycle are 
+ * allocated marked. A full garbageCollect() abandons any cycle in 
+ * progress.
+ *
+ * Objects can be made weak or ephemerons, see ObjectFlags. Every 
+ * collector leaves their weak slots untraced, and once it has marked 
+ * all else, traces the values of those ephemerons whose keys were 
+ * reached, until no more are, then sets the slots holding dead 
+ * objects to nil before sweeping. At the same point, the executors of
+ * dead objects registered with addFinalizer() are queued, to be run 
+ * later by a Smalltalk process, not by the collector.
+ *
+ * When the free lists run dry, a collection is tried first, unless the
+ * last one freed too little to be worth repeating. The table then grows
+ * by the grow count, or geometrically while most of it survives 
+ * collection, see THeapGrowth.
+ *
+ * A full garbageCollect() can be run on several worker threads, see 
+ * setGCWorkers(). Marking is then shared out through work stealing 
+ * deques, and the sweep is split into ranges of the object table, 
+ * each building its own free list fragments, merged once all are done.
  */
 class MemoryManager
 {
     static const size_t m_defaultInitialSize = 6500;
     static const size_t m_defaultGrowCount = 5000;
+    //! Number of exact size free lists, objects this size and up are large.
+    static const size_t m_sizeClassCount = 64;
+    static const size_t m_defaultNurserySize = 10000;
+    static const double m_defaultCompactionThreshold;
+    static const size_t m_defaultIncrementalBudget = 20000;
+    //! Number of recent pause times kept for the percentiles.
+    static const size_t m_pauseSampleCount = 1024;
     private:
         //! Default constructor.
-        /*! The default constructor is private as the memory manager is implemented
-         *  as a singleton, all access is via the Instance() function.
+        /*! The default constructor is private as there is one memory manager 
+         *  per thread, all access is via the Instance() function.
          */
-        MemoryManager(size_t initialSize = m_defaultInitialSize, size_t growCount = m_defaultGrowCount);
+        MemoryManager(size_t initialSize = m_defaultInitialSize, size_t growCount = m_defaultGrowCount,
+                const THeapGrowth& growth = THeapGrowth());
     public:
         //! Destructor
         ~MemoryManager();
 
-        //! Singleton accessor
+        //! Per thread accessor
         /*! 
-         * The memory manager is implemented as a singleton, all access to the
-         * functionality is via this function.
+         * Each thread has a memory manager of its own, made on first use,
+         * so that VMs on different threads share no objects. All access 
+         * to the functionality is via this function.
          */
         static MemoryManager* Instance();
 
-        static void Initialise(size_t initialSize = m_defaultInitialSize, size_t growCount = m_defaultGrowCount);
+        static void Initialise(size_t initialSize = m_defaultInitialSize, size_t growCount = m_defaultGrowCount, 
+                const THeapGrowth& growth = THeapGrowth());
+
+        //! Delete the calling thread's memory manager, if it has one.
+        static void Release();
 
         //! Transfer all unreferenced objects into the free list for reuse.
         void setFreeLists(); 
@@ -271,15 +916,167 @@ class MemoryManager
          */
         int garbageCollect();
 
+        //! Run a minor collection of the young generation.
+        /*! Only objects allocated since the last collection are considered,
+         *  they are marked from the ObjectHandle roots and the remembered
+         *  set. Survivors are promoted to the old generation.
+         *
+         *  \return The number of objects freed.
+         */
+        int minorCollect();
+
+        /*! Write barrier, called after a pointer store into an object.
+         *
+         * The target is marked changed. If it is old and the stored value 
+         * is young, it is added to the remembered set, so that the next 
+         * minor collection treats it as a root.
+         *
+         * \param target The object written to.
+         * \param value The value stored.
+         */
+        void writeBarrier(ObjectStruct* target, object value);
+        void writeBarrier(object target, object value);
+
+        /*! Write barrier for a bulk or untracked update.
+         *
+         * Used where the interpreter writes into an object directly, such as
+         * the process stack. The target is marked changed, remembered if it
+         * is old, regardless of what was stored, and is scanned again if 
+         * marking is in progress.
+         *
+         * \param target The object written to.
+         */
+        void writeBarrier(object target);
+
+        /*! Start an incremental collection of the whole heap.
+         *
+         * Does nothing if a cycle is already in progress. Cycles are also
+         * started automatically as objects are promoted.
+         */
+        void startIncrementalCycle();
+
+        /*! Do a bounded amount of incremental collection work.
+         *
+         * Called at the end of each interpreter time slice. Marks or 
+         * sweeps at most the configured budget of objects.
+         *
+         * \return True if a cycle is still in progress.
+         */
+        bool incrementalStep();
+
+        /*! Set the incremental work budget.
+         *
+         * \param budget The number of object ID's scanned, or object slots
+         *          swept, in each call to incrementalStep().
+         */
+        void setIncrementalBudget(size_t budget);
+
+        /*! Get a percentile of the recent collection pause times.
+         *
+         * Each minor, full and compacting collection, and each incremental
+         * step, counts as one pause.
+         *
+         * \param percentile The percentile wanted, from 0 to 100.
+         * \return The pause time in seconds, 0 if there have been none.
+         */
+        double pausePercentile(double percentile) const;
+
+        /*! Get the collector and allocator counters.
+         *
+         * Free list occupancy is not kept here, see freeSlotsCount().
+         *
+         * \return The counters since the memory manager was made.
+         */
+        const TGCStats& gcStats() const;
+
+        /*! Log a line of JSON to a file at the end of every collection.
+         *
+         * Each line has the kind of collection, its pause, the objects 
+         * it freed, what was allocated since the one before, the table 
+         * size and growth, and the length of each free list.
+         *
+         * \param path The file to append to, or NULL to stop logging.
+         * \return False if the file couldn't be opened.
+         */
+        bool setStatsLog(const char* path);
+
+        /*! Count the instances of each class, and the memory they use.
+         *
+         * Every object in the table is counted, including any garbage not
+         * yet collected. Retained sizes come from a dominator tree of the
+         * objects reachable from the roots garbageCollect() marks from, 
+         * with weak slots and ephemeron keys left out. An object's 
+         * retained size is the memory that would be freed if it were.
+         *
+         * \param census Replaced with one entry per class that has 
+         *          instances, in no particular order.
+         * \param retained Also work out retained sizes, which takes 
+         *          longer, and memory in proportion to the heap. Left 
+         *          as zero otherwise.
+         */
+        void heapCensus(std::vector<TClassCensus>& census, bool retained);
+
+        /*! Sample allocations.
+         *
+         * Every so many bytes allocated, counting table entries as well
+         * as data areas, the sampler is called with the object just made.
+         * The interval varies at random by up to half either way, so a 
+         * loop that allocates in a fixed pattern isn't always sampled at
+         * the same point in it.
+         *
+         * \param interval The mean number of bytes between samples.
+         * \param sampler The function to call, or NULL to stop sampling.
+         */
+        void setAllocationSampler(size_t interval, TAllocationSampler sampler);
+
         //! Mark function for the garbage collection.
         /*! When performing the mark part of mark/sweep, this function is called
-         *  for each object. It recursively calls visit on all object ID's in the 
-         *  data area for any object that has standard object data.
+         *  for each root. Everything reachable from it is marked, using an 
+         *  explicit mark stack rather than recursion, so that long chains
+         *  of objects, such as the Links of a big List, can't overflow the
+         *  C stack.
          *
          *  \param x The object to start marking from.
          */
         void visit(register object x);
 
+        /*! Slide the data areas of all objects together.
+         *
+         * Free slots give up their data areas, and the data areas of all
+         * other objects are moved down to the start of the arena. Chunks
+         * of the arena left empty are given back to the OS.
+         *
+         * This must only be called when no raw pointers into data areas
+         * are held, that is, when no TBodyLock is active.
+         */
+        void compact();
+
+        /*! Compact if the last full collection found too much fragmentation.
+         *
+         * Called at safe points, where no raw pointers into data areas 
+         * are held. Nothing is done while a TBodyLock is active.
+         */
+        void compactIfPending();
+
+        /*! Set the fragmentation that triggers compaction.
+         *
+         * \param threshold The fraction of the arena, from 0 to 1, that may
+         *          be taken up by dead or free data areas.
+         */
+        void setCompactionThreshold(double threshold);
+
+        /*! Get the deepest the mark stack has been in any collection.
+         *
+         * \return The maximum number of objects waiting to be scanned.
+         */
+        size_t maxMarkStackDepth() const;
+
+        /*! Get the time taken to mark in the last collection.
+         *
+         * \return The mark time in seconds.
+         */
+        double lastMarkSeconds() const;
+
         /*! Get the count of live, referenced objects.
          *
          * \return The number of active objects.
@@ -292,6 +1089,15 @@ class MemoryManager
          */
         size_t freeSlotsCount();
 
+        /*! Get the count of free object slots of a given size.
+         *
+         * \param size The size class to query, in object ID's.
+         * \return The number of free slots that hold a data area of that size.
+         */
+        size_t freeSlotsCount(size_t size) const;
+
+        //! The number of exact size free lists, see freeSlotsCount(size).
+        size_t sizeClassCount() const;
 
         size_t storageSize() const;
 
@@ -357,6 +1163,63 @@ class MemoryManager
          */
         object allocStr(register const char* str);
 
+        /*! Give an object more slots.
+         *
+         * The object keeps its ID, its slots are copied to a new, longer
+         * data area, and the rest set to nil. Used when a class declared
+         * ahead of its metaclass turns out to need more instance variables.
+         * Only this object's data area moves, so nothing may hold a raw
+         * pointer into it, unlike compact() it is fine under a TBodyLock.
+         *
+         * \param obj The object, which must not be a byte object.
+         * \param size The new number of slots, ignored if not larger.
+         * \return False if the object can't be grown.
+         */
+        bool growObject(object obj, size_t size);
+
+        /*! Make an object weak.
+         *
+         * Its slots no longer keep their contents alive. Should be called
+         * on a newly allocated object, before anything is stored in it.
+         *
+         * \param obj The object, which must not be a byte object.
+         * \return False if the object can't be made weak.
+         */
+        bool makeWeak(object obj);
+
+        /*! Make an object an ephemeron.
+         *
+         * The first slot is the key, the second the value, see kEphemeron.
+         * Should be called on a newly allocated object.
+         *
+         * \param obj The object, which must have at least two slots.
+         * \return False if the object can't be made an ephemeron.
+         */
+        bool makeEphemeron(object obj);
+
+        /*! Register an object for finalization.
+         *
+         * Once the target is found to be dead, the executor is queued for
+         * nextFinalizer(). The executor is held strongly until then, so
+         * it must not refer to the target, or the target never dies. It
+         * holds whatever is needed to release the target's resources, 
+         * such as a copy of a CPointer.
+         *
+         * \param target The object to watch.
+         * \param executor The object to hand back once the target dies.
+         * \return False if the target can never be collected.
+         */
+        bool addFinalizer(object target, object executor);
+
+        /*! Take the next executor of a dead object off the queue.
+         *
+         * \return The executor, or nilobj if the queue is empty.
+         */
+        object nextFinalizer();
+
+        //! Number of executors waiting on the finalization queue.
+        size_t finalizersPending() const;
+
         /*! Destroy an object.
          *
          * The given object is added to the free list in the 
@@ -384,6 +1247,11 @@ class MemoryManager
          * of the specified image file. Object memory is grown sufficiently to contain all
          * object ID's specified in the image file.
          *
+         * The data areas of an image written by imageWrite() are mapped rather than
+         * read, and copied a page at a time only as they are written to. Changes
+         * appended by imageWriteDelta() are then replayed. Images from before the
+         * current format are read an object at a time.
+         *
          * \param fp The opened file to read from.
          */
         void imageRead(FILE* fp);
@@ -392,31 +1260,294 @@ class MemoryManager
          *
          * The current memory is first garbage collected to eliminate dead objects, then
          * the whole object table is written to the specified file.
-         * The first entry is the global symbols table.
+         * A header, with the word size and object count, comes first, then the table,
+         * then the data areas, aligned so that imageRead() can map them. Changes
+         * made after this can be appended with imageWriteDelta().
+         *
+         * Renumbering writes only what can be reached from nil and the symbols,
+         * with no free entries between, in the order a depth first walk finds
+         * them. Each object comes just after the first to refer to it, a class
+         * just after its first instance, its method dictionary and methods soon
+         * after, so objects used together are stored together. The objects in
+         * memory keep their numbers, so no changes can be appended to an image
+         * written this way.
+         *
+         * Objects hash by their numbers, so hashed collections in a renumbered
+         * image have to be rehashed once it is read, see imageRenumbered().
          *
          * \param fp A file opened for write to copy the object table to.
+         * \param renumber Number the objects in the image afresh.
+         * \return false if it couldn't all be written and flushed.
+         */
+        bool imageWrite(FILE* fp, bool renumber = false);
+
+        //! True if the image last read was renumbered as it was written.
+        bool imageRenumbered() const;
+
+        /*! Get ready for a file to be written in place.
+         *
+         * The data areas of an image are mapped from the file it was read
+         * from, so truncating or writing over it would change or lose any
+         * not yet copied. If the file is that image, they are copied now.
+         * This has to be done before the file is opened for writing.
+         *
+         * \param path The file about to be written.
+         * \return false if the data areas couldn't be copied, and the file
+         *          mustn't be written.
+         */
+        bool releaseImageFile(const char* path);
+
+        /*! Write a fresh image in place of a file.
+         *
+         * As imageWrite(), to a temporary file beside it, with a name of its
+         * own, renamed over the old one once it is all on disk. The old
+         * file is never truncated, so an image
+         * can be saved over the one it was read from, whose data areas may
+         * still be mapped. Any changes appended to the old file are folded
+         * into the new one.
+         *
+         * \param path The name of the image file.
+         * \param renumber As for imageWrite().
+         * \return true if the image was saved.
+         */
+        bool imageSave(const char* path, bool renumber = false);
+
+        /*! Append the objects changed since the last save to an image.
+         *
+         * Every object made, changed or freed since the image was last
+         * saved or read is appended, and nothing else, so a checkpoint
+         * costs in proportion to how much has changed rather than to the
+         * size of the heap, apart from a pass over the object table.
+         * imageRead() replays the changes after the image they follow.
+         * Young objects are collected first, but nothing else is, so an
+         * image saved this way grows until saved with imageSave().
+         *
+         * \param fp The image file last written by imageWrite() or
+         *          imageWriteDelta(), or last read by imageRead(), opened
+         *          for update, "r+b".
+         * \return false, writing nothing, if the file isn't that image, or
+         *          has changed since, or if the changes couldn't all be
+         *          written and synced. The file is then cut back to where
+         *          it was, and the changes are kept for the next try.
          */
-        void imageWrite(FILE* fp);
+        bool imageWriteDelta(FILE* fp);
+
+        /*! Write an image in the background.
+         *
+         * A temporary file is made and the process forks, nothing more
+         * is done here. The child writes the heap as it is, garbage and 
+         * all, then renames the file to the given name once it is all on
+         * disk, so a reader never sees half an image. Objects that an
+         * incremental collection under way has found dead are left out.
+         * The child makes nothing but system calls, since other threads
+         * may have held locks as it was forked. It shares the heap with
+         * this process, each page copied only when one side writes to it,
+         * so the image is of memory as it was at the fork, whatever this
+         * process does in the meantime.
+         *
+         * Only one snapshot runs at a time. Not supported on Windows.
+         *
+         * \param path The name of the image file.
+         * \return true if the snapshot was started, false if one is already
+         *          running, or the file or the fork couldn't be made.
+         */
+        bool startSnapshot(const char* path);
+
+        /*! Check on the snapshot started last, without waiting for it.
+         *
+         * Saved or failed are answered only once, after that there is no
+         * snapshot until the next is started.
+         */
+        TSnapshotStatus snapshotStatus();
 
         void setGrowAmount(size_t amount);
 
+        /*! Set the heap growth policy.
+         *
+         * \param growth Replaces the policy given to Initialise().
+         */
+        void setHeapGrowth(const THeapGrowth& growth);
+
+        /*! Set the number of threads used by a full collection.
+         *
+         * \param workers The number of threads to mark and sweep with, 1 
+         *          collects serially on the calling thread.
+         */
+        void setGCWorkers(size_t workers);
+
+        /*! Set the nursery size.
+         *
+         * A minor collection is run when this many objects have been 
+         * allocated since the last collection, or earlier if the free lists
+         * run out.
+         *
+         * \param size The number of young objects to allow.
+         */
+        void setNurserySize(size_t size);
+
     private:
-        TObjectFreeList objectFreeList;
-        TObjectFreeListInv objectFreeListInv;
+        //! Index of the first free slot of each size, 0 when empty.
+        object          freeListHeads[m_sizeClassCount];
+        //! Length of each free list.
+        size_t          freeListCounts[m_sizeClassCount];
+        //! Bit n is set when the free list for size n is not empty.
+        unsigned long long freeListMask;
+        //! Total number of free slots across all lists.
+        size_t          freeSlots;
         TObjectTable    objectTable;
+        //! Marks of the current full or minor collection.
+        TMarkBitmap     markBits;
+        TObjectArena    arena;
+        //! Indices of the objects allocated since the last collection.
+        TObjectList     youngObjects;
+        //! Old objects that may refer to young ones.
+        TRememberedSet  rememberedSet;
+        size_t          nurserySize;
+        //! Objects marked but not yet scanned.
+        TMarkStack      markStack;
+        //! Weak objects, and ephemerons with unmarked keys, found by the current full or minor collection.
+        TMarkStack      weakObjects;
+        TMarkStack      ephemerons;
+        size_t          markDepth;
+        size_t          maxMarkDepth;
+        clock_t         markStart;
+        double          lastMarkTime;
+        double          totalMarkTime;
+        //! Fraction of the arena not used by live objects at the last full collection.
+        double          fragmentation;
+        double          compactionThreshold;
+        bool            compactionPending;
+        //! Count of active TBodyLock's, data areas can't move while non zero.
+        size_t          bodyLocks;
+        size_t          lastCompactionMoved;
+        size_t          chunksReleased;
+        enum GCPhase { kIdle, kMarking, kSweeping };
+        GCPhase         gcPhase;
+        //! Objects marked by the incremental collector but not yet scanned.
+        TMarkStack      greyStack;
+        //! Marked objects written without a barrier, to scan again at the end of marking.
+        TMarkStack      rescanSet;
+        //! As weakObjects and ephemerons, for the incremental collector.
+        TMarkStack      cycleWeakObjects;
+        TMarkStack      cycleEphemerons;
+        //! Objects registered for finalization, their executors are roots.
+        TFinalizerList  finalizers;
+        //! Executors of dead objects, waiting to be run, also roots.
+        TFinalizationQueue finalizationQueue;
+        //! Highest object index not yet swept.
+        size_t          sweepCursor;
+        size_t          sweepLiveWords;
+        size_t          incrementalBudget;
+        size_t          promotedSinceCycle;
+        //! Live objects found by the last full or incremental collection.
+        size_t          liveObjects;
+        TGCStats        stats;
+        FILE*           statsLog;
+        TAllocationSampler allocationSampler;
+        size_t          sampleInterval;
+        //! Bytes until the next sample, and since the last, the length of the current window.
+        long            sampleCountdown;
+        long            sampleWindow;
+        unsigned long   sampleSeed;
+        //! The process writing a snapshot, 0 if there isn't one.
+        long            snapshotProcess;
+        //! The image last saved or read, which changes can be appended to.
+        TSavedImage     savedImage;
+        bool            renumberedImage;
+        std::vector<double> pauseTimes;
+        size_t          pauseNext;
+        size_t          gcWorkers;
         TObjectRefs     objectReferences;
         bool            noGC;
         size_t          growAmount;
+        THeapGrowth     heapGrowth;
+        //! Fraction of the table in use after the last collection of any kind.
+        double          liveRatio;
+        //! Fraction of the objects it examined that the last collection freed.
+        double          reclaimRatio;
+        //! The table was last grown without collecting first.
+        bool            grewWithoutCollecting;
+        size_t          sweepFreed;
 
-        static MemoryManager* m_pInstance;
+        static TW_THREAD MemoryManager* m_pInstance;
 
         size_t growObjectStore(size_t amount);
+        size_t nextGrowth() const;
+        void noteCollection(size_t freed, size_t examined);
+
+        void pushFreeSlot(object index);
+        object popFreeSlot(size_t sizeClass);
+        void clearFreeLists();
+
+        void remember(ObjectStruct* p);
+        void forgetRemembered();
+        void visitYoung(object x);
+        void visitYoungChildren(ObjectStruct& p);
+        void markObject(object x);
+        void markYoungObject(object x);
+        void drainMarkStack(bool youngOnly);
+        bool survives(object x, bool youngOnly);
+        void scanWeak(ObjectStruct& p, bool youngOnly);
+        void processWeak(bool youngOnly);
+        void finishIncrementalWeak();
+        template<typename F> void forEachFinalizerRoot(F f);
+        template<typename L> void queueFinalizers(L isLive);
+        void beginMark();
+        void endMark();
+        void shade(ObjectStruct& p);
+        void shadeObject(object x);
+        bool isShaded(object x);
+        void shadeRoots();
+        size_t incrementalMark(size_t budget);
+        size_t incrementalSweep(size_t budget);
+        void recordPause(clock_t start);
+        void endCollection(const char* kind, size_t freed);
+        void logStats(const char* kind, size_t freed);
+        void measureFragmentation(size_t liveWords);
+        void parallelMark();
+        int parallelSweep(int& live, size_t& liveWords);
+        void abandonIncrementalCycle();
+        void retainedSizes(std::vector<TClassCensus>& census, const std::vector<unsigned int>& censusEntry);
+        void sampleAllocation(object allocated);
+        bool imageReadMapped(FILE* fp);
+        bool readDelta(FILE* fp, size_t& count);
+        void imageOrder(std::vector<object>& order, std::vector<object>& newID);
+        void imageLayout(TImageLayout& layout, bool renumber, bool clearDirty);
+        template<typename W> bool imageWriteLayout(const TImageLayout& layout, W write);
+        bool snapshotFree(size_t i) const;
+        bool imageWriteSnapshot(int fd);
+        bool noteSaved(FILE* fp, size_t count);
+
+        friend class TBodyLock;
 
 #if defined TW_UNIT_TESTS
         FRIEND_TEST(MemoryManagerTest, AllocateFromFree);
+        FRIEND_TEST(MemoryManagerTest, CompactReleasesChunks);
+        FRIEND_TEST(MemoryManagerTest, LargeObjectsReturnMemory);
+        FRIEND_TEST(MemoryManagerImageTest, SnapshotDuringSweep);
 #endif
 };
 
+/*! \brief Prevents data areas moving while in scope.
+ *
+ * Code that keeps raw pointers into data areas across allocations, 
+ * such as the interpreter loop, holds one of these for as long as it
+ * does so.
+ */
+class TBodyLock
+{
+    public:
+        TBodyLock()
+        {
+            ++MemoryManager::Instance()->bodyLocks;
+        }
+
+        ~TBodyLock()
+        {
+            --MemoryManager::Instance()->bodyLocks;
+        }
+};
+
 inline MemoryManager* MemoryManager::Instance()
 {
     if(NULL == m_pInstance)
@@ -425,11 +1556,129 @@ inline MemoryManager* MemoryManager::Instance()
     return m_pInstance;
 }
 
+inline size_t MemoryManager::finalizersPending() const
+{
+    return finalizationQueue.size();
+}
+
+inline bool MemoryManager::imageRenumbered() const
+{
+    return renumberedImage;
+}
+
+inline size_t MemoryManager::maxMarkStackDepth() const
+{
+    return maxMarkDepth;
+}
+
+inline double MemoryManager::lastMarkSeconds() const
+{
+    return lastMarkTime;
+}
+
 inline ObjectStruct& MemoryManager::objectFromID(object id)
 {
-    return objectTable[(id >> 1)];
+    return objectTable[objectIndex(id)];
+}
+
+inline void MemoryManager::shade(ObjectStruct& p)
+{
+    p.flags |= kMarked;
+    greyStack.push_back(&p);
 }
 
+inline void MemoryManager::writeBarrier(ObjectStruct* target, object value)
+{
+    target->flags |= kDirty;
+    if(value == nilobj || isImmediate(value))
+        return;
+    ObjectStruct& v = objectFromID(value);
+    if(((target->flags & (kOld | kRemembered)) == kOld) && !(v.flags & kOld))
+        remember(target);
+    if(gcPhase == kMarking && !(v.flags & kMarked))
+        shade(v);
+}
+
+inline void MemoryManager::writeBarrier(object target, object value)
+{
+    if(!isImmediate(target))
+        writeBarrier(&objectFromID(target), value);
+}
+
+inline void MemoryManager::writeBarrier(object target)
+{
+    if(isImmediate(target))
+        return;
+    ObjectStruct& p = objectFromID(target);
+    p.flags |= kDirty;
+    if((p.flags & (kOld | kRemembered)) == kOld)
+        remember(&p);
+    /* scanning it again now would be repeated at every time slice, so
+       anything already scanned is left until marking finishes */
+    if(gcPhase == kMarking)
+    {
+        if(!(p.flags & kMarked))
+            shade(p);
+        else if(rescanSet.empty() || rescanSet.back() != &p)
+            rescanSet.push_back(&p);
+    }
+}
+
+
+inline object ObjectStruct::objectClass() const
+{
+    return m_class;
+}
+
+inline void ObjectStruct::setClass(object c)
+{
+    assert(c == static_cast<unsigned int>(c));
+    m_class = c;
+    flags |= kDirty;
+}
+
+inline bool ObjectStruct::isBytes() const
+{
+    return (flags & kBytes) != 0;
+}
+
+inline long ObjectStruct::size() const
+{
+    return (m_size != kSizeInBody)? m_size : memory[-1];
+}
+
+inline long ObjectStruct::slotCount() const
+{
+    return (flags & kBytes)? 0 : size();
+}
+
+inline size_t ObjectStruct::wordsFor(size_t count, bool bytes)
+{
+    return bytes? (count + sizeof(object) - 1) / sizeof(object) : count;
+}
+
+inline size_t ObjectStruct::words() const
+{
+    return wordsFor(size(), isBytes());
+}
+
+/* the data area has to be in place before an object too big for the
+   header is given its size */
+inline void ObjectStruct::setPointerSize(size_t count)
+{
+    flags &= ~kBytes;
+    m_size = (count < kSizeInBody)? count : kSizeInBody;
+    if (count >= kSizeInBody)
+        memory[-1] = count;
+}
+
+inline void ObjectStruct::setByteSize(size_t count)
+{
+    flags |= kBytes;
+    m_size = (count < kSizeInBody)? count : kSizeInBody;
+    if (count >= kSizeInBody)
+        memory[-1] = count;
+}
 
 inline object* ObjectStruct::sysMemPtr()
 {
@@ -449,14 +1698,17 @@ inline char* ObjectStruct::charPtr()
 
 inline void ObjectStruct::basicAtPut(int i, object v)
 {
-    if((i <= 0) || (i > size))
+    if((i <= 0) || (i > slotCount()))
     {
         char msg[255];
-        sprintf(msg, "index out of range : %d %ld", i, size);
+        sprintf(msg, "index out of range : %d %ld", i, slotCount());
         sysError(msg, "basicAtPut");
     }
     else
+    {
         sysMemPtr()[i-1] = v;
+        MemoryManager::Instance()->writeBarrier(this, v);
+    }
 }
 
 
@@ -467,126 +1719,121 @@ inline void ObjectStruct::basicAtPut(int i, object v)
 #if defined TW_SMALLINTEGER_AS_OBJECT
 
 #define getInteger(x) (objectRef((x)).intValue())
-#define getClass(x) (objectRef((x))._class)
 
 #else
 
 extern object g_intClass;
 #define getInteger(x) ((x) >> 1)
-#define getClass(x) (((x)&1)? ((classSyms[kInteger] == 0)? (globalSymbol("Integer")) : classSyms[kInteger].handle()) : (objectRef((x))._class))
 
 #endif
+#define getClass(x) (isImmediate((x))? immediateClass((x)) : objectRef((x)).objectClass())
 
 
-inline ObjectHandle::ObjectHandle() : 
-    m_prev(NULL),
-    m_next(NULL),
-    m_handle(0)
+inline ObjectHandle::ObjectHandle()
+{
+    pushSlot(0);
+}
+
+inline ObjectHandle::ObjectHandle(const ObjectHandle& from)
 {
-    appendToList();
+    pushSlot(from.handle());
 }
 
-inline ObjectHandle::ObjectHandle(const ObjectHandle& from) :
-    m_prev(NULL),
-    m_next(NULL)
+inline ObjectHandle::ObjectHandle(ObjectHandle&& from) noexcept :
+    m_slot(from.m_slot)
 {
-    m_handle = from.m_handle;
-    appendToList();
+    from.m_slot = NULL;
 }
 
-inline ObjectHandle::ObjectHandle(long object) : 
-    m_prev(NULL),
-    m_next(NULL),
-    m_handle(object) 
+inline ObjectHandle::ObjectHandle(long object)
 {
-    appendToList();
+    pushSlot(object);
 }
 
-inline ObjectHandle::ObjectHandle(long object, MemoryManager* manager) : 
-    m_prev(NULL),
-    m_next(NULL),
-    m_handle(object)
+inline ObjectHandle::ObjectHandle(long object, MemoryManager*)
 {
-    appendToList();
+    pushSlot(object);
 }
 
 inline ObjectHandle::~ObjectHandle() 
 {
-    removeFromList();
+    if(NULL != m_slot)
+        popSlot();
 }
 
 inline ObjectHandle& ObjectHandle::operator=(long o)
 {
-    m_handle = o;
+    if(NULL == m_slot)
+        pushSlot(o);
+    else
+        *m_slot = o;
     return *this;
 }
 
 inline ObjectHandle& ObjectHandle::operator=(const ObjectHandle& from)
 {
-    m_handle = from.m_handle;
-    return *this;
+    return *this = from.handle();
 }
 
 inline ObjectStruct* ObjectHandle::operator->() const
 {
-    return &MemoryManager::Instance()->objectFromID(m_handle);
+    return &MemoryManager::Instance()->objectFromID(handle());
 }
 
 inline ObjectHandle::operator ObjectStruct&() const
 {
-    return MemoryManager::Instance()->objectFromID(m_handle);
+    return MemoryManager::Instance()->objectFromID(handle());
 }
 
 inline ObjectHandle::operator long() const
 {
-    return m_handle;
+    return handle();
 }
 
-inline int ObjectHandle::hash() const
+inline size_t MemoryManager::sizeClassCount() const
 {
-    return m_handle;
+    return m_sizeClassCount;
 }
 
-inline void ObjectHandle::appendToList()
+inline long ObjectHandle::hash() const
 {
-    // Register the handle with the global list.
-    if(NULL == ObjectHandle::tail)
-        ObjectHandle::head = ObjectHandle::tail = this;
-    else
-    {
-        ObjectHandle::tail->m_next = this;
-        m_prev = ObjectHandle::tail;
-        ObjectHandle::tail = this;
-    }
+    return hashObject(handle());
 }
 
-inline void ObjectHandle::removeFromList()
+inline void ObjectHandle::pushSlot(long object)
 {
-    // Unlink from the list pointers
-    if(NULL != m_prev)
-        m_prev->m_next = m_next;
-
-    if(NULL != m_next)
-        m_next->m_prev = m_prev;
+    if(m_rootTop == m_rootLimit)
+        growRoots();
+    m_slot = m_rootTop++;
+    *m_slot = object;
+}
 
-    if(ObjectHandle::head == this)
-        ObjectHandle::head = m_next;
-    if(ObjectHandle::tail == this)
-        ObjectHandle::tail = m_prev;
+inline void ObjectHandle::popSlot()
+{
+    if(m_slot + 1 == m_rootTop)
+    {
+        // Pop this slot, and any vacated out of order beneath it.
+        do
+            --m_rootTop;
+        while(m_rootTop != m_roots && m_rootTop[-1] == vacantSlot);
+        if(m_rootTop == m_roots && m_rootsOrphaned)
+            releaseRoots();
+    }
+    else
+        *m_slot = vacantSlot;
 }
 
-inline ObjectHandle* ObjectHandle::next() const
+inline const long* ObjectHandle::rootSlots()
 {
-    return m_next;
+    return m_roots;
 }
 
-inline ObjectHandle* ObjectHandle::prev() const
+inline size_t ObjectHandle::rootTop()
 {
-    return m_prev;
+    return m_rootTop - m_roots;
 }
 
 
 
 
 #endif
-
@@ -28,6 +28,8 @@
 #include <ctype.h>
 #include "env.h"
 #include "parser.h"
+#include "vm.h"
+#include "largeint.h"
 
 void Parser::compilWarn(const char* selector, const char* str1, const char* str2)
 {
@@ -59,7 +61,7 @@ void Parser::setInstanceVariables(object aClass)
         vars = objectRef(aClass).basicAt(variablesInClass);
         if (vars != nilobj) 
         {
-            limit = objectRef(vars).size;
+            limit = objectRef(vars).size();
             for (i = 1; i <= limit; i++)
                 instanceName[++instanceTop] = objectRef(objectRef(vars).basicAt(i)).charPtr();
         }
@@ -91,7 +93,7 @@ int Parser::genLiteral(object aLiteral)
     return(literalArray.size()-1);
 }
 
-void Parser::genInteger(int val)    /* generate an integer push */
+void Parser::genInteger(long val)    /* generate an integer push */
 {
     if (val == -1)
         genInstruction(PushConstant, minusOne);
@@ -102,6 +104,21 @@ void Parser::genInteger(int val)    /* generate an integer push */
                 genLiteral(newInteger(val)));
 }
 
+/* an integer literal too big for a SmallInteger, from the digits the
+   lexer kept, which once negated may fit one after all */
+object Parser::largeLiteral(bool negate)
+{
+    TLargeInteger value;
+    object literal = nilobj;
+
+    if (TLargeInteger::fromString(m_lexer.strToken(), 10, value))
+        literal = newLargeInteger(negate? -value : value);
+    if (literal == nilobj)
+        compilError(selector, "integer literal too large",
+                m_lexer.strToken().c_str());
+    return literal;
+}
+
 const char *glbsyms[] = 
 {
     "currentInterpreter", "nil", "true", "false",
@@ -211,6 +228,11 @@ int Parser::parseArray()
                 m_lexer.nextToken();
                 break;
 
+            case largeconst:
+                genLiteral(largeLiteral(false));
+                m_lexer.nextToken();
+                break;
+
             case nameconst: case namecolon: case symconst:
                 genLiteral(createSymbol(m_lexer.strToken().c_str()));
                 m_lexer.nextToken();
@@ -231,6 +253,8 @@ int Parser::parseArray()
                     {
                         genLiteral(newFloat(-m_lexer.floatToken()));
                     }
+                    else if (m_lexer.currentToken() == largeconst)
+                        genLiteral(largeLiteral(true));
                     else
                         compilError(selector,"negation not followed", "by number");
                     m_lexer.nextToken();
@@ -298,6 +322,11 @@ bool Parser::term()
         genInstruction(PushLiteral, genLiteral(newFloat(m_lexer.floatToken())));
         m_lexer.nextToken();
     }
+    else if (token == largeconst) 
+    {
+        genInstruction(PushLiteral, genLiteral(largeLiteral(false)));
+        m_lexer.nextToken();
+    }
     else if ((token == binary) && m_lexer.strToken().compare("-") == 0) 
     {
         token = m_lexer.nextToken();
@@ -308,6 +337,8 @@ bool Parser::term()
             genInstruction(PushLiteral,
                     genLiteral(newFloat(-m_lexer.floatToken())));
         }
+        else if (token == largeconst)
+            genInstruction(PushLiteral, genLiteral(largeLiteral(true)));
         else
             compilError(selector,"negation not followed",
                     "by number");
@@ -378,14 +409,15 @@ void Parser::parsePrimitive()
 
 void Parser::genMessage(bool toSuper, int argumentCount, object messagesym)
 {   
+    TVMState& vm = VM::state();
     bool sent = false;
     int i;
 
     if ((! toSuper) && (argumentCount == 0))
     {
-        for (i = 0; (! sent) && i < unSyms.size() ; i++)
+        for (i = 0; (! sent) && i < vm.unSyms.size() ; i++)
         {
-            if (messagesym == unSyms[i]) {
+            if (messagesym == vm.unSyms[i]) {
                 genInstruction(SendUnary, i);
                 sent = true;
             }
@@ -394,9 +426,9 @@ void Parser::genMessage(bool toSuper, int argumentCount, object messagesym)
 
     if ((! toSuper) && (argumentCount == 1))
     {
-        for (i = 0; (! sent) && i < binSyms.size(); i++)
+        for (i = 0; (! sent) && i < vm.binSyms.size(); i++)
         {
-            if (messagesym == binSyms[i]) 
+            if (messagesym == vm.binSyms[i]) 
             {
                 genInstruction(SendBinary, i);
                 sent = true;
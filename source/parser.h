@@ -50,7 +50,8 @@ class Parser
         void genInstruction(int high, int low);
         void genCode(int value);
         int genLiteral(object aLiteral);
-        void genInteger(int val);
+        void genInteger(long val);
+        object largeLiteral(bool negate);
         void expression();
         bool unaryContinuation(bool superReceiver);
         bool binaryContinuation(bool superReceiver);
@@ -15,10 +15,9 @@
    argument count and type, and in some cases type checking is performed.
 
    IMPORTANT NOTE:
-   The technique used to tell if an arithmetic operation
-   has overflowed in intBinary() depends upon integers
-   being 16 bits.  If this is not true, other techniques
-   may be required.
+   intBinary() works on the full width of a SmallInteger, and
+   reports overflow with the compiler's checked arithmetic where
+   there is one.
 
    system specific I/O primitives are found in a different file.
    */
@@ -43,9 +42,9 @@
 #include "names.h"
 #include "interp.h"
 #include "parser.h"
+#include "vm.h"
+#include "largeint.h"
 
-extern ObjectHandle processStack;
-extern int linkPointer;
 
 extern double frexp(), ldexp();
 extern object ioPrimitive(int, object*);
@@ -136,8 +135,9 @@ static object zeroaryPrims(int number)
   return(returnedObject);
 }
 
-static int unaryPrims(int number, object firstarg)
+static object unaryPrims(int number, object firstarg)
 {   
+  TVMState& vm = VM::state();
   int i, j, saveLinkPointer;
   object returnedObject;
   ObjectHandle saveProcessStack;
@@ -145,14 +145,11 @@ static int unaryPrims(int number, object firstarg)
   returnedObject = firstarg;
   switch(number) {
     case 1:     /* class of object */
-      returnedObject = objectRef(firstarg)._class;
+      returnedObject = getClass(firstarg);
       break;
 
     case 2:     /* basic size of object */
-      i = objectRef(firstarg).size;
-      /* byte objects have negative size */
-      if (i < 0) i = (-i);
-      returnedObject = newInteger(i);
+      returnedObject = newInteger(isImmediate(firstarg)? 0 : objectRef(firstarg).size());
       break;
 
     case 3:     /* hash value of object */
@@ -162,7 +159,7 @@ static int unaryPrims(int number, object firstarg)
       if(getClass(firstarg) == globalSymbol("Integer"))
         returnedObject = newInteger(getInteger(firstarg));
       else
-        returnedObject = newInteger(firstarg);
+        returnedObject = newInteger(hashObject(firstarg));
       break;
 
     case 4:     /* debugging print */
@@ -172,33 +169,33 @@ static int unaryPrims(int number, object firstarg)
 
     case 8:     /* change return point - block return */
       /* first get previous link pointer */
-      i = getInteger(processStack->basicAt(linkPointer));
+      i = getInteger(vm.processStack->basicAt(vm.linkPointer));
       /* then creating context pointer */
       j = getInteger(objectRef(firstarg).basicAt(1));
-      if (processStack->basicAt(j+1) != firstarg) 
+      if (vm.processStack->basicAt(j+1) != firstarg) 
       {
-        returnedObject = booleanSyms[booleanFalse];
+        returnedObject = vm.booleanSyms[booleanFalse];
         break;
       }
       /* first change link pointer to that of creator */
-      processStack->basicAtPut(i, 
-          processStack->basicAt(j));
+      vm.processStack->basicAtPut(i, 
+          vm.processStack->basicAt(j));
       /* then change return point to that of creator */
-      processStack->basicAtPut(i+2, 
-          processStack->basicAt(j+2));
-      returnedObject = booleanSyms[booleanTrue];
+      vm.processStack->basicAtPut(i+2, 
+          vm.processStack->basicAt(j+2));
+      returnedObject = vm.booleanSyms[booleanTrue];
       break;
 
     case 9:         /* process execute */
       /* first save the values we are about to clobber */
-      saveProcessStack = processStack;
-      saveLinkPointer = linkPointer;
+      saveProcessStack = vm.processStack;
+      saveLinkPointer = vm.linkPointer;
 # ifdef SIGNAL
       /* trap control-C */
       signal(SIGINT, brkfun);
       if (setjmp(jb)) 
       {
-        returnedObject = booleanSyms[booleanFalse];
+        returnedObject = vm.booleanSyms[booleanFalse];
       }
       else
 # endif
@@ -207,17 +204,17 @@ static int unaryPrims(int number, object firstarg)
         ctrlbrk(brkfun);
       if (setjmp(jb)) 
       {
-        returnedObject = booleanSyms[booleanFalse];
+        returnedObject = vm.booleanSyms[booleanFalse];
       }
       else
 # endif
         if (execute(firstarg, 5000))
-          returnedObject = booleanSyms[booleanTrue];
+          returnedObject = vm.booleanSyms[booleanTrue];
         else
-          returnedObject = booleanSyms[booleanFalse];
+          returnedObject = vm.booleanSyms[booleanFalse];
       /* then restore previous environment */
-      processStack = saveProcessStack;
-      linkPointer = saveLinkPointer;
+      vm.processStack = saveProcessStack;
+      vm.linkPointer = saveLinkPointer;
 # ifdef SIGNAL
       signal(SIGINT, brkignore);
 # endif
@@ -233,8 +230,9 @@ static int unaryPrims(int number, object firstarg)
   return(returnedObject);
 }
 
-static int binaryPrims(int number, object firstarg, object secondarg)
+static object binaryPrims(int number, object firstarg, object secondarg)
 {   
+  TVMState& vm = VM::state();
   char* buffer;
   int i;
   object returnedObject;
@@ -244,13 +242,14 @@ static int binaryPrims(int number, object firstarg, object secondarg)
   {
     case 1:     /* object identity test */
       if (firstarg == secondarg)
-        returnedObject = booleanSyms[booleanTrue];
+        returnedObject = vm.booleanSyms[booleanTrue];
       else
-        returnedObject = booleanSyms[booleanFalse];
+        returnedObject = vm.booleanSyms[booleanFalse];
       break;
 
     case 2:     /* set class of object */
-      objectRef(firstarg)._class = secondarg;
+      objectRef(firstarg).setClass(secondarg);
+      MemoryManager::Instance()->writeBarrier(firstarg, secondarg);
       returnedObject = firstarg;
       break;
 
@@ -266,7 +265,7 @@ static int binaryPrims(int number, object firstarg, object secondarg)
         strcpy(buffer, objectRef(firstarg).charPtr());
         strcat(buffer, objectRef(secondarg).charPtr());
         returnedObject = newStString(buffer);
-        delete buffer;
+        delete[] buffer;
       }
       break;
 
@@ -287,10 +286,10 @@ static int binaryPrims(int number, object firstarg, object secondarg)
 
     case 8:     /* block start */
       /* first get previous link */
-      i = getInteger(processStack->basicAt(linkPointer));
+      i = getInteger(vm.processStack->basicAt(vm.linkPointer));
       /* change context and byte pointer */
-      processStack->basicAtPut(i+1, firstarg);
-      processStack->basicAtPut(i+4, secondarg);
+      vm.processStack->basicAtPut(i+1, firstarg);
+      vm.processStack->basicAtPut(i+4, secondarg);
       break;
 
     case 9:     /* duplicate a block, adding a new context to it */
@@ -309,7 +308,7 @@ static int binaryPrims(int number, object firstarg, object secondarg)
   return(returnedObject);
 }
 
-static int trinaryPrims(int number, object firstarg, object secondarg, object thirdarg)
+static object trinaryPrims(int number, object firstarg, object secondarg, object thirdarg)
 {   
   char *bp, *tp, *buffer;
   int i, j;
@@ -338,7 +337,7 @@ static int trinaryPrims(int number, object firstarg, object secondarg, object th
           *tp++ = bp[i-1];
       *tp = '\0';
       returnedObject = newStString(buffer);
-      delete buffer;
+      delete[] buffer;
       break;
 
     case 9:         /* compile method */
@@ -348,10 +347,10 @@ static int trinaryPrims(int number, object firstarg, object secondarg, object th
         if (pp.parseMessageHandler(thirdarg, false)) {
           flushCache(objectRef(thirdarg).basicAt(messageInMethod), firstarg);
           objectRef(thirdarg).basicAtPut(methodClassInMethod, firstarg);
-          returnedObject = booleanSyms[booleanTrue];
+          returnedObject = VM::state().booleanSyms[booleanTrue];
         }
         else
-          returnedObject = booleanSyms[booleanFalse];
+          returnedObject = VM::state().booleanSyms[booleanFalse];
       }
       break;
 
@@ -362,9 +361,9 @@ static int trinaryPrims(int number, object firstarg, object secondarg, object th
   return(returnedObject);
 }
 
-static int intUnary(int number, object firstarg)
+static object intUnary(int number, long firstarg)
 {   
-  object returnedObject;
+  object returnedObject = nilobj;
 
   switch(number) 
   {
@@ -373,7 +372,7 @@ static int intUnary(int number, object firstarg)
       break;
 
     case 2:     /* print - for debugging purposes */
-      fprintf(stderr,"debugging print %d\n", static_cast<int>(firstarg));
+      fprintf(stderr,"debugging print %ld\n", firstarg);
       break;
 
     case 3: /* set time slice - done in interpreter */
@@ -384,12 +383,18 @@ static int intUnary(int number, object firstarg)
       returnedObject = nilobj;
       break;
 
-    case 8:
-      returnedObject = MemoryManager::Instance()->allocObject(firstarg);
+    case 7:     /* character with the integer as its value */
+      returnedObject = newChar(firstarg);
+      break;
+
+    case 8:     /* new object, nil if it can't be that big */
+      if (firstarg >= 0 && (unsigned long) firstarg <= ObjectStruct::maxSize)
+        returnedObject = MemoryManager::Instance()->allocObject(firstarg);
       break;
 
     case 9:
-      returnedObject = MemoryManager::Instance()->allocByte(firstarg);
+      if (firstarg >= 0 && (unsigned long) firstarg <= ObjectStruct::maxSize)
+        returnedObject = MemoryManager::Instance()->allocByte(firstarg);
       break;
 
     default:
@@ -398,7 +403,41 @@ static int intUnary(int number, object firstarg)
   return(returnedObject);
 }
 
-static object intBinary(register int number, register int firstarg, int secondarg)
+/* SmallInteger arithmetic is done in a long and is only good if the
+   result is still a SmallInteger, else the Smalltalk code falls back on
+   LongInteger */
+static bool addOverflows(long a, long b, long* result)
+{
+#if defined(__GNUC__)
+  if (__builtin_add_overflow(a, b, result)) return true;
+#else
+  *result = a + b;
+#endif
+  return !fitsSmallInteger(*result);
+}
+
+static bool subOverflows(long a, long b, long* result)
+{
+#if defined(__GNUC__)
+  if (__builtin_sub_overflow(a, b, result)) return true;
+#else
+  *result = a - b;
+#endif
+  return !fitsSmallInteger(*result);
+}
+
+static bool mulOverflows(long a, long b, long* result)
+{
+#if defined(__GNUC__)
+  if (__builtin_mul_overflow(a, b, result)) return true;
+#else
+  *result = static_cast<long>(static_cast<unsigned long>(a) * static_cast<unsigned long>(b));
+  if (a != 0 && *result / a != b) return true;
+#endif
+  return !fitsSmallInteger(*result);
+}
+
+static object intBinary(register int number, register long firstarg, long secondarg)
 {   
   bool binresult;
   long longresult;
@@ -407,20 +446,14 @@ static object intBinary(register int number, register int firstarg, int secondar
   switch(number) 
   {
     case 0:     /* addition */
-      longresult = firstarg;
-      longresult += secondarg;
-      if (longCanBeInt(longresult))
-        firstarg = longresult; 
-      else
+      if (addOverflows(firstarg, secondarg, &longresult))
         goto overflow;
+      firstarg = longresult; 
       break;
     case 1:     /* subtraction */
-      longresult = firstarg;
-      longresult -= secondarg;
-      if (longCanBeInt(longresult))
-        firstarg = longresult;
-      else
+      if (subOverflows(firstarg, secondarg, &longresult))
         goto overflow;
+      firstarg = longresult;
       break;
 
     case 2:     /* relationals */
@@ -437,17 +470,17 @@ static object intBinary(register int number, register int firstarg, int secondar
       binresult = firstarg != secondarg; break;
 
     case 8:     /* multiplication */
-      longresult = firstarg;
-      longresult *= secondarg;
-      if (longCanBeInt(longresult))
-        firstarg = longresult;
-      else
+      if (mulOverflows(firstarg, secondarg, &longresult))
         goto overflow;
+      firstarg = longresult;
       break;
 
     case 9:     /* quo: */
       if (secondarg == 0) goto overflow;
-      firstarg /= secondarg; break;
+      /* the smallest SmallInteger divided by -1 is not one */
+      firstarg /= secondarg;
+      if (!fitsSmallInteger(firstarg)) goto overflow;
+      break;
 
     case 10:    /* rem: */
       if (secondarg == 0) goto overflow;
@@ -461,16 +494,22 @@ static object intBinary(register int number, register int firstarg, int secondar
 
     case 19:    /* shifts */
       if (secondarg < 0)
-        firstarg >>= (- secondarg);
-      else
-        firstarg <<= secondarg;
+        firstarg >>= (secondarg < -63)? 63 : -secondarg;
+      else if (firstarg != 0)
+      {
+        if (secondarg > 62) goto overflow;
+        longresult = static_cast<long>(static_cast<unsigned long>(firstarg) << secondarg);
+        if ((longresult >> secondarg) != firstarg || !fitsSmallInteger(longresult))
+          goto overflow;
+        firstarg = longresult;
+      }
       break;
   }
   if ((number >= 2) && (number <= 7))
     if (binresult)
-      returnedObject = booleanSyms[booleanTrue];
+      returnedObject = VM::state().booleanSyms[booleanTrue];
     else
-      returnedObject = booleanSyms[booleanFalse];
+      returnedObject = VM::state().booleanSyms[booleanFalse];
   else
     returnedObject = newInteger(firstarg);
   return(returnedObject);
@@ -482,7 +521,117 @@ overflow:
   return(returnedObject);
 }
 
-static int strUnary(int number, char* firstargument)
+/* The large integer primitives take any mix of SmallIntegers and large
+   integers, so they serve both as the fallback when SmallInteger
+   arithmetic overflows and as the methods of the large integer classes.
+   Results are SmallIntegers whenever they fit. Anything else as an
+   argument, or an image without the large integer classes, fails the
+   primitive with nil. */
+static bool largeIntegerValue(object arg, TLargeInteger& value)
+{
+  if (isSmallInteger(arg))
+  {
+    value = TLargeInteger(static_cast<long>(getInteger(arg)));
+    return true;
+  }
+  if (!isLargeInteger(arg))
+    return false;
+  ObjectStruct& o = objectRef(arg);
+  value = TLargeInteger(reinterpret_cast<unsigned char*>(o.charPtr()), o.size(),
+      o.objectClass() == VM::state().classSyms[kLargeNegativeInteger]);
+  return true;
+}
+
+/* numbered as intBinary, with bitOr:, gcd: and radix: printing added */
+static object largeIntBinary(int number, object firstarg, object secondarg)
+{
+  TLargeInteger a, b, quotient, remainder;
+  int comparison;
+  long count;
+
+  if (!largeIntegerValue(firstarg, a) || !largeIntegerValue(secondarg, b))
+    return nilobj;
+
+  switch(number)
+  {
+    case 0:     /* addition */
+      return newLargeInteger(a + b);
+    case 1:     /* subtraction */
+      return newLargeInteger(a - b);
+
+    case 2: case 3: case 4: case 5: case 6: case 7: case 13:
+      comparison = TLargeInteger::compare(a, b);
+      switch(number)
+      {
+        case 2: comparison = comparison < 0; break;
+        case 3: comparison = comparison > 0; break;
+        case 4: comparison = comparison <= 0; break;
+        case 5: comparison = comparison >= 0; break;
+        case 7: comparison = comparison != 0; break;
+        default: comparison = comparison == 0; break;
+      }
+      return VM::state().booleanSyms[comparison? booleanTrue : booleanFalse];
+
+    case 8:     /* multiplication */
+      return newLargeInteger(a * b);
+
+    case 9:     /* quo: */
+      if (!TLargeInteger::divide(a, b, quotient, remainder))
+        return nilobj;
+      return newLargeInteger(quotient);
+
+    case 10:    /* rem: */
+      if (!TLargeInteger::divide(a, b, quotient, remainder))
+        return nilobj;
+      return newLargeInteger(remainder);
+
+    case 11:    /* bit operations */
+      return newLargeInteger(TLargeInteger::bitAnd(a, b));
+    case 12:
+      return newLargeInteger(TLargeInteger::bitXor(a, b));
+    case 14:
+      return newLargeInteger(TLargeInteger::bitOr(a, b));
+
+    case 15:    /* gcd: */
+      return newLargeInteger(TLargeInteger::gcd(a, b));
+
+    case 16:    /* printString: radix */
+      if (!b.toLong(count) || count < 2 || count > 36)
+        return nilobj;
+      return newStString(a.toString(count).c_str());
+
+    case 19:    /* shifts, refusing results that might be more than 16Mb */
+      if (!b.toLong(count) || (count > 0 && a.byteCount() + (unsigned long)count / 8 + 1 > (1 << 24)))
+        return nilobj;
+      return newLargeInteger(a.shift(count));
+  }
+  sysError("largeIntBinary primitive","not implemented yet");
+  return nilobj;
+}
+
+static object largeIntUnary(int number, object firstarg)
+{
+  TLargeInteger a;
+
+  switch(number)
+  {
+    case 0:     /* float equiv of integer */
+      if (!largeIntegerValue(firstarg, a))
+        return nilobj;
+      return newFloat(a.toDouble());
+
+    case 1:     /* integer part of a float, of any size */
+      if (getClass(firstarg) != classObject(kFloat))
+        return nilobj;
+      if (!TLargeInteger::fromDouble(floatValue(firstarg), a))
+        return nilobj;
+      return newLargeInteger(a);
+  }
+  sysError("largeIntUnary primitive","not implemented yet");
+  return nilobj;
+}
+
+static object strUnary(int number, char* firstargument)
 {   
   object returnedObject;
 
@@ -522,7 +671,7 @@ static int strUnary(int number, char* firstargument)
   return(returnedObject);
 }
 
-static int floatUnary(int number, double firstarg)
+static object floatUnary(int number, double firstarg)
 {   
   char buffer[20];
   double temp;
@@ -555,19 +704,6 @@ static int floatUnary(int number, double firstarg)
       returnedObject = newArray(2);
       returnedObject->basicAtPut(1, newInteger(j));
       returnedObject->basicAtPut(2, newInteger(i));
-# ifdef trynew
-      /* if number is too big it can't be integer anyway */
-      if (firstarg > 2e9)
-        returnedObject = nilobj;
-      else {
-        modf(firstarg, &temp);
-        ltemp = (long) temp;
-        if (longCanBeInt(ltemp))
-          returnedObject = newInteger((int) temp);
-        else
-          returnedObject = newFloat(temp);
-      }
-# endif
       break;
 
     default:
@@ -603,16 +739,16 @@ static object floatBinary(int number, double first, double second)
 
   if ((number >= 2) && (number <= 7))
     if (binResult)
-      returnedObject = booleanSyms[booleanTrue];
+      returnedObject = VM::state().booleanSyms[booleanTrue];
     else
-      returnedObject = booleanSyms[booleanFalse];
+      returnedObject = VM::state().booleanSyms[booleanFalse];
   else
     returnedObject = newFloat(first);
   return(returnedObject);
 }
 
 
-static int cPointerUnary(int number, void* firstarg)
+static object cPointerUnary(int number, void* firstarg)
 {   
   object returnedObject;
 
@@ -625,6 +761,9 @@ static int cPointerUnary(int number, void* firstarg)
         returnedObject = newStString(ss.str().c_str());
       }
       break;
+    case 2:     /* a new cPointer with the same value */
+      returnedObject = newCPointer(firstarg);
+      break;
     default:
       sysError("unknown primitive","cPointerUnary");
       break;
@@ -644,7 +783,7 @@ object exceptionPrimitive(int number, object* arguments)
       break;
 
     case 2:     // signal
-      fprintf(stderr, "signal from: %s\n", objectRef(objectRef(objectRef(arguments[0])._class).basicAt(nameInClass)).charPtr());
+      fprintf(stderr, "signal from: %s\n", objectRef(objectRef(objectRef(arguments[0]).objectClass()).basicAt(nameInClass)).charPtr());
       break;
 
     default:
@@ -693,13 +832,13 @@ object primitive(register int primitiveNumber, object* arguments)
       break;
 
     case 10:        /* float unary */
-      returnedObject = floatUnary(primitiveNumber-100, objectRef(arguments[0]).floatValue());
+      returnedObject = floatUnary(primitiveNumber-100, floatValue(arguments[0]));
       break;
 
     case 11:        /* float binary */
       returnedObject = floatBinary(primitiveNumber-110,
-          objectRef(arguments[0]).floatValue(),
-          objectRef(arguments[1]).floatValue());
+          floatValue(arguments[0]),
+          floatValue(arguments[1]));
       break;
 
     case 12: case 13:   /* file operations */
@@ -711,7 +850,7 @@ object primitive(register int primitiveNumber, object* arguments)
       returnedObject = cPointerUnary(primitiveNumber-140, objectRef(arguments[0]).cPointerValue());
       break;
 
-    case 15:
+    case 15: case 16: case 17:
       /* system dependent primitives, handled in separate module */
       returnedObject = sysPrimitive(primitiveNumber, arguments);
       break;
@@ -728,6 +867,14 @@ object primitive(register int primitiveNumber, object* arguments)
       returnedObject = exceptionPrimitive(primitiveNumber-200, arguments);
       break;
 
+    case 21: case 22:   /* large integer binary operations */
+      returnedObject = largeIntBinary(primitiveNumber-210, arguments[0], arguments[1]);
+      break;
+
+    case 23:        /* large integer unary operations */
+      returnedObject = largeIntUnary(primitiveNumber-230, arguments[0]);
+      break;
+
     default:
       sysError("unknown primitive number","doPrimitive");
       break;
@@ -8,19 +8,25 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "env.h"
 #include "objmemory.h"
 #include "names.h"
 #include "interp.h"
-
-#ifdef __APPLE__
-#	define GLFW_INCLUDE_GLCOREARB
+#include "vm.h"
+
+/* tw-headless is this without the graphics module, so without a display
+   and the libraries behind one */
+#if !defined TW_HEADLESS
+#include "graphics.h"
+#if !defined WIN32
+#include <dlfcn.h>
+#else
+#include <Windows.h>
+#endif
 #endif
-#include <GLFW/glfw3.h>
-
-#include "nanovg.h"
-#define NANOVG_GL3_IMPLEMENTATION
-#include "nanovg_gl.h"
 
 ObjectHandle firstProcess;
 int initial = 0;    /* not making initial image */
@@ -29,68 +35,186 @@ int initial = 0;    /* not making initial image */
 extern void initFFISymbols();   /* FFI symbols */
 #endif
 
-static void error_callback(int error, const char* description)
+/* heap growth and gc log flags, each --name=value, taken before the image name */
+static bool memoryOption(const char* arg, THeapGrowth& growth)
 {
-    fputs(description, stderr);
+    const char* value = strchr(arg, '=');
+    if (value == NULL)
+        return false;
+    ++value;
+    if (strncmp(arg, "--grow=", 7) == 0)
+        MemoryManager::Instance()->setGrowAmount(strtoul(value, NULL, 10));
+    else if (strncmp(arg, "--growth-factor=", 16) == 0)
+        growth.growthFactor = atof(value);
+    else if (strncmp(arg, "--survival=", 11) == 0)
+        growth.survivalThreshold = atof(value);
+    else if (strncmp(arg, "--min-reclaim=", 14) == 0)
+        growth.minReclaimRatio = atof(value);
+    else if (strncmp(arg, "--gc-log=", 9) == 0)
+    {
+        if (!MemoryManager::Instance()->setStatsLog(value))
+            sysWarn("cannot open gc log", value);
+    }
+    else
+        return false;
+    return true;
 }
 
-static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+/* --alloc-profile=file, written as the process exits */
+static const char* allocProfilePath = NULL;
+
+static void writeAllocationProfile()
 {
-    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, GL_TRUE);
+    FILE* fp = fopen(allocProfilePath, "w");
+    if (fp == NULL)
+    {
+        sysWarn("cannot write allocation profile", allocProfilePath);
+        return;
+    }
+    VM::state().allocationProfile.writeFolded(fp);
+    fclose(fp);
 }
 
-extern "C" void my_nvgFillColor(NVGcontext* vg, NVGcolor color) {
-    printf("R: %f G: %f B: %f A: %F\n", color.r, color.g, color.b, color.a);
-    nvgFillColor(vg, nvgRGBA(28.0, 30.0, 34.0, 192.0));
+static bool byRetained(const TClassCensus& a, const TClassCensus& b)
+{
+    return a.retainedBytes > b.retainedBytes;
 }
 
-GLFWwindow* window;
-int winWidth, winHeight;
-int fbWidth, fbHeight;
-float pxRatio;
-double mx, my, t, dt;
-
-extern "C" void drawWindow(NVGcontext* vg, const char* title, float x, float y, float w, float h)
+/* print the classes retaining the most memory, for --census=n */
+static void printCensus(size_t top)
 {
-    nvgBeginFrame(vg, winWidth, winHeight, pxRatio);
-
-	float cornerRadius = 3.0f;
-	NVGpaint shadowPaint;
-	NVGpaint headerPaint;
-
-	nvgSave(vg);
-//	nvgClearState(vg);
-
-	// Window
-	nvgBeginPath(vg);
-	nvgRoundedRect(vg, x,y, w,h, cornerRadius);
-	nvgFillColor(vg, nvgRGBA(28,30,34,192));
-//	nvgFillColor(vg, nvgRGBA(0,0,0,128));
-	nvgFill(vg);
+    std::vector<TClassCensus> census;
+    MemoryManager::Instance()->heapCensus(census, true);
+    std::sort(census.begin(), census.end(), byRetained);
+    printf("%-32s %10s %12s %12s\n", "class", "instances", "bytes", "retained");
+    for (size_t i = 0; i < census.size() && i < top; ++i)
+    {
+        const char* name = "?";
+        object classObj = census[i].classObject;
+        if (classObj != nilobj && objectRef(classObj).size() > nameInClass)
+        {
+            object nameObj = objectRef(classObj).basicAt(nameInClass);
+            if (nameObj != nilobj && !isImmediate(nameObj) && objectRef(nameObj).isBytes())
+                name = objectRef(nameObj).charPtr();
+        }
+        printf("%-32s %10lu %12lu %12lu\n", name, (unsigned long)census[i].instances,
+                (unsigned long)census[i].bytes, (unsigned long)census[i].retainedBytes);
+    }
+}
 
+#if !defined TW_HEADLESS
+/* --graphics=file, the module opening the window */
+static const char* graphicsPath = "modules/graphics/graphics." SO_EXT;
+static TGraphics graphics;
+static TGraphicsClose graphicsClose = NULL;
+static void* graphicsModule = NULL;
 
-	nvgRestore(vg);
+static void* graphicsSymbol(void* module, const char* name)
+{
+#if !defined WIN32
+    return dlsym(module, name);
+#else
+    return (void*)GetProcAddress((HMODULE)module, name);
+#endif
+}
 
-    nvgEndFrame(vg);
+static void unloadGraphics()
+{
+#if !defined WIN32
+    dlclose(graphicsModule);
+#else
+    FreeLibrary((HMODULE)graphicsModule);
+#endif
+    graphicsModule = NULL;
+}
 
-    glfwSwapBuffers(window);
-    glfwPollEvents();
+/* close the window and unload the module, once, however tw exits */
+static void closeGraphics()
+{
+    if (graphicsClose != NULL)
+        graphicsClose(&graphics);
+    graphicsClose = NULL;
+    if (graphicsModule != NULL)
+        unloadGraphics();
+}
 
+/* load the graphics module and open a window, false, leaving tw running
+   headless, if either can't be done. the module's symbols are global,
+   so the image can call into it by FFI. the image quits with exit(), so
+   the window is closed by an exit handler */
+static bool openGraphics()
+{
+#if !defined WIN32
+    graphicsModule = dlopen(graphicsPath, RTLD_NOW | RTLD_GLOBAL);
+#else
+    graphicsModule = (void*)LoadLibrary(graphicsPath);
+#endif
+    if (graphicsModule == NULL)
+    {
+        sysWarn("cannot load graphics module", graphicsPath);
+        return false;
+    }
+    TGraphicsOpen open = (TGraphicsOpen)graphicsSymbol(graphicsModule, TW_GRAPHICS_OPEN);
+    graphicsClose = (TGraphicsClose)graphicsSymbol(graphicsModule, TW_GRAPHICS_CLOSE);
+    if (open == NULL || graphicsClose == NULL || !open(&graphics))
+    {
+        sysWarn("cannot open graphics, running headless", graphicsPath);
+        graphicsClose = NULL;
+        unloadGraphics();
+        return false;
+    }
+    atexit(closeGraphics);
+    return true;
 }
 
+/* Store the vg pointer into the globals */
+static void graphicsGlobals()
+{
+    nameTableInsert(symbols, strHash("vg"), createSymbol("vg"), newCPointer(graphics.vg));
+    nameTableInsert(symbols, strHash("winWidth"), createSymbol("winWidth"), newInteger(graphics.winWidth));
+    nameTableInsert(symbols, strHash("winHeight"), createSymbol("winHeight"), newInteger(graphics.winHeight));
+    nameTableInsert(symbols, strHash("fbWidth"), createSymbol("fbWidth"), newInteger(graphics.fbWidth));
+    nameTableInsert(symbols, strHash("fbHeight"), createSymbol("fbHeight"), newInteger(graphics.fbHeight));
+    nameTableInsert(symbols, strHash("pxRatio"), createSymbol("pxRatio"), newFloat(graphics.pxRatio));
+    nameTableInsert(symbols, strHash("window"), createSymbol("window"), newCPointer(graphics.window));
+    nameTableInsert(symbols, strHash("fontNormal"), createSymbol("fontNormal"), newInteger(graphics.fontNormal));
+    nameTableInsert(symbols, strHash("fontBold"), createSymbol("fontBold"), newInteger(graphics.fontBold));
+}
+#endif
 
 int main(int argc, char** argv)
 {
     FILE *fp;
     char *p, buffer[120];
-    NVGcontext* vg = NULL;
-    int fontNormal, fontBold;
 
     strcpy(buffer,"systemImage");
     p = buffer;
 
-    if (argc != 1) p = argv[1];
+    THeapGrowth growth;
+    size_t censusTop = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--", 2) != 0)
+            p = argv[i];
+        else if (strncmp(argv[i], "--census=", 9) == 0)
+            censusTop = strtoul(argv[i] + 9, NULL, 10);
+        else if (strncmp(argv[i], "--alloc-profile=", 16) == 0)
+            allocProfilePath = argv[i] + 16;
+#if !defined TW_HEADLESS
+        else if (strncmp(argv[i], "--graphics=", 11) == 0)
+            graphicsPath = argv[i] + 11;
+#endif
+        else if (!memoryOption(argv[i], growth))
+        {
+#if !defined TW_HEADLESS
+            fprintf(stderr, "usage: %s [--grow=n] [--growth-factor=f] [--survival=f] [--min-reclaim=f] [--gc-log=file] [--census=n] [--alloc-profile=file] [--graphics=module] [image]\n", argv[0]);
+#else
+            fprintf(stderr, "usage: %s [--grow=n] [--growth-factor=f] [--survival=f] [--min-reclaim=f] [--gc-log=file] [--census=n] [--alloc-profile=file] [image]\n", argv[0]);
+#endif
+            exit(1);
+        }
+    }
+    MemoryManager::Instance()->setHeapGrowth(growth);
 
     fp = fopen(p, "rb");
 
@@ -100,88 +224,47 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    if (!glfwInit())
-        exit(EXIT_FAILURE);
-
-    glfwSetErrorCallback(error_callback);
-
-#ifndef _WIN32 // don't require this on win32, and works with more cards
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-#endif
-    glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, 1);
-
-    window = glfwCreateWindow(640, 480, "NanoVG", NULL, NULL);
-
-    if (!window)
+    /* just report on the image, without opening a window */
+    if (censusTop > 0)
     {
-        glfwTerminate();
-        exit(EXIT_FAILURE);
-    }
-
-    glfwMakeContextCurrent(window);
-    glfwSwapInterval(1);
-    glfwSetKeyCallback(window, key_callback);
-
-    vg = nvgCreateGL3(NVG_ANTIALIAS | NVG_STENCIL_STROKES | NVG_DEBUG);
-    if (vg == NULL) {
-            printf("Could not init nanovg.\n");
-            return -1;
-    }
-
-    fontNormal = nvgCreateFont(vg, "sans", "Roboto-Regular.ttf");
-    if (fontNormal == -1) {
-        printf("Could not add font italic.\n");
-        return -1;
-    }
-    fontBold = nvgCreateFont(vg, "sans-bold", "Roboto-Bold.ttf");
-    if (fontBold == -1) {
-        printf("Could not add font bold.\n");
-        return -1;
+        MemoryManager::Instance()->imageRead(fp);
+        MemoryManager::Instance()->garbageCollect();
+        printCensus(censusTop);
+        exit(0);
     }
 
+#if !defined TW_HEADLESS
+    bool windowed = openGraphics();
+#endif
 
-    glfwGetCursorPos(window, &mx, &my);
-    glfwGetWindowSize(window, &winWidth, &winHeight);
-    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
-    // Calculate pixel ration for hi-dpi devices.
-    pxRatio = (float)fbWidth / (float)winWidth;
-    
-    glViewport(0, 0, fbWidth, fbHeight);
-    glClearColor(0.3f, 0.3f, 0.32f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT);
-
-    printf("GL_COLOR_BUFFER_BIT: %d\n", GL_COLOR_BUFFER_BIT);
-    printf("GL_DEPTH_BUFFER_BIT: %d\n", GL_DEPTH_BUFFER_BIT);
-    printf("GL_STENCIL_BUFFER_BIT: %d\n", GL_STENCIL_BUFFER_BIT);
-
-    //drawWindow(vg, "Widgets `n Stuff", 50, 50, 300, 400);
-
+    /* images are collected as they are written, so there is nothing to 
+       collect yet, and marking would touch every page of a mapped image */
     MemoryManager::Instance()->imageRead(fp);
-    MemoryManager::Instance()->garbageCollect();
 
     initCommonSymbols();
 #if defined TW_ENABLE_FFI
     initFFISymbols();
 #endif
 
-    /* Store the vg pointer into the globals */
-    nameTableInsert(symbols, strHash("vg"), createSymbol("vg"), newCPointer(vg));
-    nameTableInsert(symbols, strHash("winWidth"), createSymbol("winWidth"), newInteger(winWidth));
-    nameTableInsert(symbols, strHash("winHeight"), createSymbol("winHeight"), newInteger(winHeight));
-    nameTableInsert(symbols, strHash("fbWidth"), createSymbol("fbWidth"), newInteger(fbWidth));
-    nameTableInsert(symbols, strHash("fbHeight"), createSymbol("fbHeight"), newInteger(fbHeight));
-    nameTableInsert(symbols, strHash("pxRatio"), createSymbol("pxRatio"), newFloat(pxRatio));
-    nameTableInsert(symbols, strHash("window"), createSymbol("window"), newCPointer(window));
-    nameTableInsert(symbols, strHash("fontNormal"), createSymbol("fontNormal"), newInteger(fontNormal));
-    nameTableInsert(symbols, strHash("fontBold"), createSymbol("fontBold"), newInteger(fontBold));
-
-    runCode("ObjectMemory changed: #returnFromSnapshot");
+    if (allocProfilePath != NULL)
+    {
+        VM::state().allocationProfile.start();
+        atexit(writeAllocationProfile);
+    }
+
+#if !defined TW_HEADLESS
+    if (windowed)
+        graphicsGlobals();
+#endif
+
+    runCode("ObjectMemory returnFromSnapshot");
     firstProcess = globalSymbol("systemProcess");
     if (firstProcess == nilobj) 
     {
+#if !defined TW_HEADLESS
+        /* sysError aborts, without running the exit handlers */
+        closeGraphics();
+#endif
         sysError("no initial process","in image");
         exit(1); 
         return 1;
@@ -192,8 +275,9 @@ int main(int argc, char** argv)
 
     while (execute(firstProcess, 15000)) ;
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
+#if !defined TW_HEADLESS
+    closeGraphics();
+#endif
 
     /* exit and return - belt and suspenders, but it keeps lint happy */
     exit(0); 
@@ -15,10 +15,11 @@
 #include "objmemory.h"
 #include "names.h"
 #include "parser.h"
+#include "vm.h"
 
 #include "linenoise.h"
 
-static char gLastError[1024];
+static TW_THREAD char gLastError[1024];
 
 /* report a fatal system error */
 void sysError(const char* s1, const char* s2)
@@ -94,6 +95,227 @@ object sysPrimitive(int number, object* arguments)
       }
       break;
 
+    case 6: /* collection pause time percentile, in microseconds */
+      {
+        double pause = MemoryManager::Instance()->pausePercentile(getInteger(arguments[0]));
+        returnedObject = newInteger(static_cast<int>(pause * 1000000.0));
+      }
+      break;
+
+    case 7: /* set the incremental collection budget */
+      {
+        MemoryManager::Instance()->setIncrementalBudget(getInteger(arguments[0]));
+      }
+      break;
+
+    case 8: /* set the number of full collection threads */
+      {
+        MemoryManager::Instance()->setGCWorkers(getInteger(arguments[0]));
+      }
+      break;
+
+    case 9: /* make an object weak (1) or an ephemeron (2), answering it */
+      {
+        bool made = (getInteger(arguments[1]) == 2)?
+          MemoryManager::Instance()->makeEphemeron(arguments[0]) :
+          MemoryManager::Instance()->makeWeak(arguments[0]);
+        if(made)
+          returnedObject = arguments[0];
+      }
+      break;
+
+    case 10: /* register an object for finalization by an executor, answering it */
+      {
+        if(MemoryManager::Instance()->addFinalizer(arguments[0], arguments[1]))
+          returnedObject = arguments[0];
+      }
+      break;
+
+    case 11: /* the next executor whose object has died, or nil */
+      {
+        returnedObject = MemoryManager::Instance()->nextFinalizer();
+      }
+      break;
+
+    case 12: /* number of executors waiting to be run */
+      {
+        returnedObject = newInteger(MemoryManager::Instance()->finalizersPending());
+      }
+      break;
+
+    case 13: /* collector and allocator counters, an Array of names and values */
+      {
+        MemoryManager* mm = MemoryManager::Instance();
+        const TGCStats& stats = mm->gcStats();
+        const struct { const char* name; double value; } counters[] = {
+          { "minorCollections", (double)stats.minorCollections },
+          { "fullCollections", (double)stats.fullCollections },
+          { "incrementalCycles", (double)stats.incrementalCycles },
+          { "compactions", (double)stats.compactions },
+          { "growths", (double)stats.growths },
+          { "growMicroseconds", stats.growSeconds * 1e6 },
+          { "pauses", (double)stats.pauses },
+          { "totalPauseMicroseconds", stats.totalPauseSeconds * 1e6 },
+          { "maxPauseMicroseconds", stats.maxPauseSeconds * 1e6 },
+          { "lastPauseMicroseconds", stats.lastPauseSeconds * 1e6 },
+          { "objectsAllocated", (double)stats.objectsAllocated },
+          { "bytesAllocated", (double)(stats.wordsAllocated * sizeof(object)) },
+          { "totalObjectsAllocated", (double)stats.totalObjectsAllocated },
+          { "lastFreed", (double)stats.lastFreed },
+          { "totalFreed", (double)stats.totalFreed },
+          { "tableSize", (double)mm->storageSize() },
+          { "freeSlots", (double)mm->freeSlotsCount() },
+        };
+        const int count = sizeof(counters) / sizeof(counters[0]);
+        ObjectHandle list = newArray(2 * (count + 2));
+        for(int i = 0; i < count; ++i)
+        {
+          list->basicAtPut(2 * i + 1, createSymbol(counters[i].name));
+          list->basicAtPut(2 * i + 2, newInteger(static_cast<long>(counters[i].value)));
+        }
+        /* bucket n counts pauses under 2^n microseconds */
+        ObjectHandle histogram = newArray(TGCStats::kPauseBuckets);
+        for(size_t i = 0; i < TGCStats::kPauseBuckets; ++i)
+          histogram->basicAtPut(i + 1, newInteger(stats.pauseHistogram[i]));
+        list->basicAtPut(2 * count + 1, createSymbol("pauseHistogram"));
+        list->basicAtPut(2 * count + 2, histogram);
+        /* free list n holds slots of n words */
+        ObjectHandle freeLists = newArray(mm->sizeClassCount());
+        for(size_t i = 0; i < mm->sizeClassCount(); ++i)
+          freeLists->basicAtPut(i + 1, newInteger(mm->freeSlotsCount(i)));
+        list->basicAtPut(2 * count + 3, createSymbol("freeLists"));
+        list->basicAtPut(2 * count + 4, freeLists);
+        returnedObject = list;
+      }
+      break;
+
+    case 14: /* log stats as JSON lines to the named file at every collection, nil stops,
+                answers false for anything else */
+      {
+        bool logging = false;
+        if(arguments[0] == nilobj)
+          logging = MemoryManager::Instance()->setStatsLog(NULL);
+        else if(!isImmediate(arguments[0]) && objectRef(arguments[0]).isBytes())
+          logging = MemoryManager::Instance()->setStatsLog(objectRef(arguments[0]).charPtr());
+        returnedObject = VM::state().booleanSyms[logging? booleanTrue : booleanFalse];
+      }
+      break;
+
+    case 15: /* heap census, an Array of class, instances, bytes and retained bytes, 
+                retained sizes only worked out if the argument is true */
+      {
+        /* collect first, so every class counted has live instances,
+           and survives making the Array */
+        std::vector<TClassCensus> census;
+        MemoryManager::Instance()->garbageCollect();
+        MemoryManager::Instance()->heapCensus(census, 
+            arguments[0] == VM::state().booleanSyms[booleanTrue]);
+        ObjectHandle list = newArray(4 * census.size());
+        for(size_t i = 0; i < census.size(); ++i)
+        {
+          list->basicAtPut(4 * i + 1, census[i].classObject);
+          list->basicAtPut(4 * i + 2, newInteger(census[i].instances));
+          list->basicAtPut(4 * i + 3, newInteger(census[i].bytes));
+          list->basicAtPut(4 * i + 4, newInteger(census[i].retainedBytes));
+        }
+        returnedObject = list;
+      }
+      break;
+
+    case 16: /* sample allocations every so many bytes, nil or 0 stops, 
+                answers the samples taken so far */
+      {
+        TAllocationProfile& profile = VM::state().allocationProfile;
+        returnedObject = newInteger(profile.sampleCount());
+        if(isSmallInteger(arguments[0]) && getInteger(arguments[0]) > 0)
+          profile.start(getInteger(arguments[0]));
+        else
+          profile.stop();
+      }
+      break;
+
+    case 17: /* write the allocation samples to the named file as folded stacks */
+      {
+        FILE* fp = NULL;
+        if(!isImmediate(arguments[0]) && objectRef(arguments[0]).isBytes())
+          fp = fopen(objectRef(arguments[0]).charPtr(), "w");
+        if(fp != NULL)
+        {
+          VM::state().allocationProfile.writeFolded(fp);
+          fclose(fp);
+        }
+        returnedObject = VM::state().booleanSyms[(fp != NULL)? booleanTrue : booleanFalse];
+      }
+      break;
+
+    case 18: /* save the image to the named file in the background, answers
+                false if a snapshot is already being saved */
+      {
+        bool started = !isImmediate(arguments[0]) && objectRef(arguments[0]).isBytes() &&
+          MemoryManager::Instance()->startSnapshot(objectRef(arguments[0]).charPtr());
+        returnedObject = VM::state().booleanSyms[started? booleanTrue : booleanFalse];
+      }
+      break;
+
+    case 19: /* whether the last snapshot was saved, once it has finished, nil until then */
+      switch(MemoryManager::Instance()->snapshotStatus())
+      {
+        case kSnapshotSaved:
+          returnedObject = VM::state().booleanSyms[booleanTrue];
+          break;
+        case kSnapshotFailed:
+          returnedObject = VM::state().booleanSyms[booleanFalse];
+          break;
+        default:
+          break;
+      }
+      break;
+
+    case 20: /* save the image to the named file, replacing it and any
+                changes appended to it */
+      {
+        bool saved = !isImmediate(arguments[0]) && objectRef(arguments[0]).isBytes() &&
+          MemoryManager::Instance()->imageSave(objectRef(arguments[0]).charPtr());
+        returnedObject = VM::state().booleanSyms[saved? booleanTrue : booleanFalse];
+      }
+      break;
+
+    case 21: /* append the changes since the image was last saved or read to
+                the named file, answers false if it isn't that image */
+      {
+        FILE* fp = NULL;
+        if(!isImmediate(arguments[0]) && objectRef(arguments[0]).isBytes())
+          fp = fopen(objectRef(arguments[0]).charPtr(), "r+b");
+        bool saved = false;
+        if(fp != NULL)
+        {
+          /* the interpreter writes the stack directly */
+          MemoryManager::Instance()->writeBarrier(VM::state().processStack);
+          saved = MemoryManager::Instance()->imageWriteDelta(fp);
+          fclose(fp);
+        }
+        returnedObject = VM::state().booleanSyms[saved? booleanTrue : booleanFalse];
+      }
+      break;
+
+    case 22: /* save the image to the named file, its objects numbered afresh
+                in the order they are reached */
+      {
+        bool saved = !isImmediate(arguments[0]) && objectRef(arguments[0]).isBytes() &&
+          MemoryManager::Instance()->imageSave(objectRef(arguments[0]).charPtr(), true);
+        returnedObject = VM::state().booleanSyms[saved? booleanTrue : booleanFalse];
+      }
+      break;
+
+    case 23: /* whether the image was numbered afresh as it was saved, so
+                what hashes by number has to be rehashed */
+      returnedObject = VM::state().booleanSyms[MemoryManager::Instance()->imageRenumbered()? booleanTrue : booleanFalse];
+      break;
+
+    case 24: /* every object that understands the given selector, an Array */
+      returnedObject = allResponders(arguments[0]);
+      break;
+
     default:
       sysError("unknown primitive","sysPrimitive");
   }
@@ -11,6 +11,7 @@
 #include "env.h"
 #include "objmemory.h"
 #include "names.h"
+#include "vm.h"
 
 void fileIn(FILE* fd, bool printit);
 
@@ -20,7 +21,7 @@ void fileIn(FILE* fd, bool printit);
    */
 # define MAXFILES 20
 /* we assume this is initialized to NULL */
-static FILE *fp[MAXFILES];
+static TW_THREAD FILE *fp[MAXFILES];
 
 object ioPrimitive(int number, object* arguments)
 {   
@@ -48,7 +49,12 @@ object ioPrimitive(int number, object* arguments)
         else if (streq(p, "stderr"))
           fp[i] = stderr;
         else {
-          fp[i] = fopen(p, objectRef(arguments[2]).charPtr());
+          char* mode = objectRef(arguments[2]).charPtr();
+          /* the running image may be mapped from the file to be written */
+          if (strpbrk(mode, "wa+") != NULL && !MemoryManager::Instance()->releaseImageFile(p))
+            fp[i] = NULL;
+          else
+            fp[i] = fopen(p, mode);
         }
         if (fp[i] == NULL)
           returnedObject = nilobj;
@@ -92,8 +98,10 @@ object ioPrimitive(int number, object* arguments)
       break;
 
     case 7:     /* write an object image */
-      if (fp[i]) MemoryManager::Instance()->imageWrite(fp[i]);
-      returnedObject = booleanSyms[booleanTrue];
+      {
+        bool saved = fp[i] && MemoryManager::Instance()->imageWrite(fp[i]);
+        returnedObject = VM::state().booleanSyms[saved? booleanTrue : booleanFalse];
+      }
       break;
 
     case 8:     /* print no return */
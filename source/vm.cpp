@@ -0,0 +1,84 @@
+/*
+    Tumbleweed
+
+    a VM, one Smalltalk system isolated from any others in the process
+*/
+
+#include <stdio.h>
+
+#include "env.h"
+#include "objmemory.h"
+#include "names.h"
+#include "interp.h"
+#include "vm.h"
+
+#if defined TW_ENABLE_FFI
+extern void initFFISymbols();   /* FFI symbols */
+#endif
+
+TW_THREAD TVMState* VM::m_state = NULL;
+
+VM::VM(const std::string& image, const THeapGrowth& growth) :
+    m_image(image),
+    m_growth(growth),
+    m_succeeded(false)
+{
+}
+
+VM::~VM()
+{
+    join();
+}
+
+void VM::start(const std::string& code)
+{
+    m_code = code;
+    m_thread = std::thread(&VM::run, this);
+}
+
+bool VM::join()
+{
+    if(m_thread.joinable())
+        m_thread.join();
+    return m_succeeded;
+}
+
+/* runs on the VM's own thread, everything made here, the object memory
+   and the state, is that thread's alone */
+void VM::run()
+{
+    MemoryManager::Initialise();
+    MemoryManager::Instance()->setHeapGrowth(m_growth);
+    m_state = new TVMState();
+
+    FILE* fp = fopen(m_image.c_str(), "rb");
+    if(NULL != fp)
+    {
+        MemoryManager::Instance()->imageRead(fp);
+        fclose(fp);
+
+        initCommonSymbols();
+#if defined TW_ENABLE_FFI
+        initFFISymbols();
+#endif
+        runCode("ObjectMemory returnFromSnapshot");
+        if(!m_code.empty())
+        {
+            runCode(m_code.c_str());
+            m_succeeded = true;
+        }
+        else
+        {
+            ObjectHandle process = globalSymbol("systemProcess");
+            if(process != nilobj)
+            {
+                while(execute(process, 15000)) ;
+                m_succeeded = true;
+            }
+        }
+    }
+
+    delete m_state;
+    m_state = NULL;
+    MemoryManager::Release();
+}
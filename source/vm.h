@@ -0,0 +1,141 @@
+/*
+    Tumbleweed
+
+    a VM, one Smalltalk system isolated from any others in the process
+*/
+
+#ifndef VM_H_INCLUDED
+#define VM_H_INCLUDED
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "env.h"
+#include "objmemory.h"
+#include "names.h"
+#include "interp.h"
+#include "allocprofile.h"
+
+//! An entry in the interpreter's cache of recently executed methods.
+struct TMethodCacheEntry
+{
+    ObjectHandle cacheMessage;  /* the message being requested */
+    ObjectHandle lookupClass;   /* the class of the receiver */
+    ObjectHandle cacheClass;    /* the class of the method */
+    ObjectHandle cacheMethod;   /* the method itself */
+};
+
+/*! \brief The state of a VM, other than its object memory.
+ *
+ * The interpreter registers and method cache, and the symbols that the
+ * interpreter and primitives refer to directly. It belongs to the thread
+ * running the VM, its handles are on that thread's root stack.
+ */
+struct TVMState
+{
+    TVMState() : linkPointer(0) {}
+
+    /* the interpreter registers, also manipulated by primitives */
+    ObjectHandle processStack;
+    int linkPointer;
+    ObjectHandle method;
+    ObjectHandle messageToSend;
+    TMethodCacheEntry methodCache[cacheSize];
+
+    /* filled in by initCommonSymbols() */
+    std::vector<ObjectHandle> booleanSyms;
+    std::vector<ObjectHandle> unSyms;
+    std::vector<ObjectHandle> binSyms;
+    ObjectHandle classSyms[k__lastClass+1];
+
+    TAllocationProfile allocationProfile;
+};
+
+/*! \brief A Smalltalk system, isolated from any others in the process.
+ *
+ * A VM has its own object memory, symbols, method cache and interpreter
+ * registers, and runs an image on a thread of its own, so several can
+ * run side by side, each on its own core.
+ *
+ * Code running in a VM finds its state through VM::state(), and its
+ * object memory through MemoryManager::Instance(), both per thread. A
+ * thread that doesn't start a VM, such as the main thread of tw, gets
+ * state of its own the first time it asks.
+ */
+class VM
+{
+    public:
+        /*! Constructor, the image isn't read until the VM is started.
+         *
+         * \param image The file name of the image to run.
+         * \param growth The heap growth policy of the VM's object memory.
+         */
+        VM(const std::string& image, const THeapGrowth& growth = THeapGrowth());
+
+        //! Destructor, waits for the VM to finish.
+        ~VM();
+
+        /*! Start the VM on a thread of its own.
+         *
+         * The image is read, then the code given is run, or if there is
+         * none, the image's systemProcess, until it finishes.
+         *
+         * \param code Smalltalk statements to run.
+         */
+        void start(const std::string& code = std::string());
+
+        /*! Wait for the VM to finish.
+         *
+         * \return False if the image couldn't be read, or had nothing to run.
+         */
+        bool join();
+
+        //! The calling thread's VM state.
+        static TVMState& state();
+
+    private:
+        void run();
+
+        std::string m_image;
+        std::string m_code;
+        THeapGrowth m_growth;
+        std::thread m_thread;
+        bool        m_succeeded;
+
+        static TW_THREAD TVMState* m_state;
+};
+
+inline TVMState& VM::state()
+{
+    if(NULL == m_state)
+        m_state = new TVMState();
+    return *m_state;
+}
+
+inline object classObject(ClassSymbols_t cname) {
+    object cached = VM::state().classSyms[cname];
+    if(cached != nilobj) {
+        return cached;
+    } else {
+        return globalSymbol(classStrs[cname].name);
+    }
+}
+
+//! The class of a SmallInteger, Character or Float held as an immediate.
+inline object immediateClass(object o) {
+    if(isSmallInteger(o))
+        return classObject(kInteger);
+    return classObject(isCharacter(o)? kChar : kFloat);
+}
+
+//! True for a LargePositiveInteger or LargeNegativeInteger, never in images without them.
+inline bool isLargeInteger(object o) {
+    if(isImmediate(o))
+        return false;
+    TVMState& vm = VM::state();
+    object cls = objectRef(o).objectClass();
+    return cls != nilobj && (cls == vm.classSyms[kLargePositiveInteger] || cls == vm.classSyms[kLargeNegativeInteger]);
+}
+
+#endif
@@ -10,8 +10,8 @@
 # include "env.h"
 # include "objmemory.h"
 # include "names.h"
+# include "vm.h"
 
-extern object booleanSyms[booleanTrue], booleanSyms[booleanFalse];
 extern boolean parseok;
 extern int initial;
 
@@ -374,8 +374,8 @@ object *arguments;
     
     case 202:   /* asky a binary question */
         i = waskync(objectRef(arguments[0]).charPtr(), intValue(arguments[1]));
-        if (i == 1) returnedObject = booleanSyms[booleanTrue];
-        else if (i == 0) returnedObject = booleanSyms[booleanFalse];
+        if (i == 1) returnedObject = VM::state().booleanSyms[booleanTrue];
+        else if (i == 0) returnedObject = VM::state().booleanSyms[booleanFalse];
         break;
 
     case 203:   /* ask for a file */
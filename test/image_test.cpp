@@ -0,0 +1,101 @@
+#include "gtest/gtest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "objmemory.h"
+#include "vm.h"
+
+/* the image shipped in the source tree, which these tests start from */
+#if !defined TW_TEST_IMAGE
+#define TW_TEST_IMAGE "systemImage"
+#endif
+
+/* run code in a VM on the image, answering the first line the code wrote
+   to resultPath, empty if it wrote none */
+static std::string runImage(const char* image, const std::string& code, const char* resultPath)
+{
+  remove(resultPath);
+  VM vm(image);
+  vm.start(code);
+  if(!vm.join())
+    return std::string();
+  char line[256] = { 0 };
+  FILE* fp = fopen(resultPath, "r");
+  if(fp == NULL)
+    return std::string();
+  if(fgets(line, sizeof(line), fp) == NULL)
+    line[0] = '\0';
+  fclose(fp);
+  remove(resultPath);
+  line[strcspn(line, "\r\n")] = '\0';
+  return line;
+}
+
+/* statements compiling a method into aClass, and adding it */
+static std::string addMethod(const char* aClass, const std::string& text)
+{
+  std::string quoted;
+  for(size_t i = 0; i < text.size(); ++i)
+  {
+    quoted += text[i];
+    if(text[i] == '\'')
+      quoted += '\'';
+  }
+  return std::string("#ImageTestMethod assign: Method new.\n") +
+    "ImageTestMethod text: '" + quoted + "'.\n" +
+    "ImageTestMethod compileWithClass: " + aClass + ".\n" +
+    aClass + " methods at: ImageTestMethod name put: ImageTestMethod.\n";
+}
+
+/* statements writing the printString of expression to path */
+static std::string writeResult(const char* path, const std::string& expression)
+{
+  return std::string("#ImageTestFile assign: File new.\n") +
+    "ImageTestFile name: '" + path + "'.\n" +
+    "ImageTestFile open: 'w'.\n" +
+    "ImageTestFile print: (" + expression + ") printString.\n" +
+    "ImageTestFile close\n";
+}
+
+TEST(ImageTest, CompactImageKeepsHashedCollections)
+{
+  const char* path = "image_test_compact.image";
+  const char* result = "image_test_result.txt";
+  remove(path);
+
+  // A Set and a Dictionary of objects that hash by their numbers, held
+  // by an object that understands rehash, saved with their numbers 
+  // changed. Blocks can't be made by code run from outside the image, so
+  // the work is done in methods of a class made for the test.
+  std::string save =
+    "Object subClass: #ImageTestHashed instanceVariableNames: #(keys set dictionary rehashed).\n" +
+    addMethod("ImageTestHashed",
+      "fill\n"
+      "  keys <- Array new: 100.\n"
+      "  set <- Set new.\n"
+      "  dictionary <- Dictionary new.\n"
+      "  (1 to: 100) do: [:i |\n"
+      "    keys at: i put: Object new.\n"
+      "    set add: (keys at: i).\n"
+      "    dictionary at: (keys at: i) put: i ]") +
+    addMethod("ImageTestHashed",
+      "rehash\n"
+      "  rehashed <- true") +
+    addMethod("ImageTestHashed",
+      "found | count |\n"
+      "  count <- 0.\n"
+      "  (1 to: 100) do: [:i |\n"
+      "    ((set includes: (keys at: i)) and: [ (dictionary at: (keys at: i) ifAbsent: [ 0 ]) = i ])\n"
+      "      ifTrue: [ count <- count + 1 ] ].\n"
+      "  ^ count printString, ' ', rehashed printString") +
+    "#ImageTestHashedInstance assign: ImageTestHashed new.\n"
+    "ImageTestHashedInstance fill.\n" +
+    writeResult(result, std::string("ObjectMemory saveCompactImageTo: '") + path + "'");
+  ASSERT_EQ("true", runImage(TW_TEST_IMAGE, save, result));
+
+  EXPECT_EQ("'100 true'", runImage(path, writeResult(result, "ImageTestHashedInstance found"), result));
+  remove(path);
+}
@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <limits.h>
+#include <math.h>
+#include "largeint.h"
+
+static TLargeInteger power(long base, int exponent)
+{
+  TLargeInteger result(1);
+  for(int i = 0; i < exponent; ++i)
+    result = result * TLargeInteger(base);
+  return result;
+}
+
+TEST(LargeIntegerTest, LongRoundTrip)
+{
+  const long values[] = { 0, 1, -1, 255, -256, LONG_MAX, LONG_MIN, 1L << 40 };
+  for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+  {
+    long back = 0;
+    TLargeInteger n(values[i]);
+    ASSERT_TRUE(n.toLong(back));
+    EXPECT_EQ(values[i], back);
+    // And through the bytes of an object.
+    std::vector<unsigned char> bytes(n.byteCount() + 1);
+    n.getBytes(&bytes[0]);
+    TLargeInteger again(&bytes[0], n.byteCount(), n.negative());
+    EXPECT_EQ(0, TLargeInteger::compare(n, again));
+  }
+  long unchanged = 7;
+  EXPECT_FALSE((TLargeInteger(LONG_MAX) + TLargeInteger(1)).toLong(unchanged));
+  EXPECT_FALSE((TLargeInteger(LONG_MIN) - TLargeInteger(1)).toLong(unchanged));
+  EXPECT_EQ(7, unchanged);
+}
+
+TEST(LargeIntegerTest, Printing)
+{
+  EXPECT_EQ("0", TLargeInteger().toString(10));
+  EXPECT_EQ("-FF", TLargeInteger(-255).toString(16));
+  EXPECT_EQ("100000000000000000000000000000000", power(2, 32).toString(2));
+  TLargeInteger f(1);
+  for(long i = 2; i <= 100; ++i)
+    f = f * TLargeInteger(i);
+  EXPECT_EQ("93326215443944152681699238856266700490715968264381621468592963895217599993229915608941463976156518286253697920827223758251185210916864000000000000000000000000", f.toString(10));
+  EXPECT_EQ("", f.toString(37));
+}
+
+TEST(LargeIntegerTest, Parsing)
+{
+  TLargeInteger f(1);
+  for(long i = 2; i <= 100; ++i)
+    f = f * TLargeInteger(i);
+  TLargeInteger parsed;
+  ASSERT_TRUE(TLargeInteger::fromString(f.toString(10), 10, parsed));
+  EXPECT_EQ(0, TLargeInteger::compare(f, parsed));
+  ASSERT_TRUE(TLargeInteger::fromString("ff", 16, parsed));
+  EXPECT_EQ("255", parsed.toString(10));
+  ASSERT_TRUE(TLargeInteger::fromString("0004611686018427387904", 10, parsed));
+  EXPECT_EQ("4611686018427387904", parsed.toString(10));
+  EXPECT_FALSE(TLargeInteger::fromString("", 10, parsed));
+  EXPECT_FALSE(TLargeInteger::fromString("12a", 10, parsed));
+  EXPECT_FALSE(TLargeInteger::fromString("-1", 10, parsed));
+  EXPECT_EQ("4611686018427387904", parsed.toString(10));
+}
+
+TEST(LargeIntegerTest, Karatsuba)
+{
+  // Well past the threshold, and lopsided, against a known value.
+  std::string digits = power(3, 1000).toString(10);
+  EXPECT_EQ(478u, digits.size());
+  EXPECT_EQ("132207081948080663689045525975", digits.substr(0, 30));
+  EXPECT_EQ("614366132173102768902855220001", digits.substr(448));
+  TLargeInteger a = power(3, 700) + TLargeInteger(12345);
+  TLargeInteger b = power(7, 500) - TLargeInteger(1);
+  TLargeInteger q, r;
+  ASSERT_TRUE(TLargeInteger::divide(a * b + TLargeInteger(17), b, q, r));
+  EXPECT_EQ(0, TLargeInteger::compare(a, q));
+  EXPECT_EQ(0, TLargeInteger::compare(TLargeInteger(17), r));
+  // (a + b)^2 = a^2 + 2ab + b^2
+  TLargeInteger lhs = (a + b) * (a + b);
+  TLargeInteger rhs = a * a + TLargeInteger(2) * a * b + b * b;
+  EXPECT_EQ(0, TLargeInteger::compare(lhs, rhs));
+}
+
+TEST(LargeIntegerTest, Division)
+{
+  TLargeInteger q, r;
+  EXPECT_FALSE(TLargeInteger::divide(TLargeInteger(1), TLargeInteger(), q, r));
+  // Truncated, the remainder has the dividend's sign.
+  ASSERT_TRUE(TLargeInteger::divide(-power(2, 200), TLargeInteger(7), q, r));
+  EXPECT_EQ("-24924924924924924924924924924924924924924924924924", q.toString(16));
+  EXPECT_EQ("-4", r.toString(10));
+  ASSERT_TRUE(TLargeInteger::divide(TLargeInteger(-7), TLargeInteger(2), q, r));
+  EXPECT_EQ("-3", q.toString(10));
+  EXPECT_EQ("-1", r.toString(10));
+  TLargeInteger x = power(3, 300) * TLargeInteger(11 * 13);
+  TLargeInteger y = power(7, 200) * TLargeInteger(13 * 17);
+  EXPECT_EQ("13", TLargeInteger::gcd(x, -y).toString(10));
+}
+
+TEST(LargeIntegerTest, Bits)
+{
+  TLargeInteger big = power(2, 100);
+  EXPECT_EQ("0", TLargeInteger::bitAnd(-big, power(2, 99) + TLargeInteger(12345)).toString(10));
+  EXPECT_EQ("-1267650600228229401496703205377", TLargeInteger::bitOr(-big - TLargeInteger(1), TLargeInteger(5)).toString(10));
+  EXPECT_EQ("-1267650600228229401496703205379", TLargeInteger::bitXor(big, TLargeInteger(-3)).toString(10));
+  // Right shifts round towards negative infinity.
+  EXPECT_EQ("-1361129467683753853853498429727072845824", (-power(2, 200)).shift(-70).toString(10));
+  EXPECT_EQ("2305843009213693952", (power(2, 64) + TLargeInteger(5)).shift(-3).toString(10));
+  EXPECT_EQ("-1", TLargeInteger(-1).shift(-1000).toString(10));
+  EXPECT_EQ(0, TLargeInteger::compare(big, TLargeInteger(1).shift(100)));
+}
+
+TEST(LargeIntegerTest, Doubles)
+{
+  TLargeInteger n;
+  ASSERT_TRUE(TLargeInteger::fromDouble(-1e30, n));
+  EXPECT_EQ("-1000000000000000019884624838656", n.toString(10));
+  EXPECT_DOUBLE_EQ(-1e30, n.toDouble());
+  ASSERT_TRUE(TLargeInteger::fromDouble(-2.75, n));
+  EXPECT_EQ("-2", n.toString(10));
+  EXPECT_FALSE(TLargeInteger::fromDouble(HUGE_VAL, n));
+  EXPECT_FALSE(TLargeInteger::fromDouble(NAN, n));
+}
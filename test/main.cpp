@@ -3,7 +3,7 @@
 
 int main(int argc, char **argv)
 {
-    std::cout << "Initial: " << ObjectHandle::getListHead() << std:: endl;
+    std::cout << "Initial: " << ObjectHandle::numTotalHandles() << std:: endl;
     ::testing::InitGoogleTest(&argc, argv);
     int ret = RUN_ALL_TESTS();
     return ret;
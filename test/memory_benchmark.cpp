@@ -0,0 +1,602 @@
+/*
+ * MemoryManager benchmarks.
+ *
+ * Not part of the unit tests, run by hand to compare allocator and
+ * collector changes. Each benchmark prints the time taken and a rate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "objmemory.h"
+
+/* report a fatal system error */
+void sysError(const char* s1, const char* s2)
+{
+  fprintf(stderr,"%s\n%s\n", s1, s2);
+  abort();
+}
+
+/* Sizes in the rough proportion the interpreter asks for them: Links,
+   Contexts, argument and temporary Arrays, short strings and Floats. */
+static const size_t sizes[] = { 3, 8, 3, 1, 2, 3, 9, 4, 3, 5, 8, 1, 3, 6, 2, 20 };
+static const size_t sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+
+static double seconds(clock_t start)
+{
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void report(const char* name, size_t count, double secs)
+{
+  printf("%-40s %8.3fs %12.0f allocs/s\n", name, secs, count / secs);
+}
+
+
+/*
+ * A replica of the allocator this benchmark was written to replace, a
+ * multimap of free slots keyed on size plus its inverse, with the
+ * exact size, size zero, trim bigger, regrow smaller fallbacks.
+ */
+class LegacyAllocator
+{
+  public:
+    LegacyAllocator(size_t initialSize, size_t growCount) : growAmount(growCount)
+    {
+      grow(initialSize);
+    }
+
+    ~LegacyAllocator()
+    {
+      for(size_t i = 0; i < table.size(); ++i)
+        free(table[i].memory);
+    }
+
+    object alloc(size_t memorySize)
+    {
+      std::multimap<size_t, object>::iterator tpos;
+      object position;
+
+      if((tpos = freeList.find(memorySize)) != freeList.end())
+      {
+        position = tpos->second;
+        freeList.erase(tpos);
+        freeListInv.erase(position);
+      }
+      else if((tpos = freeList.find(0)) != freeList.end())
+      {
+        position = tpos->second;
+        freeList.erase(tpos);
+        freeListInv.erase(position);
+        table[position].memory = mBlockAlloc(memorySize);
+      }
+      else if((tpos = freeList.upper_bound(memorySize)) != freeList.end())
+      {
+        position = tpos->second;
+        freeList.erase(tpos);
+        freeListInv.erase(position);
+      }
+      else if(!freeList.empty())
+      {
+        tpos = --freeList.end();
+        position = tpos->second;
+        freeList.erase(tpos);
+        freeListInv.erase(position);
+        free(table[position].memory);
+        table[position].memory = mBlockAlloc(memorySize);
+      }
+      else
+      {
+        grow(growAmount);
+        return alloc(memorySize);
+      }
+      table[position].setPointerSize(memorySize);
+      return position << 1;
+    }
+
+    void destroy(object z)
+    {
+      ObjectStruct& p = table[z];
+      if(freeListInv.find(z) == freeListInv.end())
+      {
+        freeList.insert(std::pair<size_t, object>(p.size(), z));
+        freeListInv.insert(std::pair<object, size_t>(z, p.size()));
+      }
+      for(long i = p.size(); i > 0; )
+        p.memory[--i] = nilobj;
+    }
+
+  private:
+    void grow(size_t amount)
+    {
+      ObjectStruct empty;
+      memset(&empty, 0, sizeof(empty));
+      size_t current = table.size();
+      table.resize(current + amount, empty);
+      for(size_t i = current; i < table.size(); ++i)
+      {
+        freeList.insert(std::pair<size_t, object>(0, i));
+        freeListInv.insert(std::pair<object, size_t>(i, 0));
+      }
+    }
+
+    std::vector<ObjectStruct> table;
+    std::multimap<size_t, object> freeList;
+    std::map<object, size_t> freeListInv;
+    size_t growAmount;
+};
+
+
+/*
+ * A replica of the handle this benchmark was written to replace, each
+ * one linked into a global doubly linked list while it is alive.
+ */
+class LegacyHandle
+{
+  public:
+    LegacyHandle(long o = 0) : handle(o) { append(); }
+    LegacyHandle(const LegacyHandle& from) : handle(from.handle) { append(); }
+    ~LegacyHandle()
+    {
+      if(prev) prev->next = next;
+      if(next) next->prev = prev;
+      if(head == this) head = next;
+      if(tail == this) tail = prev;
+    }
+    LegacyHandle& operator=(long o) { handle = o; return *this; }
+    operator long() const { return handle; }
+
+  private:
+    void append()
+    {
+      next = NULL;
+      prev = tail;
+      if(tail) tail->next = this; else head = this;
+      tail = this;
+    }
+
+    long handle;
+    LegacyHandle* next;
+    LegacyHandle* prev;
+    static LegacyHandle* head;
+    static LegacyHandle* tail;
+};
+
+LegacyHandle* LegacyHandle::head = NULL;
+LegacyHandle* LegacyHandle::tail = NULL;
+
+
+/*
+ * Allocation with a sliding window of live objects, the oldest object
+ * is destroyed as each new one is made. Measures slot reuse only.
+ */
+static void benchAllocFree(size_t window, size_t count)
+{
+  std::vector<object> live(window, nilobj);
+  clock_t start;
+
+  {
+    LegacyAllocator legacy(window + 1, 5000);
+    start = clock();
+    for(size_t i = 0; i < count; ++i)
+    {
+      object& slot = live[i % window];
+      if(slot != nilobj)
+        legacy.destroy(slot >> 1);
+      slot = legacy.alloc(sizes[i % sizeCount]);
+    }
+    report("alloc/free, multimap free list", count, seconds(start));
+  }
+
+  live.assign(window, nilobj);
+  MemoryManager::Initialise(window + 1, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  start = clock();
+  for(size_t i = 0; i < count; ++i)
+  {
+    object& slot = live[i % window];
+    if(slot != nilobj)
+      mm->destroyObject(objectIndex(slot));
+    slot = mm->allocObject(sizes[i % sizeCount]);
+  }
+  report("alloc/free, size class free lists", count, seconds(start));
+}
+
+/*
+ * Allocation of garbage only, the collector reclaims everything each
+ * time the free lists run dry. Measures allocation plus collection.
+ */
+static void benchAllocCollect(size_t heap, size_t count)
+{
+  MemoryManager::Initialise(heap, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  clock_t start = clock();
+  for(size_t i = 0; i < count; ++i)
+    mm->allocObject(sizes[i % sizeCount]);
+  report("alloc/collect, size class free lists", count, seconds(start));
+}
+
+/*
+ * Allocation where each free slot is reused at a different size, so 
+ * every allocation has to replace the slot's data area.
+ */
+static void benchAllocResize(size_t window, size_t count)
+{
+  std::vector<object> live(window, nilobj);
+  MemoryManager::Initialise(window + 1, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  clock_t start = clock();
+  for(size_t i = 0; i < count; ++i)
+  {
+    object& slot = live[i % window];
+    if(slot != nilobj)
+      mm->destroyObject(objectIndex(slot));
+    slot = mm->allocObject(1 + (i * 7) % 40);
+  }
+  report("alloc/free, changing sizes", count, seconds(start));
+}
+
+/*
+ * Full collections of a heap of Link like objects, the mark phase 
+ * follows each chain through memory allocated in order.
+ */
+static void benchCollectLinks(size_t heap, size_t collections)
+{
+  MemoryManager::Initialise(heap + 1000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  std::vector<ObjectHandle> chains(100);
+  for(size_t i = 0; i < heap; i += 2)
+  {
+    ObjectHandle& chain = chains[i % chains.size()];
+    object link = mm->allocObject(3);
+    mm->objectFromID(link).basicAtPut(1, chain);
+    mm->objectFromID(link).basicAtPut(2, mm->allocObject(2));
+    chain = link;
+  }
+  clock_t start = clock();
+  for(size_t i = 0; i < collections; ++i)
+    mm->garbageCollect();
+  double secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f objects/s\n", "full collection, linked heap", secs, heap * collections / secs);
+}
+
+/* stands in for the interpreter, called through a pointer the compiler
+   can't see through, so the handles have to be kept up to date around it */
+static long executeProcess(long process)
+{
+  return process + 2;
+}
+static long (*volatile execute)(long) = executeProcess;
+
+/*
+ * The handles sendMessageToObject makes for each call, the receiver and
+ * result passed by value, the new process and its stack, and the saved
+ * process stack, beneath the handles held by the callers.
+ */
+template<typename H>
+static H sendMessageHandles(H receiver, H* args, int cargs)
+{
+  H process(receiver + 2);
+  H stack(process + 2);
+  for(int i = 0; i < cargs; ++i)
+    stack = stack + args[i];
+  H saveProcessStack(stack);
+  long ro = execute(process);
+  stack = saveProcessStack;
+  return ro;
+}
+
+template<typename H>
+static void benchHandleChurn(const char* name, size_t depth, size_t count)
+{
+  std::vector<H> held(depth, H(2));
+  H args[2] = { H(4), H(6) };
+  long total = 0;
+  clock_t start = clock();
+  for(size_t i = 0; i < count; ++i)
+    total += sendMessageHandles(H(i << 1), args, 2);
+  double secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f sends/s\n", name, secs, count / secs);
+  if(total == 1)
+    printf("\n");
+}
+
+/*
+ * Full collections of a large heap of short chains with one worker and
+ * then with several, for the speedup of the parallel mark and sweep. The
+ * times are wall clock, clock() adds up all the threads.
+ */
+static void benchParallelCollect(size_t heap, size_t collections, size_t workers)
+{
+  MemoryManager::Initialise(heap + 1000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  std::vector<ObjectHandle> roots(1000);
+  for(size_t i = 0; i < heap; ++i)
+  {
+    ObjectHandle& chain = roots[i % roots.size()];
+    object link = mm->allocObject(2);
+    mm->objectFromID(link).basicAtPut(1, chain);
+    chain = link;
+  }
+
+  mm->garbageCollect();
+  double serial = 0;
+  for(size_t n = 1; ; n = std::min(n * 2, workers))
+  {
+    mm->setGCWorkers(n);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < collections; ++i)
+      mm->garbageCollect();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / collections;
+    if(n == 1)
+      serial = secs;
+    char name[64];
+    sprintf(name, "parallel collection, %lu workers", (unsigned long)n);
+    printf("%-40s %8.3fs %11.2fx\n", name, secs, serial / secs);
+    if(n >= workers)
+      break;
+  }
+}
+
+/*
+ * Scanning a string a character at a time, each character either a new
+ * one slot object, as Char used to be, or an immediate. The collector
+ * runs as the boxed characters use up the heap.
+ */
+static void benchStringIteration(size_t count)
+{
+  MemoryManager::Initialise(100000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle text = mm->allocStr("the quick brown fox jumps over the lazy dog");
+  int length = mm->objectFromID(text).size();
+  long sum = 0;
+  clock_t start = clock();
+  for(size_t i = 0; i < count; ++i)
+  {
+    object c = mm->allocObject(1);
+    mm->objectFromID(c).basicAtPut(1, (mm->objectFromID(text).byteAt(i % length + 1) << 1) | 1);
+    sum += mm->objectFromID(c).basicAt(1) >> 1;
+  }
+  double secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f chars/s\n", "string iteration, boxed chars", secs, count / secs);
+
+  start = clock();
+  for(size_t i = 0; i < count; ++i)
+  {
+    object c = immediateChar(mm->objectFromID(text).byteAt(i % length + 1));
+    sum -= immediateCharValue(c);
+  }
+  secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f chars/s\n", "string iteration, immediate chars", secs, count / secs);
+  if(sum != 0)
+    printf("checksum mismatch\n");
+}
+
+/*
+ * A loop of Float arithmetic, each result either a new byte object, or
+ * an immediate when its exponent allows, as newFloat() does.
+ */
+static void benchFloatLoop(size_t count)
+{
+  MemoryManager::Initialise(100000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  double boxed, immediate;
+  object x = mm->allocByte(sizeof(double));
+  double d = 1.0;
+  memcpy(mm->objectFromID(x).charPtr(), &d, sizeof(double));
+  clock_t start = clock();
+  for(size_t i = 0; i < count; ++i)
+  {
+    d = mm->objectFromID(x).floatValue() * 0.999999 + 0.001;
+    x = mm->allocByte(sizeof(double));
+    memcpy(mm->objectFromID(x).charPtr(), &d, sizeof(double));
+  }
+  boxed = mm->objectFromID(x).floatValue();
+  double secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f floats/s\n", "float loop, boxed", secs, count / secs);
+
+  x = immediateFloat(1.0);
+  start = clock();
+  for(size_t i = 0; i < count; ++i)
+  {
+    d = immediateFloatValue(x) * 0.999999 + 0.001;
+    if(fitsImmediateFloat(d))
+      x = immediateFloat(d);
+    else
+      sysError("float out of immediate range", "benchFloatLoop");
+  }
+  immediate = immediateFloatValue(x);
+  secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f floats/s\n", "float loop, immediate", secs, count / secs);
+  if(boxed != immediate)
+    printf("checksum mismatch\n");
+}
+
+/*
+ * A census of a heap of short chains hung off a table, with a few dozen
+ * classes, counting only and then with retained sizes.
+ */
+static void benchHeapCensus(size_t heap)
+{
+  MemoryManager::Initialise(heap + 1000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle classes = mm->allocObject(40);
+  for(int i = 1; i <= 40; ++i)
+    mm->objectFromID(classes).basicAtPut(i, mm->allocObject(0));
+  ObjectHandle table = mm->allocObject(heap / 10);
+  for(size_t i = 0; i < heap; ++i)
+  {
+    int slot = i % (heap / 10) + 1;
+    object link = mm->allocObject(sizes[i % sizeCount]);
+    mm->objectFromID(link).setClass(mm->objectFromID(classes).basicAt(i % 40 + 1));
+    mm->objectFromID(link).basicAtPut(1, mm->objectFromID(table).basicAt(slot));
+    mm->objectFromID(table).basicAtPut(slot, link);
+  }
+  mm->garbageCollect();
+
+  std::vector<TClassCensus> census;
+  for(int retained = 0; retained <= 1; ++retained)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mm->heapCensus(census, retained != 0);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-40s %8.3fs %12.0f objects/s\n", retained? "heap census, retained sizes" : "heap census, counts", secs, heap / secs);
+  }
+}
+
+/*
+ * Writing an image of a heap of short chains, and reading it back into
+ * a fresh memory manager. The data areas are mapped, so reading should
+ * cost little more than the object table.
+ */
+static void benchImageRead(size_t heap)
+{
+  const char* path = "memory_benchmark.image";
+  MemoryManager::Initialise(heap + 1000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle table = mm->allocObject(heap / 10);
+  for(size_t i = 0; i < heap; ++i)
+  {
+    int slot = i % (heap / 10) + 1;
+    object link = mm->allocObject(sizes[i % sizeCount]);
+    mm->objectFromID(link).basicAtPut(1, mm->objectFromID(table).basicAt(slot));
+    mm->objectFromID(table).basicAtPut(slot, link);
+  }
+  symbols = table;
+  FILE* fp = fopen(path, "wb");
+  if(fp == NULL)
+    return;
+  clock_t start = clock();
+  mm->imageWrite(fp);
+  fclose(fp);
+  double secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f objects/s\n", "image write", secs, heap / secs);
+
+  symbols = nilobj;
+  table = nilobj;
+  MemoryManager::Initialise();
+  fp = fopen(path, "rb");
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  MemoryManager::Instance()->imageRead(fp);
+  fclose(fp);
+  secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - now).count();
+  printf("%-40s %8.3fs %12.0f objects/s\n", "image read", secs, heap / secs);
+  symbols = nilobj;
+  remove(path);
+}
+
+/* a checkpoint after a few thousand changes, against saving in full */
+static void benchImageDelta(size_t heap, size_t changes)
+{
+  const char* path = "memory_benchmark.image";
+  MemoryManager::Initialise(heap + 1000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle table = mm->allocObject(heap / 10);
+  for(size_t i = 0; i < heap; ++i)
+  {
+    int slot = i % (heap / 10) + 1;
+    object link = mm->allocObject(sizes[i % sizeCount]);
+    mm->objectFromID(link).basicAtPut(1, mm->objectFromID(table).basicAt(slot));
+    mm->objectFromID(table).basicAtPut(slot, link);
+  }
+  symbols = table;
+  clock_t start = clock();
+  if(!mm->imageSave(path))
+    return;
+  double secs = seconds(start);
+  printf("%-40s %8.3fs\n", "image save", secs);
+
+  for(size_t i = 0; i < changes; ++i)
+  {
+    object link = mm->objectFromID(table).basicAt(i * 7 % (heap / 10) + 1);
+    mm->objectFromID(link).basicAtPut(1, mm->allocObject(2));
+  }
+  FILE* fp = fopen(path, "r+b");
+  start = clock();
+  mm->imageWriteDelta(fp);
+  fclose(fp);
+  secs = seconds(start);
+  printf("%-40s %8.3fs %12.0f changes/s\n", "image changes", secs, changes / secs);
+  symbols = nilobj;
+  remove(path);
+}
+
+/* an image from a heap with most of its objects gone, saved as it is
+   and renumbered */
+static void benchImageRenumber(size_t heap)
+{
+  MemoryManager::Initialise(heap + 1000, 5000);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle table = mm->allocObject(heap / 10);
+  for(size_t i = 0; i < heap; ++i)
+  {
+    int slot = i % (heap / 10) + 1;
+    object link = mm->allocObject(sizes[i % sizeCount]);
+    mm->objectFromID(link).basicAtPut(1, mm->objectFromID(table).basicAt(slot));
+    mm->objectFromID(table).basicAtPut(slot, link);
+  }
+  /* the oldest six of each chain of ten die, leaving holes all through
+     the table */
+  for(size_t i = 0; i < heap / 10; ++i)
+  {
+    object link = mm->objectFromID(table).basicAt(i + 1);
+    for(int n = 0; n < 3 && link != nilobj; ++n)
+      link = mm->objectFromID(link).basicAt(1);
+    if(link != nilobj)
+      mm->objectFromID(link).basicAtPut(1, nilobj);
+  }
+  symbols = table;
+  const char* paths[] = { "memory_benchmark.image", "memory_benchmark_renumbered.image" };
+  bool saved = mm->imageSave(paths[0]) && mm->imageSave(paths[1], true);
+  symbols = nilobj;
+  table = nilobj;
+  for(int i = 0; i < 2 && saved; ++i)
+  {
+    MemoryManager::Initialise();
+    FILE* fp = fopen(paths[i], "rb");
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    MemoryManager::Instance()->imageRead(fp);
+    double readSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - now).count();
+    long length = ftell(fp);
+    fclose(fp);
+    /* marking follows every reference, so shows how well they are laid out */
+    now = std::chrono::steady_clock::now();
+    MemoryManager::Instance()->garbageCollect();
+    double markSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - now).count();
+    printf("%-40s %8.3fs read %8.3fs collect %6.1fMB %9lu entries\n", 
+        (i == 0)? "image as allocated" : "image renumbered", readSecs, markSecs,
+        length / 1e6, (unsigned long)MemoryManager::Instance()->storageSize());
+    symbols = nilobj;
+  }
+  remove(paths[0]);
+  remove(paths[1]);
+}
+
+int main(int argc, char** argv)
+{
+  size_t count = (argc > 1)? strtoul(argv[1], NULL, 10) : 10000000;
+  size_t workers = (argc > 2)? strtoul(argv[2], NULL, 10) : std::thread::hardware_concurrency();
+
+  printf("%lu allocations\n", (unsigned long)count);
+  benchAllocFree(10000, count);
+  benchAllocCollect(100000, count);
+  benchAllocResize(10000, count);
+  benchHandleChurn<LegacyHandle>("send handles, linked list", 1000, count);
+  benchHandleChurn<ObjectHandle>("send handles, root stack", 1000, count);
+  benchCollectLinks(1000000, 10);
+  benchParallelCollect(12000000, 3, workers > 1? workers : 4);
+  benchStringIteration(count);
+  benchFloatLoop(count);
+  benchHeapCensus(5000000);
+  benchImageRead(5000000);
+  benchImageDelta(5000000, 5000);
+  benchImageRenumber(5000000);
+  return 0;
+}
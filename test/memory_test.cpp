@@ -1,4 +1,10 @@
 #include <gtest/gtest.h>
+#include <math.h>
+#include <thread>
+#if !defined(WIN32)
+#include <signal.h>
+#include <sys/resource.h>
+#endif
 #include "objmemory.h"
 
 /* report a fatal system error */
@@ -41,12 +47,77 @@ TEST_F(MemoryManagerTest, IsInitiallyEmpty)
 TEST_F(MemoryManagerTest, DereferenceNil)
 {
   // Check that dereferencing 0 results in the nilobj
-  EXPECT_EQ(0, MemoryManager::Instance()->objectFromID(0).size);
+  EXPECT_EQ(0, MemoryManager::Instance()->objectFromID(0).size());
 }
 
 TEST_F(MemoryManagerTest, ObjectSize)
 {
-  ASSERT_EQ(10, MemoryManager::Instance()->objectFromID(arrayID).size);
+  ASSERT_EQ(10, MemoryManager::Instance()->objectFromID(arrayID).size());
+}
+
+TEST_F(MemoryManagerTest, ByteObjectSize)
+{
+  EXPECT_LE(sizeof(ObjectStruct), 2 * sizeof(object));
+  ObjectHandle bytes = MemoryManager::Instance()->allocByte(13);
+  ObjectStruct& p = MemoryManager::Instance()->objectFromID(bytes);
+  EXPECT_TRUE(p.isBytes());
+  EXPECT_EQ(13, p.size());
+  EXPECT_EQ(0, p.slotCount());
+  EXPECT_EQ((13 + sizeof(object) - 1) / sizeof(object), p.words());
+  p.byteAtPut(13, 42);
+  EXPECT_EQ(42, p.byteAt(13));
+  // A collection must keep it, and leave it a byte object.
+  MemoryManager::Instance()->garbageCollect();
+  EXPECT_TRUE(p.isBytes());
+  EXPECT_EQ(42, p.byteAt(13));
+}
+
+TEST_F(MemoryManagerTest, VeryLargeObjects)
+{
+  const size_t bytes = (1 << 26) + 3;
+  const size_t slots = (1 << 26) + 5;
+  MemoryManager* mm = MemoryManager::Instance();
+  // Too big for the header, the sizes are kept beside the data areas.
+  ObjectHandle b = mm->allocByte(bytes);
+  ObjectHandle a = mm->allocObject(slots);
+  ObjectStruct& pb = mm->objectFromID(b);
+  ObjectStruct& pa = mm->objectFromID(a);
+  EXPECT_TRUE(pb.isBytes());
+  EXPECT_EQ((long)bytes, pb.size());
+  EXPECT_EQ((bytes + sizeof(object) - 1) / sizeof(object), pb.words());
+  EXPECT_EQ((long)slots, pa.slotCount());
+  pb.bytePtr()[bytes - 1] = 'z';
+  pa.basicAtPut(slots, arrayID);
+  // A collection keeps them as they were.
+  mm->garbageCollect();
+  EXPECT_EQ((long)bytes, pb.size());
+  EXPECT_EQ('z', pb.bytePtr()[bytes - 1]);
+  EXPECT_EQ(arrayID, pa.basicAt(slots));
+  // And releases them, like any other.
+  b = nilobj;
+  a = nilobj;
+  EXPECT_EQ(2, mm->garbageCollect());
+}
+
+TEST_F(MemoryManagerTest, GrowObject)
+{
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle o1 = mm->allocObject(5);
+  ObjectHandle o2 = mm->allocObject(1);
+  mm->objectFromID(o1).basicAtPut(5, o2);
+  EXPECT_TRUE(mm->growObject(o1, 6));
+  ObjectStruct& p = mm->objectFromID(o1);
+  EXPECT_EQ(6, p.size());
+  EXPECT_EQ(o2, p.basicAt(5));
+  EXPECT_EQ(nilobj, p.basicAt(6));
+  // Asking for fewer slots leaves it alone.
+  EXPECT_TRUE(mm->growObject(o1, 2));
+  EXPECT_EQ(6, p.size());
+  ObjectHandle bytes = mm->allocByte(8);
+  EXPECT_FALSE(mm->growObject(bytes, 16));
+  // The moved slots are still traced, so o2 is kept through o1.
+  o2 = nilobj;
+  EXPECT_EQ(0, mm->garbageCollect());
 }
 
 
@@ -87,6 +158,141 @@ TEST_F(MemoryManagerTest, GrowObjectTable)
   EXPECT_EQ(9, MemoryManager::Instance()->freeSlotsCount());
 }
 
+static size_t countGrowths(const THeapGrowth& growth, bool keep)
+{
+  MemoryManager::Initialise(1000, 100, growth);
+  MemoryManager* mm = MemoryManager::Instance();
+  mm->setNurserySize(1000000);
+  ObjectHandle chain;
+  size_t growths = 0;
+  for(int i = 0; i < 50000; ++i)
+  {
+    size_t before = mm->storageSize();
+    object link = mm->allocObject(1);
+    if(keep)
+    {
+      mm->objectFromID(link).basicAtPut(1, chain);
+      chain = link;
+    }
+    if(mm->storageSize() != before)
+      ++growths;
+  }
+  return growths;
+}
+
+TEST(MemoryManagerGrowthTest, GrowthFollowsSurvival)
+{
+  THeapGrowth fixed;
+  fixed.growthFactor = 1.0;
+  fixed.minReclaimRatio = 0;
+  // Everything survives, a fixed grow count means a collection that 
+  // finds nothing every 100 allocations. Growing geometrically, and 
+  // not collecting again straight after a collection found nothing,
+  // keeps both down to a few dozen.
+  EXPECT_LT(400u, countGrowths(fixed, true));
+  EXPECT_GT(40u, countGrowths(THeapGrowth(), true));
+  // All garbage, the table needn't grow at all.
+  EXPECT_EQ(0u, countGrowths(THeapGrowth(), false));
+}
+
+TEST_F(MemoryManagerTest, InstancePerThread)
+{
+  // Another thread has a memory of its own, and roots of its own, so 
+  // collecting there frees its garbage and leaves ours alone.
+  MemoryManager* other = NULL;
+  int otherFreed = -1;
+  int otherCount = -1;
+  std::thread vm([&]() {
+    MemoryManager::Initialise(7, 10);
+    other = MemoryManager::Instance();
+    {
+      ObjectHandle kept = other->allocObject(3);
+      for(int i = 0; i < 4; ++i)
+        other->allocObject(1);
+      otherFreed = other->garbageCollect();
+      otherCount = other->objectCount();
+      EXPECT_EQ(3, other->objectFromID(kept).size());
+    }
+    MemoryManager::Release();
+  });
+  vm.join();
+
+  EXPECT_NE(MemoryManager::Instance(), other);
+  EXPECT_EQ(4, otherFreed);
+  EXPECT_EQ(2, otherCount);
+  EXPECT_EQ(2, MemoryManager::Instance()->objectCount());
+  EXPECT_EQ(10, MemoryManager::Instance()->objectFromID(arrayID).size());
+}
+
+TEST(ImmediateTest, Tags)
+{
+  object c = immediateChar(0x10ffff);
+  object f = immediateFloat(2.5);
+  object i = (42 << 1) | 1;
+  EXPECT_TRUE(isImmediate(c) && isCharacter(c));
+  EXPECT_TRUE(isImmediate(f) && isSmallFloat(f));
+  EXPECT_TRUE(isImmediate(i) && isSmallInteger(i));
+  EXPECT_FALSE(isSmallInteger(c) || isSmallFloat(c));
+  EXPECT_FALSE(isSmallInteger(f) || isCharacter(f));
+  EXPECT_FALSE(isImmediate(objectID(12345)));
+  EXPECT_EQ(12345u, objectIndex(objectID(12345)));
+  EXPECT_EQ(0x10ffff, immediateCharValue(c));
+  EXPECT_EQ(0, immediateCharValue(immediateChar(0)));
+}
+
+TEST(ImmediateTest, FloatsRoundTrip)
+{
+  const double fits[] = { 0.0, -0.0, 1.0, -2.5, 3.14159, 1e30, -1e-30, 1e38 };
+  for(size_t i = 0; i < sizeof(fits) / sizeof(fits[0]); ++i)
+  {
+    ASSERT_TRUE(fitsImmediateFloat(fits[i]));
+    double back = immediateFloatValue(immediateFloat(fits[i]));
+    // Bit for bit, so the sign of zero too.
+    EXPECT_EQ(0, memcmp(&fits[i], &back, sizeof(double))) << fits[i];
+  }
+  // Beyond the exponent range, and the special values, stay boxed.
+  const double boxed[] = { 1e300, -1e-300, 5e-324, HUGE_VAL, -HUGE_VAL, NAN };
+  for(size_t i = 0; i < sizeof(boxed) / sizeof(boxed[0]); ++i)
+    EXPECT_FALSE(fitsImmediateFloat(boxed[i])) << boxed[i];
+}
+
+TEST(ImmediateTest, SmallIntegerRange)
+{
+  // The whole word above the tag bit.
+  EXPECT_EQ(LONG_MAX >> 1, kSmallIntegerMax);
+  EXPECT_TRUE(fitsSmallInteger(kSmallIntegerMax));
+  EXPECT_TRUE(fitsSmallInteger(kSmallIntegerMin));
+  EXPECT_FALSE(fitsSmallInteger(kSmallIntegerMax + 1));
+  EXPECT_FALSE(fitsSmallInteger(kSmallIntegerMin - 1));
+  object max = static_cast<object>((static_cast<unsigned long>(kSmallIntegerMax) << 1) | 1);
+  object min = static_cast<object>((static_cast<unsigned long>(kSmallIntegerMin) << 1) | 1);
+  EXPECT_TRUE(isSmallInteger(max) && isSmallInteger(min));
+  EXPECT_EQ(kSmallIntegerMax, getInteger(max));
+  EXPECT_EQ(kSmallIntegerMin, getInteger(min));
+  // Hashes are never negative, and references keep their old hash.
+  EXPECT_GE(hashObject(min), 0);
+  EXPECT_GE(hashObject(immediateFloat(-2.5)), 0);
+  EXPECT_EQ(24690, hashObject(objectID(12345)));
+}
+
+TEST_F(MemoryManagerTest, ImmediatesAreNotObjects)
+{
+  // Immediates in slots are neither followed nor freed by any collector.
+  ObjectStruct& array = MemoryManager::Instance()->objectFromID(arrayID);
+  array.basicAtPut(1, immediateChar('a'));
+  array.basicAtPut(2, immediateFloat(-0.75));
+  array.basicAtPut(3, (7 << 1) | 1);
+  EXPECT_EQ(0, MemoryManager::Instance()->minorCollect());
+  EXPECT_EQ(0, MemoryManager::Instance()->garbageCollect());
+  MemoryManager::Instance()->startIncrementalCycle();
+  while(MemoryManager::Instance()->incrementalStep())
+    ;
+  EXPECT_EQ(2, MemoryManager::Instance()->objectCount());
+  EXPECT_EQ(immediateChar('a'), array.basicAt(1));
+  EXPECT_EQ(-0.75, immediateFloatValue(array.basicAt(2)));
+  EXPECT_EQ((7 << 1) | 1, array.basicAt(3));
+}
+
 TEST_F(MemoryManagerTest, AllocateFromFree)
 {
   {
@@ -105,158 +311,1080 @@ TEST_F(MemoryManagerTest, AllocateFromFree)
   ObjectHandle o1 = MemoryManager::Instance()->allocObject(2);
   // After one allocation, the GC should result in 5 freed, then one 
   // is reused, resulting in 4 free in the tracker.
-  EXPECT_EQ(1, MemoryManager::Instance()->objectFreeList.count(1));
-  EXPECT_EQ(0, MemoryManager::Instance()->objectFreeList.count(2));
-  EXPECT_EQ(3, MemoryManager::Instance()->objectFreeList.count(3));
+  EXPECT_EQ(1, MemoryManager::Instance()->freeSlotsCount(1));
+  EXPECT_EQ(0, MemoryManager::Instance()->freeSlotsCount(2));
+  EXPECT_EQ(3, MemoryManager::Instance()->freeSlotsCount(3));
   ObjectHandle o2 = MemoryManager::Instance()->allocObject(2);
   // After allocating the second, there should be 3 free, 4 objects,
   // and the three free should all be of size 3.
   EXPECT_EQ(3, MemoryManager::Instance()->freeSlotsCount());
   EXPECT_EQ(4, MemoryManager::Instance()->objectCount());
   EXPECT_EQ(7, MemoryManager::Instance()->storageSize());
-  EXPECT_EQ(0, MemoryManager::Instance()->objectFreeList.count(2));
-  EXPECT_EQ(1, MemoryManager::Instance()->objectFreeList.count(1));
-  EXPECT_EQ(2, MemoryManager::Instance()->objectFreeList.count(3));
+  EXPECT_EQ(0, MemoryManager::Instance()->freeSlotsCount(2));
+  EXPECT_EQ(1, MemoryManager::Instance()->freeSlotsCount(1));
+  EXPECT_EQ(2, MemoryManager::Instance()->freeSlotsCount(3));
 }
 
+TEST_F(MemoryManagerTest, MinorCollectPromotes)
+{
+  ObjectHandle survivor = MemoryManager::Instance()->allocObject(2);
+  MemoryManager::Instance()->allocObject(3);
+  // The unreferenced young object is freed, the rest are promoted.
+  EXPECT_EQ(1, MemoryManager::Instance()->minorCollect());
+  EXPECT_TRUE(MemoryManager::Instance()->objectFromID(survivor).flags & kOld);
+  // Once old, only a full collection will free it.
+  survivor = nilobj;
+  EXPECT_EQ(0, MemoryManager::Instance()->minorCollect());
+  EXPECT_EQ(1, MemoryManager::Instance()->garbageCollect());
+}
 
+TEST_F(MemoryManagerTest, CompactReleasesChunks)
+{
+  // Fill several arena chunks, then drop nine objects in ten.
+  const int count = 100000;
+  MemoryManager* mm = MemoryManager::Instance();
+  mm->setGrowAmount(count);
+  ObjectHandle root = mm->allocObject(count);
+  for(int i = 0; i < count; ++i)
+  {
+    object o = mm->allocObject(3);
+    mm->objectFromID(o).basicAtPut(2, (i << 1) | 1);
+    mm->objectFromID(root).basicAtPut(i + 1, o);
+  }
+  for(int i = 0; i < count; ++i)
+    if(i % 10)
+      mm->objectFromID(root).basicAtPut(i + 1, nilobj);
+  size_t chunks = mm->arena.chunkCount();
+  mm->garbageCollect();
+  {
+    // Nothing moves while a lock is held.
+    TBodyLock lock;
+    mm->compactIfPending();
+    EXPECT_EQ(chunks, mm->arena.chunkCount());
+  }
+  mm->compactIfPending();
+  EXPECT_GT(chunks / 2, mm->arena.chunkCount());
+  // The survivors still hold their contents.
+  for(int i = 0; i < count; i += 10)
+  {
+    object o = mm->objectFromID(root).basicAt(i + 1);
+    EXPECT_EQ((i << 1) | 1, mm->objectFromID(o).basicAt(2));
+  }
+}
+
+#if defined(__linux__)
+#include <unistd.h>
 
-TEST(ObjectHandleTest, AppendToList)
+/* resident set size of this process, in pages */
+static long residentPages()
 {
-  // Check that the handle list is empty to start
+  long size = 0, resident = 0;
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if(fp)
+  {
+    if(fscanf(fp, "%ld %ld", &size, &resident) != 2)
+      resident = 0;
+    fclose(fp);
+  }
+  return resident;
+}
+
+TEST_F(MemoryManagerTest, LargeObjectsReturnMemory)
+{
+  // Some big transient buffers, each written through so its pages
+  // are resident, as when a file is read in.
+  const int count = 16;
+  const size_t bytes = 4 << 20;
+  MemoryManager* mm = MemoryManager::Instance();
+  mm->setGrowAmount(100);
+  long before = residentPages();
+  // Twice over, the second round must not be kept by the first.
+  for(int round = 0; round < 2; ++round)
+  {
+    {
+      ObjectHandle root = mm->allocObject(count);
+      for(int i = 0; i < count; ++i)
+      {
+        object o = mm->allocByte(bytes);
+        memset(mm->objectFromID(o).charPtr(), 'x', bytes);
+        mm->objectFromID(root).basicAtPut(i + 1, o);
+      }
+      EXPECT_EQ(count, mm->arena.mappedCount());
+      EXPECT_LT(before + (long)(count * bytes / 2 / getpagesize()), residentPages());
+    }
+    // Once swept the buffers are unmapped, not kept for reuse.
+    mm->garbageCollect();
+    EXPECT_EQ(0, mm->arena.mappedCount());
+    EXPECT_EQ(0, mm->freeSlotsCount(bytes / sizeof(object)));
+    EXPECT_GT(before + (long)(count * bytes / 4 / getpagesize()), residentPages());
+  }
+}
+#endif
+
+TEST_F(MemoryManagerTest, IncrementalCycle)
+{
+  MemoryManager* mm = MemoryManager::Instance();
+  mm->setGrowAmount(100);
+  // Build, and promote, an array holding a holder of x, plus some 
+  // objects that then become garbage.
+  ObjectHandle top = mm->allocObject(1);
+  object root = mm->allocObject(10);
+  mm->objectFromID(top).basicAtPut(1, root);
+  object holder = mm->allocObject(1);
+  object x = mm->allocObject(1);
+  mm->objectFromID(holder).basicAtPut(1, x);
+  mm->objectFromID(root).basicAtPut(1, holder);
+  for(int i = 3; i <= 10; ++i)
+    mm->objectFromID(root).basicAtPut(i, mm->allocObject(2));
+  mm->garbageCollect();
+  object garbage = mm->objectFromID(root).basicAt(10);
+  mm->objectFromID(root).basicAtPut(10, nilobj);
+
+  mm->setIncrementalBudget(2);
+  mm->startIncrementalCycle();
+  // Once the array has been scanned, move x into it from the holder
+  // which hasn't, the barrier must keep it.
+  mm->incrementalStep();
+  mm->incrementalStep();
+  mm->objectFromID(root).basicAtPut(2, x);
+  mm->objectFromID(holder).basicAtPut(1, nilobj);
+  // Objects allocated during the cycle survive it.
+  object young = mm->allocObject(1);
+  mm->objectFromID(root).basicAtPut(3, young);
+  int steps = 1;
+  while(mm->incrementalStep())
+    ++steps;
+  EXPECT_LT(2, steps);
+  EXPECT_FALSE(mm->objectFromID(x).flags & kFreeSlot);
+  EXPECT_FALSE(mm->objectFromID(young).flags & kFreeSlot);
+  EXPECT_TRUE(mm->objectFromID(garbage).flags & kFreeSlot);
+  EXPECT_FALSE(mm->objectFromID(x).flags & kMarked);
+  EXPECT_LE(mm->pausePercentile(50), mm->pausePercentile(100));
+}
+
+TEST_F(MemoryManagerTest, StatsCountCollections)
+{
+  MemoryManager* mm = MemoryManager::Instance();
+  const char* path = "memory_test_gc.log";
+  remove(path);
+  ASSERT_TRUE(mm->setStatsLog(path));
+  size_t objects = mm->gcStats().objectsAllocated;
+  size_t words = mm->gcStats().wordsAllocated;
+  mm->allocObject(3);
+  mm->allocObject(1);
+  EXPECT_EQ(objects + 2, mm->gcStats().objectsAllocated);
+  EXPECT_EQ(words + 4, mm->gcStats().wordsAllocated);
+  size_t full = mm->gcStats().fullCollections;
+  EXPECT_EQ(2, mm->garbageCollect());
+
+  const TGCStats& stats = mm->gcStats();
+  EXPECT_EQ(full + 1, stats.fullCollections);
+  EXPECT_EQ(0u, stats.objectsAllocated);
+  EXPECT_EQ(2u, stats.lastFreed);
+  EXPECT_LE(stats.lastFreed, stats.totalFreed);
+  size_t bucketed = 0;
+  for(size_t i = 0; i < TGCStats::kPauseBuckets; ++i)
+    bucketed += stats.pauseHistogram[i];
+  EXPECT_EQ(stats.pauses, bucketed);
+  EXPECT_LE(stats.lastPauseSeconds, stats.maxPauseSeconds);
+
+  // The collection is the last line of the log.
+  mm->setStatsLog(NULL);
+  FILE* log = fopen(path, "r");
+  ASSERT_TRUE(log != NULL);
+  char line[2048] = "";
+  char last[2048] = "";
+  while(fgets(line, sizeof(line), log))
+    strcpy(last, line);
+  fclose(log);
+  remove(path);
+  EXPECT_TRUE(strstr(last, "\"kind\":\"full\"") != NULL);
+  EXPECT_TRUE(strstr(last, "\"freed\":2") != NULL);
+}
+
+static const TClassCensus* censusOf(const std::vector<TClassCensus>& census, object cls)
+{
+  for(size_t i = 0; i < census.size(); ++i)
+    if(census[i].classObject == cls)
+      return &census[i];
+  return NULL;
+}
+
+TEST_F(MemoryManagerTest, HeapCensus)
+{
+  MemoryManager* mm = MemoryManager::Instance();
+  mm->disableGC(true);
+  ObjectHandle k1 = mm->allocObject(0);
+  ObjectHandle k2 = mm->allocObject(0);
+  // top holds a and b, a holds b and c. So top retains everything, a
+  // retains c, and b is retained by top alone.
+  ObjectHandle top = mm->allocObject(2);
+  object a = mm->allocObject(1);
+  object b = mm->allocObject(3);
+  object c = mm->allocObject(4);
+  object garbage = mm->allocObject(5);
+  mm->objectFromID(top).setClass(k1);
+  mm->objectFromID(garbage).setClass(k1);
+  mm->objectFromID(a).setClass(k2);
+  mm->objectFromID(b).setClass(k2);
+  mm->objectFromID(c).setClass(k2);
+  mm->objectFromID(top).basicAtPut(1, a);
+  mm->objectFromID(top).basicAtPut(2, b);
+  mm->objectFromID(a).basicAtPut(1, c);
+  mm->objectFromID(c).basicAtPut(1, b);
+
+  std::vector<TClassCensus> census;
+  mm->heapCensus(census, false);
+  const size_t header = sizeof(ObjectStruct);
+  const size_t word = sizeof(object);
+  const TClassCensus* first = censusOf(census, k1);
+  ASSERT_TRUE(first != NULL);
+  EXPECT_EQ(2u, first->instances);
+  EXPECT_EQ(2 * header + 7 * word, first->bytes);
+  EXPECT_EQ(0u, first->retainedBytes);
+
+  mm->heapCensus(census, true);
+  first = censusOf(census, k1);
+  const TClassCensus* second = censusOf(census, k2);
+  ASSERT_TRUE(first != NULL && second != NULL);
+  EXPECT_EQ(3u, second->instances);
+  EXPECT_EQ(3 * header + 8 * word, second->bytes);
+  // The garbage isn't reachable, so retains nothing.
+  EXPECT_EQ(4 * header + 10 * word, first->retainedBytes);
+  // c is retained by a, of the same class, so only counts once.
+  EXPECT_EQ(3 * header + 8 * word, second->retainedBytes);
+
+  // Once b is only reached through c, a retains it too.
+  mm->objectFromID(top).basicAtPut(2, nilobj);
+  mm->heapCensus(census, true);
+  EXPECT_EQ(3 * header + 8 * word, censusOf(census, k2)->retainedBytes);
+  mm->objectFromID(a).basicAtPut(1, nilobj);
+  mm->heapCensus(census, true);
+  EXPECT_EQ(header + word, censusOf(census, k2)->retainedBytes);
+  mm->disableGC(false);
+}
+
+static size_t sampledCount, sampledBytes;
+
+static void countSample(object allocated, size_t bytes)
+{
+  EXPECT_NE(nilobj, allocated);
+  ++sampledCount;
+  sampledBytes += bytes;
+}
+
+TEST(MemoryManagerSamplingTest, SamplesStandForAllBytes)
+{
+  MemoryManager::Initialise(1000, 1000);
+  MemoryManager* mm = MemoryManager::Instance();
+  const size_t interval = 4096;
+  sampledCount = sampledBytes = 0;
+  mm->setAllocationSampler(interval, countSample);
+  size_t allocated = 0;
+  for(int i = 0; i < 100000; ++i)
+  {
+    mm->allocObject(i % 7);
+    allocated += sizeof(ObjectStruct) + (i % 7) * sizeof(object);
+  }
+  // Every byte is in one sample's window, bar the last window.
+  EXPECT_LE(sampledBytes, allocated);
+  EXPECT_GT(sampledBytes + 2 * interval, allocated);
+  EXPECT_LT(allocated / interval / 2, sampledCount);
+  EXPECT_GT(allocated / interval * 2, sampledCount);
+
+  mm->setAllocationSampler(0, NULL);
+  size_t count = sampledCount;
+  for(int i = 0; i < 10000; ++i)
+    mm->allocObject(3);
+  EXPECT_EQ(count, sampledCount);
+}
+
+TEST(MemoryManagerImageTest, WriteAndMap)
+{
+  const char* path = "memory_test.image";
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle root = mm->allocObject(3);
+  object text = mm->allocStr("hello image");
+  object big = mm->allocObject(2000);
+  mm->objectFromID(big).basicAtPut(2000, text);
+  mm->objectFromID(root).basicAtPut(1, text);
+  mm->objectFromID(root).basicAtPut(2, big);
+  mm->objectFromID(root).basicAtPut(3, (42 << 1) | 1);
+  mm->objectFromID(root).setClass(text);
+  mm->allocObject(5);
+  symbols = root;
+  FILE* fp = fopen(path, "wb");
+  ASSERT_TRUE(fp != NULL);
+  mm->imageWrite(fp);
+  fclose(fp);
+  symbols = nilobj;
+  root = nilobj;
+
+  for(int pass = 0; pass < 2; ++pass)
+  {
+    MemoryManager::Initialise(10, 100);
+    mm = MemoryManager::Instance();
+    fp = fopen(path, "rb");
+    ASSERT_TRUE(fp != NULL);
+    mm->imageRead(fp);
+    fclose(fp);
+    ASSERT_NE(nilobj, symbols);
+    ObjectStruct& r = mm->objectFromID(symbols);
+    ASSERT_EQ(3, r.size());
+    EXPECT_EQ(r.basicAt(1), r.objectClass());
+    EXPECT_STREQ("hello image", mm->objectFromID(r.basicAt(1)).charPtr());
+    EXPECT_TRUE(mm->objectFromID(r.basicAt(1)).isBytes());
+    EXPECT_EQ(r.basicAt(1), mm->objectFromID(r.basicAt(2)).basicAt(2000));
+    EXPECT_EQ((42 << 1) | 1, r.basicAt(3));
+    // The garbage wasn't saved, and the table has room to spare.
+    EXPECT_EQ(4u, mm->objectCount());
+    EXPECT_LT(0u, mm->freeSlotsCount());
+
+    // Changes are private, the second pass sees the image as written.
+    r.basicAtPut(3, nilobj);
+    mm->objectFromID(r.basicAt(1)).charPtr()[0] = 'j';
+    // Image data areas survive collection, compaction and being freed.
+    mm->objectFromID(r.basicAt(2)).basicAtPut(2000, mm->allocObject(2));
+    r.basicAtPut(2, nilobj);
+    mm->garbageCollect();
+    mm->compact();
+    EXPECT_STREQ("jello image", mm->objectFromID(r.basicAt(1)).charPtr());
+    mm->allocObject(2000);
+  }
+  symbols = nilobj;
+  remove(path);
+}
+
+static long fileLength(const char* path)
+{
+  FILE* fp = fopen(path, "rb");
+  if(fp == NULL)
+    return -1;
+  fseek(fp, 0, SEEK_END);
+  long length = ftell(fp);
+  fclose(fp);
+  return length;
+}
+
+static bool appendChanges(const char* path)
+{
+  FILE* fp = fopen(path, "r+b");
+  if(fp == NULL)
+    return false;
+  bool saved = MemoryManager::Instance()->imageWriteDelta(fp);
+  fclose(fp);
+  return saved;
+}
+
+static void readImage(const char* path)
+{
+  MemoryManager::Initialise(10, 100);
+  FILE* fp = fopen(path, "rb");
+  ASSERT_TRUE(fp != NULL);
+  MemoryManager::Instance()->imageRead(fp);
+  fclose(fp);
+}
+
+TEST(MemoryManagerImageTest, Deltas)
+{
+  const char* path = "memory_test_delta.image";
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle root = mm->allocObject(4);
+  ObjectHandle table = mm->allocObject(5000);
+  mm->objectFromID(root).basicAtPut(1, mm->allocStr("abc"));
+  mm->objectFromID(root).basicAtPut(2, table);
+  mm->objectFromID(root).basicAtPut(3, mm->allocObject(1));
+  symbols = root;
+  ASSERT_TRUE(mm->imageSave(path));
+  long base = fileLength(path);
+
+  // Only the changes are appended, a freed object among them.
+  mm->objectFromID(mm->objectFromID(root).basicAt(1)).byteAtPut(1, 'x');
+  mm->objectFromID(root).basicAtPut(3, nilobj);
+  mm->objectFromID(root).basicAtPut(4, mm->allocStr("new"));
+  mm->garbageCollect();
+  ASSERT_TRUE(appendChanges(path));
+  EXPECT_LT(fileLength(path), base + 1024);
+  for(int i = 1; i <= 300; ++i)
+    mm->objectFromID(table).basicAtPut(i, mm->allocObject(1));
+  mm->objectFromID(table).basicAtPut(5000, (7 << 1) | 1);
+  ASSERT_TRUE(appendChanges(path));
+  symbols = nilobj;
+  root = nilobj;
+  table = nilobj;
+
+  readImage(path);
+  mm = MemoryManager::Instance();
+  ASSERT_NE(nilobj, symbols);
+  EXPECT_FALSE(mm->imageRenumbered());
+  ObjectStruct& r = mm->objectFromID(symbols);
+  EXPECT_STREQ("xbc", mm->objectFromID(r.basicAt(1)).charPtr());
+  EXPECT_EQ(nilobj, r.basicAt(3));
+  EXPECT_STREQ("new", mm->objectFromID(r.basicAt(4)).charPtr());
+  ObjectStruct& t = mm->objectFromID(r.basicAt(2));
+  EXPECT_EQ((7 << 1) | 1, t.basicAt(5000));
+  EXPECT_EQ(1, mm->objectFromID(t.basicAt(300)).size());
+  EXPECT_EQ(305u, mm->objectCount());
+
+  // Changes can follow an image that was read, but only the same one.
+  t.basicAtPut(1, nilobj);
+  FILE* other = fopen("memory_test_other.image", "wb");
+  ASSERT_TRUE(other != NULL);
+  fputs("other", other);
+  fclose(other);
+  EXPECT_FALSE(appendChanges("memory_test_other.image"));
+  remove("memory_test_other.image");
+  ASSERT_TRUE(appendChanges(path));
+  // A delta cut short is left out.
+  FILE* fp = fopen(path, "ab");
+  ASSERT_TRUE(fp != NULL);
+  fwrite("TWDELTA", 8, 1, fp);
+  fclose(fp);
+  readImage(path);
+  mm = MemoryManager::Instance();
+  EXPECT_EQ(nilobj, mm->objectFromID(mm->objectFromID(symbols).basicAt(2)).basicAt(1));
+  // Old garbage isn't collected before appending.
+  EXPECT_EQ(305u, mm->objectCount());
+  EXPECT_FALSE(appendChanges(path));
+
+  // Saving again folds them all into a new image.
+  ASSERT_TRUE(mm->imageSave(path));
+  EXPECT_LT(fileLength(path), base + 65536);
+  readImage(path);
+  EXPECT_EQ(304u, MemoryManager::Instance()->objectCount());
+  symbols = nilobj;
+  remove(path);
+}
+
+TEST(MemoryManagerImageTest, WriteOverMappedImage)
+{
+  const char* path = "memory_test_self.image";
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle root = mm->allocObject(2);
+  object bytes = mm->allocByte(65536);
+  for(int i = 1; i <= 65536; ++i)
+    mm->objectFromID(bytes).byteAtPut(i, i & 0x7f);
+  mm->objectFromID(root).basicAtPut(1, bytes);
+  mm->objectFromID(root).basicAtPut(2, mm->allocStr("mapped"));
+  symbols = root;
+  ASSERT_TRUE(mm->imageSave(path));
+  symbols = nilobj;
+  root = nilobj;
+
+  // Written in place, over the file its data areas are mapped from, 
+  // which is truncated before any of them are read.
+  readImage(path);
+  mm = MemoryManager::Instance();
+  mm->releaseImageFile(path);
+  FILE* fp = fopen(path, "wb");
+  ASSERT_TRUE(fp != NULL);
+  EXPECT_TRUE(mm->imageWrite(fp));
+  fclose(fp);
+  symbols = nilobj;
+
+  readImage(path);
+  mm = MemoryManager::Instance();
+  ASSERT_NE(nilobj, symbols);
+  ObjectStruct& r = mm->objectFromID(symbols);
+  ObjectStruct& b = mm->objectFromID(r.basicAt(1));
+  ASSERT_EQ(65536, b.size());
+  EXPECT_EQ(1, b.byteAt(1));
+  EXPECT_EQ(65535 & 0x7f, b.byteAt(65535));
+  EXPECT_STREQ("mapped", mm->objectFromID(r.basicAt(2)).charPtr());
+  symbols = nilobj;
+  remove(path);
+}
+
+#if !defined(WIN32)
+TEST(MemoryManagerImageTest, FailedWrites)
+{
+  const char* path = "memory_test_full.image";
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle root = mm->allocObject(2);
+  mm->objectFromID(root).basicAtPut(1, mm->allocStr("abc"));
+  symbols = root;
+
+  // A full disk fails the write rather than the process.
+  FILE* full = fopen("/dev/full", "wb");
+  if(full != NULL)
+  {
+    EXPECT_FALSE(mm->imageWrite(full));
+    fclose(full);
+  }
+
+  // A delta that can't be written is cut off, and its changes are kept
+  // for the next one.
+  ASSERT_TRUE(mm->imageSave(path));
+  long base = fileLength(path);
+  mm->objectFromID(mm->objectFromID(root).basicAt(1)).byteAtPut(1, 'x');
+  mm->objectFromID(root).basicAtPut(2, mm->allocStr("new"));
+  struct rlimit limit, small;
+  getrlimit(RLIMIT_FSIZE, &limit);
+  small = limit;
+  small.rlim_cur = base + 16;
+  void (*handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &small));
+  bool saved = appendChanges(path);
+  setrlimit(RLIMIT_FSIZE, &limit);
+  signal(SIGXFSZ, handler);
+  EXPECT_FALSE(saved);
+  EXPECT_EQ(base, fileLength(path));
+  ASSERT_TRUE(appendChanges(path));
+  symbols = nilobj;
+  root = nilobj;
+
+  readImage(path);
+  mm = MemoryManager::Instance();
+  ASSERT_NE(nilobj, symbols);
+  ObjectStruct& r = mm->objectFromID(symbols);
+  EXPECT_STREQ("xbc", mm->objectFromID(r.basicAt(1)).charPtr());
+  EXPECT_STREQ("new", mm->objectFromID(r.basicAt(2)).charPtr());
+  symbols = nilobj;
+  remove(path);
+}
+#endif
+
+TEST(MemoryManagerImageTest, VeryLargeObjects)
+{
+  const char* path = "memory_test_large.image";
+  const size_t bytes = (1 << 24) + 3;
+  const size_t slots = (1 << 24) + 5;
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  // Too big for the header, the sizes are kept beside the data areas.
+  ObjectHandle root = mm->allocObject(2);
+  mm->objectFromID(root).basicAtPut(1, mm->allocByte(bytes));
+  mm->objectFromID(root).basicAtPut(2, mm->allocObject(slots));
+  ObjectStruct& b = mm->objectFromID(mm->objectFromID(root).basicAt(1));
+  ObjectStruct& a = mm->objectFromID(mm->objectFromID(root).basicAt(2));
+  EXPECT_EQ((long)bytes, b.size());
+  EXPECT_EQ((bytes + sizeof(object) - 1) / sizeof(object), b.words());
+  EXPECT_EQ((long)slots, a.slotCount());
+  b.bytePtr()[bytes - 1] = 'z';
+  a.basicAtPut(slots, root);
+  symbols = root;
+  ASSERT_TRUE(mm->imageSave(path));
+  // Changed after the save, so appended.
+  a.basicAtPut(slots - 1, (7 << 1) | 1);
+  ASSERT_TRUE(appendChanges(path));
+  symbols = nilobj;
+  root = nilobj;
+
+  readImage(path);
+  mm = MemoryManager::Instance();
+  ASSERT_NE(nilobj, symbols);
+  ObjectStruct& r = mm->objectFromID(symbols);
+  ObjectStruct& b2 = mm->objectFromID(r.basicAt(1));
+  ObjectStruct& a2 = mm->objectFromID(r.basicAt(2));
+  EXPECT_EQ((long)bytes, b2.size());
+  EXPECT_EQ('z', b2.bytePtr()[bytes - 1]);
+  EXPECT_EQ((long)slots, a2.size());
+  EXPECT_EQ(symbols, a2.basicAt(slots));
+  EXPECT_EQ((7 << 1) | 1, a2.basicAt(slots - 1));
+  // And released again, like any other.
+  r.basicAtPut(1, nilobj);
+  r.basicAtPut(2, nilobj);
+  mm->garbageCollect();
+  EXPECT_EQ(2u, mm->objectCount());
+  symbols = nilobj;
+  remove(path);
+}
+
+TEST(MemoryManagerImageTest, Renumber)
+{
+  const char* path = "memory_test_renumber.image";
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  // A class, and a list of instances kept among plenty of garbage.
+  ObjectHandle aClass = mm->allocStr("Link");
+  ObjectHandle root = mm->allocObject(2);
+  mm->objectFromID(root).basicAtPut(1, aClass);
+  for(int i = 0; i < 1000; ++i)
+  {
+    ObjectHandle link = mm->allocObject(2);
+    mm->allocObject(3);
+    if(i % 10 != 0)
+      continue;
+    mm->objectFromID(link).setClass(aClass);
+    mm->objectFromID(link).basicAtPut(1, mm->objectFromID(root).basicAt(2));
+    mm->objectFromID(link).basicAtPut(2, (i << 1) | 1);
+    mm->objectFromID(root).basicAtPut(2, link);
+  }
+  // Kept alive only by a handle, it isn't in the image.
+  ObjectHandle unsaved = mm->allocObject(1);
+  symbols = root;
+  ASSERT_TRUE(mm->imageSave(path, true));
+  EXPECT_FALSE(appendChanges(path));
+  // The objects in memory keep their numbers.
+  EXPECT_EQ(aClass, mm->objectFromID(root).basicAt(1));
+  symbols = nilobj;
+  root = nilobj;
+  aClass = nilobj;
+  unsaved = nilobj;
+
+  readImage(path);
+  mm = MemoryManager::Instance();
+  // So its dictionaries are rehashed.
+  EXPECT_TRUE(mm->imageRenumbered());
+  EXPECT_EQ(103u, mm->objectCount());
+  // In the order reached, the root, then its first slot, then the list.
+  EXPECT_EQ(objectID(1), symbols);
+  ObjectStruct& r = mm->objectFromID(symbols);
+  EXPECT_EQ(objectID(2), r.basicAt(1));
+  EXPECT_STREQ("Link", mm->objectFromID(r.basicAt(1)).charPtr());
+  object link = r.basicAt(2);
+  for(int i = 990; i >= 0; i -= 10)
+  {
+    EXPECT_EQ(objectID(3 + (990 - i) / 10), link);
+    ObjectStruct& l = mm->objectFromID(link);
+    EXPECT_EQ(r.basicAt(1), l.objectClass());
+    EXPECT_EQ((i << 1) | 1, l.basicAt(2));
+    link = l.basicAt(1);
+  }
+  EXPECT_EQ(nilobj, link);
+  symbols = nilobj;
+  remove(path);
+}
+
+#if !defined(WIN32)
+TEST(MemoryManagerImageTest, BackgroundSnapshot)
+{
+  const char* path = "memory_test_snapshot.image";
+  remove(path);
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle root = mm->allocObject(2);
+  mm->objectFromID(root).basicAtPut(1, mm->allocStr("before"));
+  symbols = root;
+  EXPECT_EQ(kNoSnapshot, mm->snapshotStatus());
+  ASSERT_TRUE(mm->startSnapshot(path));
+  EXPECT_FALSE(mm->startSnapshot(path));
+  // Changes after the fork aren't in the image.
+  mm->objectFromID(mm->objectFromID(root).basicAt(1)).charPtr()[0] = 'B';
+  mm->objectFromID(root).basicAtPut(2, mm->allocStr("after"));
+  TSnapshotStatus status;
+  while((status = mm->snapshotStatus()) == kSnapshotRunning)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  ASSERT_EQ(kSnapshotSaved, status);
+  EXPECT_EQ(kNoSnapshot, mm->snapshotStatus());
+  symbols = nilobj;
+  root = nilobj;
+
+  MemoryManager::Initialise(10, 100);
+  mm = MemoryManager::Instance();
+  FILE* fp = fopen(path, "rb");
+  ASSERT_TRUE(fp != NULL);
+  mm->imageRead(fp);
+  fclose(fp);
+  ASSERT_NE(nilobj, symbols);
+  ObjectStruct& r = mm->objectFromID(symbols);
+  EXPECT_STREQ("before", mm->objectFromID(r.basicAt(1)).charPtr());
+  EXPECT_EQ(nilobj, r.basicAt(2));
+  symbols = nilobj;
+  remove(path);
+
+  // A save to the same file while a snapshot runs has a file of its own
+  // to write to, so both succeed.
+  root = mm->allocObject(1);
+  symbols = root;
+  ASSERT_TRUE(mm->startSnapshot(path));
+  EXPECT_TRUE(mm->imageSave(path));
+  while((status = mm->snapshotStatus()) == kSnapshotRunning)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_EQ(kSnapshotSaved, status);
+  symbols = nilobj;
+  root = nilobj;
+  remove(path);
+
+  // One whose file can't be made isn't started.
+  EXPECT_FALSE(mm->startSnapshot("no_such_directory/memory_test.image"));
+  EXPECT_EQ(kNoSnapshot, mm->snapshotStatus());
+}
+
+TEST(MemoryManagerImageTest, SnapshotDuringSweep)
+{
+  const char* path = "memory_test_snapshot.image";
+  remove(path);
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle root = mm->allocObject(2);
+  symbols = root;
+  mm->objectFromID(root).basicAtPut(1, mm->allocStr("kept"));
+  object dead = mm->allocObject(1);
+  mm->objectFromID(root).basicAtPut(2, dead);
+  mm->garbageCollect();
+  mm->objectFromID(root).basicAtPut(2, nilobj);
+
+  // Found dead, but not yet swept.
+  mm->setIncrementalBudget(1);
+  mm->startIncrementalCycle();
+  while(mm->gcPhase != MemoryManager::kSweeping)
+    mm->incrementalStep();
+  ASSERT_LT(objectIndex(dead), mm->sweepCursor);
+  size_t full = mm->gcStats().fullCollections;
+  ASSERT_TRUE(mm->startSnapshot(path));
+  // Nothing is collected before the fork.
+  EXPECT_EQ(full, mm->gcStats().fullCollections);
+  EXPECT_EQ(MemoryManager::kSweeping, mm->gcPhase);
+  EXPECT_FALSE(mm->objectFromID(dead).flags & kFreeSlot);
+  TSnapshotStatus status;
+  while((status = mm->snapshotStatus()) == kSnapshotRunning)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  ASSERT_EQ(kSnapshotSaved, status);
+  symbols = nilobj;
+  root = nilobj;
+
+  MemoryManager::Initialise(10, 100);
+  mm = MemoryManager::Instance();
+  FILE* fp = fopen(path, "rb");
+  ASSERT_TRUE(fp != NULL);
+  mm->imageRead(fp);
+  fclose(fp);
+  ASSERT_NE(nilobj, symbols);
+  ObjectStruct& r = mm->objectFromID(symbols);
+  EXPECT_STREQ("kept", mm->objectFromID(r.basicAt(1)).charPtr());
+  EXPECT_TRUE(mm->objectFromID(dead).flags & kFreeSlot);
+  symbols = nilobj;
+  remove(path);
+}
+#endif
+
+TEST(MemoryManagerMarkTest, LongChain)
+{
+  // A million element linked list must not overflow the C stack when 
+  // marked, and shouldn't need a deep mark stack either.
+  const int length = 1000000;
+  MemoryManager::Initialise(length + 100, 10000);
+  ObjectHandle head = nilobj;
+  for(int i = 0; i < length; ++i)
+  {
+    object link = MemoryManager::Instance()->allocObject(1);
+    MemoryManager::Instance()->objectFromID(link).basicAtPut(1, head);
+    head = link;
+  }
+  EXPECT_EQ(0, MemoryManager::Instance()->garbageCollect());
+  EXPECT_EQ(length + 1, MemoryManager::Instance()->objectCount());
+  EXPECT_GT(10, MemoryManager::Instance()->maxMarkStackDepth());
+  head = nilobj;
+  EXPECT_EQ(length, MemoryManager::Instance()->garbageCollect());
+}
+
+TEST(MemoryManagerMarkTest, ParallelCollect)
+{
+  // Several workers must keep and free exactly what one does, a tree
+  // with every other leaf dropped leaves garbage in every range.
+  const int leaves = 100000;
+  MemoryManager::Initialise(2 * leaves + 100, 10000);
+  MemoryManager::Instance()->setGCWorkers(4);
+  ObjectHandle root = MemoryManager::Instance()->allocObject(leaves);
+  for(int i = 1; i <= leaves; ++i)
+  {
+    ObjectHandle node = MemoryManager::Instance()->allocObject(2);
+    MemoryManager::Instance()->objectFromID(node).basicAtPut(1, MemoryManager::Instance()->allocObject(i % 8));
+    MemoryManager::Instance()->objectFromID(root).basicAtPut(i, node);
+  }
+  EXPECT_EQ(0, MemoryManager::Instance()->garbageCollect());
+  EXPECT_EQ(2 * leaves + 2, MemoryManager::Instance()->objectCount());
+  for(int i = 1; i <= leaves; i += 2)
+    MemoryManager::Instance()->objectFromID(root).basicAtPut(i, nilobj);
+  EXPECT_EQ(leaves, MemoryManager::Instance()->garbageCollect());
+  EXPECT_EQ(leaves + 2, MemoryManager::Instance()->objectCount());
+
+  // The freed slots must be usable again, and leave the free lists
+  // consistent for a serial collection.
+  for(int i = 0; i < leaves; ++i)
+    MemoryManager::Instance()->allocObject(i % 8);
+  MemoryManager::Instance()->setGCWorkers(1);
+  MemoryManager::Instance()->garbageCollect();
+  EXPECT_EQ(leaves + 2, MemoryManager::Instance()->objectCount());
+}
+
+TEST_F(MemoryManagerTest, RememberedSetKeepsYoungAlive)
+{
+  // Promote the array, then store a young object into it.
+  MemoryManager::Instance()->minorCollect();
+  object young = MemoryManager::Instance()->allocObject(1);
+  MemoryManager::Instance()->objectFromID(arrayID).basicAtPut(1, young);
+  EXPECT_TRUE(MemoryManager::Instance()->objectFromID(arrayID).flags & kRemembered);
+  EXPECT_EQ(0, MemoryManager::Instance()->minorCollect());
+  EXPECT_TRUE(MemoryManager::Instance()->objectFromID(young).flags & kOld);
+  EXPECT_FALSE(MemoryManager::Instance()->objectFromID(arrayID).flags & kRemembered);
+}
+
+/* a weak pair, holding a live object and a dead one, collected by each
+   of the collectors in turn */
+static void checkWeakCleared(void (*collect)(MemoryManager*))
+{
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle weak = mm->allocObject(2);
+  ASSERT_TRUE(mm->makeWeak(weak));
+  ObjectHandle kept = mm->allocObject(1);
+  object dead = mm->allocObject(1);
+  mm->objectFromID(weak).basicAtPut(1, kept);
+  mm->objectFromID(weak).basicAtPut(2, dead);
+  collect(mm);
+  EXPECT_EQ(kept, mm->objectFromID(weak).basicAt(1));
+  EXPECT_EQ(nilobj, mm->objectFromID(weak).basicAt(2));
+  EXPECT_TRUE(mm->objectFromID(dead).flags & kFreeSlot);
+  EXPECT_FALSE(mm->objectFromID(kept).flags & kFreeSlot);
+}
+
+TEST(MemoryManagerWeakTest, WeakSlotsCleared)
+{
+  checkWeakCleared([](MemoryManager* mm) { mm->garbageCollect(); });
+  checkWeakCleared([](MemoryManager* mm) { mm->minorCollect(); });
+  checkWeakCleared([](MemoryManager* mm) { 
+    mm->setGCWorkers(3);
+    mm->garbageCollect(); 
+    mm->setGCWorkers(1);
+  });
+  checkWeakCleared([](MemoryManager* mm) { 
+    mm->startIncrementalCycle();
+    while(mm->incrementalStep())
+      ;
+  });
+}
+
+TEST(MemoryManagerWeakTest, MakeWeakChecksFormat)
+{
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle bytes = mm->allocByte(8);
+  ObjectHandle single = mm->allocObject(1);
+  EXPECT_FALSE(mm->makeWeak(bytes));
+  EXPECT_FALSE(mm->makeEphemeron(single));
+  EXPECT_TRUE(mm->makeWeak(single));
+  EXPECT_FALSE(mm->makeEphemeron(single));
+}
+
+static object newEphemeron(MemoryManager* mm, object key, object value)
+{
+  ObjectHandle e = mm->allocObject(3);
+  mm->makeEphemeron(e);
+  mm->objectFromID(e).basicAtPut(1, key);
+  mm->objectFromID(e).basicAtPut(2, value);
+  return e;
+}
+
+TEST(MemoryManagerWeakTest, Ephemerons)
+{
+  for(int workers = 1; workers <= 2; ++workers)
+  {
+    MemoryManager::Initialise(100, 100);
+    MemoryManager* mm = MemoryManager::Instance();
+    mm->setGCWorkers(workers);
+    ObjectHandle key = mm->allocObject(1);
+    // The value of the first refers to the key of the second, which is
+    // otherwise only reachable from the value of the third, whose key
+    // is dead. The value of a dead key's ephemeron doesn't keep it alive.
+    object second = mm->allocObject(1);
+    object deadKey = mm->allocObject(1);
+    object value = mm->allocObject(1);
+    mm->objectFromID(value).basicAtPut(1, second);
+    ObjectHandle table = mm->allocObject(3);
+    mm->objectFromID(table).basicAtPut(3, newEphemeron(mm, deadKey, mm->allocObject(1)));
+    mm->objectFromID(table).basicAtPut(2, newEphemeron(mm, second, deadKey));
+    mm->objectFromID(table).basicAtPut(1, newEphemeron(mm, key, value));
+    mm->garbageCollect();
+
+    ObjectStruct& first = mm->objectFromID(mm->objectFromID(table).basicAt(1));
+    EXPECT_EQ(key, first.basicAt(1));
+    EXPECT_EQ(value, first.basicAt(2));
+    ObjectStruct& chained = mm->objectFromID(mm->objectFromID(table).basicAt(2));
+    EXPECT_EQ(second, chained.basicAt(1));
+    EXPECT_EQ(deadKey, chained.basicAt(2));
+    // Still alive, by way of the second's value.
+    ObjectStruct& lost = mm->objectFromID(mm->objectFromID(table).basicAt(3));
+    EXPECT_EQ(deadKey, lost.basicAt(1));
+
+    // Drop the first key, and the whole chain goes.
+    key = nilobj;
+    mm->garbageCollect();
+    EXPECT_EQ(nilobj, first.basicAt(1));
+    EXPECT_EQ(nilobj, first.basicAt(2));
+    EXPECT_EQ(nilobj, chained.basicAt(1));
+    EXPECT_EQ(nilobj, lost.basicAt(1));
+    EXPECT_EQ(nilobj, lost.basicAt(2));
+    EXPECT_TRUE(mm->objectFromID(value).flags & kFreeSlot);
+    mm->setGCWorkers(1);
+  }
+}
+
+TEST(MemoryManagerWeakTest, CacheStaysBounded)
+{
+  // An identity keyed cache, chains of ephemerons hung off a table, 
+  // dead entries dropped as each chain is added to. The keys are all
+  // transient, so the cache must not keep the entries, however many.
+  const int buckets = 64;
+  const int entries = 200000;
+  MemoryManager::Initialise(1000, 1000);
+  MemoryManager* mm = MemoryManager::Instance();
+  mm->setNurserySize(1000);
+  ObjectHandle table = mm->allocObject(buckets);
+  size_t largest = 0;
+  for(int i = 0; i < entries; ++i)
+  {
+    ObjectHandle key = mm->allocObject(1);
+    ObjectHandle value = mm->allocObject(10);
+    int bucket = (key >> 1) % buckets + 1;
+    object head = mm->objectFromID(table).basicAt(bucket);
+    while(head != nilobj && mm->objectFromID(head).basicAt(1) == nilobj)
+      head = mm->objectFromID(head).basicAt(3);
+    ObjectHandle entry = newEphemeron(mm, key, value);
+    mm->objectFromID(entry).basicAtPut(3, head);
+    mm->objectFromID(table).basicAtPut(bucket, entry);
+    mm->incrementalStep();
+    largest = std::max(largest, mm->storageSize());
+  }
+  EXPECT_GT(entries / 10, largest);
+  mm->garbageCollect();
+  EXPECT_GT(buckets * 4, mm->objectCount());
+}
+
+static void checkFinalized(void (*collect)(MemoryManager*))
+{
+  MemoryManager::Initialise(100, 100);
+  MemoryManager* mm = MemoryManager::Instance();
+  ObjectHandle kept = mm->allocObject(1);
+  object dead = mm->allocObject(1);
+  // Only the executors refer to these, and they must outlive the targets.
+  object keptExecutor = mm->allocObject(1);
+  object deadExecutor = mm->allocObject(1);
+  ASSERT_TRUE(mm->addFinalizer(kept, keptExecutor));
+  ASSERT_TRUE(mm->addFinalizer(dead, deadExecutor));
+  EXPECT_FALSE(mm->addFinalizer(nilobj, deadExecutor));
+  EXPECT_FALSE(mm->addFinalizer(3, deadExecutor));
+  collect(mm);
+  EXPECT_TRUE(mm->objectFromID(dead).flags & kFreeSlot);
+  EXPECT_FALSE(mm->objectFromID(keptExecutor).flags & kFreeSlot);
+  ASSERT_EQ(1u, mm->finalizersPending());
+  mm->garbageCollect();
+  EXPECT_FALSE(mm->objectFromID(deadExecutor).flags & kFreeSlot);
+  EXPECT_EQ(deadExecutor, mm->nextFinalizer());
+  EXPECT_EQ(nilobj, mm->nextFinalizer());
+  mm->garbageCollect();
+  EXPECT_TRUE(mm->objectFromID(deadExecutor).flags & kFreeSlot);
+  EXPECT_EQ(0u, mm->finalizersPending());
+}
+
+TEST(MemoryManagerWeakTest, FinalizersQueued)
+{
+  checkFinalized([](MemoryManager* mm) { mm->garbageCollect(); });
+  checkFinalized([](MemoryManager* mm) { mm->minorCollect(); });
+  checkFinalized([](MemoryManager* mm) { 
+    mm->setGCWorkers(3);
+    mm->garbageCollect(); 
+    mm->setGCWorkers(1);
+  });
+  checkFinalized([](MemoryManager* mm) { 
+    mm->startIncrementalCycle();
+    while(mm->incrementalStep())
+      ;
+  });
+}
+
+
+
+TEST(ObjectHandleTest, PushRootSlot)
+{
+  // Check that the root stack is empty to start
   EXPECT_EQ(0, ObjectHandle::numTotalHandles());
-  // Check that appending to the list creates a single
-  // entry list.
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
+  // Check that a handle takes a single slot holding its object.
   ObjectHandle h1(1);
   EXPECT_EQ(1, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(ObjectHandle::getListHead() == &h1);
-  EXPECT_TRUE(ObjectHandle::getListHead()->handle() == 1);
-  EXPECT_TRUE(ObjectHandle::getListHead() == ObjectHandle::getListTail());
-  EXPECT_TRUE(h1.prev() == NULL);
-  EXPECT_TRUE(h1.next() == NULL);
-  // Add another, should append to the end
+  EXPECT_EQ(1u, ObjectHandle::rootTop());
+  EXPECT_EQ(1, ObjectHandle::rootSlots()[0]);
+  // Add another, should go on top
   ObjectHandle h2(2);
   EXPECT_EQ(2, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(ObjectHandle::getListTail() == &h2);
-  EXPECT_TRUE(ObjectHandle::getListHead() == &h1);
-  EXPECT_TRUE(h1.next() == &h2);
-  EXPECT_TRUE(h2.prev() == &h1);
-  EXPECT_TRUE(h1.prev() == NULL);
-  EXPECT_TRUE(h2.next() == NULL);
-  // Add another, check linkage
-  ObjectHandle h3(3);
+  EXPECT_EQ(2u, ObjectHandle::rootTop());
+  EXPECT_EQ(2, ObjectHandle::rootSlots()[1]);
+  // A copy takes a slot of its own
+  ObjectHandle h3(h2);
   EXPECT_EQ(3, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(ObjectHandle::getListTail() == &h3);
-  EXPECT_TRUE(ObjectHandle::getListHead() == &h1);
-  EXPECT_TRUE(h2.next() == &h3);
-  EXPECT_TRUE(h3.prev() == &h2);
-  EXPECT_TRUE(h3.next() == NULL);
+  EXPECT_EQ(2, ObjectHandle::rootSlots()[2]);
+  EXPECT_TRUE(ObjectHandle::isReferenced(2));
+  EXPECT_FALSE(ObjectHandle::isReferenced(4));
 }
 
-TEST(ObjectHandleTest, RemoveIsolatedHeadFromList)
+TEST(ObjectHandleTest, PopIsolatedSlot)
 {
-  // Check that the previous tests have left the list empty.
-  EXPECT_EQ(0, ObjectHandle::numTotalHandles());
-  // Add a single entry
+  // Check that the previous tests have left the stack empty.
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
   {
     ObjectHandle h1(1);
-    EXPECT_EQ(1, ObjectHandle::numTotalHandles());
-    EXPECT_TRUE(&h1 == ObjectHandle::getListHead()); 
-    EXPECT_TRUE(&h1 == ObjectHandle::getListTail()); 
-    // When it goes out of scope, it should be removed from the list,
-    // leaving an empty list.
+    EXPECT_EQ(1u, ObjectHandle::rootTop());
+    // When it goes out of scope, its slot should be popped, leaving
+    // an empty stack.
   }
   EXPECT_EQ(0, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(NULL == ObjectHandle::getListHead()); 
-  EXPECT_TRUE(NULL == ObjectHandle::getListTail()); 
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
 }
 
-TEST(ObjectHandleTest, RemoveHeadFromList)
+TEST(ObjectHandleTest, RemoveOutOfOrder)
 {
-  // Check that the previous tests have left the list empty.
-  EXPECT_EQ(0, ObjectHandle::numTotalHandles());
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
   // Allocate a new object handle that we can manually delete.
   ObjectHandle* h1 = new ObjectHandle(1);
-  // ..and a static one that will go out of scope automatically.
-  ObjectHandle h2(2);
-  EXPECT_EQ(2, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(ObjectHandle::getListHead() == h1);
-  EXPECT_TRUE(ObjectHandle::getListTail() == &h2);
-
-  delete(h1);
-
-  EXPECT_EQ(1, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(ObjectHandle::getListHead() == &h2); 
-  EXPECT_TRUE(ObjectHandle::getListTail() == &h2); 
-}
-
-
-TEST(ObjectHandleTest, RemoveTailFromList)
-{
-  // Check that the previous tests have left the list empty.
-  EXPECT_EQ(0, ObjectHandle::numTotalHandles());
-  // Add one to the head
-  ObjectHandle h1(1);
   {
+    // ..and a static one that will go out of scope automatically.
     ObjectHandle h2(2);
-    EXPECT_EQ(2, ObjectHandle::numTotalHandles());
-    EXPECT_TRUE(&h1 == ObjectHandle::getListHead());
-    EXPECT_TRUE(&h2 == ObjectHandle::getListTail());
+    EXPECT_EQ(2u, ObjectHandle::rootTop());
+
+    // Deleting the lower one leaves its slot vacant.
+    delete(h1);
+    EXPECT_EQ(1, ObjectHandle::numTotalHandles());
+    EXPECT_EQ(2u, ObjectHandle::rootTop());
+    EXPECT_EQ(ObjectHandle::vacantSlot, ObjectHandle::rootSlots()[0]);
+    EXPECT_FALSE(ObjectHandle::isReferenced(1));
+    EXPECT_EQ(2, h2.handle());
   }
-  EXPECT_EQ(1, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(&h1 == ObjectHandle::getListHead());
-  EXPECT_TRUE(&h1 == ObjectHandle::getListTail());
+  // Popping the top one pops the vacant slot under it too.
+  EXPECT_EQ(0, ObjectHandle::numTotalHandles());
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
 }
 
-
-TEST(ObjectHandleTest, RemoveInternalFromList)
+TEST(ObjectHandleTest, RemoveInternal)
 {
-  // Check that the previous tests have left the list empty.
-  EXPECT_EQ(0, ObjectHandle::numTotalHandles());
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
 
   // Add two on the stack
-  ObjectHandle h1;
-  ObjectHandle h2;
+  ObjectHandle h1(1);
+  ObjectHandle h2(2);
   // and one on the heap
-  ObjectHandle* h3 = new ObjectHandle();
+  ObjectHandle* h3 = new ObjectHandle(3);
   // and another two on the stack
-  ObjectHandle h4;
-  ObjectHandle h5;
-
+  ObjectHandle h4(4);
+  ObjectHandle h5(5);
   EXPECT_EQ(5, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(&h1 == ObjectHandle::getListHead());
-  EXPECT_TRUE(&h5 == ObjectHandle::getListTail());
-  EXPECT_TRUE(NULL == h1.prev());
-  EXPECT_TRUE(&h2 == h1.next());
-  EXPECT_TRUE(&h1 == h2.prev());
-  EXPECT_TRUE(h3 == h2.next());
-  EXPECT_TRUE(&h2 == h3->prev());
-  EXPECT_TRUE(&h4 == h3->next());
-  EXPECT_TRUE(h3 == h4.prev());
-  EXPECT_TRUE(&h5 == h4.next());
-  EXPECT_TRUE(&h4 == h5.prev());
-  EXPECT_TRUE(NULL == h5.next());
-
-  // Now delete h3 from the middle.
+
+  // Now delete h3 from the middle, the others must keep their objects.
   delete(h3);
 
   EXPECT_EQ(4, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(&h1 == ObjectHandle::getListHead());
-  EXPECT_TRUE(&h5 == ObjectHandle::getListTail());
-  EXPECT_TRUE(NULL == h1.prev());
-  EXPECT_TRUE(&h2 == h1.next());
-  EXPECT_TRUE(&h1 == h2.prev());
-  EXPECT_TRUE(&h4 == h2.next());
-  EXPECT_TRUE(&h2 == h4.prev());
-  EXPECT_TRUE(&h5 == h4.next());
-  EXPECT_TRUE(&h4 == h5.prev());
-  EXPECT_TRUE(NULL == h5.next());
+  EXPECT_EQ(5u, ObjectHandle::rootTop());
+  EXPECT_EQ(1, h1.handle());
+  EXPECT_EQ(2, h2.handle());
+  EXPECT_EQ(4, h4.handle());
+  EXPECT_EQ(5, h5.handle());
+
+  // A new handle goes on top, not into the vacant slot.
+  {
+    ObjectHandle h6(6);
+    EXPECT_EQ(6u, ObjectHandle::rootTop());
+  }
+  EXPECT_EQ(5u, ObjectHandle::rootTop());
 }
 
-TEST(ObjectHandleTest, ModifyInternalInList)
+TEST(ObjectHandleTest, ModifyInternal)
 {
-  // Check that the previous tests have left the list empty.
-  EXPECT_EQ(0, ObjectHandle::numTotalHandles());
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
 
   // Add some on the stack
   ObjectHandle h1(1);
@@ -266,50 +1394,72 @@ TEST(ObjectHandleTest, ModifyInternalInList)
   ObjectHandle h5(5);
 
   EXPECT_EQ(5, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(&h1 == ObjectHandle::getListHead());
-  EXPECT_TRUE(&h5 == ObjectHandle::getListTail());
-  EXPECT_TRUE(NULL == h1.prev());
-  EXPECT_TRUE(&h2 == h1.next());
-  EXPECT_TRUE(&h1 == h2.prev());
-  EXPECT_TRUE(&h3 == h2.next());
-  EXPECT_TRUE(&h2 == h3.prev());
-  EXPECT_TRUE(&h4 == h3.next());
-  EXPECT_TRUE(&h3 == h4.prev());
-  EXPECT_TRUE(&h5 == h4.next());
-  EXPECT_TRUE(&h4 == h5.prev());
-  EXPECT_TRUE(NULL == h5.next());
+  EXPECT_EQ(0, h3.handle());
 
   h3 = 3;
 
   EXPECT_EQ(5, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(&h1 == ObjectHandle::getListHead());
-  EXPECT_TRUE(&h5 == ObjectHandle::getListTail());
-  EXPECT_TRUE(NULL == h1.prev());
-  EXPECT_TRUE(&h2 == h1.next());
-  EXPECT_TRUE(&h1 == h2.prev());
-  EXPECT_TRUE(&h3 == h2.next());
-  EXPECT_TRUE(&h2 == h3.prev());
-  EXPECT_TRUE(&h4 == h3.next());
-  EXPECT_TRUE(&h3 == h4.prev());
-  EXPECT_TRUE(&h5 == h4.next());
-  EXPECT_TRUE(&h4 == h5.prev());
-  EXPECT_TRUE(NULL == h5.next());
   EXPECT_EQ(3, h3.handle());
+  EXPECT_EQ(3, ObjectHandle::rootSlots()[2]);
 
   h3 = ObjectHandle(6);
 
   EXPECT_EQ(5, ObjectHandle::numTotalHandles());
-  EXPECT_TRUE(&h1 == ObjectHandle::getListHead());
-  EXPECT_TRUE(&h5 == ObjectHandle::getListTail());
-  EXPECT_TRUE(NULL == h1.prev());
-  EXPECT_TRUE(&h2 == h1.next());
-  EXPECT_TRUE(&h1 == h2.prev());
-  EXPECT_TRUE(&h3 == h2.next());
-  EXPECT_TRUE(&h2 == h3.prev());
-  EXPECT_TRUE(&h4 == h3.next());
-  EXPECT_TRUE(&h3 == h4.prev());
-  EXPECT_TRUE(&h5 == h4.next());
-  EXPECT_TRUE(&h4 == h5.prev());
-  EXPECT_TRUE(NULL == h5.next());
+  EXPECT_EQ(5u, ObjectHandle::rootTop());
   EXPECT_EQ(6, h3.handle());
+  EXPECT_EQ(2, h2.handle());
+  EXPECT_EQ(4, h4.handle());
+}
+
+TEST(ObjectHandleTest, GrowRootStack)
+{
+  // Handles must keep their objects when the stack is reallocated.
+  ObjectHandle h1(2);
+  {
+    // The temporary the vector is filled from has gone, leaving a
+    // vacant slot under the vector's.
+    std::vector<ObjectHandle> many(5000, ObjectHandle(4));
+    EXPECT_EQ(5001, ObjectHandle::numTotalHandles());
+    EXPECT_EQ(5002u, ObjectHandle::rootTop());
+    EXPECT_EQ(4, many.back().handle());
+  }
+  EXPECT_EQ(2, h1.handle());
+  EXPECT_EQ(1u, ObjectHandle::rootTop());
+}
+
+TEST(ObjectHandleTest, MoveTakesSlot)
+{
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
+  {
+    // Growing a vector moves its handles, which keep their slots, so 
+    // there are no vacant slots left under them.
+    std::vector<ObjectHandle> many;
+    for(long i = 0; i < 1000; ++i)
+      many.push_back(ObjectHandle(i << 2));
+    EXPECT_EQ(1000, ObjectHandle::numTotalHandles());
+    EXPECT_EQ(1000u, ObjectHandle::rootTop());
+    EXPECT_EQ(999 << 2, many.back().handle());
+    // One moved from can be given a new object.
+    ObjectHandle h1(std::move(many.front()));
+    EXPECT_EQ(0, h1.handle());
+    many.front() = 8;
+    EXPECT_EQ(1001, ObjectHandle::numTotalHandles());
+    EXPECT_EQ(8, many.front().handle());
+  }
+  EXPECT_EQ(0u, ObjectHandle::rootTop());
+}
+
+TEST(ObjectHandleTest, MoreThanAStepOfHandles)
+{
+  // The stack is committed in steps of a million slots, and handles
+  // below must keep their objects as the next steps are committed.
+  ObjectHandle h1(2);
+  {
+    std::vector<ObjectHandle> many(3 << 20, ObjectHandle(4));
+    EXPECT_EQ((3 << 20) + 1, ObjectHandle::numTotalHandles());
+    EXPECT_EQ(4, many.back().handle());
+    EXPECT_EQ(2, h1.handle());
+  }
+  EXPECT_EQ(2, h1.handle());
+  EXPECT_EQ(1u, ObjectHandle::rootTop());
 }
@@ -0,0 +1,97 @@
+/*
+ * Startup benchmark.
+ *
+ * Not part of the unit tests, run by hand to compare how long tw and
+ * tw-headless take from exec to running the image. Each executable is
+ * started on the image so many times, given just <9> to exit on, and
+ * the best and mean times are printed.
+ *
+ *   startup_benchmark [-n runs] image executable...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* start executable on image, and answer the seconds until it exits, or
+   a negative number if it didn't exit cleanly */
+static double timeStartup(const char* executable, const char* image)
+{
+  static const char command[] = "<9>\n";
+  int input[2];
+  if(pipe(input) != 0)
+    return -1;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  pid_t child = fork();
+  if(child == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(input[0], 0);
+    dup2(null, 1);
+    dup2(null, 2);
+    close(input[0]);
+    close(input[1]);
+    execl(executable, executable, image, (char*)NULL);
+    _exit(127);
+  }
+  close(input[0]);
+  if(child > 0 && write(input[1], command, strlen(command)) < 0)
+    fprintf(stderr, "%s didn't read its input\n", executable);
+  close(input[1]);
+  int status = 0;
+  if(child < 0 || waitpid(child, &status, 0) != child)
+    return -1;
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return (WIFEXITED(status) && WEXITSTATUS(status) == 0)? secs : -1;
+}
+
+int main(int argc, char** argv)
+{
+  int runs = 20;
+  int first = 1;
+  if(argc > 2 && strcmp(argv[1], "-n") == 0)
+  {
+    runs = atoi(argv[2]);
+    first = 3;
+  }
+  if(argc - first < 2 || runs < 1)
+  {
+    fprintf(stderr, "usage: %s [-n runs] image executable...\n", argv[0]);
+    return 1;
+  }
+  const char* image = argv[first];
+
+  printf("%d starts of %s\n", runs, image);
+  for(int i = first + 1; i < argc; ++i)
+  {
+    double best = 0, total = 0;
+    int n;
+    for(n = 0; n < runs; ++n)
+    {
+      double secs = timeStartup(argv[i], image);
+      if(secs < 0)
+        break;
+      best = (n == 0)? secs : std::min(best, secs);
+      total += secs;
+    }
+    if(n < runs)
+      printf("%-40s failed\n", argv[i]);
+    else
+      printf("%-40s %8.4fs best %8.4fs mean\n", argv[i], best, total / runs);
+  }
+  return 0;
+}
+#else
+int main(int argc, char** argv)
+{
+  fprintf(stderr, "%s: not supported on Windows\n", argv[0]);
+  return 1;
+}
+#endif